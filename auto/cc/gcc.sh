@@ -82,6 +82,18 @@ case $CPU in
         TCH_CPU_CACHE_LINE=64
     ;;
 
+    haswell)
+        # optimize for Haswell and later, enables AVX2 protocol scanning
+        CPU_OPT="-march=haswell"
+        TCH_CPU_CACHE_LINE=64
+    ;;
+
+    native)
+        # optimize for the build host
+        CPU_OPT="-march=native"
+        TCH_CPU_CACHE_LINE=64
+    ;;
+
     sparc32)
         # build 32-bit UltraSparc binary
         CPU_OPT="-m32"
@@ -4,6 +4,8 @@
 
 cat << END >> Makefile
 
+.PHONY:	build install modules bench
+
 build:
 	\$(MAKE) -f $TCH_MAKEFILE
 
@@ -13,4 +15,7 @@ install:
 modules:
 	\$(MAKE) -f $TCH_MAKEFILE modules
 
+bench:
+	\$(MAKE) -f $TCH_MAKEFILE bench
+
 END
@@ -5,6 +5,8 @@ echo "creating $TCH_MAKEFILE"
 mkdir -p $TCH_OBJS/src
 mkdir -p $TCH_OBJS/src/event
 mkdir -p $TCH_OBJS/src/hashkit
+mkdir -p $TCH_OBJS/src/proto
+mkdir -p $TCH_OBJS/bench
 
 tch_objs_dir=$TCH_OBJS$tch_regex_dirsep
 tch_use_pch=`echo $TCH_USE_PCH | sed -e "s/\//$tch_regex_dirsep/g"`
@@ -127,3 +129,45 @@ $tch_obj:	\$(CORE_DEPS)$tch_cont$tch_src
 END
 
 done
+
+
+# the benchmarks, linked with all the core objects but the one with main()
+
+tch_bench_objs=`echo $BENCH_SRCS \
+    | sed -e "s#\([^ ]*\.\)c#$TCH_OBJS\/\1$tch_objext#g"`
+
+tch_bench_objs=`echo $tch_all_objs $tch_bench_objs \
+    | sed -e "s#$TCH_OBJS/src/gfw\.$tch_objext##"`
+
+tch_bench_deps=`echo $tch_bench_objs \
+    | sed -e "s/  *\([^ ][^ ]*\)/$tch_regex_cont\1/g" \
+          -e "s/\//$tch_regex_dirsep/g"`
+
+tch_bench_objs=`echo $tch_bench_objs \
+    | sed -e "s/  *\([^ ][^ ]*\)/$tch_long_regex_cont\1/g" \
+          -e "s/\//$tch_regex_dirsep/g"`
+
+cat << END                                                    >> $TCH_MAKEFILE
+
+bench:	$TCH_OBJS${tch_dirsep}gfw-bench$tch_binext
+
+$TCH_OBJS${tch_dirsep}gfw-bench$tch_binext: $tch_bench_deps$tch_spacer
+	\$(LINK) $tch_long_start$tch_binout$TCH_OBJS${tch_dirsep}gfw-bench$tch_binext$tch_long_cont$tch_bench_objs$TCH_LIB
+$tch_long_end
+
+END
+
+for tch_src in $BENCH_SRCS
+do
+    tch_src=`echo $tch_src | sed -e "s/\//$tch_regex_dirsep/g"`
+    tch_obj=`echo $tch_src \
+        | sed -e "s#^\(.*\.\)c\\$#$tch_objs_dir\1$tch_objext#g"`
+
+    cat << END                                                >> $TCH_MAKEFILE
+
+$tch_obj:	\$(CORE_DEPS)$tch_cont$tch_src
+	$tch_cc$tch_tab$tch_objout$tch_obj$tch_tab$tch_src$TCH_AUX
+
+END
+
+done
@@ -46,6 +46,43 @@ if [ "$TCH_PLATFORM" != win32 ]; then
     . auto/feature.sh
 
 
+    if [ $TCH_IO_URING = YES ]; then
+
+        tch_feature="io_uring"
+        tch_feature_name="HAVE_IO_URING"
+        tch_feature_run=no
+        tch_feature_incs="#include <unistd.h>
+                          #include <sys/syscall.h>
+                          #include <linux/io_uring.h>"
+        tch_feature_path=
+        tch_feature_libs=
+        tch_feature_test="struct io_uring_params p;
+                        p.features = IORING_FEAT_EXT_ARG | IORING_FEAT_NODROP;
+                        p.flags = IORING_POLL_ADD_MULTI | IORING_POLL_UPDATE_EVENTS;
+                        (void) syscall(__NR_io_uring_setup, 1, &p);"
+        . auto/feature.sh
+
+        if [ $tch_found = no ]; then
+            echo "$0: error: --with-io_uring requires linux/io_uring.h from 5.13 or newer"
+            exit 1
+        fi
+
+        tch_feature="io_uring sync cancel"
+        tch_feature_name="HAVE_IO_URING_SYNC_CANCEL"
+        tch_feature_run=no
+        tch_feature_incs="#include <unistd.h>
+                          #include <sys/syscall.h>
+                          #include <linux/io_uring.h>"
+        tch_feature_path=
+        tch_feature_libs=
+        tch_feature_test="struct io_uring_sync_cancel_reg reg;
+                        reg.addr = 0;
+                        (void) syscall(__NR_io_uring_register, -1,
+                                       IORING_REGISTER_SYNC_CANCEL, &reg, 1);"
+        . auto/feature.sh
+    fi
+
+
     tch_feature="backtrace variadic"
     tch_feature_name="HAVE_BACKTRACE"
     tch_feature_run=yes
@@ -55,4 +92,19 @@ if [ "$TCH_PLATFORM" != win32 ]; then
     tch_feature_test="char  buf[30];"
     . auto/feature.sh
 
+
+    tch_feature="perf_event_open"
+    tch_feature_name="HAVE_PERF_EVENT"
+    tch_feature_run=no
+    tch_feature_incs="#include <unistd.h>
+                      #include <sys/syscall.h>
+                      #include <linux/perf_event.h>"
+    tch_feature_path=
+    tch_feature_libs=
+    tch_feature_test="struct perf_event_attr pe;
+                    pe.type = PERF_TYPE_HARDWARE;
+                    pe.config = PERF_COUNT_HW_CACHE_MISSES;
+                    (void) syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);"
+    . auto/feature.sh
+
 fi
\ No newline at end of file
@@ -10,6 +10,7 @@ TCH_OBJS=objs
 
 TCH_DEBUG=NO
 TCH_STATS=YES
+TCH_IO_URING=NO
 TCH_ADDON_SRCS=
 TCH_ADDON_DEPS=
 TCH_CC_OPT=
@@ -35,6 +36,7 @@ do
         --with-cpu-opt=*)                CPU="$value"               ;;
         --with-debug)                    TCH_DEBUG=YES              ;;
         --disable-stats)                 TCH_STATS=NO               ;;
+        --with-io_uring)                 TCH_IO_URING=YES           ;;
         *)
             echo "$0: error: invalid option \"$option\""
             exit 1
@@ -51,9 +53,11 @@ cat << END
   --help                             print this message
   --with-cpu-opt=CPU                 build for the specified CPU, valid values:
                                      pentium, pentiumpro, pentium3, pentium4,
-                                     athlon, opteron, sparc32, sparc64, ppc64
+                                     athlon, opteron, haswell, native,
+                                     sparc32, sparc64, ppc64
   --with-debug                       enable debug logging
   --disable-stats                    disable stats
+  --with-io_uring                    build the io_uring event backend
 END
 
     exit 1
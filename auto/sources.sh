@@ -18,8 +18,11 @@ CORE_DEPS="src/gf_core.h    \
            src/gf_message.h \
            src/event/gf_event.h \
            src/hashkit/gf_hashkit.h \
+           src/proto/gf_proto.h \
            src/gf_client.h  \
            src/gf_proxy.h   \
+           src/gf_ring.h    \
+           src/gf_backend.h \
            src/gf_conf.h    \
            src/gf_signal.h"
 
@@ -35,6 +38,7 @@ CORE_SRCS="src/gfw.c        \
            src/gf_server.c   \
            src/gf_message.c \
            src/event/gf_epoll.c \
+           src/event/gf_io_uring.c \
            src/event/gf_evport.c \
            src/event/gf_kqueue.c \
            src/hashkit/gf_crc16.c \
@@ -45,17 +49,25 @@ CORE_SRCS="src/gfw.c        \
            src/hashkit/gf_jenkins.c \
            src/hashkit/gf_ketama.c \
            src/hashkit/gf_modula.c \
+           src/hashkit/gf_cluster.c \
            src/hashkit/gf_murmur.c \
            src/hashkit/gf_one_at_a_time.c \
            src/hashkit/gf_random.c \
+           src/proto/gf_memcache.c \
+           src/proto/gf_memcache_binary.c \
+           src/proto/gf_redis.c \
            src/gf_request.c \
            src/gf_response.c \
            src/gf_client.c  \
            src/gf_proxy.c   \
+           src/gf_ring.c    \
+           src/gf_backend.c \
            src/gf_conf.c    \
            src/gf_signal.c  \
            src/gf_core.c"
 
+BENCH_SRCS="bench/gf_bench.c"
+
 UNIX_INCS="$CORE_INCS"
 
 UNIX_DEPS="$CORE_DEPS"
@@ -0,0 +1,689 @@
+/*
+ * Copyright (c) 2024-2024, yanruibinghxu@gmail.com All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * gfw-bench measures the throughput of the protocol parsers. Every case
+ * fills an mbuf with back to back messages and runs them through
+ * msg_run_parser(), the way msg_recv_chain() does with data read from a
+ * socket, optionally making the data visible a few bytes at a time to
+ * exercise parsing across reads. Requests of a case with servers are then
+ * split over those servers, the way req_recv_done() does. Parsed messages
+ * stay in flight until the whole mbuf is parsed, like a pipeline of
+ * requests waiting in a client queue.
+ *
+ * Where the kernel exposes hardware counters, the cache misses per message
+ * are reported as well.
+ *
+ *   $ make bench
+ *   $ ./objs/gfw-bench [-t msec] [case ...]
+ */
+
+#include <getopt.h>
+
+#include <gf_core.h>
+#include <gf_conf.h>
+
+#ifdef GF_HAVE_PERF_EVENT
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#define BENCH_DURATION  1000    /* default duration of a case in msec */
+#define BENCH_VALUE_MAX 4096    /* max value length of generated messages */
+#define BENCH_SERVER_MAX 16     /* max # servers of a case */
+
+typedef size_t (*bench_gen_t)(uint8_t *buf, size_t size, uint32_t i);
+
+struct bench_case {
+    const char  *name;          /* case name */
+    bool        request;        /* parse requests? or responses? */
+    protocol_type_t protocol;   /* message protocol */
+    size_t      nread;          /* bytes per read, 0 for the whole mbuf */
+    bench_gen_t gen;            /* generate message i into buf */
+    uint32_t    nserver;        /* # servers to fragment over, 0 for none */
+};
+
+static uint8_t bench_value[BENCH_VALUE_MAX];
+static int bench_misses_fd = -1;
+static struct server bench_server[BENCH_SERVER_MAX];
+static struct continuum bench_continuum[BENCH_SERVER_MAX];
+
+static size_t
+bench_redis_get(uint8_t *buf, size_t size, uint32_t i)
+{
+    return (size_t)gf_scnprintf(buf, size, "*2\r\n$3\r\nGET\r\n"
+                                "$12\r\nkey:%08"PRIu32"\r\n", i);
+}
+
+static size_t
+bench_redis_set(uint8_t *buf, size_t size, uint32_t i, uint32_t vlen)
+{
+    return (size_t)gf_scnprintf(buf, size, "*3\r\n$3\r\nSET\r\n"
+                                "$12\r\nkey:%08"PRIu32"\r\n$%"PRIu32"\r\n"
+                                "%.*s\r\n", i, vlen, (int)vlen, bench_value);
+}
+
+static size_t
+bench_redis_set_100(uint8_t *buf, size_t size, uint32_t i)
+{
+    return bench_redis_set(buf, size, i, 100);
+}
+
+static size_t
+bench_redis_set_4k(uint8_t *buf, size_t size, uint32_t i)
+{
+    return bench_redis_set(buf, size, i, 4096);
+}
+
+static size_t
+bench_redis_mget_16(uint8_t *buf, size_t size, uint32_t i)
+{
+    size_t n;
+    uint32_t k;
+
+    n = (size_t)gf_scnprintf(buf, size, "*17\r\n$4\r\nMGET\r\n");
+    for (k = 0; k < 16; k++) {
+        n += (size_t)gf_scnprintf(buf + n, size - n, "$12\r\nkey:%08"PRIu32
+                                  "\r\n", i * 16 + k);
+    }
+
+    return n;
+}
+
+static size_t
+bench_redis_mget_256(uint8_t *buf, size_t size, uint32_t i)
+{
+    size_t n;
+    uint32_t k;
+
+    n = (size_t)gf_scnprintf(buf, size, "*257\r\n$4\r\nMGET\r\n");
+    for (k = 0; k < 256; k++) {
+        n += (size_t)gf_scnprintf(buf + n, size - n, "$12\r\nkey:%08"PRIu32
+                                  "\r\n", i * 256 + k);
+    }
+
+    return n;
+}
+
+static size_t
+bench_redis_rsp_status(uint8_t *buf, size_t size, uint32_t i)
+{
+    return (size_t)gf_scnprintf(buf, size, "+OK\r\n");
+}
+
+static size_t
+bench_redis_rsp_bulk(uint8_t *buf, size_t size, uint32_t i, uint32_t vlen)
+{
+    return (size_t)gf_scnprintf(buf, size, "$%"PRIu32"\r\n%.*s\r\n", vlen,
+                                (int)vlen, bench_value);
+}
+
+static size_t
+bench_redis_rsp_bulk_100(uint8_t *buf, size_t size, uint32_t i)
+{
+    return bench_redis_rsp_bulk(buf, size, i, 100);
+}
+
+static size_t
+bench_redis_rsp_bulk_4k(uint8_t *buf, size_t size, uint32_t i)
+{
+    return bench_redis_rsp_bulk(buf, size, i, 4096);
+}
+
+static size_t
+bench_redis_rsp_multibulk_16(uint8_t *buf, size_t size, uint32_t i)
+{
+    size_t n;
+    uint32_t k;
+
+    n = (size_t)gf_scnprintf(buf, size, "*16\r\n");
+    for (k = 0; k < 16; k++) {
+        if (k % 4 == 3) {
+            n += (size_t)gf_scnprintf(buf + n, size - n, "$-1\r\n");
+        } else {
+            n += (size_t)gf_scnprintf(buf + n, size - n, "$16\r\nval:%012"PRIu32
+                                      "\r\n", i * 16 + k);
+        }
+    }
+
+    return n;
+}
+
+/* RESP3 HGETALL reply: a map of 8 fields with string, double and null values */
+static size_t
+bench_redis_rsp_map_8(uint8_t *buf, size_t size, uint32_t i)
+{
+    size_t n;
+    uint32_t k;
+
+    n = (size_t)gf_scnprintf(buf, size, "%%8\r\n");
+    for (k = 0; k < 8; k++) {
+        n += (size_t)gf_scnprintf(buf + n, size - n, "$6\r\nfield%"PRIu32
+                                  "\r\n", k);
+        if (k % 4 == 3) {
+            n += (size_t)gf_scnprintf(buf + n, size - n, "_\r\n");
+        } else if (k % 4 == 2) {
+            n += (size_t)gf_scnprintf(buf + n, size - n, ",%"PRIu32".5\r\n",
+                                      i + k);
+        } else {
+            n += (size_t)gf_scnprintf(buf + n, size - n, "$16\r\nval:%012"
+                                      PRIu32"\r\n", i * 8 + k);
+        }
+    }
+
+    return n;
+}
+
+static size_t
+bench_memcache_get(uint8_t *buf, size_t size, uint32_t i)
+{
+    return (size_t)gf_scnprintf(buf, size, "get key:%08"PRIu32"\r\n", i);
+}
+
+static size_t
+bench_memcache_set_100(uint8_t *buf, size_t size, uint32_t i)
+{
+    return (size_t)gf_scnprintf(buf, size, "set key:%08"PRIu32" 0 0 100\r\n"
+                                "%.*s\r\n", i, 100, bench_value);
+}
+
+static size_t
+bench_memcache_get_16(uint8_t *buf, size_t size, uint32_t i)
+{
+    size_t n;
+    uint32_t k;
+
+    n = (size_t)gf_scnprintf(buf, size, "get");
+    for (k = 0; k < 16; k++) {
+        n += (size_t)gf_scnprintf(buf + n, size - n, " key:%08"PRIu32,
+                                  i * 16 + k);
+    }
+    n += (size_t)gf_scnprintf(buf + n, size - n, "\r\n");
+
+    return n;
+}
+
+static size_t
+bench_memcache_rsp_value_4k(uint8_t *buf, size_t size, uint32_t i)
+{
+    return (size_t)gf_scnprintf(buf, size, "VALUE key:%08"PRIu32" 0 4096\r\n"
+                                "%.*s\r\nEND\r\n", i, 4096, bench_value);
+}
+
+/*
+ * Memcache binary packet with the given opcode, key and value, and no extras
+ */
+static size_t
+bench_memcache_binary(uint8_t *buf, size_t size, uint8_t magic, uint8_t opcode,
+                      uint32_t i, uint32_t vlen)
+{
+    uint32_t bodylen;
+    size_t n;
+
+    n = 24;
+    n += (size_t)gf_scnprintf(buf + n, size - n, "key:%08"PRIu32, i);
+    bodylen = (uint32_t)(n - 24) + vlen;
+
+    memset(buf, 0, 24);
+    buf[0] = magic;
+    buf[1] = opcode;
+    buf[3] = (uint8_t)(n - 24);
+    buf[8] = (uint8_t)(bodylen >> 24);
+    buf[9] = (uint8_t)(bodylen >> 16);
+    buf[10] = (uint8_t)(bodylen >> 8);
+    buf[11] = (uint8_t)bodylen;
+    memcpy(buf + 12, &i, 4);
+
+    memcpy(buf + n, bench_value, vlen);
+
+    return n + vlen;
+}
+
+static size_t
+bench_memcache_binary_get(uint8_t *buf, size_t size, uint32_t i)
+{
+    return bench_memcache_binary(buf, size, 0x80, 0x00, i, 0);
+}
+
+static size_t
+bench_memcache_binary_getkq_16(uint8_t *buf, size_t size, uint32_t i)
+{
+    size_t n;
+    uint32_t k;
+
+    for (n = 0, k = 0; k < 16; k++) {
+        n += bench_memcache_binary(buf + n, size - n, 0x80, 0x0d, i * 16 + k,
+                                   0);
+    }
+
+    /* NOOP */
+    memset(buf + n, 0, 24);
+    buf[n] = 0x80;
+    buf[n + 1] = 0x0a;
+
+    return n + 24;
+}
+
+static size_t
+bench_memcache_binary_rsp_4k(uint8_t *buf, size_t size, uint32_t i)
+{
+    return bench_memcache_binary(buf, size, 0x81, 0x0c, i, 4096);
+}
+
+static const struct bench_case bench_cases[] = {
+    { "redis_req_get", true, PROTOCOL_REDIS, 0, bench_redis_get, 0 },
+    { "redis_req_get_16b_reads", true, PROTOCOL_REDIS, 16, bench_redis_get, 0 },
+    { "redis_req_set_100", true, PROTOCOL_REDIS, 0, bench_redis_set_100, 0 },
+    { "redis_req_set_4k", true, PROTOCOL_REDIS, 0, bench_redis_set_4k, 0 },
+    { "redis_req_mget_16", true, PROTOCOL_REDIS, 0, bench_redis_mget_16, 0 },
+    { "redis_req_mget_256_frag_4", true, PROTOCOL_REDIS, 0,
+      bench_redis_mget_256, 4 },
+    { "redis_rsp_status", false, PROTOCOL_REDIS, 0, bench_redis_rsp_status, 0 },
+    { "redis_rsp_bulk_100", false, PROTOCOL_REDIS, 0,
+      bench_redis_rsp_bulk_100, 0 },
+    { "redis_rsp_bulk_4k", false, PROTOCOL_REDIS, 0, bench_redis_rsp_bulk_4k, 0 },
+    { "redis_rsp_bulk_4k_16b_reads", false, PROTOCOL_REDIS, 16,
+      bench_redis_rsp_bulk_4k, 0 },
+    { "redis_rsp_multibulk_16", false, PROTOCOL_REDIS, 0,
+      bench_redis_rsp_multibulk_16, 0 },
+    { "redis_rsp_map_8", false, PROTOCOL_REDIS, 0, bench_redis_rsp_map_8, 0 },
+    { "memcache_req_get", true, PROTOCOL_MEMCACHE, 0, bench_memcache_get, 0 },
+    { "memcache_req_set_100", true, PROTOCOL_MEMCACHE, 0,
+      bench_memcache_set_100, 0 },
+    { "memcache_req_get_16", true, PROTOCOL_MEMCACHE, 0,
+      bench_memcache_get_16, 0 },
+    { "memcache_req_get_16_frag_4", true, PROTOCOL_MEMCACHE, 0,
+      bench_memcache_get_16, 4 },
+    { "memcache_rsp_value_4k", false, PROTOCOL_MEMCACHE, 0,
+      bench_memcache_rsp_value_4k, 0 },
+    { "memcache_binary_req_get", true, PROTOCOL_MEMCACHE_BINARY, 0,
+      bench_memcache_binary_get, 0 },
+    { "memcache_binary_req_getkq_16", true, PROTOCOL_MEMCACHE_BINARY, 0,
+      bench_memcache_binary_getkq_16, 0 },
+    { "memcache_binary_rsp_4k", false, PROTOCOL_MEMCACHE_BINARY, 0,
+      bench_memcache_binary_rsp_4k, 0 },
+};
+
+static const char *
+bench_simd(void)
+{
+#if defined(__AVX2__)
+    return "avx2";
+#elif defined(__SSE2__)
+    return "sse2";
+#else
+    return "none";
+#endif
+}
+
+/*
+ * Fill mbuf b with as many whole messages of case bc as fit in it, and
+ * return their count
+ */
+static uint32_t
+bench_fill(const struct bench_case *bc, struct mbuf *b)
+{
+    uint8_t buf[BENCH_VALUE_MAX + 1024];
+    uint32_t i;
+    size_t n;
+
+    for (i = 0; ; i++) {
+        n = bc->gen(buf, sizeof(buf), i);
+        if (n > (size_t)(b->end - b->last)) {
+            break;
+        }
+        mbuf_copy(b, buf, n);
+    }
+
+    return i;
+}
+
+/*
+ * Fragment request msg over the servers of case bc and drop the requests
+ * it is split into
+ */
+static rstatus_t
+bench_fragment(const struct bench_case *bc, struct msg *msg)
+{
+    struct msg_tqh frag_msgq;
+    struct msg *sub_msg;
+    rstatus_t status;
+
+    TAILQ_INIT(&frag_msgq);
+    status = msg->ops->fragment(msg, bc->nserver, &frag_msgq);
+
+    while ((sub_msg = TAILQ_FIRST(&frag_msgq)) != NULL) {
+        TAILQ_REMOVE(&frag_msgq, sub_msg, m_tqe);
+        msg_put(sub_msg);
+    }
+
+    return status;
+}
+
+static void
+bench_put(struct msg_tqh *msgq)
+{
+    struct msg *msg;
+
+    while ((msg = TAILQ_FIRST(msgq)) != NULL) {
+        TAILQ_REMOVE(msgq, msg, c_tqe);
+        msg_put(msg);
+    }
+}
+
+/*
+ * Parse all the messages in mbuf b and return their count, or -1 on a
+ * parsing error
+ */
+static int
+bench_parse(const struct bench_case *bc, struct conn *conn, struct mbuf *b)
+{
+    struct msg_tqh msgq;
+    struct msg *msg;
+    uint8_t *pos, *last;
+    int nmsg;
+
+    TAILQ_INIT(&msgq);
+
+    pos = b->pos;
+    last = b->last;
+    if (bc->nread != 0) {
+        b->last = MIN(pos + bc->nread, last);
+    }
+
+    nmsg = 0;
+    msg = NULL;
+    while (pos < last) {
+        if (msg == NULL) {
+            msg = msg_get(conn, bc->request, conn->redis);
+            if (msg == NULL) {
+                return -1;
+            }
+            mbuf_insert(&msg->mhdr, b);
+            msg->pos = pos;
+        }
+
+        msg_run_parser(msg);
+
+        switch (msg->result) {
+        case MSG_PARSE_OK:
+            if (bc->nserver != 0 && bench_fragment(bc, msg) != GF_OK) {
+                goto error;
+            }
+            pos = msg->pos;
+            mbuf_remove(&msg->mhdr, b);
+            TAILQ_INSERT_TAIL(&msgq, msg, c_tqe);
+            msg = NULL;
+            nmsg++;
+            break;
+
+        case MSG_PARSE_AGAIN:
+            if (b->last == last) {
+                goto error;
+            }
+            b->last = MIN(b->last + bc->nread, last);
+            break;
+
+        default:
+            goto error;
+        }
+    }
+
+    bench_put(&msgq);
+
+    return nmsg;
+
+error:
+    log_stderr("case '%s' failed to parse message %d", bc->name, nmsg);
+    b->last = last;
+    mbuf_remove(&msg->mhdr, b);
+    msg_put(msg);
+    bench_put(&msgq);
+    return -1;
+}
+
+/*
+ * Open a counter of the cache misses of this thread, or return -1 when the
+ * kernel or the cpu provide none
+ */
+static int
+bench_misses_open(void)
+{
+#ifdef GF_HAVE_PERF_EVENT
+    struct perf_event_attr pe;
+
+    memset(&pe, 0, sizeof(pe));
+    pe.size = sizeof(pe);
+    pe.type = PERF_TYPE_HARDWARE;
+    pe.config = PERF_COUNT_HW_CACHE_MISSES;
+    pe.disabled = 1;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+
+    return (int)syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+static void
+bench_misses_start(void)
+{
+#ifdef GF_HAVE_PERF_EVENT
+    if (bench_misses_fd >= 0) {
+        ioctl(bench_misses_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(bench_misses_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+/*
+ * Stop the cache miss counter and return its count, or -1 if there is no
+ * counter
+ */
+static int64_t
+bench_misses_stop(void)
+{
+#ifdef GF_HAVE_PERF_EVENT
+    uint64_t count;
+
+    if (bench_misses_fd >= 0) {
+        ioctl(bench_misses_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(bench_misses_fd, &count, sizeof(count)) == sizeof(count)) {
+            return (int64_t)count;
+        }
+    }
+#endif
+    return -1;
+}
+
+/*
+ * Set pool up with the servers of case bc, keys being spread over them by
+ * modula distribution
+ */
+static void
+bench_pool(const struct bench_case *bc, struct server_pool *pool)
+{
+    uint32_t i;
+
+    ASSERT(bc->nserver <= BENCH_SERVER_MAX);
+
+    memset(pool, 0, sizeof(*pool));
+    array_set(&pool->server, bench_server, sizeof(bench_server[0]),
+              BENCH_SERVER_MAX);
+    for (i = 0; i < bc->nserver; i++) {
+        array_push(&pool->server);
+        bench_continuum[i].index = i;
+        bench_continuum[i].value = 0;
+    }
+    pool->continuum = bench_continuum;
+    pool->ncontinuum = bc->nserver;
+    pool->dist_type = DIST_MODULA;
+    pool->key_hash = hash_fnv1a_64;
+}
+
+static int
+bench_run(const struct bench_case *bc, int duration)
+{
+    struct server_pool pool;
+    struct conn conn;
+    struct mbuf *b;
+    uint32_t nfill;
+    uint64_t nmsg, nbyte;
+    int64_t start, elapsed, nmiss;
+    char miss[16];
+    int n;
+
+    memset(&conn, 0, sizeof(conn));
+    conn.sd = -1;
+    conn.client = bc->request ? 1 : 0;
+    conn.redis = bc->protocol == PROTOCOL_REDIS ? 1 : 0;
+    conn.binary = bc->protocol == PROTOCOL_MEMCACHE_BINARY ? 1 : 0;
+
+    if (bc->nserver != 0) {
+        bench_pool(bc, &pool);
+        conn.owner = &pool;
+    }
+
+    b = mbuf_get();
+    if (b == NULL) {
+        return -1;
+    }
+
+    nfill = bench_fill(bc, b);
+
+    nmsg = 0;
+    nbyte = 0;
+    start = gf_usec_now();
+    bench_misses_start();
+    do {
+        n = bench_parse(bc, &conn, b);
+        if (n < 0 || (uint32_t)n != nfill) {
+            mbuf_put(b);
+            return -1;
+        }
+        nmsg += (uint64_t)n;
+        nbyte += mbuf_length(b);
+        elapsed = gf_usec_now() - start;
+    } while (elapsed < (int64_t)duration * 1000);
+    nmiss = bench_misses_stop();
+
+    if (nmiss < 0) {
+        gf_scnprintf(miss, sizeof(miss), "%8s", "-");
+    } else {
+        gf_scnprintf(miss, sizeof(miss), "%8.2f",
+                     (double)nmiss / (double)nmsg);
+    }
+
+    log_stderr("%-28s %10.1f MB/s %10.2f Mmsg/s %8.1f ns/msg %s miss/msg",
+               bc->name, (double)nbyte / (double)elapsed,
+               (double)nmsg / (double)elapsed,
+               (double)elapsed * 1000.0 / (double)nmsg, miss);
+
+    mbuf_put(b);
+
+    return 0;
+}
+
+static bool
+bench_selected(const struct bench_case *bc, int argc, char **argv)
+{
+    int i;
+
+    if (argc == 0) {
+        return true;
+    }
+
+    for (i = 0; i < argc; i++) {
+        if (strstr(bc->name, argv[i]) != NULL) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+int
+main(int argc, char **argv)
+{
+    int c, duration, status;
+    uint32_t i;
+
+    duration = BENCH_DURATION;
+    while ((c = getopt(argc, argv, "ht:")) != -1) {
+        switch (c) {
+        case 't':
+            duration = atoi(optarg);
+            if (duration <= 0) {
+                log_stderr("gfw-bench: option -t requires a positive number");
+                return 1;
+            }
+            break;
+
+        default:
+            log_stderr("usage: gfw-bench [-t msec] [case ...]");
+            return c == 'h' ? 0 : 1;
+        }
+    }
+
+    if (log_init(LOG_WARN, NULL) < 0) {
+        return 1;
+    }
+    if (mbuf_init(MBUF_SIZE, 0, MBUF_HUGEPAGE_OFF) != GF_OK) {
+        return 1;
+    }
+    msg_init();
+
+    memset(bench_value, 'x', sizeof(bench_value));
+
+    bench_misses_fd = bench_misses_open();
+
+    log_stderr("gfw-bench: mbuf %zu bytes, msg %zu bytes, simd %s, "
+               "%d msec per case", mbuf_data_size(), sizeof(struct msg),
+               bench_simd(), duration);
+
+    status = 0;
+    for (i = 0; i < NELEMS(bench_cases); i++) {
+        if (!bench_selected(&bench_cases[i], argc - optind, argv + optind)) {
+            continue;
+        }
+        if (bench_run(&bench_cases[i], duration) < 0) {
+            status = 1;
+        }
+    }
+
+    if (bench_misses_fd >= 0) {
+        close(bench_misses_fd);
+    }
+    msg_deinit();
+    mbuf_deinit();
+    log_deinit();
+
+    return status;
+}
@@ -69,12 +69,40 @@ event_base_create(int nevent, event_cb_t cb)
     evb->event = event;
     evb->nevent = nevent;
     evb->cb = cb;
+    evb->et = false;
+#ifdef GF_HAVE_IO_URING
+    evb->uring = NULL;
+#endif
 
     log_debug(LOG_INFO, "ep %d with nevent %d", evb->ep, evb->nevent);
 
     return evb;
 }
 
+/*
+ * Create an event base that watches each conn for writes as well as reads,
+ * edge triggered, from event_add_conn on and never changes that. Whether
+ * a conn waits to write is kept in send_active only, and write events for
+ * a conn that does not are dropped, so event_add_out and event_del_out do
+ * no epoll_ctl. This relies on conns being written before a write event is
+ * asked for (see core_dirty), so that one is only asked for once the socket
+ * buffer is full and an edge is bound to follow when it drains.
+ */
+struct event_base *
+event_base_create_et(int nevent, event_cb_t cb)
+{
+    struct event_base *evb;
+
+    evb = event_base_create(nevent, cb);
+    if (evb == NULL) {
+        return NULL;
+    }
+
+    evb->et = true;
+
+    return evb;
+}
+
 void
 event_base_destroy(struct event_base *evb)
 {
@@ -84,6 +112,13 @@ event_base_destroy(struct event_base *evb)
         return;
     }
 
+#ifdef GF_HAVE_IO_URING
+    if (evb->uring != NULL) {
+        event_base_destroy_uring(evb);
+        return;
+    }
+#endif
+
     ASSERT(evb->ep > 0);
 
     gf_free(evb->event);
@@ -97,100 +132,112 @@ event_base_destroy(struct event_base *evb)
     gf_free(evb);
 }
 
-int
-event_add_in(struct event_base *evb, struct conn *c)
+/*
+ * Account an epoll_ctl on conn c to the client side of its pool or to its
+ * server, in the stats of the event loop owning c
+ */
+static void
+event_ctl_stats(struct conn *c)
+{
+    if (c->client || c->proxy) {
+        stats_pool_incr(conn_to_ctx(c), c->owner, client_epoll_ctl);
+    } else {
+        stats_server_incr(conn_to_ctx(c), c->owner, server_epoll_ctl);
+    }
+}
+
+/*
+ * Watch conn c for reads if in is set and for writes if out is set, or
+ * always on an et event base
+ */
+static int
+event_mod(struct event_base *evb, struct conn *c, bool in, bool out)
 {
     int status;
     struct epoll_event event;
     int ep = evb->ep;
 
+#ifdef GF_HAVE_IO_URING
+    if (evb->uring != NULL) {
+        return event_uring_mod(evb, c, in, out);
+    }
+#endif
+
     ASSERT(ep > 0);
     ASSERT(c != NULL);
     ASSERT(c->sd > 0);
 
-    if (c->recv_active) {
-        return 0;
+    event.events = (uint32_t)EPOLLET;
+    if (in) {
+        event.events |= (uint32_t)EPOLLIN;
+    }
+    if (out || evb->et) {
+        event.events |= (uint32_t)EPOLLOUT;
     }
-
-    event.events = (uint32_t)(EPOLLIN | EPOLLET);
     event.data.ptr = c;
 
+    event_ctl_stats(c);
     status = epoll_ctl(ep, EPOLL_CTL_MOD, c->sd, &event);
     if (status < 0) {
         log_error("epoll ctl on e %d sd %d failed: %s", ep, c->sd,
                   strerror(errno));
-    } else {
-        c->recv_active = 1;
+        return status;
     }
 
+    c->recv_active = in ? 1 : 0;
+    c->send_active = out ? 1 : 0;
+
     return status;
 }
 
+int
+event_add_in(struct event_base *evb, struct conn *c)
+{
+    if (c->recv_active) {
+        return 0;
+    }
+
+    return event_mod(evb, c, true, c->send_active);
+}
 
 int
 event_del_in(struct event_base *evb, struct conn *c)
 {
-    return 0;
+    if (!c->recv_active) {
+        return 0;
+    }
+
+    return event_mod(evb, c, false, c->send_active);
 }
 
 int
 event_add_out(struct event_base *evb, struct conn *c)
 {
-    int status;
-    struct epoll_event event;
-    int ep = evb->ep;
-
-    ASSERT(ep > 0);
-    ASSERT(c != NULL);
-    ASSERT(c->sd > 0);
-    ASSERT(c->recv_active);
-
     if (c->send_active) {
         return 0;
     }
 
-    event.events = (uint32_t)(EPOLLIN | EPOLLOUT | EPOLLET);
-    event.data.ptr = c;
-
-    status = epoll_ctl(ep, EPOLL_CTL_MOD, c->sd, &event);
-    if (status < 0) {
-        log_error("epoll ctl on e %d sd %d failed: %s", ep, c->sd,
-                  strerror(errno));
-    } else {
+    if (evb->et) {
         c->send_active = 1;
+        return 0;
     }
 
-    return status;
+    return event_mod(evb, c, c->recv_active, true);
 }
 
 int
 event_del_out(struct event_base *evb, struct conn *c)
 {
-    int status;
-    struct epoll_event event;
-    int ep = evb->ep;
-
-    ASSERT(ep > 0);
-    ASSERT(c != NULL);
-    ASSERT(c->sd > 0);
-    ASSERT(c->recv_active);
-
     if (!c->send_active) {
         return 0;
     }
 
-    event.events = (uint32_t)(EPOLLIN | EPOLLET);
-    event.data.ptr = c;
-
-    status = epoll_ctl(ep, EPOLL_CTL_MOD, c->sd, &event);
-    if (status < 0) {
-        log_error("epoll ctl on e %d sd %d failed: %s", ep, c->sd,
-                  strerror(errno));
-    } else {
+    if (evb->et) {
         c->send_active = 0;
+        return 0;
     }
 
-    return status;
+    return event_mod(evb, c, c->recv_active, false);
 }
 
 int
@@ -200,6 +247,12 @@ event_add_conn(struct event_base *evb, struct conn *c)
     struct epoll_event event;
     int ep = evb->ep;
 
+#ifdef GF_HAVE_IO_URING
+    if (evb->uring != NULL) {
+        return event_uring_add_conn(evb, c);
+    }
+#endif
+
     ASSERT(ep > 0);
     ASSERT(c != NULL);
     ASSERT(c->sd > 0);
@@ -207,6 +260,7 @@ event_add_conn(struct event_base *evb, struct conn *c)
     event.events = (uint32_t)(EPOLLIN | EPOLLOUT | EPOLLET);
     event.data.ptr = c;
 
+    event_ctl_stats(c);
     status = epoll_ctl(ep, EPOLL_CTL_ADD, c->sd, &event);
     if (status < 0) {
         log_error("epoll ctl on e %d sd %d failed: %s", ep, c->sd,
@@ -225,10 +279,17 @@ event_del_conn(struct event_base *evb, struct conn *c)
     int status;
     int ep = evb->ep;
 
+#ifdef GF_HAVE_IO_URING
+    if (evb->uring != NULL) {
+        return event_uring_del_conn(evb, c);
+    }
+#endif
+
     ASSERT(ep > 0);
     ASSERT(c != NULL);
     ASSERT(c->sd > 0);
 
+    event_ctl_stats(c);
     status = epoll_ctl(ep, EPOLL_CTL_DEL, c->sd, NULL);
     if (status < 0) {
         log_error("epoll ctl on e %d sd %d failed: %s", ep, c->sd,
@@ -248,6 +309,12 @@ event_wait(struct event_base *evb, int timeout)
     struct epoll_event *event = evb->event;
     int nevent = evb->nevent;
 
+#ifdef GF_HAVE_IO_URING
+    if (evb->uring != NULL) {
+        return event_uring_wait(evb, timeout);
+    }
+#endif
+
     ASSERT(ep > 0);
     ASSERT(event != NULL);
     ASSERT(nevent > 0);
@@ -273,10 +340,14 @@ event_wait(struct event_base *evb, int timeout)
                 }
 
                 if (ev->events & EPOLLOUT) {
-                    events |= EVENT_WRITE;
+                    struct conn *c = ev->data.ptr;
+
+                    if (!evb->et || c->send_active) {
+                        events |= EVENT_WRITE;
+                    }
                 }
 
-                if (evb->cb != NULL) {
+                if (events != 0 && evb->cb != NULL) {
                     evb->cb(ev->data.ptr, events);
                 }
             }
@@ -58,6 +58,8 @@ struct event_base {
 
 #elif GF_HAVE_EPOLL
 
+struct event_uring;
+
 struct event_base {
     int                ep;      /* epoll descriptor */
 
@@ -65,6 +67,12 @@ struct event_base {
     int                nevent;  /* # event */
 
     event_cb_t         cb;      /* event callback */
+
+    bool               et;      /* conns watched for writes from the start? */
+
+#ifdef GF_HAVE_IO_URING
+    struct event_uring *uring;  /* io_uring state, NULL when using epoll */
+#endif
 };
 
 #elif GF_HAVE_EVENT_PORTS
@@ -96,4 +104,21 @@ int event_del_conn(struct event_base *evb, struct conn *c);
 int event_wait(struct event_base *evb, int timeout);
 void event_loop_stats(event_stats_cb_t cb, void *arg);
 
+#ifdef GF_HAVE_EPOLL
+struct event_base *event_base_create_et(int size, event_cb_t cb);
+#endif
+
+#ifdef GF_HAVE_IO_URING
+struct event_base *event_base_create_uring(int size, event_cb_t cb);
+void event_base_destroy_uring(struct event_base *evb);
+int event_uring_mod(struct event_base *evb, struct conn *c, bool in, bool out);
+int event_uring_add_conn(struct event_base *evb, struct conn *c);
+int event_uring_del_conn(struct event_base *evb, struct conn *c);
+int event_uring_wait(struct event_base *evb, int timeout);
+ssize_t event_uring_recv(struct event_base *evb, struct conn *c, void *buf,
+                         size_t size);
+ssize_t event_uring_sendv(struct event_base *evb, struct conn *c,
+                          const struct array *sendv, size_t nsend);
+#endif
+
 #endif /* _NC_EVENT_H */
@@ -88,68 +88,79 @@ event_base_destroy(struct event_base *evb)
     gf_free(evb);
 }
 
+/*
+ * Associate conn c with the port for reads if in is set and for writes if
+ * out is set
+ */
+static int
+event_associate(struct event_base *evb, struct conn *c, bool in, bool out)
+{
+    int status, events;
+    int evp = evb->evp;
+
+    ASSERT(evp > 0);
+    ASSERT(c != NULL);
+    ASSERT(c->sd > 0);
+
+    events = (in ? POLLIN : 0) | (out ? POLLOUT : 0);
+    if (events == 0) {
+        status = port_dissociate(evp, PORT_SOURCE_FD, c->sd);
+        if (status < 0 && errno == ENOENT) {
+            status = 0;
+        }
+    } else {
+        status = port_associate(evp, PORT_SOURCE_FD, c->sd, events, c);
+    }
+    if (status < 0) {
+        log_error("port associate on evp %d sd %d failed: %s", evp, c->sd,
+                  strerror(errno));
+        return status;
+    }
+
+    c->recv_active = in ? 1 : 0;
+    c->send_active = out ? 1 : 0;
+
+    return status;
+}
+
 int
 event_add_in(struct event_base *evb, struct conn *c)
 {
-    return 0;
+    if (c->recv_active) {
+        return 0;
+    }
+
+    return event_associate(evb, c, true, c->send_active);
 }
 
 int
 event_del_in(struct event_base *evb, struct conn *c)
 {
-    return 0;
+    if (!c->recv_active) {
+        return 0;
+    }
+
+    return event_associate(evb, c, false, c->send_active);
 }
 
 int
 event_add_out(struct event_base *evb, struct conn *c)
 {
-    int status;
-    int evp = evb->evp;
-
-    ASSERT(evp > 0);
-    ASSERT(c != NULL);
-    ASSERT(c->sd > 0);
-    ASSERT(c->recv_active);
-
     if (c->send_active) {
         return 0;
     }
 
-    status = port_associate(evp, PORT_SOURCE_FD, c->sd, POLLIN | POLLOUT, c);
-    if (status < 0) {
-        log_error("port associate on evp %d sd %d failed: %s", evp, c->sd,
-                  strerror(errno));
-    } else {
-        c->send_active = 1;
-    }
-
-    return status;
+    return event_associate(evb, c, c->recv_active, true);
 }
 
 int
 event_del_out(struct event_base *evb, struct conn *c)
 {
-    int status;
-    int evp = evb->evp;
-
-    ASSERT(evp > 0);
-    ASSERT(c != NULL);
-    ASSERT(c->sd > 0);
-    ASSERT(c->recv_active);
-
     if (!c->send_active) {
         return 0;
     }
 
-    status = port_associate(evp, PORT_SOURCE_FD, c->sd, POLLIN, c);
-    if (status < 0) {
-        log_error("port associate on evp %d sd %d failed: %s", evp, c->sd,
-                  strerror(errno));
-    } else {
-        c->send_active = 0;
-    }
-
-    return status;
+    return event_associate(evb, c, c->recv_active, false);
 }
 
 int
@@ -215,27 +226,11 @@ event_del_conn(struct event_base *evb, struct conn *c)
 static int
 event_reassociate(struct event_base *evb, struct conn *c)
 {
-    int status, events;
-    int evp = evb->evp;
-
-    ASSERT(evp > 0);
-    ASSERT(c != NULL);
-    ASSERT(c->sd > 0);
-    ASSERT(c->recv_active);
-
-    if (c->send_active) {
-        events = POLLIN | POLLOUT;
-    } else {
-        events = POLLIN;
-    }
-
-    status = port_associate(evp, PORT_SOURCE_FD, c->sd, events , c);
-    if (status < 0) {
-        log_error("port associate on evp %d sd %d failed: %s", evp, c->sd,
-                  strerror(errno));
+    if (!c->recv_active && !c->send_active) {
+        return 0;
     }
 
-    return status;
+    return event_associate(evb, c, c->recv_active, c->send_active);
 }
 
 int
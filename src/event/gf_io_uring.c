@@ -0,0 +1,917 @@
+/*
+ * Copyright (c) 2024-2024, yanruibinghxu@gmail.com All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <gf_core.h>
+
+#ifdef GF_HAVE_IO_URING
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/*
+ * io_uring flavour of the epoll backend. Every conn is watched by one
+ * multishot poll request, which reports readiness edges just like
+ * EPOLLET does. Interest changes and removals only queue sqes; they reach
+ * the kernel together with the wait in event_uring_wait(), so that a loop
+ * iteration costs one io_uring_enter() instead of an epoll_wait() plus an
+ * epoll_ctl() for every change.
+ *
+ * A poll request carries (gen << 32 | sd) as its user_data and slot[sd]
+ * holds the conn and generation currently registered on a descriptor, so
+ * that completions of a removed poll are never handed to a conn that got
+ * the same descriptor later. Updates and removals carry the user_data of
+ * the poll they target with EVENT_URING_CTL set in the sd half.
+ *
+ * Server conns are only polled once, for their connect to complete. From
+ * then on their reads and writes are done by the kernel: conn_recv() and
+ * conn_sendv() queue an IORING_OP_RECV into the mbuf the parser reads next
+ * and an IORING_OP_SENDMSG of the iovec msg_send_chain() built, and return
+ * EAGAIN. Their completion is handed to the conn as a read or write event,
+ * and the next conn_recv() or conn_sendv() with the same arguments returns
+ * its result, so that the messages and mbufs the kernel is working on are
+ * left untouched until then. Both carry EVENT_URING_RECV or
+ * EVENT_URING_SEND in the sd half of their user_data.
+ */
+
+struct event_io {
+    void          *recv_buf;       /* buffer of the recv request */
+    size_t        recv_size;       /* size of the recv buffer */
+    int32_t       recv_res;        /* result of the completed recv */
+    unsigned      recv_busy:1;     /* recv request in the kernel? */
+    unsigned      recv_done:1;     /* recv result not yet taken? */
+    unsigned      send_busy:1;     /* send request in the kernel? */
+    unsigned      send_done:1;     /* send result not yet taken? */
+    int32_t       send_res;        /* result of the completed send */
+    size_t        send_size;       /* # bytes of the send request */
+    struct msghdr msg;             /* header of the send request */
+    struct iovec  iov[GF_IOV_MAX]; /* iovec of the send request */
+};
+
+struct event_slot {
+    struct conn     *conn; /* registered conn or NULL */
+    uint32_t        gen;   /* generation of the poll request */
+    uint32_t        mask;  /* requested poll mask */
+    struct event_io *io;   /* recv and send requests, NULL until needed */
+};
+
+struct event_uring {
+    int                 fd;           /* io_uring descriptor */
+    unsigned            nsubmit;      /* # sqe queued, not yet submitted */
+
+    void                *sq_ring;     /* submission queue ring */
+    size_t              sq_ring_size; /* submission queue ring size */
+    unsigned            *sq_head;     /* submission queue head */
+    unsigned            *sq_tail;     /* submission queue tail */
+    unsigned            *sq_array;    /* submission queue sqe index[] */
+    unsigned            sq_mask;      /* submission queue index mask */
+    unsigned            sq_entries;   /* # submission queue entries */
+    struct io_uring_sqe *sqe;         /* sqe[] */
+    size_t              sqe_size;     /* sqe[] size */
+
+    void                *cq_ring;     /* completion queue ring */
+    size_t              cq_ring_size; /* completion queue ring size */
+    unsigned            *cq_head;     /* completion queue head */
+    unsigned            *cq_tail;     /* completion queue tail */
+    unsigned            cq_mask;      /* completion queue index mask */
+    struct io_uring_cqe *cqe;         /* cqe[] */
+
+    struct event_slot   *slot;        /* slot[] indexed by sd */
+    uint32_t            nslot;        /* # slot */
+    uint32_t            gen;          /* last generation handed out */
+    bool                io;           /* complete server conn io? */
+};
+
+#define EVENT_URING_CTL             0x80000000U
+#define EVENT_URING_RECV            0x40000000U
+#define EVENT_URING_SEND            0x20000000U
+#define EVENT_URING_OP              0xe0000000U
+#define EVENT_URING_DATA(_sd, _gen) (((uint64_t)(_gen) << 32) | (uint32_t)(_sd))
+
+static void
+event_uring_unmap(struct event_uring *ring)
+{
+    int status;
+
+    if (ring->sqe != NULL) {
+        munmap(ring->sqe, ring->sqe_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+
+    status = close(ring->fd);
+    if (status < 0) {
+        log_error("close io_uring %d failed, ignored: %s", ring->fd,
+                  strerror(errno));
+    }
+    ring->fd = -1;
+}
+
+static void *
+event_uring_mmap(int fd, size_t size, off_t offset)
+{
+    void *p;
+
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+             fd, offset);
+    if (p == MAP_FAILED) {
+        log_error("mmap of %zu bytes at %lld on io_uring %d failed: %s",
+                  size, (long long)offset, fd, strerror(errno));
+        return NULL;
+    }
+
+    return p;
+}
+
+/*
+ * Cancel the request with the given user_data and wait for the kernel to
+ * be done with it; its completion is still posted
+ */
+static int
+event_uring_cancel(struct event_uring *ring, uint64_t data)
+{
+#ifdef GF_HAVE_IO_URING_SYNC_CANCEL
+    struct io_uring_sync_cancel_reg reg;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.addr = data;
+    reg.fd = -1;
+    reg.timeout.tv_sec = -1;
+    reg.timeout.tv_nsec = -1;
+
+    return (int)syscall(__NR_io_uring_register, ring->fd,
+                        IORING_REGISTER_SYNC_CANCEL, &reg, 1);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static rstatus_t
+event_uring_setup(struct event_uring *ring, int nevent)
+{
+    struct io_uring_params p;
+    uint8_t *sq, *cq;
+    int fd;
+
+    memset(&p, 0, sizeof(p));
+#ifdef IORING_SETUP_SUBMIT_ALL
+    p.flags |= IORING_SETUP_SUBMIT_ALL;
+#endif
+
+    fd = (int)syscall(__NR_io_uring_setup, nevent, &p);
+    if (fd < 0 && errno == EINVAL && p.flags != 0) {
+        /* kernel predates the setup flags, try without them */
+        memset(&p, 0, sizeof(p));
+        fd = (int)syscall(__NR_io_uring_setup, nevent, &p);
+    }
+    if (fd < 0) {
+        log_error("io_uring setup of size %d failed: %s", nevent,
+                  strerror(errno));
+        return GF_ERROR;
+    }
+    ring->fd = fd;
+
+    if (!(p.features & IORING_FEAT_EXT_ARG) ||
+        !(p.features & IORING_FEAT_NODROP)) {
+        log_error("io_uring %d lacks ext arg or nodrop support", fd);
+        event_uring_unmap(ring);
+        return GF_ERROR;
+    }
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes +
+                         p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_ring_size = MAX(ring->sq_ring_size, ring->cq_ring_size);
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = event_uring_mmap(fd, ring->sq_ring_size,
+                                     IORING_OFF_SQ_RING);
+    if (ring->sq_ring == NULL) {
+        event_uring_unmap(ring);
+        return GF_ERROR;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = event_uring_mmap(fd, ring->cq_ring_size,
+                                         IORING_OFF_CQ_RING);
+        if (ring->cq_ring == NULL) {
+            event_uring_unmap(ring);
+            return GF_ERROR;
+        }
+    }
+
+    ring->sqe_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqe = event_uring_mmap(fd, ring->sqe_size, IORING_OFF_SQES);
+    if (ring->sqe == NULL) {
+        event_uring_unmap(ring);
+        return GF_ERROR;
+    }
+
+    sq = ring->sq_ring;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+
+    cq = ring->cq_ring;
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqe = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    /*
+     * Server conn io needs sockets retried by the kernel and buffers that
+     * can be taken back on close; a cancel of user_data 0, which no
+     * request carries, tells whether the latter is there
+     */
+    ring->io = (p.features & IORING_FEAT_FAST_POLL) &&
+               event_uring_cancel(ring, 0) < 0 && errno == ENOENT;
+
+    log_debug(LOG_NOTICE, "io_uring %d with %u sq and %u cq entries%s", fd,
+              p.sq_entries, p.cq_entries,
+              ring->io ? ", server conn io" : "");
+
+    return GF_OK;
+}
+
+struct event_base *
+event_base_create_uring(int nevent, event_cb_t cb)
+{
+    struct event_base *evb;
+    struct event_uring *ring;
+
+    ASSERT(nevent > 0);
+
+    ring = gf_zalloc(sizeof(*ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    if (event_uring_setup(ring, nevent) != GF_OK) {
+        gf_free(ring);
+        return NULL;
+    }
+
+    evb = gf_alloc(sizeof(*evb));
+    if (evb == NULL) {
+        event_uring_unmap(ring);
+        gf_free(ring);
+        return NULL;
+    }
+
+    evb->ep = -1;
+    evb->event = NULL;
+    evb->nevent = nevent;
+    evb->cb = cb;
+    evb->et = false;
+    evb->uring = ring;
+
+    return evb;
+}
+
+void
+event_base_destroy_uring(struct event_base *evb)
+{
+    struct event_uring *ring = evb->uring;
+    uint32_t i;
+
+    ASSERT(ring != NULL && ring->fd > 0);
+
+    event_uring_unmap(ring);
+    for (i = 0; i < ring->nslot; i++) {
+        if (ring->slot[i].io != NULL) {
+            gf_free(ring->slot[i].io);
+        }
+    }
+    gf_free(ring->slot);
+    gf_free(ring);
+    gf_free(evb);
+}
+
+/*
+ * Submit queued sqes and, if min_complete is non-zero, wait up to timeout
+ * msec for that many completions; timeout of -1 waits forever
+ */
+static int
+event_uring_enter(struct event_uring *ring, unsigned min_complete,
+                  int timeout)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags;
+    int n;
+
+    flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+
+    memset(&arg, 0, sizeof(arg));
+    if (timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+
+    n = (int)syscall(__NR_io_uring_enter, ring->fd, ring->nsubmit,
+                     min_complete, flags, &arg, sizeof(arg));
+    if (n > 0) {
+        ASSERT((unsigned)n <= ring->nsubmit);
+        ring->nsubmit -= (unsigned)n;
+    }
+
+    return n;
+}
+
+static struct io_uring_sqe *
+event_uring_sqe(struct event_uring *ring)
+{
+    struct io_uring_sqe *sqe;
+    unsigned head, tail, idx;
+
+    tail = *ring->sq_tail;
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head == ring->sq_entries) {
+        /* submission queue is full, hand it to the kernel now */
+        if (event_uring_enter(ring, 0, 0) < 0) {
+            log_error("io_uring %d submit of %u sqe failed: %s", ring->fd,
+                      ring->nsubmit, strerror(errno));
+            return NULL;
+        }
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head == ring->sq_entries) {
+            log_error("io_uring %d submission queue stuck full", ring->fd);
+            return NULL;
+        }
+    }
+
+    idx = tail & ring->sq_mask;
+    sqe = &ring->sqe[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+
+    return sqe;
+}
+
+static void
+event_uring_push(struct event_uring *ring)
+{
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+    ring->nsubmit++;
+}
+
+static uint32_t
+event_uring_poll32(uint32_t mask)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    /* poll32_events is read as two swapped half words on big endian */
+    mask = (mask << 16) | (mask >> 16);
+#endif
+    return mask;
+}
+
+static rstatus_t
+event_uring_poll_add(struct event_uring *ring, int sd, struct event_slot *slot,
+                     bool multi)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = event_uring_sqe(ring);
+    if (sqe == NULL) {
+        return GF_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = sd;
+    sqe->len = multi ? IORING_POLL_ADD_MULTI : 0;
+    sqe->poll32_events = event_uring_poll32(slot->mask);
+    sqe->user_data = EVENT_URING_DATA(sd, slot->gen);
+    event_uring_push(ring);
+
+    return GF_OK;
+}
+
+/*
+ * Queue a change to mask of the poll request with generation gen on sd,
+ * or its removal if remove is set
+ */
+static rstatus_t
+event_uring_poll_update(struct event_uring *ring, int sd, uint32_t gen,
+                        uint32_t mask, bool remove)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = event_uring_sqe(ring);
+    if (sqe == NULL) {
+        return GF_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = EVENT_URING_DATA(sd, gen);
+    if (!remove) {
+        sqe->len = IORING_POLL_UPDATE_EVENTS | IORING_POLL_ADD_MULTI;
+        sqe->poll32_events = event_uring_poll32(mask);
+    }
+    sqe->user_data = EVENT_URING_DATA((uint32_t)sd | EVENT_URING_CTL, gen);
+    event_uring_push(ring);
+
+    return GF_OK;
+}
+
+int
+event_uring_mod(struct event_base *evb, struct conn *c, bool in, bool out)
+{
+    struct event_uring *ring = evb->uring;
+    struct event_slot *slot;
+    uint32_t mask;
+
+    ASSERT(c != NULL);
+    ASSERT(c->sd > 0 && (uint32_t)c->sd < ring->nslot);
+
+    slot = &ring->slot[c->sd];
+    ASSERT(slot->conn == c);
+
+    /* a conn io waits on its recv and send requests rather than a poll */
+    mask = (in ? POLLIN : 0) | (out ? POLLOUT : 0);
+    if (!c->uring && mask != slot->mask) {
+        slot->mask = mask;
+        if (event_uring_poll_update(ring, c->sd, slot->gen, slot->mask,
+                                    false) != GF_OK) {
+            return -1;
+        }
+    }
+
+    c->recv_active = in ? 1 : 0;
+    c->send_active = out ? 1 : 0;
+
+    return 0;
+}
+
+/*
+ * Take the recv and send requests of the conn io on sd back from the
+ * kernel before their messages and mbufs are freed. Their completions
+ * are dropped as stale once the slot is released.
+ */
+static rstatus_t
+event_uring_io_cancel(struct event_uring *ring, int sd,
+                      struct event_slot *slot)
+{
+    struct event_io *io = slot->io;
+    rstatus_t status = GF_OK;
+
+    ASSERT(io != NULL);
+
+    /* requests still in the submission queue are unknown to the kernel */
+    if ((io->recv_busy || io->send_busy) && ring->nsubmit != 0 &&
+        event_uring_enter(ring, 0, 0) < 0) {
+        log_error("io_uring %d submit of %u sqe failed: %s", ring->fd,
+                  ring->nsubmit, strerror(errno));
+        status = GF_ERROR;
+    }
+
+    if (io->recv_busy &&
+        event_uring_cancel(ring, EVENT_URING_DATA((uint32_t)sd |
+                                                  EVENT_URING_RECV,
+                                                  slot->gen)) < 0 &&
+        errno != ENOENT) {
+        log_error("io_uring %d cancel of recv on sd %d failed: %s",
+                  ring->fd, sd, strerror(errno));
+        status = GF_ERROR;
+    }
+
+    if (io->send_busy &&
+        event_uring_cancel(ring, EVENT_URING_DATA((uint32_t)sd |
+                                                  EVENT_URING_SEND,
+                                                  slot->gen)) < 0 &&
+        errno != ENOENT) {
+        log_error("io_uring %d cancel of send on sd %d failed: %s",
+                  ring->fd, sd, strerror(errno));
+        status = GF_ERROR;
+    }
+
+    io->recv_busy = 0;
+    io->recv_done = 0;
+    io->send_busy = 0;
+    io->send_done = 0;
+
+    return status;
+}
+
+int
+event_uring_add_conn(struct event_base *evb, struct conn *c)
+{
+    struct event_uring *ring = evb->uring;
+    struct event_slot *slot;
+
+    ASSERT(c != NULL);
+    ASSERT(c->sd > 0);
+
+    if ((uint32_t)c->sd >= ring->nslot) {
+        uint32_t nslot = MAX((uint32_t)c->sd + 1, 2 * ring->nslot);
+
+        slot = gf_realloc(ring->slot, nslot * sizeof(*slot));
+        if (slot == NULL) {
+            return -1;
+        }
+        memset(&slot[ring->nslot], 0,
+               (nslot - ring->nslot) * sizeof(*slot));
+        ring->slot = slot;
+        ring->nslot = nslot;
+    }
+
+    slot = &ring->slot[c->sd];
+    if (slot->conn != NULL) {
+        /* sd was closed without event_del_conn, drop its stale poll */
+        log_warn("io_uring %d sd %d reused while still registered",
+                 ring->fd, c->sd);
+        if (slot->conn->uring &&
+            event_uring_io_cancel(ring, c->sd, slot) != GF_OK) {
+            return -1;
+        }
+        if (event_uring_poll_update(ring, c->sd, slot->gen, 0, true) != GF_OK) {
+            return -1;
+        }
+        slot->conn->uring = 0;
+        slot->conn = NULL;
+    }
+
+    if (ring->io && !c->client && !c->proxy && slot->io == NULL) {
+        slot->io = gf_zalloc(sizeof(*slot->io));
+        if (slot->io == NULL) {
+            log_warn("io_uring %d has no memory for io on s %d, polled "
+                     "instead", ring->fd, c->sd);
+        }
+    }
+
+    if (++ring->gen == 0) {
+        ring->gen = 1;
+    }
+    slot->gen = ring->gen;
+
+    /* server conn io only polls once, for the connect */
+    c->uring = ring->io && !c->client && !c->proxy && slot->io != NULL;
+    slot->mask = c->uring ? POLLOUT : POLLIN | POLLOUT;
+
+    if (event_uring_poll_add(ring, c->sd, slot, !c->uring) != GF_OK) {
+        c->uring = 0;
+        return -1;
+    }
+
+    slot->conn = c;
+    c->send_active = 1;
+    c->recv_active = 1;
+
+    return 0;
+}
+
+int
+event_uring_del_conn(struct event_base *evb, struct conn *c)
+{
+    struct event_uring *ring = evb->uring;
+    struct event_slot *slot;
+    rstatus_t status;
+
+    ASSERT(c != NULL);
+    ASSERT(c->sd > 0 && (uint32_t)c->sd < ring->nslot);
+
+    slot = &ring->slot[c->sd];
+    ASSERT(slot->conn == c);
+
+    /*
+     * The poll request keeps its own reference to the socket, so the
+     * socket only goes away once the removal reaches the kernel
+     */
+    slot->conn = NULL;
+    c->recv_active = 0;
+    c->send_active = 0;
+
+    status = GF_OK;
+    if (c->uring) {
+        c->uring = 0;
+        status = event_uring_io_cancel(ring, c->sd, slot);
+    }
+
+    if (event_uring_poll_update(ring, c->sd, slot->gen, 0, true) != GF_OK) {
+        return -1;
+    }
+
+    return status == GF_OK ? 0 : -1;
+}
+
+/*
+ * Read into buf of the conn io c: return the result of the recv request
+ * that completed on it, or else queue one and fail with EAGAIN
+ */
+ssize_t
+event_uring_recv(struct event_base *evb, struct conn *c, void *buf,
+                 size_t size)
+{
+    struct event_uring *ring = evb->uring;
+    struct event_slot *slot;
+    struct event_io *io;
+    struct io_uring_sqe *sqe;
+
+    ASSERT(c->uring);
+    ASSERT(c->sd > 0 && (uint32_t)c->sd < ring->nslot);
+
+    slot = &ring->slot[c->sd];
+    io = slot->io;
+    ASSERT(slot->conn == c && io != NULL);
+
+    if (io->recv_done) {
+        /* the parser has not moved on from the buffer read into */
+        ASSERT(io->recv_buf == buf && io->recv_size == size);
+
+        io->recv_done = 0;
+        if (io->recv_res < 0) {
+            errno = -io->recv_res;
+            return -1;
+        }
+        return io->recv_res;
+    }
+
+    if (!io->recv_busy) {
+        sqe = event_uring_sqe(ring);
+        if (sqe == NULL) {
+            errno = EBUSY;
+            return -1;
+        }
+
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = c->sd;
+        sqe->addr = (uint64_t)(uintptr_t)buf;
+        sqe->len = (uint32_t)MIN(size, UINT32_MAX);
+        sqe->user_data = EVENT_URING_DATA((uint32_t)c->sd | EVENT_URING_RECV,
+                                          slot->gen);
+        event_uring_push(ring);
+
+        io->recv_buf = buf;
+        io->recv_size = size;
+        io->recv_busy = 1;
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+/*
+ * Write sendv of the conn io c: return the result of the send request
+ * that completed on it, or else queue one and fail with EAGAIN. The send
+ * request asks for all of nsend bytes, so a short result means an error
+ * follows. Messages queued meanwhile extend sendv past the one sent.
+ */
+ssize_t
+event_uring_sendv(struct event_base *evb, struct conn *c,
+                  const struct array *sendv, size_t nsend)
+{
+    struct event_uring *ring = evb->uring;
+    struct event_slot *slot;
+    struct event_io *io;
+    struct io_uring_sqe *sqe;
+
+    ASSERT(c->uring);
+    ASSERT(c->sd > 0 && (uint32_t)c->sd < ring->nslot);
+    ASSERT(array_n(sendv) <= GF_IOV_MAX);
+
+    slot = &ring->slot[c->sd];
+    io = slot->io;
+    ASSERT(slot->conn == c && io != NULL);
+
+    if (io->send_done) {
+        ASSERT(io->send_size <= nsend);
+        ASSERT(io->send_res < 0 || (size_t)io->send_res <= io->send_size);
+
+        io->send_done = 0;
+        if (io->send_res < 0) {
+            errno = -io->send_res;
+            return -1;
+        }
+        return io->send_res;
+    }
+
+    if (!io->send_busy) {
+        sqe = event_uring_sqe(ring);
+        if (sqe == NULL) {
+            errno = EBUSY;
+            return -1;
+        }
+
+        memcpy(io->iov, sendv->elem, array_n(sendv) * sizeof(io->iov[0]));
+        memset(&io->msg, 0, sizeof(io->msg));
+        io->msg.msg_iov = io->iov;
+        io->msg.msg_iovlen = array_n(sendv);
+
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = c->sd;
+        sqe->addr = (uint64_t)(uintptr_t)&io->msg;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        sqe->user_data = EVENT_URING_DATA((uint32_t)c->sd | EVENT_URING_SEND,
+                                          slot->gen);
+        event_uring_push(ring);
+
+        io->send_size = nsend;
+        io->send_busy = 1;
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+/*
+ * Queue again an update or removal of the poll request with generation
+ * gen on sd that the kernel refused with EALREADY
+ */
+static void
+event_uring_poll_retry(struct event_uring *ring, uint32_t sd, uint32_t gen)
+{
+    struct event_slot *slot;
+    rstatus_t status;
+
+    slot = sd < ring->nslot ? &ring->slot[sd] : NULL;
+    if (slot != NULL && slot->conn != NULL && slot->gen == gen) {
+        status = event_uring_poll_update(ring, (int)sd, gen, slot->mask,
+                                         false);
+    } else {
+        status = event_uring_poll_update(ring, (int)sd, gen, 0, true);
+    }
+
+    if (status != GF_OK) {
+        log_error("io_uring %d retry of poll update on sd %"PRIu32" failed",
+                  ring->fd, sd);
+    }
+}
+
+static int
+event_uring_reap(struct event_base *evb)
+{
+    struct event_uring *ring = evb->uring;
+    unsigned head, tail;
+    int nsd = 0;
+
+    head = *ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &ring->cqe[head & ring->cq_mask];
+        uint32_t gen = (uint32_t)(cqe->user_data >> 32);
+        uint32_t sd = (uint32_t)cqe->user_data & ~EVENT_URING_OP;
+        uint32_t op = (uint32_t)cqe->user_data & EVENT_URING_OP;
+        int32_t res = cqe->res;
+        struct event_slot *slot;
+        struct event_io *io;
+        struct conn *c;
+        uint32_t events = 0;
+
+        if (op == EVENT_URING_CTL) {
+            if (res == -EALREADY) {
+                /* poll request was busy completing, try again */
+                event_uring_poll_retry(ring, sd, gen);
+            } else if (res < 0 && res != -ENOENT) {
+                /* ENOENT is an update racing with the end of its poll */
+                log_error("io_uring %d poll update on sd %"PRIu32" failed: "
+                          "%s", ring->fd, sd, strerror(-res));
+            }
+            continue;
+        }
+
+        if (sd >= ring->nslot || ring->slot[sd].gen != gen ||
+            ring->slot[sd].conn == NULL) {
+            /* stale completion of a removed or cancelled request */
+            continue;
+        }
+        slot = &ring->slot[sd];
+        c = slot->conn;
+        io = slot->io;
+
+        if (op == EVENT_URING_RECV) {
+            ASSERT(c->uring && io->recv_busy && !io->recv_done);
+            io->recv_busy = 0;
+            io->recv_done = 1;
+            io->recv_res = res;
+            events = EVENT_READ;
+        } else if (op == EVENT_URING_SEND) {
+            ASSERT(c->uring && io->send_busy && !io->send_done);
+            io->send_busy = 0;
+            io->send_done = 1;
+            io->send_res = res;
+            events = EVENT_WRITE;
+        } else if (res < 0) {
+            log_error("io_uring %d poll on sd %"PRIu32" failed: %s",
+                      ring->fd, sd, strerror(-res));
+            events = EVENT_ERR;
+        } else {
+            if (!c->uring && !(cqe->flags & IORING_CQE_F_MORE)) {
+                /* kernel ended the multishot poll, arm it again */
+                if (event_uring_poll_add(ring, (int)sd, slot, true) != GF_OK) {
+                    events |= EVENT_ERR;
+                }
+            }
+
+            /*
+             * Completions posted before a queued update reached the kernel
+             * can still report readiness that is no longer asked for
+             */
+            res &= (int32_t)(slot->mask | POLLERR | POLLHUP);
+
+            if (res & POLLERR) {
+                events |= EVENT_ERR;
+            }
+
+            if (res & (POLLIN | POLLHUP)) {
+                events |= EVENT_READ;
+            }
+
+            if (res & POLLOUT) {
+                events |= EVENT_WRITE;
+            }
+
+            if (c->uring) {
+                /* the connect is done, start reading with io */
+                slot->mask = 0;
+                events |= EVENT_READ;
+            }
+        }
+
+        if (events == 0) {
+            continue;
+        }
+
+        log_debug(LOG_VVERB, "io_uring %04"PRIX32" triggered on conn %p",
+                  (uint32_t)res, c);
+
+        nsd++;
+        if (evb->cb != NULL) {
+            evb->cb(c, events);
+        }
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    return nsd;
+}
+
+int
+event_uring_wait(struct event_base *evb, int timeout)
+{
+    struct event_uring *ring = evb->uring;
+
+    ASSERT(ring != NULL && ring->fd > 0);
+
+    for (;;) {
+        int n, nsd;
+
+        n = event_uring_enter(ring, 1, timeout);
+        if (n < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+            log_error("io_uring wait on %d with %u sqe and %d timeout "
+                      "failed: %s", ring->fd, ring->nsubmit, timeout,
+                      strerror(errno));
+            return -1;
+        }
+
+        nsd = event_uring_reap(evb);
+        if (nsd > 0 || timeout >= 0) {
+            return nsd;
+        }
+
+        /* only update completions or stale completions arrived */
+    }
+
+    NOT_REACHED();
+}
+
+#endif /* GF_HAVE_IO_URING */
@@ -0,0 +1,546 @@
+/*
+ * Copyright (c) 2024-2024, yanruibinghxu@gmail.com All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <gf_core.h>
+
+/*
+ * Backend I/O threads
+ * -------------------
+ *
+ * With backend threads, the event loops that accept clients (frontends)
+ * own no server connections. A request that is to be forwarded is handed
+ * over to one of a few backend I/O threads instead, which own every server
+ * connection, so that the traffic to a server is pipelined on a few
+ * connections however many frontends there are.
+ *
+ *   frontend                                        backend
+ *                        +---------------+
+ *   req_forward -------> |     reqq      | -------> req_forward_server
+ *                        +---------------+              |
+ *                                                  server conns
+ *                        +---------------+              |
+ *   rsp_forward_client <-|     doneq     | <------- rsp_forward
+ *                        +---------------+
+ *
+ * All requests of a client go to the same backend thread, so they reach a
+ * server in the order they were sent. While the backend holds a request,
+ * the frontend does not touch it other than to link it in the client outq,
+ * and the backend neither frees it nor touches the client side of it. The
+ * backend hands every request back, with its response as peer or in error,
+ * and the frontend completes it as if the server connection were its own,
+ * or frees it if the client is gone in the meantime.
+ *
+ * An event loop with nothing to do blocks in event_wait. Before that it
+ * flags itself as sleeping, and a thread that has pushed on one of its
+ * rings writes to its wake up pipe only if it finds the flag set.
+ */
+
+static struct ring *
+backend_inq(const struct context *ctx, struct backend_chan *chan)
+{
+    return ctx->backend ? &chan->reqq : &chan->doneq;
+}
+
+static struct ring *
+backend_outq(const struct context *ctx, struct backend_chan *chan)
+{
+    return ctx->backend ? &chan->doneq : &chan->reqq;
+}
+
+static struct msg_tqh *
+backend_backlog(const struct context *ctx, struct backend_chan *chan)
+{
+    return ctx->backend ? &chan->done_backlog : &chan->req_backlog;
+}
+
+/*
+ * Create the wake up pipe of event loop ctx and the channel array it is
+ * later attached with
+ */
+rstatus_t
+backend_init(struct context *ctx)
+{
+    rstatus_t status;
+    struct conn *conn;
+    int sd[2];
+
+    status = array_init(&ctx->chan, ctx->backend ? ctx->nthread : ctx->nbackend,
+                        sizeof(struct backend_chan *));
+    if (status != GF_OK) {
+        return status;
+    }
+
+    status = pipe(sd);
+    if (status < 0) {
+        log_error("pipe failed: %s", strerror(errno));
+        array_deinit(&ctx->chan);
+        return GF_ERROR;
+    }
+
+    if (gf_set_nonblocking(sd[0]) < 0 || gf_set_nonblocking(sd[1]) < 0) {
+        log_error("set nonblock on wake pipe failed: %s", strerror(errno));
+        close(sd[0]);
+        close(sd[1]);
+        array_deinit(&ctx->chan);
+        return GF_ERROR;
+    }
+
+    conn = conn_get_wake(array_get(&ctx->pool, 0));
+    if (conn == NULL) {
+        close(sd[0]);
+        close(sd[1]);
+        array_deinit(&ctx->chan);
+        return GF_ENOMEM;
+    }
+    conn->sd = sd[0];
+    ctx->wake = conn;
+    ctx->wake_sd = sd[1];
+
+    status = event_add_conn(ctx->evb, conn);
+    if (status == GF_OK) {
+        status = event_del_out(ctx->evb, conn);
+    }
+    if (status != GF_OK) {
+        log_error("event add wake pipe %d failed: %s", conn->sd,
+                  strerror(errno));
+        conn->ops->close(ctx, conn);
+        close(sd[1]);
+        ctx->wake_sd = -1;
+        array_deinit(&ctx->chan);
+        return GF_ERROR;
+    }
+
+    log_debug(LOG_VVERB, "init wake pipe %d of ctx %"PRIu32"", conn->sd,
+              ctx->id);
+
+    return GF_OK;
+}
+
+/*
+ * Close the wake up pipe of ctx. The channels are shared with the event
+ * loops on the other side, and kept until exit.
+ */
+void
+backend_deinit(struct context *ctx)
+{
+    if (ctx->wake_sd < 0) {
+        return;
+    }
+
+    if (ctx->wake != NULL) {
+        ctx->wake->ops->close(ctx, ctx->wake);
+    }
+    close(ctx->wake_sd);
+    ctx->wake_sd = -1;
+
+    while (array_n(&ctx->chan) != 0) {
+        array_pop(&ctx->chan);
+    }
+    array_deinit(&ctx->chan);
+}
+
+/*
+ * Attach frontend event loop front to backend event loop back with a
+ * channel, before any of the two runs
+ */
+rstatus_t
+backend_attach(struct context *front, struct context *back)
+{
+    rstatus_t status;
+    struct backend_chan *chan, **pchan;
+
+    ASSERT(!front->backend && back->backend);
+
+    chan = gf_memalign(GF_CACHELINE_SIZE, sizeof(*chan));
+    if (chan == NULL) {
+        return GF_ENOMEM;
+    }
+
+    status = ring_init(&chan->reqq, BACKEND_RING_SIZE);
+    if (status != GF_OK) {
+        gf_free(chan);
+        return status;
+    }
+
+    status = ring_init(&chan->doneq, BACKEND_RING_SIZE);
+    if (status != GF_OK) {
+        ring_deinit(&chan->reqq);
+        gf_free(chan);
+        return status;
+    }
+
+    chan->front = front;
+    chan->back = back;
+    TAILQ_INIT(&chan->req_backlog);
+    chan->req_kick = false;
+    TAILQ_INIT(&chan->done_backlog);
+    chan->done_kick = false;
+
+    pchan = array_push(&front->chan);
+    if (pchan == NULL) {
+        ring_deinit(&chan->doneq);
+        ring_deinit(&chan->reqq);
+        gf_free(chan);
+        return GF_ENOMEM;
+    }
+    *pchan = chan;
+
+    pchan = array_push(&back->chan);
+    if (pchan == NULL) {
+        array_pop(&front->chan);
+        ring_deinit(&chan->doneq);
+        ring_deinit(&chan->reqq);
+        gf_free(chan);
+        return GF_ENOMEM;
+    }
+    *pchan = chan;
+
+    log_debug(LOG_VERB, "attach ctx %"PRIu32" to backend ctx %"PRIu32"",
+              front->id, back->id);
+
+    return GF_OK;
+}
+
+static void
+backend_push(struct ring *r, struct msg_tqh *backlog, struct msg *msg)
+{
+    if (!TAILQ_EMPTY(backlog) || !ring_push(r, msg)) {
+        TAILQ_INSERT_TAIL(backlog, msg, m_tqe);
+    }
+}
+
+/*
+ * Hand request msg from client c_conn over to the backend thread of the
+ * client, on frontend ctx
+ */
+void
+backend_forward(struct context *ctx, struct conn *c_conn, struct msg *msg)
+{
+    struct backend_chan *chan;
+    struct server_pool *pool = c_conn->owner;
+
+    ASSERT(!ctx->backend && array_n(&ctx->chan) != 0);
+    ASSERT(msg->request && !msg->done && msg->chan == NULL);
+
+    chan = *(struct backend_chan **)array_get(&ctx->chan,
+                                              (uint32_t)c_conn->sd %
+                                              array_n(&ctx->chan));
+
+    msg->chan = chan;
+    msg->pool_idx = pool->idx;
+
+    backend_push(&chan->reqq, &chan->req_backlog, msg);
+    chan->req_kick = true;
+
+    log_debug(LOG_VERB, "forward from c %d to backend ctx %"PRIu32" req "
+              "%"PRIu64" len %"PRIu32"", c_conn->sd, chan->back->id, msg->id,
+              msg->mlen);
+}
+
+/*
+ * Hand request msg, or response msg along with its request, back to the
+ * frontend the request came from, on backend ctx. A request in error has
+ * its errno in err.
+ */
+void
+backend_done(struct context *ctx, struct msg *msg)
+{
+    struct msg *req = msg->request ? msg : msg->peer;
+    struct backend_chan *chan = req->chan;
+
+    ASSERT(ctx->backend && chan != NULL && chan->back == ctx);
+    ASSERT(msg->request || req->peer == NULL);
+
+    msg_tmo_delete(req);
+
+    backend_push(&chan->doneq, &chan->done_backlog, msg);
+    chan->done_kick = true;
+
+    log_debug(LOG_VERB, "done req %"PRIu64" len %"PRIu32" for ctx "
+              "%"PRIu32"%s", req->id, req->mlen, chan->front->id,
+              msg->request ? " in error" : "");
+}
+
+/*
+ * Forward a request handed over by a frontend to its server, on backend ctx
+ */
+static void
+backend_serve(struct context *ctx, struct msg *msg)
+{
+    rstatus_t status;
+    struct server_pool *pool;
+
+    ASSERT(msg->request && msg->chan != NULL);
+
+    pool = array_get(&ctx->pool, msg->pool_idx);
+
+    status = req_forward_server(ctx, pool, msg);
+    if (status != GF_OK) {
+        msg->err = errno;
+        backend_done(ctx, msg);
+    }
+}
+
+/*
+ * Complete a request handed back by a backend, on frontend ctx
+ */
+static void
+backend_complete(struct context *ctx, struct msg *msg)
+{
+    struct msg *req, *rsp;
+    struct conn *c_conn;
+
+    if (msg->request) {
+        req = msg;
+        rsp = NULL;
+    } else {
+        req = msg->peer;
+        rsp = msg;
+    }
+    ASSERT(req->request && !req->done && req->peer == NULL);
+
+    req->chan = NULL;
+
+    /* nobody waits for the response of noreply requests or closed clients */
+    c_conn = req->owner;
+    if (c_conn == NULL || req->noreply) {
+        log_debug(LOG_INFO, "swallow req %"PRIu64" len %"PRIu32" done by "
+                  "backend", req->id, req->mlen);
+        req->owner = NULL;
+        req->peer = rsp;
+        req_put(req);
+        return;
+    }
+
+    if (rsp != NULL) {
+        rsp_forward_client(ctx, c_conn, req, rsp);
+    } else {
+        req_forward_error(ctx, c_conn, req, req->err);
+    }
+}
+
+/*
+ * Wake event loop ctx up, if it is blocked in event_wait
+ */
+static void
+backend_wake(struct context *ctx)
+{
+    ssize_t n;
+
+    /* order the pushes before the load of sleeping, see backend_sleep() */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&ctx->sleeping, __ATOMIC_RELAXED) == 0 ||
+        __atomic_exchange_n(&ctx->sleeping, 0, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+
+    n = write(ctx->wake_sd, "", 1);
+    if (n < 0 && errno != EAGAIN) {
+        log_error("write on wake pipe %d failed: %s", ctx->wake_sd,
+                  strerror(errno));
+    }
+}
+
+/*
+ * Return the timeout for event loop ctx to block in event_wait with. It is
+ * flagged as sleeping from then on, and does not block at all if a ring
+ * to it is not empty by then.
+ */
+int
+backend_sleep(struct context *ctx, int timeout)
+{
+    uint32_t i, nchan = array_n(&ctx->chan);
+    struct backend_chan *chan;
+
+    if (nchan == 0) {
+        return timeout;
+    }
+
+    for (i = 0; i < nchan; i++) {
+        chan = *(struct backend_chan **)array_get(&ctx->chan, i);
+        if (!TAILQ_EMPTY(backend_backlog(ctx, chan))) {
+            /* retry pushing the backlog shortly */
+            timeout = MIN(timeout, BACKEND_BACKLOG_TIMEOUT);
+            break;
+        }
+    }
+
+    if (ctx->wake == NULL) {
+        /* no way to be woken up, so poll */
+        return MIN(timeout, BACKEND_BACKLOG_TIMEOUT);
+    }
+
+    __atomic_store_n(&ctx->sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    for (i = 0; i < nchan; i++) {
+        chan = *(struct backend_chan **)array_get(&ctx->chan, i);
+        if (!ring_empty(backend_inq(ctx, chan))) {
+            __atomic_store_n(&ctx->sleeping, 0, __ATOMIC_RELAXED);
+            return 0;
+        }
+    }
+
+    return timeout;
+}
+
+/*
+ * Take in what the rings to event loop ctx hold, once it is done with its
+ * events, and then push its backlogs and wake up the event loops it has
+ * pushed to.
+ */
+void
+backend_run(struct context *ctx)
+{
+    uint32_t i, n, nchan = array_n(&ctx->chan);
+    struct backend_chan *chan;
+    struct ring *r;
+    struct msg_tqh *backlog;
+    struct msg *msg;
+    bool *kick;
+
+    if (nchan == 0) {
+        return;
+    }
+
+    __atomic_store_n(&ctx->sleeping, 0, __ATOMIC_RELAXED);
+
+    for (i = 0; i < nchan; i++) {
+        chan = *(struct backend_chan **)array_get(&ctx->chan, i);
+        r = backend_inq(ctx, chan);
+
+        /* a ring worth at most, for a busy producer not to keep us here */
+        for (n = 0; n <= r->mask && (msg = ring_pop(r)) != NULL; n++) {
+            if (ctx->backend) {
+                backend_serve(ctx, msg);
+            } else {
+                backend_complete(ctx, msg);
+            }
+        }
+    }
+
+    for (i = 0; i < nchan; i++) {
+        chan = *(struct backend_chan **)array_get(&ctx->chan, i);
+        r = backend_outq(ctx, chan);
+        backlog = backend_backlog(ctx, chan);
+
+        while (!TAILQ_EMPTY(backlog)) {
+            msg = TAILQ_FIRST(backlog);
+            TAILQ_REMOVE(backlog, msg, m_tqe);
+            if (!ring_push(r, msg)) {
+                TAILQ_INSERT_HEAD(backlog, msg, m_tqe);
+                break;
+            }
+        }
+
+        kick = ctx->backend ? &chan->done_kick : &chan->req_kick;
+        if (*kick) {
+            *kick = false;
+            backend_wake(ctx->backend ? chan->front : chan->back);
+        }
+    }
+}
+
+rstatus_t
+backend_wake_recv(struct context *ctx, struct conn *conn)
+{
+    uint8_t buf[64];
+    ssize_t n;
+
+    for (;;) {
+        n = read(conn->sd, buf, sizeof(buf));
+        if (n > 0) {
+            continue;
+        }
+
+        if (n == 0) {
+            conn->done = 1;
+            return GF_OK;
+        }
+
+        if (errno == EINTR) {
+            continue;
+        }
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return GF_OK;
+        }
+
+        conn->err = errno;
+        return GF_ERROR;
+    }
+}
+
+void
+backend_wake_close(struct context *ctx, struct conn *conn)
+{
+    rstatus_t status;
+
+    ASSERT(!conn->client && conn->proxy && ctx->wake == conn);
+
+    log_debug(LOG_INFO, "close wake pipe %d of ctx %"PRIu32"", conn->sd,
+              ctx->id);
+
+    conn->ops->unref(conn);
+
+    status = close(conn->sd);
+    if (status < 0) {
+        log_error("close wake pipe %d failed, ignored: %s", conn->sd,
+                  strerror(errno));
+    }
+    conn->sd = -1;
+
+    conn_put(conn);
+
+    ctx->wake = NULL;
+}
+
+void
+backend_wake_ref(struct conn *conn, void *owner)
+{
+    struct server_pool *pool = owner;
+
+    ASSERT(!conn->client && conn->proxy);
+    ASSERT(conn->owner == NULL);
+
+    conn->family = pool->info.family;
+    conn->addrlen = pool->info.addrlen;
+    conn->addr = (struct sockaddr *)&pool->info.addr;
+
+    /* owned by a pool like a proxy connection, see conn_to_ctx() */
+    conn->owner = owner;
+}
+
+void
+backend_wake_unref(struct conn *conn)
+{
+    ASSERT(!conn->client && conn->proxy);
+    ASSERT(conn->owner != NULL);
+
+    conn->owner = NULL;
+}
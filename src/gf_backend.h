@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2024-2024, yanruibinghxu@gmail.com All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __GF_BACKEND_H__
+#define __GF_BACKEND_H__
+
+#include <gf_core.h>
+
+#define BACKEND_RING_SIZE       4096 /* # requests in flight per channel ring */
+#define BACKEND_BACKLOG_TIMEOUT 1    /* loop timeout in msec while backlogged */
+
+/*
+ * Channel between a frontend event loop, which serves clients, and a backend
+ * I/O thread, which owns the server connections. Requests are handed over
+ * on reqq and handed back on doneq, either with their response linked as
+ * peer or in error. Each ring has a single producer; what does not fit in
+ * a full ring waits on the backlog of the producer in the meantime.
+ */
+struct backend_chan {
+    struct ring    reqq;         /* requests to the backend */
+    struct ring    doneq;        /* requests done by the backend */
+
+    struct context *front;       /* frontend event loop */
+    struct context *back;        /* backend event loop */
+
+    /* written by the frontend only */
+    struct msg_tqh req_backlog __attribute__((aligned(GF_CACHELINE_SIZE)));
+    bool           req_kick;     /* wake the backend up? */
+
+    /* written by the backend only */
+    struct msg_tqh done_backlog __attribute__((aligned(GF_CACHELINE_SIZE)));
+    bool           done_kick;    /* wake the frontend up? */
+};
+
+rstatus_t backend_init(struct context *ctx);
+void backend_deinit(struct context *ctx);
+rstatus_t backend_attach(struct context *front, struct context *back);
+
+void backend_forward(struct context *ctx, struct conn *c_conn, struct msg *msg);
+void backend_done(struct context *ctx, struct msg *msg);
+
+int backend_sleep(struct context *ctx, int timeout);
+void backend_run(struct context *ctx);
+
+rstatus_t backend_wake_recv(struct context *ctx, struct conn *conn);
+void backend_wake_close(struct context *ctx, struct conn *conn);
+void backend_wake_ref(struct conn *conn, void *owner);
+void backend_wake_unref(struct conn *conn);
+
+#endif
@@ -100,6 +100,87 @@ client_active(const struct conn *conn)
     return false;
 }
 
+/*
+ * Is client conn at or above the output limits of its pool, or with low
+ * set, above half of them?
+ */
+static bool
+client_over_limit(const struct conn *conn, bool low)
+{
+    const struct server_pool *pool = conn->owner;
+    uint32_t max_nmsg = pool->client_max_pending_requests;
+    size_t max_bytes = pool->client_output_buffer_limit;
+
+    if (low) {
+        return (max_nmsg != 0 && conn->nout_msg > max_nmsg / 2) ||
+               (max_bytes != 0 && conn->out_bytes > max_bytes / 2);
+    }
+
+    return (max_nmsg != 0 && conn->nout_msg >= max_nmsg) ||
+           (max_bytes != 0 && conn->out_bytes >= max_bytes);
+}
+
+/*
+ * Stop reading from client conn once it has reached the pending requests
+ * or response bytes limit of its pool, so that a client that does not read
+ * its responses cannot make us buffer them without bound.
+ */
+void
+client_throttle(struct context *ctx, struct conn *conn)
+{
+    ASSERT(conn->client && !conn->proxy);
+
+    if (conn->throttled || !client_over_limit(conn, false)) {
+        return;
+    }
+
+    if (event_del_in(ctx->evb, conn) != GF_OK) {
+        conn->err = errno;
+        return;
+    }
+    conn->throttled = 1;
+
+    stats_pool_incr(ctx, conn->owner, client_throttled);
+
+    log_debug(LOG_INFO, "c %d paused with %"PRIu32" pending req and %zu "
+              "rsp bytes", conn->sd, conn->nout_msg, conn->out_bytes);
+}
+
+/*
+ * Resume reading from a paused client conn once it is back below half of
+ * the limits of its pool
+ */
+void
+client_unthrottle(struct context *ctx, struct conn *conn)
+{
+    ASSERT(conn->client && !conn->proxy);
+
+    if (!conn->throttled || client_over_limit(conn, true)) {
+        return;
+    }
+
+    if (event_add_in(ctx->evb, conn) != GF_OK) {
+        conn->err = errno;
+        return;
+    }
+    conn->throttled = 0;
+
+    log_debug(LOG_INFO, "c %d resumed with %"PRIu32" pending req and %zu "
+              "rsp bytes", conn->sd, conn->nout_msg, conn->out_bytes);
+}
+
+/*
+ * Account for nsent response bytes written to client conn
+ */
+void
+client_drain(struct context *ctx, struct conn *conn, size_t nsent)
+{
+    ASSERT(conn->client && !conn->proxy);
+
+    conn->out_bytes -= MIN(nsent, conn->out_bytes);
+    client_unthrottle(ctx, conn);
+}
+
 static void
 client_close_stats(struct context *ctx, struct server_pool *pool, err_t err,
                    unsigned eof)
@@ -138,7 +219,7 @@ client_close(struct context *ctx, struct conn *conn)
     client_close_stats(ctx, conn->owner, conn->err, conn->eof);
 
     if (conn->sd < 0) {
-        conn->unref(conn);
+        conn->ops->unref(conn);
         conn_put(conn);
         return;
     }
@@ -159,11 +240,14 @@ client_close(struct context *ctx, struct conn *conn)
     ASSERT(conn->smsg == NULL);
     ASSERT(TAILQ_EMPTY(&conn->imsg_q));
 
+    /* the conn is going away, do not resume reading while emptying it */
+    conn->throttled = 0;
+
     for (msg = TAILQ_FIRST(&conn->omsg_q); msg != NULL; msg = nmsg) {
         nmsg = TAILQ_NEXT(msg, c_tqe);
 
         /* dequeue the message (request) from client outq */
-        conn->dequeue_outq(ctx, conn, msg);
+        conn->ops->dequeue_outq(ctx, conn, msg);
 
         if (msg->done) {
             log_debug(LOG_INFO, "close c %d discarding %s req %"PRIu64" len "
@@ -171,7 +255,15 @@ client_close(struct context *ctx, struct conn *conn)
                       msg->error ? "error": "completed", msg->id, msg->mlen);
             req_put(msg);
         } else {
-            msg->swallow = 1;
+            /*
+             * A request on a backend thread is not to be written to until
+             * it is handed back, and then freed for it has no owner
+             */
+            if (msg->chan != NULL) {
+                msg->owner = NULL;
+            } else {
+                msg->swallow = 1;
+            }
 
             ASSERT(msg->request);
             ASSERT(msg->peer == NULL);
@@ -182,7 +274,7 @@ client_close(struct context *ctx, struct conn *conn)
     }
     ASSERT(TAILQ_EMPTY(&conn->omsg_q));
 
-    conn->unref(conn);
+    conn->ops->unref(conn);
 
     status = close(conn->sd);
     if (status < 0) {
@@ -34,5 +34,8 @@ bool client_active(const struct conn *conn);
 void client_ref(struct conn *conn, void *owner);
 void client_unref(struct conn *conn);
 void client_close(struct context *ctx, struct conn *conn);
+void client_throttle(struct context *ctx, struct conn *conn);
+void client_unthrottle(struct context *ctx, struct conn *conn);
+void client_drain(struct context *ctx, struct conn *conn, size_t nsent);
 
 #endif
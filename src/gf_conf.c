@@ -50,6 +50,13 @@ static const struct string dist_strings[] = {
 };
 #undef DEFINE_ACTION
 
+#define DEFINE_ACTION(_protocol, _name) string(#_name),
+static const struct string protocol_strings[] = {
+    PROTOCOL_CODEC( DEFINE_ACTION )
+    null_string
+};
+#undef DEFINE_ACTION
+
 static const struct command conf_commands[] = {
     { string("listen"),
       conf_set_listen,
@@ -79,10 +86,22 @@ static const struct command conf_commands[] = {
       conf_set_num,
       offsetof(struct conf_pool, client_connections) },
 
+    { string("client_output_buffer_limit"),
+      conf_set_num,
+      offsetof(struct conf_pool, client_output_buffer_limit) },
+
+    { string("client_max_pending_requests"),
+      conf_set_num,
+      offsetof(struct conf_pool, client_max_pending_requests) },
+
     { string("redis"),
       conf_set_bool,
       offsetof(struct conf_pool, redis) },
 
+    { string("protocol"),
+      conf_set_protocol,
+      offsetof(struct conf_pool, protocol) },
+
     { string("tcpkeepalive"),
       conf_set_bool,
       offsetof(struct conf_pool, tcpkeepalive) },
@@ -177,6 +196,7 @@ conf_server_each_transform(void *elem, void *data)
     gf_memcpy(&s->info, &cs->info, sizeof(cs->info));
 
     s->ns_conn_q = 0;
+    s->ns_resp3_conn_q = 0;
     TAILQ_INIT(&s->s_conn_q);
 
     s->next_retry = 0LL;
@@ -207,7 +227,10 @@ conf_pool_init(struct conf_pool *cp, const struct string *name)
     cp->timeout = CONF_UNSET_NUM;
     cp->backlog = CONF_UNSET_NUM;
     cp->client_connections = CONF_UNSET_NUM;
+    cp->client_output_buffer_limit = CONF_UNSET_NUM;
+    cp->client_max_pending_requests = CONF_UNSET_NUM;
     cp->redis = CONF_UNSET_NUM;
+    cp->protocol = CONF_UNSET_PROTOCOL;
     cp->tcpkeepalive = CONF_UNSET_NUM;
     cp->reuseport = CONF_UNSET_NUM;
     cp->redis_db = CONF_UNSET_NUM;
@@ -282,6 +305,7 @@ conf_pool_each_transform(void *elem, void *data)
     sp->continuum = NULL;
     sp->nlive_server = 0;
     sp->next_rebuild = 0LL;
+    sp->next_slots_refresh = 0LL;
 
     sp->name = cp->name;
     sp->addrstr = cp->listen.pname;
@@ -299,6 +323,7 @@ conf_pool_each_transform(void *elem, void *data)
     sp->reuseport = cp->reuseport ? 1 : 0;
 
     sp->redis = cp->redis ? 1 : 0;
+    sp->binary = cp->protocol == PROTOCOL_MEMCACHE_BINARY ? 1 : 0;
     sp->timeout = cp->timeout;
     sp->backlog = cp->backlog;
     sp->redis_db = cp->redis_db;
@@ -307,6 +332,8 @@ conf_pool_each_transform(void *elem, void *data)
     sp->require_auth = cp->redis_auth.len > 0 ? 1 : 0;
 
     sp->client_connections = (uint32_t)cp->client_connections;
+    sp->client_output_buffer_limit = (uint32_t)cp->client_output_buffer_limit;
+    sp->client_max_pending_requests = (uint32_t)cp->client_max_pending_requests;
     sp->server_connections = (uint32_t)cp->server_connections;
     sp->server_retry_timeout = (int64_t)cp->server_retry_timeout * 1000LL;
     sp->server_failure_limit = (uint32_t)cp->server_failure_limit;
@@ -353,7 +380,12 @@ conf_dump(const struct conf *cf)
         log_debug(LOG_VVERB, "  distribution: %d", cp->distribution);
         log_debug(LOG_VVERB, "  client_connections: %d",
                   cp->client_connections);
+        log_debug(LOG_VVERB, "  client_output_buffer_limit: %d",
+                  cp->client_output_buffer_limit);
+        log_debug(LOG_VVERB, "  client_max_pending_requests: %d",
+                  cp->client_max_pending_requests);
         log_debug(LOG_VVERB, "  redis: %d", cp->redis);
+        log_debug(LOG_VVERB, "  protocol: %d", cp->protocol);
         log_debug(LOG_VVERB, "  preconnect: %d", cp->preconnect);
         log_debug(LOG_VVERB, "  auto_eject_hosts: %d", cp->auto_eject_hosts);
         log_debug(LOG_VVERB, "  server_connections: %d",
@@ -1204,8 +1236,26 @@ conf_validate_pool(struct conf *cf, struct conf_pool *cp)
 
     cp->client_connections = CONF_DEFAULT_CLIENT_CONNECTIONS;
 
-    if (cp->redis == CONF_UNSET_NUM) {
-        cp->redis = CONF_DEFAULT_REDIS;
+    if (cp->client_output_buffer_limit == CONF_UNSET_NUM) {
+        cp->client_output_buffer_limit = CONF_DEFAULT_CLIENT_OUTPUT_BUFFER_LIMIT;
+    }
+
+    if (cp->client_max_pending_requests == CONF_UNSET_NUM) {
+        cp->client_max_pending_requests = CONF_DEFAULT_CLIENT_MAX_PENDING_REQUESTS;
+    }
+
+    if (cp->protocol == CONF_UNSET_PROTOCOL) {
+        if (cp->redis == CONF_UNSET_NUM) {
+            cp->redis = CONF_DEFAULT_REDIS;
+        }
+        cp->protocol = cp->redis ? PROTOCOL_REDIS : PROTOCOL_MEMCACHE;
+    } else if (cp->redis == CONF_UNSET_NUM) {
+        cp->redis = cp->protocol == PROTOCOL_REDIS;
+    } else if (cp->redis != (cp->protocol == PROTOCOL_REDIS)) {
+        log_error("conf: directive \"redis:\" contradicts directive "
+                  "\"protocol:\" in pool '%.*s'", (int)cp->name.len,
+                  cp->name.data);
+        return GF_ERROR;
     }
 
     if (cp->tcpkeepalive == CONF_UNSET_NUM) {
@@ -1248,6 +1298,29 @@ conf_validate_pool(struct conf *cf, struct conf_pool *cp)
         return GF_ERROR;
     }
 
+    if (cp->distribution == DIST_REDIS_CLUSTER) {
+        if (!cp->redis) {
+            log_error("conf: distribution \"redis_cluster\" is only valid for "
+                      "a redis pool");
+            return GF_ERROR;
+        }
+
+        if (cp->redis_db != 0) {
+            log_error("conf: directive \"redis_db:\" must be 0 for "
+                      "distribution \"redis_cluster\"");
+            return GF_ERROR;
+        }
+
+        /* keys are hashed to slots the way the cluster does it */
+        if (string_empty(&cp->hash_tag)) {
+            string_set_text(&cp->hash_tag, "{}");
+        } else if (cp->hash_tag.data[0] != '{' || cp->hash_tag.data[1] != '}') {
+            log_error("conf: directive \"hash_tag:\" must be \"{}\" for "
+                      "distribution \"redis_cluster\"");
+            return GF_ERROR;
+        }
+    }
+
     status = conf_validate_server(cf, cp);
     if (status != GF_OK) {
         return status;
@@ -1722,6 +1795,35 @@ conf_set_hash(struct conf *cf, const struct command *cmd, void *conf)
     return "is not a valid hash";
 }
 
+const char *
+conf_set_protocol(struct conf *cf, const struct command *cmd, void *conf)
+{
+    uint8_t *p;
+    protocol_type_t *pp;
+    const struct string *value, *protocol;
+
+    p = conf;
+    pp = (protocol_type_t *)(p + cmd->offset);
+
+    if (*pp != CONF_UNSET_PROTOCOL) {
+        return "is a duplicate";
+    }
+
+    value = array_top(&cf->arg);
+
+    for (protocol = protocol_strings; protocol->len != 0; protocol++) {
+        if (string_compare(value, protocol) != 0) {
+            continue;
+        }
+
+        *pp = (protocol_type_t)(protocol - protocol_strings);
+
+        return CONF_OK;
+    }
+
+    return "is not a valid protocol";
+}
+
 const char *
 conf_set_distribution(struct conf *cf, const struct command *cmd, void *conf)
 {
@@ -50,12 +50,15 @@
 #define CONF_UNSET_PTR                      NULL
 #define CONF_UNSET_HASH                     (hash_type_t)-1
 #define CONF_UNSET_DIST                     (dist_type_t)-1
+#define CONF_UNSET_PROTOCOL                 (protocol_type_t)-1
 
 #define CONF_DEFAULT_HASH                    HASH_FNV1A_64
 #define CONF_DEFAULT_DIST                    DIST_KETAMA
 #define CONF_DEFAULT_TIMEOUT                 -1
 #define CONF_DEFAULT_LISTEN_BACKLOG          512
 #define CONF_DEFAULT_CLIENT_CONNECTIONS      0
+#define CONF_DEFAULT_CLIENT_OUTPUT_BUFFER_LIMIT 0              /* in bytes, 0 for none */
+#define CONF_DEFAULT_CLIENT_MAX_PENDING_REQUESTS 0
 #define CONF_DEFAULT_REDIS                   false
 #define CONF_DEFAULT_REDIS_DB                0
 #define CONF_DEFAULT_PRECONNECT              false
@@ -67,6 +70,18 @@
 #define CONF_DEFAULT_TCPKEEPALIVE            false
 #define CONF_DEFAULT_REUSEPORT		         false
 
+#define PROTOCOL_CODEC(ACTION)                                  \
+    ACTION( PROTOCOL_REDIS,             redis             )     \
+    ACTION( PROTOCOL_MEMCACHE,          memcache          )     \
+    ACTION( PROTOCOL_MEMCACHE_BINARY,   memcache_binary   )     \
+
+#define DEFINE_ACTION(_protocol, _name) _protocol,
+typedef enum protocol_type {
+    PROTOCOL_CODEC( DEFINE_ACTION )
+    PROTOCOL_SENTINEL
+} protocol_type_t;
+#undef DEFINE_ACTION
+
 struct conf_listen {
     struct string   pname;   /* listen: as "hostname:port" */
     struct string   name;    /* hostname:port */
@@ -95,8 +110,11 @@ struct conf_pool {
     int                timeout;               /* timeout: */
     int                backlog;               /* backlog: */
     int                client_connections;    /* client_connections: */
+    int                client_output_buffer_limit;  /* client_output_buffer_limit: in bytes */
+    int                client_max_pending_requests; /* client_max_pending_requests: */
     int                tcpkeepalive;          /* tcpkeepalive: */
     int                redis;                 /* redis: */
+    protocol_type_t    protocol;              /* protocol: */
     struct string      redis_auth;            /* redis_auth: redis auth password (matches requirepass on redis) */
     int                redis_db;              /* redis_db: redis db */
     int                preconnect;            /* preconnect: */
@@ -141,6 +159,7 @@ const char *conf_add_server(struct conf *cf, const struct command *cmd, void *co
 const char *conf_set_num(struct conf *cf, const struct command *cmd, void *conf);
 const char *conf_set_bool(struct conf *cf, const struct command *cmd, void *conf);
 const char *conf_set_hash(struct conf *cf, const struct command *cmd, void *conf);
+const char *conf_set_protocol(struct conf *cf, const struct command *cmd, void *conf);
 const char *conf_set_distribution(struct conf *cf, const struct command *cmd, void *conf);
 const char *conf_set_hashtag(struct conf *cf, const struct command *cmd, void *conf);
 
@@ -26,6 +26,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 #include <gf_core.h>
+#include <proto/gf_proto.h>
 
 /*
  *                   nc_connection.[ch]
@@ -85,11 +86,129 @@
  * the queue.
  */
 
-static uint32_t nfree_connq;       /* # free conn q */
-static struct conn_tqh free_connq; /* free conn q */
+/*
+ * Every event loop thread allocates conns from a pool of its own, which a
+ * conn is put back to even when it is put on another thread: it is pushed
+ * on the return q of its pool, and reclaimed by the owner thread in a batch
+ * on its next loop. The counters are shared.
+ */
+struct conn_pool {
+    uint32_t        nfree_connq;  /* # free conn q */
+    struct conn_tqh free_connq;   /* free conn q */
+    struct conn     *return_connq; /* conns put by other threads */
+};
+
+static __thread struct conn_pool conn_pool;
 static uint64_t ntotal_conn;       /* total # connections counter from start */
 static uint32_t ncurr_conn;        /* current # connections */
 static uint32_t ncurr_cconn;       /* current # client connections */
+static uint32_t nalloc_conn;       /* # allocated conn, in use or free */
+static uint32_t nalloc_conn_max;   /* high-water mark of # allocated conn */
+
+/*
+ * client receives a request, possibly parsing it, and sends a response
+ * downstream.
+ */
+static const struct conn_ops client_conn_ops = {
+    .recv = msg_recv,
+    .recv_next = req_recv_next,
+    .recv_done = req_recv_done,
+    .send = msg_send,
+    .send_next = rsp_send_next,
+    .send_done = rsp_send_done,
+    .close = client_close,
+    .active = client_active,
+    .post_connect = NULL,
+    .swallow_msg = NULL,
+    .ref = client_ref,
+    .unref = client_unref,
+    .enqueue_inq = NULL,
+    .dequeue_inq = NULL,
+    .enqueue_outq = req_client_enqueue_omsgq,
+    .dequeue_outq = req_client_dequeue_omsgq,
+};
+
+/*
+ * server receives a response, possibly parsing it, and sends a request
+ * upstream.
+ */
+static const struct conn_ops redis_server_conn_ops = {
+    .recv = msg_recv,
+    .recv_next = rsp_recv_next,
+    .recv_done = rsp_recv_done,
+    .send = msg_send,
+    .send_next = req_send_next,
+    .send_done = req_send_done,
+    .close = server_close,
+    .active = server_active,
+    .post_connect = redis_post_connect,
+    .swallow_msg = redis_swallow_msg,
+    .ref = server_ref,
+    .unref = server_unref,
+    .enqueue_inq = req_server_enqueue_imsgq,
+    .dequeue_inq = req_server_dequeue_imsgq,
+    .enqueue_outq = req_server_enqueue_omsgq,
+    .dequeue_outq = req_server_dequeue_omsgq,
+};
+
+static const struct conn_ops memcache_server_conn_ops = {
+    .recv = msg_recv,
+    .recv_next = rsp_recv_next,
+    .recv_done = rsp_recv_done,
+    .send = msg_send,
+    .send_next = req_send_next,
+    .send_done = req_send_done,
+    .close = server_close,
+    .active = server_active,
+    .post_connect = memcache_post_connect,
+    .swallow_msg = memcache_swallow_msg,
+    .ref = server_ref,
+    .unref = server_unref,
+    .enqueue_inq = req_server_enqueue_imsgq,
+    .dequeue_inq = req_server_dequeue_imsgq,
+    .enqueue_outq = req_server_enqueue_omsgq,
+    .dequeue_outq = req_server_dequeue_omsgq,
+};
+
+/* proxy only accepts new client connections */
+static const struct conn_ops proxy_conn_ops = {
+    .recv = proxy_recv,
+    .recv_next = NULL,
+    .recv_done = NULL,
+    .send = NULL,
+    .send_next = NULL,
+    .send_done = NULL,
+    .close = proxy_close,
+    .active = NULL,
+    .post_connect = NULL,
+    .swallow_msg = NULL,
+    .ref = proxy_ref,
+    .unref = proxy_unref,
+    .enqueue_inq = NULL,
+    .dequeue_inq = NULL,
+    .enqueue_outq = NULL,
+    .dequeue_outq = NULL,
+};
+
+/* wake up pipe only reads the wake ups of its event loop by other threads */
+static const struct conn_ops wake_conn_ops = {
+    .recv = backend_wake_recv,
+    .recv_next = NULL,
+    .recv_done = NULL,
+    .send = NULL,
+    .send_next = NULL,
+    .send_done = NULL,
+    .close = backend_wake_close,
+    .active = NULL,
+    .post_connect = NULL,
+    .swallow_msg = NULL,
+    .ref = backend_wake_ref,
+    .unref = backend_wake_unref,
+    .enqueue_inq = NULL,
+    .dequeue_inq = NULL,
+    .enqueue_outq = NULL,
+    .dequeue_outq = NULL,
+};
 
 /*
  * Return the context associated with this connection.
@@ -114,19 +233,23 @@ _conn_get(void)
 {
     struct conn *conn;
 
-    if (!TAILQ_EMPTY(&free_connq)) {
-        ASSERT(nfree_connq > 0);
+    if (!TAILQ_EMPTY(&conn_pool.free_connq)) {
+        ASSERT(conn_pool.nfree_connq > 0);
 
-        conn = TAILQ_FIRST(&free_connq);
-        nfree_connq--;
-        TAILQ_REMOVE(&free_connq, conn, conn_tqe);
+        conn = TAILQ_FIRST(&conn_pool.free_connq);
+        conn_pool.nfree_connq--;
+        TAILQ_REMOVE(&conn_pool.free_connq, conn, conn_tqe);
+        ASSERT(conn->pool == &conn_pool);
     } else {
         conn = gf_alloc(sizeof(*conn));
         if (conn == NULL)
             return NULL;
+        conn->pool = &conn_pool;
+        gf_atomic_max(&nalloc_conn_max, gf_atomic_add(&nalloc_conn, 1));
     }
 
     conn->owner = NULL;
+    conn->ops = NULL;
     conn->sd = -1;
 
     /* {family, addrlen, addr} are initialized in enqueue handler */
@@ -135,13 +258,12 @@ _conn_get(void)
     conn->rmsg = NULL;
     conn->smsg = NULL;
 
-    /*
-     * Callbacks {recv, recv_next, recv_done}, {send, send_next, send_done},
-     * {close, active}, parse, {ref, unref}, {enqueue_inq, dequeue_inq} and
-     * {enqueue_outq, dequeue_outq} are initialized by the wrapper.
-     */
+    /* ops are initialized by the wrapper */
     conn->send_bytes = 0;
     conn->recv_bytes = 0;
+    conn->recv_hint = 0;
+    conn->nout_msg = 0;
+    conn->out_bytes = 0;
 
     conn->events = 0;
     conn->err = 0;
@@ -149,6 +271,7 @@ _conn_get(void)
     conn->recv_ready = 0;
     conn->send_active = 0;
     conn->send_ready = 0;
+    conn->dirty = 0;
 
     conn->client = 0;
     conn->proxy = 0;
@@ -157,10 +280,15 @@ _conn_get(void)
     conn->eof = 0;
     conn->done = 0;
     conn->redis = 0;
+    conn->binary = 0;
     conn->authenticated = 0;
+    conn->resp3 = 0;
+    conn->throttled = 0;
+    conn->recv_held = 0;
+    conn->uring = 0;
 
-    ntotal_conn++;
-    ncurr_conn++;
+    gf_atomic_add(&ntotal_conn, 1);
+    gf_atomic_add(&ncurr_conn, 1);
 
     return conn;
 }
@@ -180,65 +308,16 @@ conn_get(void *owner, bool client, bool redis)
     conn->client = client ? 1 : 0;
 
     if (conn->client) {
-        /*
-         * client receives a request, possibly parsing it, and sends a
-         * response downstream.
-         */
-        conn->recv = msg_recv;
-        conn->recv_next = req_recv_next;
-        conn->recv_done = req_recv_done;
-
-        conn->send = msg_send;
-        conn->send_next = rsp_send_next;
-        conn->send_done = rsp_send_done;
-
-        conn->close = client_close;
-        conn->active = client_active;
-
-        conn->ref = client_ref;
-        conn->unref = client_unref;
-
-        conn->enqueue_inq = NULL;
-        conn->dequeue_inq = NULL;
-        conn->enqueue_outq = req_client_enqueue_omsgq;
-        conn->dequeue_outq = req_client_dequeue_omsgq;
-        conn->post_connect = NULL;
-        conn->swallow_msg = NULL;
-
-        ncurr_cconn++;
+        conn->binary = ((struct server_pool *)owner)->binary;
+        conn->ops = &client_conn_ops;
+
+        gf_atomic_add(&ncurr_cconn, 1);
     } else {
-        /*
-         * server receives a response, possibly parsing it, and sends a
-         * request upstream.
-         */
-        conn->recv = msg_recv;
-        conn->recv_next = rsp_recv_next;
-        conn->recv_done = rsp_recv_done;
-
-        conn->send = msg_send;
-        conn->send_next = req_send_next;
-        conn->send_done = req_send_done;
-
-        conn->close = server_close;
-        conn->active = server_active;
-
-        conn->ref = server_ref;
-        conn->unref = server_unref;
-
-        conn->enqueue_inq = req_server_enqueue_imsgq;
-        conn->dequeue_inq = req_server_dequeue_imsgq;
-        conn->enqueue_outq = req_server_enqueue_omsgq;
-        conn->dequeue_outq = req_server_dequeue_omsgq;
-        // if (redis) {
-        //   conn->post_connect = redis_post_connect;
-        //   conn->swallow_msg = redis_swallow_msg;
-        // } else {
-        //   conn->post_connect = memcache_post_connect;
-        //   conn->swallow_msg = memcache_swallow_msg;
-        // }
+        conn->binary = ((struct server *)owner)->owner->binary;
+        conn->ops = redis ? &redis_server_conn_ops : &memcache_server_conn_ops;
     }
 
-    conn->ref(conn, owner);
+    conn->ops->ref(conn, owner);
     log_debug(LOG_VVERB, "get conn %p client %d", conn, conn->client);
 
     return conn;
@@ -255,31 +334,38 @@ conn_get_proxy(struct server_pool *pool)
     }
 
     conn->redis = pool->redis;
+    conn->binary = pool->binary;
 
     conn->proxy = 1;
+    conn->ops = &proxy_conn_ops;
 
-    conn->recv = proxy_recv;
-    conn->recv_next = NULL;
-    conn->recv_done = NULL;
+    conn->ops->ref(conn, pool);
 
-    conn->send = NULL;
-    conn->send_next = NULL;
-    conn->send_done = NULL;
+    log_debug(LOG_VVERB, "get conn %p proxy %d", conn, conn->proxy);
 
-    conn->close = proxy_close;
-    conn->active = NULL;
+    return conn;
+}
 
-    conn->ref = proxy_ref;
-    conn->unref = proxy_unref;
+/*
+ * Return a conn for the wake up pipe of the event loop of pool, which is
+ * owned by pool like a proxy connection
+ */
+struct conn *
+conn_get_wake(struct server_pool *pool)
+{
+    struct conn *conn;
 
-    conn->enqueue_inq = NULL;
-    conn->dequeue_inq = NULL;
-    conn->enqueue_outq = NULL;
-    conn->dequeue_outq = NULL;
+    conn = _conn_get();
+    if (conn == NULL) {
+        return NULL;
+    }
 
-    conn->ref(conn, pool);
+    conn->proxy = 1;
+    conn->ops = &wake_conn_ops;
 
-    log_debug(LOG_VVERB, "get conn %p proxy %d", conn, conn->proxy);
+    conn->ops->ref(conn, pool);
+
+    log_debug(LOG_VVERB, "get conn %p wake", conn);
 
     return conn;
 }
@@ -288,6 +374,7 @@ static void
 conn_free(struct conn *conn)
 {
     log_debug(LOG_VVERB, "free conn %p", conn);
+    gf_atomic_sub(&nalloc_conn, 1);
     gf_free(conn);
 }
 
@@ -299,21 +386,48 @@ conn_put(struct conn *conn)
 
     log_debug(LOG_VVERB, "put conn %p", conn);
 
-    nfree_connq++;
-    TAILQ_INSERT_HEAD(&free_connq, conn, conn_tqe);
-
     if (conn->client) {
-        ncurr_cconn--;
+        gf_atomic_sub(&ncurr_cconn, 1);
+    }
+    gf_atomic_sub(&ncurr_conn, 1);
+
+    if (conn->pool != &conn_pool) {
+        gf_mpsc_push(&conn->pool->return_connq, conn,
+                     TAILQ_NEXT(conn, conn_tqe));
+        return;
+    }
+
+    conn_pool.nfree_connq++;
+    TAILQ_INSERT_HEAD(&conn_pool.free_connq, conn, conn_tqe);
+}
+
+/*
+ * Move the conns put back by other threads to the free q
+ */
+void
+conn_reclaim(void)
+{
+    struct conn *conn, *nconn; /* current and next connection */
+
+    if (gf_mpsc_empty(&conn_pool.return_connq)) {
+        return;
+    }
+
+    for (conn = gf_mpsc_take(&conn_pool.return_connq); conn != NULL;
+         conn = nconn) {
+        nconn = TAILQ_NEXT(conn, conn_tqe);
+        conn_pool.nfree_connq++;
+        TAILQ_INSERT_HEAD(&conn_pool.free_connq, conn, conn_tqe);
     }
-    ncurr_conn--;
 }
 
 void
 conn_init(void)
 {
     log_debug(LOG_DEBUG, "conn size %d", (int)sizeof(struct conn));
-    nfree_connq = 0;
-    TAILQ_INIT(&free_connq);
+    conn_pool.nfree_connq = 0;
+    TAILQ_INIT(&conn_pool.free_connq);
+    conn_pool.return_connq = NULL;
 }
 
 void
@@ -321,14 +435,36 @@ conn_deinit(void)
 {
     struct conn *conn, *nconn; /* current and next connection */
 
-    for (conn = TAILQ_FIRST(&free_connq); conn != NULL;
-         conn = nconn, nfree_connq--) 
+    conn_reclaim();
+
+    for (conn = TAILQ_FIRST(&conn_pool.free_connq); conn != NULL;
+         conn = nconn, conn_pool.nfree_connq--) 
     {
-        ASSERT(nfree_connq > 0);
+        ASSERT(conn_pool.nfree_connq > 0);
         nconn = TAILQ_NEXT(conn, conn_tqe);
         conn_free(conn);
     }
-    ASSERT(nfree_connq == 0);
+    ASSERT(conn_pool.nfree_connq == 0);
+}
+
+/*
+ * Free up to nbatch of the least recently used free conns beyond the first
+ * nfree_max, and return true if there may be more of them to free.
+ */
+bool
+conn_trim(uint32_t nfree_max, uint32_t nbatch)
+{
+    struct conn *conn;
+    uint32_t n;
+
+    for (n = 0; n < nbatch && conn_pool.nfree_connq > nfree_max; n++) {
+        conn = TAILQ_LAST(&conn_pool.free_connq, conn_tqh);
+        conn_pool.nfree_connq--;
+        TAILQ_REMOVE(&conn_pool.free_connq, conn, conn_tqe);
+        conn_free(conn);
+    }
+
+    return conn_pool.nfree_connq > nfree_max;
 }
 
 ssize_t
@@ -341,12 +477,18 @@ conn_recv(struct conn *conn, void *buf, size_t size)
     ASSERT(conn->recv_ready);
 
     for (;;) {
+#ifdef GF_HAVE_IO_URING
+        if (conn->uring) {
+            n = event_uring_recv(conn_to_ctx(conn)->evb, conn, buf, size);
+        } else
+#endif
         n = gf_read(conn->sd, buf, size);
 
         log_debug(LOG_VERB, "recv on sd %d %zd of %zu", conn->sd, n, size);
 
         if (n > 0) {
-            if (n < (ssize_t)size) {
+            /* io_uring is only asked for the next read by the next call */
+            if (n < (ssize_t)size && !conn->uring) {
                 conn->recv_ready = 0;
             }
             conn->recv_bytes += (size_t)n;
@@ -391,13 +533,22 @@ conn_sendv(struct conn *conn, const struct array *sendv, size_t nsend)
     ASSERT(conn->send_ready);
 
     for (;;) {
+#ifdef GF_HAVE_IO_URING
+        if (conn->uring) {
+            n = event_uring_sendv(conn_to_ctx(conn)->evb, conn, sendv, nsend);
+        } else
+#endif
         n = gf_writev(conn->sd, sendv->elem, sendv->nelem);
 
         log_debug(LOG_VERB, "sendv on sd %d %zd of %zu in %"PRIu32" buffers",
                   conn->sd, n, nsend, sendv->nelem);
 
         if (n > 0) {
-            if (n < (ssize_t) nsend) {
+            /*
+             * With io_uring, sendv may be longer than what was handed to
+             * the kernel, and the rest is only sent by the next call
+             */
+            if (n < (ssize_t) nsend && !conn->uring) {
                 conn->send_ready = 0;
             }
             conn->send_bytes += (size_t)n;
@@ -433,19 +584,31 @@ conn_sendv(struct conn *conn, const struct array *sendv, size_t nsend)
 uint32_t
 conn_ncurr_conn(void)
 {
-    return ncurr_conn;
+    return gf_atomic_get(&ncurr_conn);
 }
 
 uint64_t
 conn_ntotal_conn(void)
 {
-    return ntotal_conn;
+    return gf_atomic_get(&ntotal_conn);
 }
 
 uint32_t
 conn_ncurr_cconn(void)
 {
-    return ncurr_cconn;
+    return gf_atomic_get(&ncurr_cconn);
+}
+
+uint32_t
+conn_nalloc(void)
+{
+    return gf_atomic_get(&nalloc_conn);
+}
+
+uint32_t
+conn_nalloc_max(void)
+{
+    return gf_atomic_get(&nalloc_conn_max);
 }
 
 /*
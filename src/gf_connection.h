@@ -48,20 +48,11 @@ typedef void (*conn_msgq_t)(struct context *, struct conn *, struct msg *);
 typedef void (*conn_post_connect_t)(struct context *ctx, struct conn *, struct server *server);
 typedef void (*conn_swallow_msg_t)(struct conn *, struct msg *, struct msg *);
 
-struct conn {
-    TAILQ_ENTRY(conn)   conn_tqe;        /* link in server_pool / server / free q */
-    void                *owner;          /* connection owner - server_pool / server */
-
-    int                 sd;              /* socket descriptor */
-    int                 family;          /* socket address family */
-    socklen_t           addrlen;         /* socket length */
-    struct sockaddr     *addr;           /* socket address (ref in server or server_pool) */
-
-    struct msg_tqh      imsg_q;          /* incoming request Q */
-    struct msg_tqh      omsg_q;          /* outstanding request Q */
-    struct msg          *rmsg;           /* current message being rcvd */
-    struct msg          *smsg;           /* current message being sent */
-
+/*
+ * Handlers of a connection, one const table per kind of connection shared
+ * by all connections of that kind.
+ */
+struct conn_ops {
     conn_recv_t         recv;            /* recv (read) handler */
     conn_recv_next_t    recv_next;       /* recv next message handler */
     conn_recv_done_t    recv_done;       /* read done handler */
@@ -80,16 +71,26 @@ struct conn {
     conn_msgq_t         dequeue_inq;     /* connection inq msg dequeue handler */
     conn_msgq_t         enqueue_outq;    /* connection outq msg enqueue handler */
     conn_msgq_t         dequeue_outq;    /* connection outq msg dequeue handler */
+};
 
-    size_t              recv_bytes;      /* received (read) bytes */
-    size_t              send_bytes;      /* sent (written) bytes */
+/*
+ * Fields used by the event loop on every readiness notification come
+ * first; the socket address, only used on connect and for logging, last.
+ */
+struct conn {
+    TAILQ_ENTRY(conn)   conn_tqe;        /* link in server_pool / server / free q */
+    TAILQ_ENTRY(conn)   dirty_tqe;       /* link in dirty q of the event loop */
+    void                *owner;          /* connection owner - server_pool / server */
+    const struct conn_ops *ops;          /* connection handlers */
 
+    int                 sd;              /* socket descriptor */
     uint32_t            events;          /* connection io events */
     err_t               err;             /* connection errno */
     unsigned            recv_active:1;   /* recv active? */
     unsigned            recv_ready:1;    /* recv ready? */
     unsigned            send_active:1;   /* send active? */
     unsigned            send_ready:1;    /* send ready? */
+    unsigned            dirty:1;         /* in dirty q? */
 
     unsigned            client:1;        /* client? or server? */
     unsigned            proxy:1;         /* proxy? */
@@ -98,7 +99,29 @@ struct conn {
     unsigned            eof:1;           /* eof? aka passive close? */
     unsigned            done:1;          /* done? aka close? */
     unsigned            redis:1;         /* redis? */
+    unsigned            binary:1;        /* memcache binary protocol? */
+    unsigned            resp3:1;         /* redis RESP3 protocol? */
     unsigned            authenticated:1; /* authenticated? */
+    unsigned            throttled:1;     /* recv paused by output limits? */
+    unsigned            recv_held:1;     /* rmsg left unparsed while paused? */
+    unsigned            uring:1;         /* recv and send completed by io_uring? */
+
+    struct msg          *rmsg;           /* current message being rcvd */
+    struct msg          *smsg;           /* current message being sent */
+    struct msg_tqh      imsg_q;          /* incoming request Q */
+    struct msg_tqh      omsg_q;          /* outstanding request Q */
+
+    size_t              recv_bytes;      /* received (read) bytes */
+    size_t              send_bytes;      /* sent (written) bytes */
+    uint32_t            recv_hint;       /* # bytes for the next mbuf to read */
+    uint32_t            nout_msg;        /* # requests in omsg_q (client) */
+    size_t              out_bytes;       /* response bytes not yet sent (client) */
+
+    int                 family;          /* socket address family */
+    socklen_t           addrlen;         /* socket length */
+    struct sockaddr     *addr;           /* socket address (ref in server or server_pool) */
+
+    struct conn_pool    *pool;           /* allocator the conn is put back to (const) */
 };
 
 TAILQ_HEAD(conn_tqh, conn);
@@ -106,14 +129,19 @@ TAILQ_HEAD(conn_tqh, conn);
 struct context *conn_to_ctx(const struct conn *conn);
 struct conn *conn_get(void *owner, bool client, bool redis);
 struct conn *conn_get_proxy(struct server_pool *pool);
+struct conn *conn_get_wake(struct server_pool *pool);
 void conn_put(struct conn *conn);
 ssize_t conn_recv(struct conn *conn, void *buf, size_t size);
 ssize_t conn_sendv(struct conn *conn, const struct array *sendv, size_t nsend);
 void conn_init(void);
 void conn_deinit(void);
+void conn_reclaim(void);
+bool conn_trim(uint32_t nfree_max, uint32_t nbatch);
 uint32_t conn_ncurr_conn(void);
 uint64_t conn_ntotal_conn(void);
 uint32_t conn_ncurr_cconn(void);
+uint32_t conn_nalloc(void);
+uint32_t conn_nalloc_max(void);
 bool conn_authenticated(const struct conn *conn);
 
 #endif
\ No newline at end of file
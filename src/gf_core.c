@@ -28,6 +28,9 @@
 #include <gf_conf.h>
 #include <gf_core.h>
 
+#define CORE_TRIM_NBATCH    256 /* max # objects freed per loop and list */
+#define CORE_TRIM_TIMEOUT   10  /* loop timeout in msec while trimming */
+
 /* context generation */
 static uint32_t ctx_id;
 
@@ -48,7 +51,18 @@ core_calc_connections(struct context *ctx)
     }
 
     ctx->max_nfd = (uint32_t)limit.rlim_cur; /* Soft limit */
-    ctx->max_ncconn = ctx->max_nfd - ctx->max_nsconn - RESERVED_FDS;
+
+    /*
+     * Descriptors are per process, so leave room for every event loop that
+     * connects to servers, and for the wake up pipes of all of them
+     */
+    if (ctx->nbackend != 0) {
+        ctx->max_ncconn = ctx->max_nfd - ctx->max_nsconn * ctx->nbackend -
+                          2 * (ctx->nthread + ctx->nbackend) - RESERVED_FDS;
+    } else {
+        ctx->max_ncconn = ctx->max_nfd - ctx->max_nsconn * ctx->nthread -
+                          RESERVED_FDS;
+    }
     log_debug(LOG_NOTICE, "max fds %"PRIu32" max client conns %"PRIu32" "
               "max server conns %"PRIu32"", ctx->max_nfd, ctx->max_ncconn,
               ctx->max_nsconn);
@@ -57,7 +71,7 @@ core_calc_connections(struct context *ctx)
 }
 
 static struct context *
-core_ctx_create(struct instance *nci)
+core_ctx_create(struct instance *nci, struct context *parent, bool backend)
 {
     rstatus_t status;
     struct context *ctx;
@@ -67,7 +81,11 @@ core_ctx_create(struct instance *nci)
         return NULL;
     }
 
-    ctx->id = ++ctx_id;
+    ctx->id = gf_atomic_add(&ctx_id, 1);
+    ctx->parent = parent;
+    ctx->nthread = nci->nthread;
+    ctx->nbackend = nci->nbackend;
+    ctx->backend = backend;
     ctx->cf = NULL;
     ctx->stats = NULL;
     ctx->evb = NULL;
@@ -77,6 +95,14 @@ core_ctx_create(struct instance *nci)
     ctx->max_nfd = 0;
     ctx->max_ncconn = 0;
     ctx->max_nsconn = 0;
+    ctx->max_nfree_mbuf = nci->mbuf_free_max;
+    ctx->max_nfree_msg = nci->msg_free_max;
+    ctx->max_nfree_conn = nci->conn_free_max;
+    TAILQ_INIT(&ctx->dirty_connq);
+    array_null(&ctx->chan);
+    ctx->wake = NULL;
+    ctx->wake_sd = -1;
+    ctx->sleeping = 0;
 
     /* parse and create configuration */
     ctx->cf = conf_create(nci->conf_filename);
@@ -107,7 +133,8 @@ core_ctx_create(struct instance *nci)
 
     /* create stats per server pool */
     ctx->stats = stats_create(nci->stats_port, nci->stats_addr, nci->stats_interval,
-                              nci->hostname, &ctx->pool);
+                              nci->hostname, &ctx->pool,
+                              parent != NULL ? parent->stats : NULL);
     if (ctx->stats == NULL) {
         server_pool_deinit(&ctx->pool);
         conf_destroy(ctx->cf);
@@ -116,7 +143,23 @@ core_ctx_create(struct instance *nci)
     }
 
     /* initialize event handling for client, proxy and server */
-    ctx->evb = event_base_create(EVENT_SIZE, &core_core);
+    ctx->evb = NULL;
+#ifdef GF_HAVE_IO_URING
+    if (nci->event_uring) {
+        ctx->evb = event_base_create_uring(EVENT_SIZE, &core_core);
+        if (ctx->evb == NULL) {
+            log_warn("io_uring event backend unavailable, using epoll");
+        }
+    }
+#endif
+#ifdef GF_HAVE_EPOLL
+    if (ctx->evb == NULL && nci->event_et) {
+        ctx->evb = event_base_create_et(EVENT_SIZE, &core_core);
+    }
+#endif
+    if (ctx->evb == NULL) {
+        ctx->evb = event_base_create(EVENT_SIZE, &core_core);
+    }
     if (ctx->evb == NULL) {
         stats_destroy(ctx->stats);
         server_pool_deinit(&ctx->pool);
@@ -125,10 +168,25 @@ core_ctx_create(struct instance *nci)
         return NULL;
     }
 
-    /* preconnect? servers in server pool */
-    status = server_pool_preconnect(ctx);
+    /* wake up pipe for the backend I/O threads and the loops they serve */
+    if (ctx->nbackend != 0) {
+        status = backend_init(ctx);
+        if (status != GF_OK) {
+            event_base_destroy(ctx->evb);
+            stats_destroy(ctx->stats);
+            server_pool_deinit(&ctx->pool);
+            conf_destroy(ctx->cf);
+            gf_free(ctx);
+            return NULL;
+        }
+    }
+
+    /* preconnect? servers in server pool, unless backend threads own them */
+    status = (ctx->nbackend == 0 || backend) ? server_pool_preconnect(ctx) :
+                                                GF_OK;
     if (status != GF_OK) {
         server_pool_disconnect(ctx);
+        backend_deinit(ctx);
         event_base_destroy(ctx->evb);
         stats_destroy(ctx->stats);
         server_pool_deinit(&ctx->pool);
@@ -137,10 +195,11 @@ core_ctx_create(struct instance *nci)
         return NULL;
     }
 
-    /* initialize proxy per server pool */
-    status = proxy_init(ctx);
+    /* initialize proxy per server pool, backend threads accept no clients */
+    status = backend ? GF_OK : proxy_init(ctx);
     if (status != GF_OK) {
         server_pool_disconnect(ctx);
+        backend_deinit(ctx);
         event_base_destroy(ctx->evb);
         stats_destroy(ctx->stats);
         server_pool_deinit(&ctx->pool);
@@ -160,6 +219,7 @@ core_ctx_destroy(struct context *ctx)
     log_debug(LOG_VVERB, "destroy ctx %p id %"PRIu32"", ctx, ctx->id);
     proxy_deinit(ctx);
     server_pool_disconnect(ctx);
+    backend_deinit(ctx);
     event_base_destroy(ctx->evb);
     stats_destroy(ctx->stats);
     server_pool_deinit(&ctx->pool);
@@ -167,16 +227,28 @@ core_ctx_destroy(struct context *ctx)
     gf_free(ctx);
 }
 
+/*
+ * Start an event loop on the calling thread. The first one is started with
+ * no parent and serves the stats port; the others share its listening
+ * addresses and report their stats through it. A backend I/O thread
+ * listens on nothing and serves the requests handed over to it by the
+ * others instead.
+ */
 struct context *
-core_start(struct instance *nci)
+core_start(struct instance *nci, struct context *parent, bool backend)
 {
+    rstatus_t status;
     struct context *ctx;
 
-    mbuf_init(nci->mbuf_chunk_size);
+    status = mbuf_init(nci->mbuf_chunk_size, nci->mbuf_prealloc,
+                       nci->mbuf_hugepage);
+    if (status != GF_OK) {
+        return NULL;
+    }
     msg_init();
     conn_init();
 
-    ctx = core_ctx_create(nci);
+    ctx = core_ctx_create(nci, parent, backend);
     if (ctx != NULL) {
         nci->ctx = ctx;
         return ctx;
@@ -192,10 +264,11 @@ core_start(struct instance *nci)
 void
 core_stop(struct context *ctx)
 {
+    /* connections closed with the context put their mbufs back */
+    core_ctx_destroy(ctx);
     conn_deinit();
     msg_deinit();
     mbuf_deinit();
-    core_ctx_destroy(ctx);
 }
 
 static rstatus_t
@@ -203,7 +276,7 @@ core_recv(struct context *ctx, struct conn *conn)
 {
     rstatus_t status;
 
-    status = conn->recv(ctx, conn);
+    status = conn->ops->recv(ctx, conn);
     if (status != GF_OK) {
         log_debug(LOG_INFO, "recv on %c %d failed: %s",
                   conn->client ? 'c' : (conn->proxy ? 'p' : 's'), conn->sd,
@@ -218,7 +291,7 @@ core_send(struct context *ctx, struct conn *conn)
 {
     rstatus_t status;
 
-    status = conn->send(ctx, conn);
+    status = conn->ops->send(ctx, conn);
     if (status != GF_OK) {
         log_debug(LOG_INFO, "send on %c %d failed: status: %d errno: %d %s",
                   conn->client ? 'c' : (conn->proxy ? 'p' : 's'), conn->sd,
@@ -256,7 +329,12 @@ core_close(struct context *ctx, struct conn *conn)
                  type, conn->sd, strerror(errno));
     }
 
-    conn->close(ctx, conn);
+    if (conn->dirty) {
+        TAILQ_REMOVE(&ctx->dirty_connq, conn, dirty_tqe);
+        conn->dirty = 0;
+    }
+
+    conn->ops->close(ctx, conn);
 }
 
 static void
@@ -318,6 +396,31 @@ core_timeout(struct context *ctx)
     }
 }
 
+/*
+ * Free the mbufs, msgs and conns kept on free lists beyond their caps, a
+ * batch at a time, so that memory taken by a burst of traffic is given back
+ * without stalling the loop. The loop wakes up again shortly for as long as
+ * there is more to free.
+ */
+static void
+core_trim(struct context *ctx)
+{
+    bool more;
+
+    /* take back what other threads put first, so it is trimmed too */
+    conn_reclaim();
+    msg_reclaim();
+    mbuf_reclaim();
+
+    more = mbuf_trim(ctx->max_nfree_mbuf, CORE_TRIM_NBATCH);
+    more = msg_trim(ctx->max_nfree_msg, CORE_TRIM_NBATCH) || more;
+    more = conn_trim(ctx->max_nfree_conn, CORE_TRIM_NBATCH) || more;
+
+    if (more) {
+        ctx->timeout = MIN(ctx->timeout, CORE_TRIM_TIMEOUT);
+    }
+}
+
 rstatus_t
 core_core(void *arg, uint32_t events)
 {
@@ -363,18 +466,81 @@ core_core(void *arg, uint32_t events)
     return GF_OK;
 }
 
+/*
+ * Note that conn has output queued. Rather than asking for a write event
+ * and writing from it on the next event_wait, the conn is written once at
+ * the end of this loop iteration, so that everything queued to it in the
+ * meantime goes out in one conn_sendv. A conn already waiting for a write
+ * event is left to it.
+ */
+void
+core_dirty(struct context *ctx, struct conn *conn)
+{
+    if (conn->dirty || conn->send_active) {
+        return;
+    }
+
+    TAILQ_INSERT_TAIL(&ctx->dirty_connq, conn, dirty_tqe);
+    conn->dirty = 1;
+}
+
+static void
+core_flush(struct context *ctx)
+{
+    rstatus_t status;
+    struct conn *conn;
+
+    /* closing a conn may dirty others, which are flushed in the same pass */
+    while (!TAILQ_EMPTY(&ctx->dirty_connq)) {
+        conn = TAILQ_FIRST(&ctx->dirty_connq);
+        TAILQ_REMOVE(&ctx->dirty_connq, conn, dirty_tqe);
+        conn->dirty = 0;
+
+        if (conn->err) {
+            core_close(ctx, conn);
+            continue;
+        }
+
+        /* a pending write event, like that of a connect, does the write */
+        if (conn->send_active) {
+            continue;
+        }
+
+        status = core_send(ctx, conn);
+        if (status != GF_OK || conn->done || conn->err) {
+            core_close(ctx, conn);
+            continue;
+        }
+
+        /* socket buffer is full; write the rest on the next write event */
+        if (!conn->send_ready) {
+            status = event_add_out(ctx->evb, conn);
+            if (status != GF_OK) {
+                conn->err = errno;
+                core_close(ctx, conn);
+            }
+        }
+    }
+}
+
 rstatus_t
 core_loop(struct context *ctx)
 {
     int nsd;
 
-    nsd = event_wait(ctx->evb, ctx->timeout);
+    nsd = event_wait(ctx->evb, backend_sleep(ctx, ctx->timeout));
     if (nsd < 0) {
         return nsd;
     }
 
+    backend_run(ctx);
+
     core_timeout(ctx);
 
+    core_flush(ctx);
+
+    core_trim(ctx);
+
     stats_swap(ctx->stats);
 
     return GF_OK;
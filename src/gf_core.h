@@ -58,6 +58,14 @@
 # error missing scalable I/O event notification mechanism
 #endif
 
+#ifdef HAVE_IO_URING
+# define GF_HAVE_IO_URING 1
+#endif
+
+#ifdef HAVE_IO_URING_SYNC_CANCEL
+# define GF_HAVE_IO_URING_SYNC_CANCEL 1
+#endif
+
 #ifdef HAVE_LITTLE_ENDIAN
 # define GF_LITTLE_ENDIAN 1
 #endif
@@ -66,6 +74,10 @@
 # define GF_HAVE_BACKTRACE 1
 #endif
 
+#ifdef HAVE_PERF_EVENT
+# define GF_HAVE_PERF_EVENT 1
+#endif
+
 #define GF_OK        0
 #define GF_ERROR    -1
 #define GF_EAGAIN   -2
@@ -130,9 +142,15 @@ struct event_base;
 #include <gf_server.h>
 #include <gf_client.h>
 #include <gf_proxy.h>
+#include <gf_ring.h>
+#include <gf_backend.h>
 
 struct context {
     uint32_t           id;          /* unique context id */
+    struct context     *parent;     /* context of the first event loop or NULL */
+    uint32_t           nthread;     /* # event loop threads */
+    uint32_t           nbackend;    /* # backend I/O threads */
+    bool               backend;     /* backend I/O thread? */
     struct conf        *cf;         /* configuration */
     struct stats       *stats;      /* stats */
 
@@ -144,6 +162,17 @@ struct context {
     uint32_t           max_nfd;     /* max # files */
     uint32_t           max_ncconn;  /* max # client connections */
     uint32_t           max_nsconn;  /* max # server connections */
+
+    uint32_t           max_nfree_mbuf; /* max # free mbufs kept per class */
+    uint32_t           max_nfree_msg;  /* max # free msgs kept */
+    uint32_t           max_nfree_conn; /* max # free conns kept */
+
+    struct conn_tqh    dirty_connq; /* conns with output queued to send */
+
+    struct array       chan;        /* backend_chan *[] to the other side */
+    struct conn        *wake;       /* read end of the wake up pipe */
+    int                wake_sd;     /* write end of the wake up pipe */
+    uint32_t           sleeping;    /* blocked in event_wait? (atomic) */
 };
 
 struct instance {
@@ -156,14 +185,25 @@ struct instance {
     const char      *stats_addr;                 /* stats monitoring addr */
     char            hostname[GF_MAXHOSTNAMELEN]; /* hostname */
     size_t          mbuf_chunk_size;             /* mbuf chunk size */
+    uint32_t        mbuf_prealloc;               /* # mbuf preallocated */
+    mbuf_hugepage_t mbuf_hugepage;               /* huge pages for mbufs */
+    uint32_t        mbuf_free_max;               /* max # free mbuf per class */
+    uint32_t        msg_free_max;                /* max # free msg */
+    uint32_t        conn_free_max;               /* max # free conn */
+    uint32_t        nthread;                     /* # event loop threads */
+    uint32_t        nbackend;                    /* # backend I/O threads */
     pid_t           pid;                         /* process id */
     const char      *pid_filename;               /* pid filename */
     unsigned        pidfile:1;                   /* pid file created? */
+    unsigned        event_uring:1;               /* use io_uring event backend? */
+    unsigned        event_et:1;                  /* watch for writes once with epoll? */
 };
 
-struct context *core_start(struct instance *nci);
+struct context *core_start(struct instance *nci, struct context *parent,
+                           bool backend);
 void core_stop(struct context *ctx);
 rstatus_t core_core(void *arg, uint32_t events);
+void core_dirty(struct context *ctx, struct conn *conn);
 rstatus_t core_loop(struct context *ctx);
 
 #endif
\ No newline at end of file
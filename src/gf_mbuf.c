@@ -25,45 +25,238 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
+#include <sys/mman.h>
+
 #include <gf_core.h>
 
-static uint32_t nfree_mbufq;   /* # free mbuf */
-static struct mhdr free_mbufq; /* free mbuf q */
+/*
+ * Mbufs are carved out of regions of memory that are mapped in bulk, rather
+ * than allocated one at a time, so that they are packed into a few large
+ * mappings, backed by huge pages if asked to, instead of being scattered
+ * over the heap. Each region keeps the queue of its own free mbufs, and the
+ * regions that have a free mbuf are on the free region q of their class, the
+ * most recently used first. The chunks of a region are carved as they are
+ * first needed, so that a mapping only takes memory as it gets used, unless
+ * it was populated upfront.
+ *
+ * Mbufs come in a few size classes, each with regions of its own, so that a
+ * short message doesn't take a large mbuf and a large one isn't chained over
+ * many small ones. The class of the configured chunk size is the default,
+ * that of mbuf_get() and mbuf_data_size().
+ */
+struct mbuf_region {
+    TAILQ_ENTRY(mbuf_region) tqe;        /* link in region q */
+    TAILQ_ENTRY(mbuf_region) free_tqe;   /* link in free region q */
+    struct mbuf_class        *mclass;    /* class of mbufs */
+    uint8_t                  *base;      /* start of mapping */
+    uint32_t                 nchunk;     /* # chunk */
+    uint32_t                 ncarved;    /* # chunk carved */
+    uint32_t                 nused;      /* # mbuf in use */
+    struct mhdr              free_mbufq; /* free mbuf q */
+};
+
+TAILQ_HEAD(mbuf_region_tqh, mbuf_region);
+
+struct mbuf_class {
+    size_t                 chunk_size;    /* mbuf chunk size - header + data (const) */
+    size_t                 offset;        /* mbuf offset in chunk (const) */
+    size_t                 region_size;   /* region size (const) */
+    uint32_t               region_nchunk; /* # chunk in region (const) */
+    uint32_t               nfree;         /* # free mbuf, carved or not */
+    struct mbuf_region_tqh free_regionq;  /* regions with a free mbuf q */
+    struct mbuf_pool       *pool;         /* pool of the class (const) */
+};
+
+/* chunk sizes of the classes besides the configured one */
+static const size_t mbuf_class_size[] = { 512, 4096, 262144 };
+
+/*
+ * Every event loop thread has a pool of classes and regions of its own. An
+ * mbuf or a slice of it put on another thread is pushed on the return q of
+ * the pool, and put by the owner thread in a batch on its next loop, so that
+ * only the owner ever touches its regions and reference counts. Only the #
+ * bytes mapped is counted over all pools.
+ */
+struct mbuf_pool {
+    struct mbuf_class      mbuf_classq[MBUF_NCLASS]; /* classes */
+    uint32_t               nmbuf_class;        /* # class */
+    struct mbuf_class      *mbuf_default_class; /* class of chunk size */
+
+    uint32_t               nmbuf_region;       /* # region */
+    struct mbuf_region_tqh mbuf_regionq;       /* region q */
+    mbuf_hugepage_t        mbuf_hugepage;      /* region huge pages */
+
+    uint32_t               nfree_sliceq;       /* # free slice */
+    struct mhdr            free_sliceq;        /* free slice q */
+
+    struct mbuf            *return_mbufq;      /* mbufs put by other threads */
+};
+
+static __thread struct mbuf_pool mbuf_pool;
+static size_t mbuf_nmapped;                    /* # bytes mapped */
+static size_t mbuf_nmapped_max;                /* max # bytes mapped */
+
+/*
+ * Map size bytes for a region, on huge pages if asked to. A region on
+ * transparent huge pages is aligned on one, for the kernel to back it with
+ * them. Reserved huge pages that run out are not asked for again, and
+ * transparent ones are advised instead.
+ */
+static uint8_t *
+mbuf_region_map(size_t size)
+{
+    uint8_t *base, *aligned;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+#ifdef MAP_HUGETLB
+    if (mbuf_pool.mbuf_hugepage == MBUF_HUGEPAGE_HUGETLB) {
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB,
+                    -1, 0);
+        if (base != MAP_FAILED) {
+            return base;
+        }
+
+        log_warn("mmap of %zu bytes on huge pages failed, falling back to "
+                 "transparent huge pages: %s", size, strerror(errno));
+        mbuf_pool.mbuf_hugepage = MBUF_HUGEPAGE_THP;
+    }
+#endif
+
+    if (mbuf_pool.mbuf_hugepage == MBUF_HUGEPAGE_OFF) {
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+        return base == MAP_FAILED ? NULL : base;
+    }
+
+    base = mmap(NULL, size + MBUF_REGION_SIZE, PROT_READ | PROT_WRITE, flags,
+                -1, 0);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+
+    aligned = GF_ALIGN_PTR(base, MBUF_REGION_SIZE);
+    if (aligned != base) {
+        munmap(base, (size_t)(aligned - base));
+    }
+    munmap(aligned + size, MBUF_REGION_SIZE - (size_t)(aligned - base));
+
+#ifdef MADV_HUGEPAGE
+    if (madvise(aligned, size, MADV_HUGEPAGE) < 0) {
+        log_warn("madvise of %zu bytes for huge pages failed, ignored: %s",
+                 size, strerror(errno));
+    }
+#endif
+
+    return aligned;
+}
+
+/*
+ * Map a new region of mbufs. The pages of a populated region are all
+ * faulted in now rather than on first use.
+ */
+static struct mbuf_region *
+mbuf_region_create(struct mbuf_class *mclass, bool populate)
+{
+    struct mbuf_region *region;
+    size_t off, pagesize;
+
+    region = gf_alloc(sizeof(*region));
+    if (region == NULL) {
+        return NULL;
+    }
+
+    region->base = mbuf_region_map(mclass->region_size);
+    if (region->base == NULL) {
+        log_error("mmap of %zu bytes for mbufs failed: %s",
+                  mclass->region_size, strerror(errno));
+        gf_free(region);
+        return NULL;
+    }
+
+    if (populate) {
+        pagesize = (size_t)sysconf(_SC_PAGESIZE);
+        for (off = 0; off < mclass->region_size; off += pagesize) {
+            region->base[off] = 0;
+        }
+    }
+
+    region->mclass = mclass;
+    region->nchunk = mclass->region_nchunk;
+    region->ncarved = 0;
+    region->nused = 0;
+    STAILQ_INIT(&region->free_mbufq);
+
+    TAILQ_INSERT_TAIL(&mbuf_pool.mbuf_regionq, region, tqe);
+    TAILQ_INSERT_HEAD(&mclass->free_regionq, region, free_tqe);
+    mbuf_pool.nmbuf_region++;
+    mclass->nfree += region->nchunk;
+    gf_atomic_max(&mbuf_nmapped_max,
+                  gf_atomic_add(&mbuf_nmapped, mclass->region_size));
+
+    log_debug(LOG_VERB, "map mbuf region %p of %"PRIu32" mbufs of %zu bytes "
+              "at %p", region, region->nchunk, mclass->chunk_size,
+              region->base);
+
+    return region;
+}
+
+static void
+mbuf_region_destroy(struct mbuf_region *region)
+{
+    struct mbuf_class *mclass = region->mclass;
+
+    log_debug(LOG_VERB, "unmap mbuf region %p with %"PRIu32" mbufs in use",
+              region, region->nused);
 
-static size_t mbuf_chunk_size; /* mbuf chunk size - header + data (const) */
-static size_t mbuf_offset;     /* mbuf offset in chunk (const) */
+    TAILQ_REMOVE(&mbuf_pool.mbuf_regionq, region, tqe);
+    if (region->nused < region->nchunk) {
+        TAILQ_REMOVE(&mclass->free_regionq, region, free_tqe);
+    }
+    mbuf_pool.nmbuf_region--;
+    mclass->nfree -= region->nchunk - region->nused;
+    gf_atomic_sub(&mbuf_nmapped, mclass->region_size);
+
+    munmap(region->base, mclass->region_size);
+    gf_free(region);
+}
 
 static struct mbuf *
-_mbuf_get(void)
+_mbuf_get(struct mbuf_class *mclass)
 {
+    struct mbuf_region *region;
     struct mbuf *mbuf;
     uint8_t *buf;
 
-    if (!STAILQ_EMPTY(&free_mbufq)) {
-        ASSERT(nfree_mbufq > 0);
+    region = TAILQ_FIRST(&mclass->free_regionq);
+    if (region == NULL) {
+        region = mbuf_region_create(mclass, false);
+        if (region == NULL) {
+            return NULL;
+        }
+    }
+    ASSERT(region->nused < region->nchunk);
+    ASSERT(mclass->nfree > 0);
 
-        mbuf = STAILQ_FIRST(&free_mbufq);
-        nfree_mbufq--;
-        STAILQ_REMOVE_HEAD(&free_mbufq, next);
+    mbuf = STAILQ_FIRST(&region->free_mbufq);
+    if (mbuf != NULL) {
+        STAILQ_REMOVE_HEAD(&region->free_mbufq, next);
 
         ASSERT(mbuf->magic == MBUF_MAGIC);
+        ASSERT(mbuf->region == region);
         goto done;
     }
 
-    buf = gf_alloc(mbuf_chunk_size);
-    if (buf == NULL) {
-        return NULL;
-    }
+    ASSERT(region->ncarved < region->nchunk);
+    buf = region->base + mclass->chunk_size * region->ncarved++;
 
     /*
      * mbuf header is at the tail end of the mbuf. This enables us to catch
      * buffer overrun early by asserting on the magic value during get or
      * put operations
      *
-     *   <------------- mbuf_chunk_size ------------->
+     *   <-------------- class chunk_size ----------->
      *   +-------------------------------------------+
      *   |       mbuf data          |  mbuf header   |
-     *   |     (mbuf_offset)        | (struct mbuf)  |
+     *   |     (class offset)       | (struct mbuf)  |
      *   +-------------------------------------------+
      *   ^           ^        ^     ^^
      *   |           |        |     ||
@@ -74,64 +267,211 @@ _mbuf_get(void)
      *                        mbuf->last (one byte past valid byte)
      *
      */
-    mbuf = (struct mbuf *)(buf + mbuf_offset);
+    mbuf = (struct mbuf *)(buf + mclass->offset);
     mbuf->magic = MBUF_MAGIC;
+    mbuf->region = region;
 
 done:
+    if (++region->nused == region->nchunk) {
+        TAILQ_REMOVE(&mclass->free_regionq, region, free_tqe);
+    }
+    mclass->nfree--;
+
     STAILQ_NEXT(mbuf, next) = NULL;
     return mbuf;
 }
 
-struct mbuf *
-mbuf_get(void)
+static struct mbuf *
+mbuf_class_get(struct mbuf_class *mclass)
 {
     struct mbuf *mbuf;
     uint8_t *buf;
 
-    mbuf = _mbuf_get();
+    mbuf = _mbuf_get(mclass);
     if (mbuf == NULL) {
         return NULL;
     }
 
-    buf = (uint8_t *)mbuf - mbuf_offset;
+    buf = (uint8_t *)mbuf - mclass->offset;
     mbuf->start = buf;
-    mbuf->end = buf + mbuf_offset;
+    mbuf->end = buf + mclass->offset;
 
-    ASSERT(mbuf->end - mbuf->start == (int)mbuf_offset);
+    ASSERT(mbuf->end - mbuf->start == (int)mclass->offset);
     ASSERT(mbuf->start < mbuf->end);
 
     mbuf->pos = mbuf->start;
     mbuf->last = mbuf->start;
+    mbuf->parent = NULL;
+    mbuf->refcount = 1;
 
     log_debug(LOG_VVERB, "get mbuf %p", mbuf);
 
     return mbuf;
 }
 
-static void
-mbuf_free(struct mbuf *mbuf)
+/*
+ * Get an mbuf of the default class
+ */
+struct mbuf *
+mbuf_get(void)
 {
-    uint8_t *buf;
+    return mbuf_class_get(mbuf_pool.mbuf_default_class);
+}
 
-    log_debug(LOG_VVERB, "put mbuf %p len %d", mbuf, (int)(mbuf->last - mbuf->pos));
+/*
+ * Get an mbuf of the smallest class with room for size bytes of data, or of
+ * the largest class if none has.
+ */
+struct mbuf *
+mbuf_get_size(size_t size)
+{
+    uint32_t i;
 
-    ASSERT(STAILQ_NEXT(mbuf, next) == NULL);
-    ASSERT(mbuf->magic == MBUF_MAGIC);
+    for (i = 0; i < mbuf_pool.nmbuf_class - 1; i++) {
+        if (mbuf_pool.mbuf_classq[i].offset >= size) {
+            break;
+        }
+    }
 
-    buf = (uint8_t *)mbuf - mbuf_offset;
-    gf_free(buf);
+    return mbuf_class_get(&mbuf_pool.mbuf_classq[i]);
 }
 
+/*
+ * Put an mbuf or a slice. The buffer of an mbuf is only recycled once the
+ * last slice of it has been put too.
+ */
 void
 mbuf_put(struct mbuf *mbuf)
 {
+    struct mbuf_region *region;
+    struct mbuf *parent;
+
     log_debug(LOG_VVERB, "put mbuf %p len %d", mbuf, (int)(mbuf->last - mbuf->pos));
 
     ASSERT(STAILQ_NEXT(mbuf, next) == NULL);
     ASSERT(mbuf->magic == MBUF_MAGIC);
 
-    nfree_mbufq++;
-    STAILQ_INSERT_HEAD(&free_mbufq, mbuf, next);
+    parent = mbuf->parent;
+    if (parent != NULL) {
+        if (!mbuf_static(parent) &&
+            parent->region->mclass->pool != &mbuf_pool) {
+            gf_mpsc_push(&parent->region->mclass->pool->return_mbufq, mbuf,
+                         STAILQ_NEXT(mbuf, next));
+            return;
+        }
+
+        mbuf->parent = NULL;
+        mbuf_pool.nfree_sliceq++;
+        STAILQ_INSERT_HEAD(&mbuf_pool.free_sliceq, mbuf, next);
+
+        if (mbuf_static(parent)) {
+            return;
+        }
+
+        ASSERT(STAILQ_NEXT(parent, next) == NULL || parent->refcount > 1);
+        mbuf = parent;
+    } else if (mbuf->region->mclass->pool != &mbuf_pool) {
+        gf_mpsc_push(&mbuf->region->mclass->pool->return_mbufq, mbuf,
+                     STAILQ_NEXT(mbuf, next));
+        return;
+    }
+
+    ASSERT(mbuf->refcount > 0);
+    if (--mbuf->refcount > 0) {
+        return;
+    }
+
+    region = mbuf->region;
+    if (region->nused-- == region->nchunk) {
+        TAILQ_INSERT_HEAD(&region->mclass->free_regionq, region, free_tqe);
+    }
+    region->mclass->nfree++;
+    STAILQ_INSERT_HEAD(&region->free_mbufq, mbuf, next);
+}
+
+/*
+ * Make mbuf a static mbuf over the constant bytes [pos, last)
+ */
+void
+mbuf_init_static(struct mbuf *mbuf, uint8_t *pos, uint8_t *last)
+{
+    ASSERT(pos <= last);
+
+    mbuf->magic = MBUF_MAGIC;
+    STAILQ_NEXT(mbuf, next) = NULL;
+    mbuf->start = pos;
+    mbuf->end = last;
+    mbuf->pos = pos;
+    mbuf->last = last;
+    mbuf->parent = NULL;
+    mbuf->region = NULL;
+    mbuf->refcount = 0;
+}
+
+/*
+ * Return true if the buffer of mbuf, which may be a slice, is static or
+ * belongs to the calling thread, i.e. if mbuf can be sliced on it
+ */
+bool
+mbuf_local(const struct mbuf *mbuf)
+{
+    if (mbuf->parent != NULL) {
+        mbuf = mbuf->parent;
+    }
+
+    return mbuf_static(mbuf) || mbuf->region->mclass->pool == &mbuf_pool;
+}
+
+/*
+ * Return a slice of the bytes [pos, last) of mbuf, which may itself be a
+ * slice, or NULL if it can't be allocated.
+ */
+struct mbuf *
+mbuf_slice(struct mbuf *mbuf, uint8_t *pos, uint8_t *last)
+{
+    struct mbuf *slice;
+
+    ASSERT(mbuf->magic == MBUF_MAGIC);
+    ASSERT(pos >= mbuf->start && pos <= last && last <= mbuf->end);
+
+    if (!STAILQ_EMPTY(&mbuf_pool.free_sliceq)) {
+        ASSERT(mbuf_pool.nfree_sliceq > 0);
+
+        slice = STAILQ_FIRST(&mbuf_pool.free_sliceq);
+        mbuf_pool.nfree_sliceq--;
+        STAILQ_REMOVE_HEAD(&mbuf_pool.free_sliceq, next);
+
+        ASSERT(slice->magic == MBUF_MAGIC);
+    } else {
+        slice = gf_alloc(sizeof(*slice));
+        if (slice == NULL) {
+            return NULL;
+        }
+        slice->magic = MBUF_MAGIC;
+    }
+
+    if (mbuf->parent != NULL) {
+        mbuf = mbuf->parent;
+    }
+    if (!mbuf_static(mbuf)) {
+        /* only the owner thread counts references, see mbuf_put() */
+        ASSERT(mbuf->region->mclass->pool == &mbuf_pool);
+        mbuf->refcount++;
+    }
+
+    STAILQ_NEXT(slice, next) = NULL;
+    slice->start = pos;
+    slice->end = last;
+    slice->pos = pos;
+    slice->last = last;
+    slice->parent = mbuf;
+    slice->region = NULL;
+    slice->refcount = 0;
+
+    log_debug(LOG_VVERB, "slice mbuf %p len %d into %p", mbuf,
+              (int)(last - pos), slice);
+
+    return slice;
 }
 
 /*
@@ -170,13 +510,36 @@ mbuf_size(const struct mbuf *mbuf)
 }
 
 /*
- * Return the maximum available space size for data in any mbuf. Mbuf cannot
- * contain more than 2^32 bytes (4G).
+ * Return the maximum available space size for data in an mbuf of the default
+ * class. Mbuf cannot contain more than 2^32 bytes (4G).
  */
 size_t
 mbuf_data_size(void)
 {
-    return mbuf_offset;
+    return mbuf_pool.mbuf_default_class->offset;
+}
+
+/*
+ * Return the space size for data of the whole buffer of mbuf, be it split
+ * or not, or of the bytes of a slice or a static mbuf.
+ */
+size_t
+mbuf_capacity(const struct mbuf *mbuf)
+{
+    if (mbuf->region == NULL) {
+        return (size_t)(mbuf->end - mbuf->start);
+    }
+
+    return mbuf->region->mclass->offset;
+}
+
+/*
+ * Return the space size for data in an mbuf of the largest class
+ */
+size_t
+mbuf_max_data_size(void)
+{
+    return mbuf_pool.mbuf_classq[mbuf_pool.nmbuf_class - 1].offset;
 }
 
 /*
@@ -244,7 +607,14 @@ mbuf_split(struct mhdr *h, uint8_t *pos, mbuf_copy_t cb, void *cbarg)
     mbuf = STAILQ_LAST(h, mbuf, next);
     ASSERT(pos >= mbuf->pos && pos <= mbuf->last);
 
-    nbuf = mbuf_get();
+    /*
+     * nbuf has room for the data and more, so that a token cut by the end
+     * of a full mbuf can be read in full, as long as it is shorter than the
+     * data of the largest class
+     */
+    size = (size_t)(mbuf->last - pos);
+    ASSERT(size < mbuf_max_data_size());
+    nbuf = mbuf_get_size(MAX(size + 1, mbuf_data_size()));
     if (nbuf == NULL) {
         return NULL;
     }
@@ -255,7 +625,6 @@ mbuf_split(struct mhdr *h, uint8_t *pos, mbuf_copy_t cb, void *cbarg)
     }
 
     /* copy data from mbuf to nbuf */
-    size = (size_t)(mbuf->last - pos);
     mbuf_copy(nbuf, pos, size);
 
     /* adjust mbuf */
@@ -268,30 +637,207 @@ mbuf_split(struct mhdr *h, uint8_t *pos, mbuf_copy_t cb, void *cbarg)
     return nbuf;
 }
 
-void
-mbuf_init(size_t cksize)
+/*
+ * Split mbuf at pos without copying any data: return a slice of the bytes
+ * before pos, and leave mbuf with the bytes from pos on and its room for
+ * more. Both share the buffer until they have been put.
+ */
+struct mbuf *
+mbuf_split_head(struct mbuf *mbuf, uint8_t *pos)
 {
-    nfree_mbufq = 0;
-    STAILQ_INIT(&free_mbufq);
+    struct mbuf *slice;
 
-    mbuf_chunk_size = cksize;
+    ASSERT(mbuf->parent == NULL && !mbuf_static(mbuf));
+    ASSERT(pos > mbuf->pos && pos <= mbuf->last);
+
+    slice = mbuf_slice(mbuf, mbuf->pos, pos);
+    if (slice == NULL) {
+        return NULL;
+    }
+
+    mbuf->start = pos;
+    mbuf->pos = pos;
+
+    log_debug(LOG_VVERB, "split mbuf %p at %p into slice %p len %"PRIu32,
+              mbuf, pos, slice, mbuf_length(slice));
+
+    return slice;
+}
+
+static void
+mbuf_class_init(struct mbuf_class *mclass, size_t cksize)
+{
+    /* chunks are laid out back to back, keep their header aligned */
+    mclass->chunk_size = cksize & ~(GF_ALIGNMENT - 1);
 
     /* Calculating the offset in this way will 
      * put the head at the end of the memory.*/
-    mbuf_offset = mbuf_chunk_size - MBUF_HSIZE;
+    mclass->offset = mclass->chunk_size - MBUF_HSIZE;
+
+    mclass->region_size = GF_ALIGN(MAX(mclass->chunk_size, MBUF_REGION_SIZE),
+                                   MBUF_REGION_SIZE);
+    mclass->region_nchunk = (uint32_t)(mclass->region_size /
+                                       mclass->chunk_size);
+    mclass->nfree = 0;
+    TAILQ_INIT(&mclass->free_regionq);
+    mclass->pool = &mbuf_pool;
 
     log_debug(LOG_DEBUG, "mbuf hsize %d chunk size %zu offset %zu length %zu",
-              (int)MBUF_HSIZE, mbuf_chunk_size, mbuf_offset, mbuf_offset);
+              (int)MBUF_HSIZE, mclass->chunk_size, mclass->offset,
+              mclass->offset);
+}
+
+/*
+ * Set up the mbuf classes, the default one of cksize bytes, header included,
+ * mapped in regions on huge pages as asked by hugepage, with room for
+ * nprealloc mbufs of the default class mapped and populated upfront.
+ */
+rstatus_t
+mbuf_init(size_t cksize, uint32_t nprealloc, mbuf_hugepage_t hugepage)
+{
+    struct mbuf_class *mclass;
+    struct mbuf_region *region;
+    uint32_t i, nregion;
+
+    mbuf_pool.nmbuf_region = 0;
+    TAILQ_INIT(&mbuf_pool.mbuf_regionq);
+    mbuf_pool.nfree_sliceq = 0;
+    STAILQ_INIT(&mbuf_pool.free_sliceq);
+    mbuf_pool.return_mbufq = NULL;
+    mbuf_pool.mbuf_hugepage = hugepage;
+
+    /* classes smallest first, with the configured chunk size among them */
+    mbuf_pool.nmbuf_class = 0;
+    mbuf_pool.mbuf_default_class = NULL;
+    for (i = 0; i < NELEMS(mbuf_class_size); i++) {
+        if (mbuf_pool.mbuf_default_class == NULL && cksize <= mbuf_class_size[i]) {
+            mbuf_pool.mbuf_default_class = &mbuf_pool.mbuf_classq[mbuf_pool.nmbuf_class++];
+            mbuf_class_init(mbuf_pool.mbuf_default_class, cksize);
+            if (cksize == mbuf_class_size[i]) {
+                continue;
+            }
+        }
+        mbuf_class_init(&mbuf_pool.mbuf_classq[mbuf_pool.nmbuf_class++], mbuf_class_size[i]);
+    }
+    if (mbuf_pool.mbuf_default_class == NULL) {
+        mbuf_pool.mbuf_default_class = &mbuf_pool.mbuf_classq[mbuf_pool.nmbuf_class++];
+        mbuf_class_init(mbuf_pool.mbuf_default_class, cksize);
+    }
+    ASSERT(mbuf_pool.nmbuf_class <= MBUF_NCLASS);
+    ASSERT(mbuf_pool.mbuf_default_class != NULL);
+
+    mclass = mbuf_pool.mbuf_default_class;
+    nregion = (nprealloc + mclass->region_nchunk - 1) / mclass->region_nchunk;
+    for (i = 0; i < nregion; i++) {
+        region = mbuf_region_create(mclass, true);
+        if (region == NULL) {
+            mbuf_deinit();
+            return GF_ENOMEM;
+        }
+    }
+
+    log_debug(LOG_NOTICE, "mbuf %"PRIu32" classes up to %zu bytes, regions "
+              "of %zu bytes hold %"PRIu32" mbufs of %zu bytes, %"PRIu32" "
+              "preallocated, huge pages %d", mbuf_pool.nmbuf_class,
+              mbuf_pool.mbuf_classq[mbuf_pool.nmbuf_class - 1].chunk_size, mclass->region_size,
+              mclass->region_nchunk, mclass->chunk_size, mclass->nfree,
+              mbuf_pool.mbuf_hugepage);
+
+    return GF_OK;
 }
 
 void
 mbuf_deinit(void)
 {
-    while (!STAILQ_EMPTY(&free_mbufq)) {
-        struct mbuf *mbuf = STAILQ_FIRST(&free_mbufq);
-        mbuf_remove(&free_mbufq, mbuf);
-        mbuf_free(mbuf);
-        nfree_mbufq--;
+    mbuf_reclaim();
+
+    while (!TAILQ_EMPTY(&mbuf_pool.mbuf_regionq)) {
+        mbuf_region_destroy(TAILQ_FIRST(&mbuf_pool.mbuf_regionq));
+    }
+    ASSERT(mbuf_pool.nmbuf_region == 0);
+
+    while (!STAILQ_EMPTY(&mbuf_pool.free_sliceq)) {
+        struct mbuf *slice = STAILQ_FIRST(&mbuf_pool.free_sliceq);
+        mbuf_remove(&mbuf_pool.free_sliceq, slice);
+        gf_free(slice);
+        mbuf_pool.nfree_sliceq--;
     }
-    ASSERT(nfree_mbufq == 0);
+    ASSERT(mbuf_pool.nfree_sliceq == 0);
+}
+
+/*
+ * Put the mbufs and slices put back by other threads
+ */
+void
+mbuf_reclaim(void)
+{
+    struct mbuf *mbuf, *nbuf;
+
+    if (gf_mpsc_empty(&mbuf_pool.return_mbufq)) {
+        return;
+    }
+
+    for (mbuf = gf_mpsc_take(&mbuf_pool.return_mbufq); mbuf != NULL;
+         mbuf = nbuf) {
+        nbuf = STAILQ_NEXT(mbuf, next);
+        STAILQ_NEXT(mbuf, next) = NULL;
+        mbuf_put(mbuf);
+    }
+}
+
+/*
+ * Unmap the regions of no mbuf in use of each class that has more than
+ * nfree_max free mbufs, for as long as it keeps at least nfree_max of them,
+ * and free the free slices beyond the first nfree_max. At most nbatch
+ * regions and slices are looked at, the least recently used regions first.
+ * Return true if there may be more of them to free.
+ */
+bool
+mbuf_trim(uint32_t nfree_max, uint32_t nbatch)
+{
+    struct mbuf_class *mclass;
+    struct mbuf_region *region, *pregion;
+    struct mbuf *slice;
+    uint32_t i, n, ntrim;
+
+    n = 0;
+    ntrim = 0;
+    for (i = 0; i < mbuf_pool.nmbuf_class; i++) {
+        mclass = &mbuf_pool.mbuf_classq[i];
+        if (mclass->nfree <= nfree_max) {
+            continue;
+        }
+
+        for (region = TAILQ_LAST(&mclass->free_regionq, mbuf_region_tqh);
+             region != NULL && n < nbatch; region = pregion, n++) {
+            pregion = TAILQ_PREV(region, mbuf_region_tqh, free_tqe);
+
+            if (region->nused == 0 &&
+                mclass->nfree - region->nchunk >= nfree_max) {
+                mbuf_region_destroy(region);
+                ntrim++;
+            }
+        }
+    }
+
+    for (; n < nbatch && mbuf_pool.nfree_sliceq > nfree_max; n++, ntrim++) {
+        slice = STAILQ_FIRST(&mbuf_pool.free_sliceq);
+        mbuf_pool.nfree_sliceq--;
+        STAILQ_REMOVE_HEAD(&mbuf_pool.free_sliceq, next);
+        gf_free(slice);
+    }
+
+    return n == nbatch && ntrim > 0;
+}
+
+size_t
+mbuf_nmapped_bytes(void)
+{
+    return gf_atomic_get(&mbuf_nmapped);
+}
+
+size_t
+mbuf_nmapped_bytes_max(void)
+{
+    return gf_atomic_get(&mbuf_nmapped_max);
 }
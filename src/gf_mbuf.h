@@ -44,15 +44,40 @@
  * start                                                      end
  */
 
+/*
+ * A slice is an mbuf without data of its own: its buffer is a part of the
+ * buffer of its parent mbuf, so that bytes can be handed to another message
+ * without copying them. Every slice holds a reference on its parent, which
+ * is only freed once the message owning it and all its slices have put it.
+ * A slice is always full, nothing is ever written to it.
+ *
+ * An mbuf split at the end of one message, for the next one to be read into
+ * it, starts at the split, and its bytes before it are held by a slice.
+ *
+ * A static mbuf has a constant buffer that lives as long as the process,
+ * like a canned reply. It is never put, and its slices don't reference it.
+ */
+
 typedef void (*mbuf_copy_t)(struct mbuf *, void *);
 
+typedef enum mbuf_hugepage {
+    MBUF_HUGEPAGE_OFF,                  /* regular pages */
+    MBUF_HUGEPAGE_THP,                  /* transparent huge pages, advised */
+    MBUF_HUGEPAGE_HUGETLB,              /* reserved huge pages */
+} mbuf_hugepage_t;
+
+struct mbuf_region;
+
 struct mbuf {
-    uint32_t           magic;   /* mbuf magic (const) */
-    STAILQ_ENTRY(mbuf) next;    /* next mbuf */
-    uint8_t            *pos;    /* read marker */
-    uint8_t            *last;   /* write marker */
-    uint8_t            *start;  /* start of buffer (const) */
-    uint8_t            *end;    /* end of buffer (const) */
+    uint32_t           magic;    /* mbuf magic (const) */
+    STAILQ_ENTRY(mbuf) next;     /* next mbuf */
+    uint8_t            *pos;     /* read marker */
+    uint8_t            *last;    /* write marker */
+    uint8_t            *start;   /* start of buffer */
+    uint8_t            *end;     /* end of buffer (const) */
+    struct mbuf        *parent;  /* owner of the buffer of a slice */
+    struct mbuf_region *region;  /* region of the buffer (const) */
+    uint32_t           refcount; /* # references to the buffer */
 };
 
 STAILQ_HEAD(mhdr, mbuf);
@@ -62,6 +87,19 @@ STAILQ_HEAD(mhdr, mbuf);
 #define MBUF_MAX_SIZE   16777216
 #define MBUF_SIZE       16384
 #define MBUF_HSIZE      sizeof(struct mbuf)
+#define MBUF_REGION_SIZE    (2 * 1024 * 1024) /* unit of mbuf mapping, a huge page */
+#define MBUF_NCLASS         4                 /* max # mbuf size class */
+
+#define MBUF_STATIC(_s) {                                                   \
+    .magic = MBUF_MAGIC,                                                    \
+    .pos = (uint8_t *)(_s),                                                 \
+    .last = (uint8_t *)(_s) + sizeof(_s) - 1,                               \
+    .start = (uint8_t *)(_s),                                               \
+    .end = (uint8_t *)(_s) + sizeof(_s) - 1,                                \
+    .parent = NULL,                                                         \
+    .region = NULL,                                                         \
+    .refcount = 0                                                           \
+}
 
 static inline bool
 mbuf_empty(const struct mbuf *mbuf)
@@ -75,17 +113,34 @@ mbuf_full(const struct mbuf *mbuf)
     return mbuf->last == mbuf->end;
 }
 
-void mbuf_init(size_t cksize);
+static inline bool
+mbuf_static(const struct mbuf *mbuf)
+{
+    return mbuf->parent == NULL && mbuf->refcount == 0;
+}
+
+rstatus_t mbuf_init(size_t cksize, uint32_t nprealloc, mbuf_hugepage_t hugepage);
 void mbuf_deinit(void);
+void mbuf_reclaim(void);
+bool mbuf_trim(uint32_t nfree_max, uint32_t nbatch);
+size_t mbuf_nmapped_bytes(void);
+size_t mbuf_nmapped_bytes_max(void);
 struct mbuf *mbuf_get(void);
+struct mbuf *mbuf_get_size(size_t size);
 void mbuf_put(struct mbuf *mbuf);
+bool mbuf_local(const struct mbuf *mbuf);
+struct mbuf *mbuf_slice(struct mbuf *mbuf, uint8_t *pos, uint8_t *last);
+void mbuf_init_static(struct mbuf *mbuf, uint8_t *pos, uint8_t *last);
 void mbuf_rewind(struct mbuf *mbuf);
 uint32_t mbuf_length(const struct mbuf *mbuf);
 uint32_t mbuf_size(const struct mbuf *mbuf);
 size_t mbuf_data_size(void);
+size_t mbuf_max_data_size(void);
+size_t mbuf_capacity(const struct mbuf *mbuf);
 void mbuf_insert(struct mhdr *mhdr, struct mbuf *mbuf);
 void mbuf_remove(struct mhdr *mhdr, struct mbuf *mbuf);
 void mbuf_copy(struct mbuf *mbuf, const uint8_t *pos, size_t n);
 struct mbuf *mbuf_split(struct mhdr *h, uint8_t *pos, mbuf_copy_t cb, void *cbarg);
+struct mbuf *mbuf_split_head(struct mbuf *mbuf, uint8_t *pos);
 
 #endif
\ No newline at end of file
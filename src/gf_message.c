@@ -26,16 +26,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 #include <gf_core.h>
-
-#ifndef IOV_MAX
-#define IOV_MAX 1024
-#endif
-
-#if (IOV_MAX > 128)
-#define GF_IOV_MAX 128
-#else
-#define GF_IOV_MAX IOV_MAX
-#endif
+#include <proto/gf_proto.h>
 
 /*
  *            nc_message.[ch]
@@ -115,12 +106,70 @@
  * client, while (c) and (d) handle the corresponding response from the
  * server.
  */
-static uint64_t msg_id;          /* message id counter */
-static uint64_t frag_id;         /* fragment id counter */
-static uint32_t nfree_msgq;      /* # free msg q */
-static struct msg_tqh free_msgq; /* free msg q */
-static struct rbtree tmo_rbt;    /* timeout rbtree */
-static struct rbnode tmo_rbs;    /* timeout rbtree sentinel */
+
+/*
+ * Every event loop thread allocates msgs from a pool of its own, which also
+ * holds its ids and timeouts. A msg put on another thread is pushed on the
+ * return q of its pool, and put by the owner thread in a batch on its next
+ * loop. Only the allocation counters are shared.
+ */
+struct msg_pool {
+    uint64_t       msg_id;       /* message id counter */
+    uint64_t       frag_id;      /* fragment id counter */
+    uint32_t       nfree_msgq;   /* # free msg q */
+    struct msg_tqh free_msgq;    /* free msg q */
+    struct msg     *return_msgq; /* msgs put by other threads */
+    struct rbtree  tmo_rbt;      /* timeout rbtree */
+    struct rbnode  tmo_rbs;      /* timeout rbtree sentinel */
+};
+
+static __thread struct msg_pool msg_pool;
+static uint32_t nalloc_msg;               /* # allocated msg, in use or free */
+static uint32_t nalloc_msg_max;           /* high-water mark of nalloc_msg */
+static struct array msg_nokeys = null_array; /* keys of a msg without msg_keys */
+
+static const struct msg_ops redis_msg_ops = {
+    .parse_req = redis_parse_req,
+    .parse_rsp = redis_parse_rsp,
+    .fragment = redis_fragment,
+    .reply = redis_reply,
+    .failure = redis_failure,
+    .redirect = redis_redirect,
+    .pre_coalesce = redis_pre_coalesce,
+    .post_coalesce = redis_post_coalesce,
+};
+
+static const struct msg_ops memcache_msg_ops = {
+    .parse_req = memcache_parse_req,
+    .parse_rsp = memcache_parse_rsp,
+    .fragment = memcache_fragment,
+    .reply = NULL,
+    .failure = memcache_failure,
+    .redirect = NULL,
+    .pre_coalesce = memcache_pre_coalesce,
+    .post_coalesce = memcache_post_coalesce,
+};
+
+static const struct msg_ops memcache_binary_msg_ops = {
+    .parse_req = memcache_binary_parse_req,
+    .parse_rsp = memcache_binary_parse_rsp,
+    .fragment = memcache_binary_fragment,
+    .reply = memcache_binary_reply,
+    .failure = memcache_failure,
+    .redirect = NULL,
+    .pre_coalesce = memcache_binary_pre_coalesce,
+    .post_coalesce = memcache_binary_post_coalesce,
+};
+
+_Static_assert(offsetof(struct msg, nredirect) <= MSG_HOT_SIZE,
+               "hot fields of struct msg exceed MSG_HOT_SIZE");
+
+#define DEFINE_ACTION(_name) string(#_name),
+static const struct string msg_type_strings[] = {
+    MSG_TYPE_CODEC( DEFINE_ACTION )
+    null_string
+};
+#undef DEFINE_ACTION
 
 static struct msg *
 msg_from_rbe(struct rbnode *node)
@@ -139,7 +188,7 @@ msg_tmo_min(void)
 {
     struct rbnode *node;
 
-    node = rbtree_min(&tmo_rbt);
+    node = rbtree_min(&msg_pool.tmo_rbt);
     if (node == NULL) {
         return NULL;
     }
@@ -165,7 +214,7 @@ msg_tmo_insert(struct msg *msg, struct conn *conn)
     node->key = gf_msec_now() + timeout;
     node->data = conn;
 
-    rbtree_insert(&tmo_rbt, node);
+    rbtree_insert(&msg_pool.tmo_rbt, node);
 
     log_debug(LOG_VERB, "insert msg %"PRIu64" into tmo rbt with expiry of "
               "%d msec", msg->id, timeout);
@@ -183,72 +232,92 @@ msg_tmo_delete(struct msg *msg)
         return;
     }
 
-    rbtree_delete(&tmo_rbt, node);
+    rbtree_delete(&msg_pool.tmo_rbt, node);
 
     log_debug(LOG_VERB, "delete msg %"PRIu64" from tmo rbt", msg->id);
 }
 
+/*
+ * Drop all keys of msg and return a spilled key array to the heap; msgs
+ * sitting in the free list keep only their inline key storage.
+ */
+void
+msg_keypos_reset(struct msg *msg)
+{
+    struct msg_keys *ks = msg->kstore;
+
+    if (ks == NULL) {
+        return;
+    }
+
+    if (ks->keyv.elem != ks->kinline) {
+        gf_free(ks->keyv.elem);
+    }
+    array_set(&ks->keyv, ks->kinline, sizeof(struct keypos),
+              MSG_NKEYPOS_INLINE);
+}
+
+static void
+msg_free(struct msg *msg)
+{
+    ASSERT(STAILQ_EMPTY(&msg->mhdr));
+
+    log_debug(LOG_VVERB, "free msg %p id %"PRIu64"", msg, msg->id);
+    msg_keypos_reset(msg);
+    if (msg->kstore != NULL) {
+        gf_free(msg->kstore);
+    }
+    gf_atomic_sub(&nalloc_msg, 1);
+    gf_free(msg);
+}
+
 static struct msg *
 _msg_get(void)
 {
     struct msg *msg;
 
-    if (!TAILQ_EMPTY(&free_msgq)) {
-        ASSERT(nfree_msgq > 0);
+    if (!TAILQ_EMPTY(&msg_pool.free_msgq)) {
+        ASSERT(msg_pool.nfree_msgq > 0);
 
-        msg = TAILQ_FIRST(&free_msgq);
-        nfree_msgq--;
-        TAILQ_REMOVE(&free_msgq, msg, m_tqe);
+        msg = TAILQ_FIRST(&msg_pool.free_msgq);
+        msg_pool.nfree_msgq--;
+        TAILQ_REMOVE(&msg_pool.free_msgq, msg, m_tqe);
+        ASSERT(msg->pool == &msg_pool);
         goto done;
     }
 
-    msg = gf_alloc(sizeof(*msg));
+    msg = gf_memalign(GF_CACHELINE_SIZE, sizeof(*msg));
     if (msg == NULL) {
         return NULL;
     }
+    gf_atomic_max(&nalloc_msg_max, gf_atomic_add(&nalloc_msg, 1));
+
+    /* cold fields are reset by msg_put() from then on */
+    msg->pool = &msg_pool;
+    msg->nredirect = 0;
+    msg->chan = NULL;
+    msg->pool_idx = 0;
+    msg->kstore = NULL;
+    msg->keys = &msg_nokeys;
 
 done:
     /* c_tqe, s_tqe, and m_tqe are left uninitialized */
-    msg->id = ++msg_id;
+    msg->id = ++msg_pool.msg_id;
     msg->peer = NULL;
     msg->owner = NULL;
-
-    rbtree_node_init(&msg->tmo_rbe);
+    msg->ops = NULL;
 
     STAILQ_INIT(&msg->mhdr);
     msg->mlen = 0;
-    msg->start_ts = 0;
-
     msg->state = 0;
     msg->pos = NULL;
     msg->token = NULL;
-
-    msg->parser = NULL;
-    msg->add_auth = NULL;
     msg->result = MSG_PARSE_OK;
+    msg->type = MSG_UNKNOWN;
 
-    msg->fragment = NULL;
-    msg->reply = NULL;
-    msg->pre_coalesce = NULL;
-    msg->post_coalesce = NULL;
-
-    // msg->type = MSG_UNKNOWN;
-
-    msg->keys = array_create(1, sizeof(struct keypos));
-    if (msg->keys == NULL) {
-        gf_free(msg);
-        return NULL;
-    }
-
+    msg->expect = 0;
     msg->vlen = 0;
     msg->end = NULL;
-
-    msg->frag_owner = NULL;
-    msg->frag_seq = NULL;
-    msg->nfrag = 0;
-    msg->nfrag_done = 0;
-    msg->frag_id = 0;
-
     msg->narg_start = NULL;
     msg->narg_end = NULL;
     msg->narg = 0;
@@ -260,17 +329,23 @@ done:
      */
     msg->integer = 0;
 
+    ASSERT(array_n(msg->keys) == 0);
+    msg->frag = NULL;
+    msg->start_ts = 0;
+
     msg->err = 0;
     msg->error = 0;
-    msg->ferror = 0;
     msg->request = 0;
     msg->quit = 0;
     msg->noreply = 0;
     msg->noforward = 0;
     msg->done = 0;
-    msg->fdone = 0;
+    msg->stream = 0;
     msg->swallow = 0;
     msg->redis = 0;
+    msg->resp3 = 0;
+
+    rbtree_node_init(&msg->tmo_rbe);
 
     return msg;
 }
@@ -287,18 +362,15 @@ msg_get(struct conn *conn, bool request, bool redis)
 
     msg->owner = conn;
     msg->request = request ? 1 : 0;
+    msg->redis = redis ? 1 : 0;
 
-    if (request) {
-        msg->parser = NULL;
+    if (redis) {
+        msg->ops = &redis_msg_ops;
+    } else if (conn->binary) {
+        msg->ops = &memcache_binary_msg_ops;
     } else {
-        msg->parser = NULL;
+        msg->ops = &memcache_msg_ops;
     }
-    msg->add_auth = NULL;
-    msg->fragment = NULL;
-    msg->reply = NULL;
-    msg->failure = NULL;
-    msg->pre_coalesce = NULL;
-    msg->post_coalesce = NULL;
 
     if (log_loggable(LOG_NOTICE) != 0) {
         msg->start_ts = gf_usec_now();
@@ -325,7 +397,7 @@ msg_get_error(bool redis, err_t err)
     }
 
     msg->state = 0;
-    // msg->type = MSG_RSP_MC_SERVER_ERROR;
+    msg->type = redis ? MSG_RSP_REDIS_ERROR : MSG_UNKNOWN;
 
     mbuf = mbuf_get();
     if (mbuf == NULL) {
@@ -344,39 +416,69 @@ msg_get_error(bool redis, err_t err)
     return msg;
 }
 
-static void
-msg_free(struct msg *msg)
-{
-    ASSERT(STAILQ_EMPTY(&msg->mhdr));
-
-    log_debug(LOG_VVERB, "free msg %p id %"PRIu64"", msg, msg->id);
-    gf_free(msg);
-}
-
 void
 msg_put(struct msg *msg)
 {
     log_debug(LOG_VVERB, "put msg %p id %"PRIu64"", msg, msg->id);
 
+    if (msg->pool != &msg_pool) {
+        gf_mpsc_push(&msg->pool->return_msgq, msg, TAILQ_NEXT(msg, m_tqe));
+        return;
+    }
+
     while (!STAILQ_EMPTY(&msg->mhdr)) {
         struct mbuf *mbuf = STAILQ_FIRST(&msg->mhdr);
         mbuf_remove(&msg->mhdr, mbuf);
         mbuf_put(mbuf);
     }
 
-    if (msg->frag_seq) {
-        gf_free(msg->frag_seq);
-        msg->frag_seq = NULL;
+    if (msg->frag != NULL) {
+        msg_frag_put(msg);
     }
 
-    if (msg->keys) {
-        msg->keys->nelem = 0; /* a hack here */
-        array_destroy(msg->keys);
-        msg->keys = NULL;
+    msg_keypos_reset(msg);
+    msg->nredirect = 0;
+    msg->chan = NULL;
+
+    msg_pool.nfree_msgq++;
+    TAILQ_INSERT_HEAD(&msg_pool.free_msgq, msg, m_tqe);
+}
+
+/*
+ * Append a key to msg. The first MSG_NKEYPOS_INLINE keys live in the
+ * msg_keys of msg, attached on its first key; only multi-key requests
+ * beyond that spill to the heap.
+ */
+struct keypos *
+msg_keypos_push(struct msg *msg)
+{
+    struct msg_keys *ks = msg->kstore;
+    struct array *a;
+    struct keypos *elem;
+
+    if (ks == NULL) {
+        ks = gf_alloc(sizeof(*ks));
+        if (ks == NULL) {
+            return NULL;
+        }
+        array_set(&ks->keyv, ks->kinline, sizeof(struct keypos),
+                  MSG_NKEYPOS_INLINE);
+        msg->kstore = ks;
+        msg->keys = &ks->keyv;
     }
 
-    nfree_msgq++;
-    TAILQ_INSERT_HEAD(&free_msgq, msg, m_tqe);
+    a = &ks->keyv;
+    if (a->elem == ks->kinline && a->nelem == a->nalloc) {
+        elem = gf_alloc(2 * a->nalloc * a->size);
+        if (elem == NULL) {
+            return NULL;
+        }
+        gf_memcpy(elem, a->elem, a->nelem * a->size);
+        a->elem = elem;
+        a->nalloc *= 2;
+    }
+
+    return array_push(a);
 }
 
 void
@@ -404,15 +506,23 @@ msg_dump(const struct msg *msg, int level)
     }
 }
 
+const struct string *
+msg_type_string(msg_type_t type)
+{
+    return &msg_type_strings[type];
+}
+
 void
 msg_init(void)
 {
     log_debug(LOG_DEBUG, "msg size %d", (int)sizeof(struct msg));
-    msg_id = 0;
-    frag_id = 0;
-    nfree_msgq = 0;
-    TAILQ_INIT(&free_msgq);
-    rbtree_init(&tmo_rbt, &tmo_rbs);
+    msg_pool.msg_id = 0;
+    msg_pool.frag_id = 0;
+    msg_pool.nfree_msgq = 0;
+    TAILQ_INIT(&msg_pool.free_msgq);
+    msg_pool.return_msgq = NULL;
+    rbtree_init(&msg_pool.tmo_rbt, &msg_pool.tmo_rbs);
+    redis_init();
 }
 
 void
@@ -420,13 +530,66 @@ msg_deinit(void)
 {
     struct msg *msg, *nmsg;
 
-    for (msg = TAILQ_FIRST(&free_msgq); msg != NULL;
-         msg = nmsg, nfree_msgq--) {
-        ASSERT(nfree_msgq > 0);
+    msg_reclaim();
+
+    for (msg = TAILQ_FIRST(&msg_pool.free_msgq); msg != NULL;
+         msg = nmsg, msg_pool.nfree_msgq--) {
+        ASSERT(msg_pool.nfree_msgq > 0);
+        nmsg = TAILQ_NEXT(msg, m_tqe);
+        msg_free(msg);
+    }
+    ASSERT(msg_pool.nfree_msgq == 0);
+}
+
+/*
+ * Put the msgs put back by other threads, along with their mbufs
+ */
+void
+msg_reclaim(void)
+{
+    struct msg *msg, *nmsg;
+
+    if (gf_mpsc_empty(&msg_pool.return_msgq)) {
+        return;
+    }
+
+    for (msg = gf_mpsc_take(&msg_pool.return_msgq); msg != NULL;
+         msg = nmsg) {
         nmsg = TAILQ_NEXT(msg, m_tqe);
+        msg_put(msg);
+    }
+}
+
+/*
+ * Free up to nbatch of the least recently used free msgs beyond the first
+ * nfree_max, and return true if there may be more of them to free.
+ */
+bool
+msg_trim(uint32_t nfree_max, uint32_t nbatch)
+{
+    struct msg *msg;
+    uint32_t n;
+
+    for (n = 0; n < nbatch && msg_pool.nfree_msgq > nfree_max; n++) {
+        msg = TAILQ_LAST(&msg_pool.free_msgq, msg_tqh);
+        msg_pool.nfree_msgq--;
+        TAILQ_REMOVE(&msg_pool.free_msgq, msg, m_tqe);
         msg_free(msg);
     }
-    ASSERT(nfree_msgq == 0);
+
+    return msg_pool.nfree_msgq > nfree_max;
+}
+
+uint32_t
+msg_nalloc(void)
+{
+    return gf_atomic_get(&nalloc_msg);
+}
+
+uint32_t
+msg_nalloc_max(void)
+{
+    return gf_atomic_get(&nalloc_msg_max);
 }
 
 
@@ -445,22 +608,33 @@ msg_backend_idx(const struct msg *msg, const uint8_t *key, uint32_t keylen)
     return server_pool_idx(pool, key, keylen);
 }
 
+/*
+ * Return the last mbuf of msg if it has room for len bytes, or else a new
+ * one appended to it. The first mbuf is just large enough for len, and
+ * every one after twice as large as the one before, so that a message built
+ * by many appends takes a few mbufs of growing classes.
+ */
 struct mbuf *
 msg_ensure_mbuf(struct msg *msg, size_t len)
 {
     struct mbuf *mbuf;
+    size_t size;
 
-    if (STAILQ_EMPTY(&msg->mhdr) ||
-        mbuf_size(STAILQ_LAST(&msg->mhdr, mbuf, next)) < len) {
-        mbuf = mbuf_get();
-        if (mbuf == NULL) {
-            return NULL;
-        }
-        mbuf_insert(&msg->mhdr, mbuf);
-    } else {
-        mbuf = STAILQ_LAST(&msg->mhdr, mbuf, next);
+    mbuf = STAILQ_LAST(&msg->mhdr, mbuf, next);
+    if (mbuf != NULL && mbuf_size(mbuf) >= len) {
+        return mbuf;
     }
 
+    size = len;
+    if (mbuf != NULL) {
+        size = MAX(size, 2 * mbuf_capacity(mbuf));
+    }
+    mbuf = mbuf_get_size(size);
+    if (mbuf == NULL) {
+        return NULL;
+    }
+    mbuf_insert(&msg->mhdr, mbuf);
+
     return mbuf;
 }
 
@@ -488,6 +662,64 @@ msg_append(struct msg *msg, const uint8_t *pos, size_t n)
     return GF_OK;
 }
 
+/*
+ * Append n bytes at pos of mbuf, which may be spread over the mbufs that
+ * follow it, to msg by reference. The bytes are not copied: msg gets slices
+ * of those mbufs, and a slice at its tail that ends right at pos is grown
+ * instead of adding another one. Bytes of mbufs that belong to another
+ * thread, e.g. of responses read by a backend I/O thread, are copied.
+ */
+rstatus_t
+msg_append_slice(struct msg *msg, struct mbuf *mbuf, uint8_t *pos, size_t n)
+{
+    struct mbuf *tail, *slice;
+    size_t len;
+
+    msg->mlen += (uint32_t)n;
+
+    while (n > 0) {
+        while (pos == mbuf->last) {
+            mbuf = STAILQ_NEXT(mbuf, next);
+            ASSERT(mbuf != NULL);
+            pos = mbuf->pos;
+        }
+        ASSERT(pos >= mbuf->pos && pos < mbuf->last);
+
+        len = MIN(n, (size_t)(mbuf->last - pos));
+
+        if (!mbuf_local(mbuf)) {
+            len = MIN(len, mbuf_data_size());
+            msg->mlen -= (uint32_t)len;
+            if (msg_append(msg, pos, len) != GF_OK) {
+                msg->mlen -= (uint32_t)(n - len);
+                return GF_ENOMEM;
+            }
+            pos += len;
+            n -= len;
+            continue;
+        }
+
+        tail = STAILQ_LAST(&msg->mhdr, mbuf, next);
+        if (tail != NULL && tail->parent != NULL && tail->last == pos &&
+            tail->parent == (mbuf->parent != NULL ? mbuf->parent : mbuf)) {
+            tail->last += len;
+            tail->end = tail->last;
+        } else {
+            slice = mbuf_slice(mbuf, pos, pos + len);
+            if (slice == NULL) {
+                msg->mlen -= (uint32_t)n;
+                return GF_ENOMEM;
+            }
+            mbuf_insert(&msg->mhdr, slice);
+        }
+
+        pos += len;
+        n -= len;
+    }
+
+    return GF_OK;
+}
+
 rstatus_t
 msg_prepend(struct msg *msg, const uint8_t *pos, size_t n)
 {
@@ -546,46 +778,143 @@ msg_prepend_format(struct msg *msg, const char *fmt, ...)
 inline uint64_t
 msg_gen_frag_id(void)
 {
-    return ++frag_id;
+    return ++msg_pool.frag_id;
+}
+
+/*
+ * Start the fragment group of request owner, that fragments are then added
+ * to with msg_frag_add()
+ */
+struct msg_frag *
+msg_frag_get(struct msg *owner)
+{
+    struct msg_frag *frag;
+
+    ASSERT(owner->request && owner->frag == NULL);
+
+    frag = gf_alloc(sizeof(*frag));
+    if (frag == NULL) {
+        return NULL;
+    }
+
+    frag->id = msg_gen_frag_id();
+    frag->owner = owner;
+    frag->nfrag = 0;
+    frag->ndone = 0;
+    frag->nerror = 0;
+    frag->nref = 1;
+    frag->seq = NULL;
+    frag->coalesced = 0;
+
+    owner->frag = frag;
+
+    return frag;
+}
+
+void
+msg_frag_add(struct msg_frag *frag, struct msg *msg)
+{
+    ASSERT(msg->request && msg->frag == NULL);
+    ASSERT(frag->owner != NULL && !frag->coalesced);
+
+    frag->nfrag++;
+    frag->nref++;
+
+    msg->frag = frag;
+}
+
+/*
+ * Account for fragment msg being done, in error or not. The owner of the
+ * fragments only counts if it is in error.
+ */
+void
+msg_frag_done(struct msg *msg)
+{
+    struct msg_frag *frag = msg->frag;
+
+    ASSERT(msg->request && msg->done);
+
+    if (frag == NULL) {
+        return;
+    }
+
+    if (msg != frag->owner) {
+        ASSERT(frag->ndone < frag->nfrag);
+        frag->ndone++;
+    }
+    if (msg->error) {
+        frag->nerror++;
+    }
+}
+
+/*
+ * Take msg out of its fragment group, freeing the group once it is empty.
+ * The key to fragment map is only used by the owner and goes with it.
+ */
+void
+msg_frag_put(struct msg *msg)
+{
+    struct msg_frag *frag = msg->frag;
+
+    ASSERT(frag != NULL && frag->nref > 0);
+
+    if (frag->owner == msg) {
+        frag->owner = NULL;
+        if (frag->seq != NULL) {
+            gf_free(frag->seq);
+        }
+    }
+
+    msg->frag = NULL;
+
+    if (--frag->nref == 0) {
+        gf_free(frag);
+    }
 }
 
 static rstatus_t
 msg_parsed(struct context *ctx, struct conn *conn, struct msg *msg)
 {
     struct msg *nmsg;
-    struct mbuf *mbuf, *nbuf;
+    struct mbuf *mbuf, *slice;
 
     mbuf = STAILQ_LAST(&msg->mhdr, mbuf, next);
     if (msg->pos == mbuf->last) {
         /* no more data to parse */
-        conn->recv_done(ctx, conn, msg, NULL);
+        conn->ops->recv_done(ctx, conn, msg, NULL);
         return GF_OK;
     }
 
-    /*
-     * Input mbuf has un-parsed data. Split mbuf of the current message msg
-     * into (mbuf, nbuf), where mbuf is the portion of the message that has
-     * been parsed and nbuf is the portion of the message that is un-parsed.
-     * Parse nbuf as a new message nmsg in the next iteration.
-     */
-    nbuf = mbuf_split(&msg->mhdr, msg->pos, NULL, NULL);
-    if (nbuf == NULL) {
-        return GF_ENOMEM;
-    }
-
     nmsg = msg_get(msg->owner, msg->request, conn->redis);
     if (nmsg == NULL) {
-        mbuf_put(nbuf);
         return GF_ENOMEM;
     }
-    mbuf_insert(&nmsg->mhdr, nbuf);
-    nmsg->pos = nbuf->pos;
+
+    /*
+     * Input mbuf has un-parsed data. Hand mbuf over to a new message nmsg,
+     * from the un-parsed data on, and leave the current message msg with a
+     * slice of the portion of mbuf that has been parsed, so that no data
+     * is copied however many messages a read brings in. Parse nmsg in the
+     * next iteration.
+     */
+    mbuf_remove(&msg->mhdr, mbuf);
+    if (msg->pos > mbuf->pos) {
+        slice = mbuf_split_head(mbuf, msg->pos);
+        if (slice == NULL) {
+            mbuf_insert(&msg->mhdr, mbuf);
+            msg_put(nmsg);
+            return GF_ENOMEM;
+        }
+        mbuf_insert(&msg->mhdr, slice);
+    }
+    mbuf_insert(&nmsg->mhdr, mbuf);
+    nmsg->pos = mbuf->pos;
 
     /* update length of current (msg) and new message (nmsg) */
-    nmsg->mlen = mbuf_length(nbuf);
+    nmsg->mlen = mbuf_length(mbuf);
     msg->mlen -= nmsg->mlen;
 
-    conn->recv_done(ctx, conn, msg, nmsg);
+    conn->ops->recv_done(ctx, conn, msg, nmsg);
 
     return GF_OK;
 }
@@ -613,11 +942,12 @@ msg_parse(struct context *ctx, struct conn *conn, struct msg *msg)
 
     if (msg_empty(msg)) {
         /* no data to parse */
-        conn->recv_done(ctx, conn, msg, NULL);
+        conn->ops->recv_done(ctx, conn, msg, NULL);
         return GF_OK;
     }
 
-    msg->parser(msg);
+    msg->expect = 0;
+    msg_run_parser(msg);
 
     switch (msg->result) {
     case MSG_PARSE_OK:
@@ -638,18 +968,57 @@ msg_parse(struct context *ctx, struct conn *conn, struct msg *msg)
     return conn->err != 0 ? GF_ERROR : status;
 }
 
+/*
+ * Parse msg and the messages that follow it in the data read so far. When
+ * reading from conn gets paused, the messages left are held in conn->rmsg
+ * and parsed once it resumes, so that a paused client does not get any
+ * more of its requests forwarded.
+ */
 static rstatus_t
-msg_recv_chain(struct context *ctx, struct conn *conn, struct msg *msg)
+msg_parse_chain(struct context *ctx, struct conn *conn, struct msg *msg)
 {
     rstatus_t status;
     struct msg *nmsg;
+
+    for (;;) {
+        status = msg_parse(ctx, conn, msg);
+        if (status != GF_OK) {
+            return status;
+        }
+
+        /* get next message to parse */
+        nmsg = conn->ops->recv_next(ctx, conn, false);
+        if (nmsg == NULL || nmsg == msg) {
+            /* no more data to parse */
+            break;
+        }
+
+        if (!conn->recv_active) {
+            conn->recv_held = 1;
+            break;
+        }
+
+        msg = nmsg;
+    }
+
+    return GF_OK;
+}
+
+static rstatus_t
+msg_recv_chain(struct context *ctx, struct conn *conn, struct msg *msg)
+{
     struct mbuf *mbuf;
-    size_t msize;
+    size_t size, msize;
     ssize_t n;
 
     mbuf = STAILQ_LAST(&msg->mhdr, mbuf, next);
     if (mbuf == NULL || mbuf_full(mbuf)) {
-        mbuf = mbuf_get();
+        /*
+         * Size the mbuf for the rest of a value the parser is in, or else
+         * for about as much as the last read on the connection got
+         */
+        size = msg->expect != 0 ? msg->expect : conn->recv_hint;
+        mbuf = mbuf_get_size(size);
         if (mbuf == NULL) {
             return GF_ENOMEM;
         }
@@ -668,26 +1037,18 @@ msg_recv_chain(struct context *ctx, struct conn *conn, struct msg *msg)
         return GF_ERROR;
     }
 
+    /* a read that fills the mbuf asks for a larger one next */
+    if ((size_t)n == msize) {
+        conn->recv_hint = (uint32_t)MIN(2 * mbuf_capacity(mbuf), UINT32_MAX);
+    } else {
+        conn->recv_hint = (uint32_t)n;
+    }
+
     ASSERT((mbuf->last+n) <= mbuf->end);
     mbuf->last += n;
     msg->mlen += (uint32_t)n;
 
-    for (;;) {
-        status = msg_parse(ctx, conn, msg);
-        if (status != GF_OK) {
-            return status;
-        }
-
-        /* get next message to parse */
-        nmsg = conn->recv_next(ctx, conn, false);
-        if (nmsg == NULL || nmsg == msg) {
-            /* no more data to parse */
-            break;
-        }
-
-        msg = nmsg;
-    }
-    return GF_OK;
+    return msg_parse_chain(ctx, conn, msg);
 }
 
 rstatus_t
@@ -696,11 +1057,22 @@ msg_recv(struct context *ctx, struct conn *conn)
     rstatus_t status;
     struct msg *msg;
 
-    ASSERT(conn->recv_active);
+    if (!conn->recv_active) {
+        /* reading is paused, see client_throttle() */
+        return GF_OK;
+    }
+
+    if (conn->recv_held) {
+        conn->recv_held = 0;
+        status = msg_parse_chain(ctx, conn, conn->rmsg);
+        if (status != GF_OK || !conn->recv_active) {
+            return status;
+        }
+    }
 
     conn->recv_ready = 1;
     do {
-        msg = conn->recv_next(ctx, conn, true);
+        msg = conn->ops->recv_next(ctx, conn, true);
         if (msg == NULL) {
             return GF_OK;
         }
@@ -709,7 +1081,7 @@ msg_recv(struct context *ctx, struct conn *conn)
         if (status != GF_OK) {
             return status;
         }
-    } while (conn->recv_ready);
+    } while (conn->recv_ready && conn->recv_active);
 
     return GF_OK;
 }
@@ -771,7 +1143,7 @@ msg_send_chain(struct context *ctx, struct conn *conn, struct msg *msg)
             break;
         }
 
-        msg = conn->send_next(ctx, conn);
+        msg = conn->ops->send_next(ctx, conn);
         if (msg == NULL) {
             break;
         }
@@ -790,6 +1162,10 @@ msg_send_chain(struct context *ctx, struct conn *conn, struct msg *msg)
 
     nsent = n > 0 ? (size_t)n : 0;
 
+    if (conn->client && nsent != 0) {
+        client_drain(ctx, conn, nsent);
+    }
+
     /* postprocess - process sent messages in send_msgq */
     for (msg = TAILQ_FIRST(&send_msgq); msg != NULL; msg = nmsg) {
         nmsg = TAILQ_NEXT(msg, m_tqe);
@@ -798,7 +1174,7 @@ msg_send_chain(struct context *ctx, struct conn *conn, struct msg *msg)
 
         if (nsent == 0) {
             if (msg->mlen == 0) {
-                conn->send_done(ctx, conn, msg);
+                conn->ops->send_done(ctx, conn, msg);
             }
             continue;
         }
@@ -827,7 +1203,7 @@ msg_send_chain(struct context *ctx, struct conn *conn, struct msg *msg)
 
         /* message has been sent completely, finalize it */
         if (mbuf == NULL) {
-            conn->send_done(ctx, conn, msg);
+            conn->ops->send_done(ctx, conn, msg);
         }
     }
 
@@ -846,14 +1222,12 @@ msg_send(struct context *ctx, struct conn *conn)
     rstatus_t status;
     struct msg *msg;
 
-    ASSERT(conn->send_active);
-
     conn->send_ready = 1;
     do {
-        msg = conn->send_next(ctx, conn);
+        msg = conn->ops->send_next(ctx, conn);
         if (msg == NULL) {
             /* nothing to send */
-            return GF_OK;
+            break;
         }
 
         status = msg_send_chain(ctx, conn, msg);
@@ -863,6 +1237,12 @@ msg_send(struct context *ctx, struct conn *conn)
 
     } while (conn->send_ready);
 
+    /* sending may have resumed reading with requests held back */
+    if (conn->recv_held && conn->recv_active) {
+        conn->recv_held = 0;
+        return msg_parse_chain(ctx, conn, conn->rmsg);
+    }
+
     return GF_OK;
 }
 
@@ -874,7 +1254,7 @@ bool msg_set_placeholder_key(struct msg *r)
 {
     struct keypos *kpos;
     ASSERT(array_n(r->keys) == 0);
-    kpos = array_push(r->keys);
+    kpos = msg_keypos_push(r);
     if (kpos == NULL) {
         return false;
     }
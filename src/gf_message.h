@@ -30,12 +30,22 @@
 
 #include <gf_core.h>
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#if (IOV_MAX > 128)
+#define GF_IOV_MAX 128
+#else
+#define GF_IOV_MAX IOV_MAX
+#endif
+
 typedef void (*msg_parse_t)(struct msg *);
-typedef rstatus_t (*msg_add_auth_t)(struct context *ctx, struct conn *c_conn, struct conn *s_conn);
 typedef rstatus_t (*msg_fragment_t)(struct msg *, uint32_t, struct msg_tqh *);
 typedef void (*msg_coalesce_t)(struct msg *r);
 typedef rstatus_t (*msg_reply_t)(struct msg *r);
 typedef bool (*msg_failure_t)(const struct msg *r);
+typedef bool (*msg_redirect_t)(struct context *ctx, struct conn *conn, struct msg *r);
 
 typedef enum msg_parse_result {
     MSG_PARSE_OK,                         /* parsing ok */
@@ -44,15 +54,276 @@ typedef enum msg_parse_result {
     MSG_PARSE_AGAIN,                      /* incomplete -> parse again */
 } msg_parse_result_t;
 
+/*
+ * msg_type_t codec. Redis request types are kept in the lexical order of
+ * their command names, the order of the redis command table that maps
+ * them to a key specification (see proto/gf_redis.c).
+ */
+#define MSG_TYPE_CODEC(ACTION)                                              \
+    ACTION( UNKNOWN )                                                       \
+    ACTION( REQ_MC_GET )                                                    \
+    ACTION( REQ_MC_GETS )                                                   \
+    ACTION( REQ_MC_DELETE )                                                 \
+    ACTION( REQ_MC_CAS )                                                    \
+    ACTION( REQ_MC_SET )                                                    \
+    ACTION( REQ_MC_ADD )                                                    \
+    ACTION( REQ_MC_REPLACE )                                                \
+    ACTION( REQ_MC_APPEND )                                                 \
+    ACTION( REQ_MC_PREPEND )                                                \
+    ACTION( REQ_MC_INCR )                                                   \
+    ACTION( REQ_MC_DECR )                                                   \
+    ACTION( REQ_MC_TOUCH )                                                  \
+    ACTION( REQ_MC_QUIT )                                                   \
+    ACTION( REQ_MC_GAT )                                                    \
+    ACTION( REQ_MC_NOOP )                                                   \
+    ACTION( REQ_MC_VERSION )                                                \
+    ACTION( RSP_MC_NUM )                                                    \
+    ACTION( RSP_MC_STORED )                                                 \
+    ACTION( RSP_MC_NOT_STORED )                                             \
+    ACTION( RSP_MC_EXISTS )                                                 \
+    ACTION( RSP_MC_NOT_FOUND )                                              \
+    ACTION( RSP_MC_END )                                                    \
+    ACTION( RSP_MC_VALUE )                                                  \
+    ACTION( RSP_MC_DELETED )                                                \
+    ACTION( RSP_MC_TOUCHED )                                                \
+    ACTION( RSP_MC_VERSION )                                                \
+    ACTION( RSP_MC_ERROR )                                                  \
+    ACTION( RSP_MC_CLIENT_ERROR )                                           \
+    ACTION( RSP_MC_SERVER_ERROR )                                           \
+    ACTION( REQ_REDIS_APPEND )                                              \
+    ACTION( REQ_REDIS_ASKING )                                              \
+    ACTION( REQ_REDIS_AUTH )                                                \
+    ACTION( REQ_REDIS_BITCOUNT )                                            \
+    ACTION( REQ_REDIS_BITOP )                                               \
+    ACTION( REQ_REDIS_BITPOS )                                              \
+    ACTION( REQ_REDIS_CLIENT )                                              \
+    ACTION( REQ_REDIS_CLUSTER )                                             \
+    ACTION( REQ_REDIS_COMMAND )                                             \
+    ACTION( REQ_REDIS_DECR )                                                \
+    ACTION( REQ_REDIS_DECRBY )                                              \
+    ACTION( REQ_REDIS_DEL )                                                 \
+    ACTION( REQ_REDIS_DUMP )                                                \
+    ACTION( REQ_REDIS_ECHO )                                                \
+    ACTION( REQ_REDIS_EVAL )                                                \
+    ACTION( REQ_REDIS_EVALSHA )                                             \
+    ACTION( REQ_REDIS_EXISTS )                                              \
+    ACTION( REQ_REDIS_EXPIRE )                                              \
+    ACTION( REQ_REDIS_EXPIREAT )                                            \
+    ACTION( REQ_REDIS_GEOADD )                                              \
+    ACTION( REQ_REDIS_GEODIST )                                             \
+    ACTION( REQ_REDIS_GEOHASH )                                             \
+    ACTION( REQ_REDIS_GEOPOS )                                              \
+    ACTION( REQ_REDIS_GEORADIUS )                                           \
+    ACTION( REQ_REDIS_GEORADIUSBYMEMBER )                                   \
+    ACTION( REQ_REDIS_GEOSEARCH )                                           \
+    ACTION( REQ_REDIS_GET )                                                 \
+    ACTION( REQ_REDIS_GETBIT )                                              \
+    ACTION( REQ_REDIS_GETDEL )                                              \
+    ACTION( REQ_REDIS_GETEX )                                               \
+    ACTION( REQ_REDIS_GETRANGE )                                            \
+    ACTION( REQ_REDIS_GETSET )                                              \
+    ACTION( REQ_REDIS_HDEL )                                                \
+    ACTION( REQ_REDIS_HELLO )                                               \
+    ACTION( REQ_REDIS_HEXISTS )                                             \
+    ACTION( REQ_REDIS_HGET )                                                \
+    ACTION( REQ_REDIS_HGETALL )                                             \
+    ACTION( REQ_REDIS_HINCRBY )                                             \
+    ACTION( REQ_REDIS_HINCRBYFLOAT )                                        \
+    ACTION( REQ_REDIS_HKEYS )                                               \
+    ACTION( REQ_REDIS_HLEN )                                                \
+    ACTION( REQ_REDIS_HMGET )                                               \
+    ACTION( REQ_REDIS_HMSET )                                               \
+    ACTION( REQ_REDIS_HRANDFIELD )                                          \
+    ACTION( REQ_REDIS_HSCAN )                                               \
+    ACTION( REQ_REDIS_HSET )                                                \
+    ACTION( REQ_REDIS_HSETNX )                                              \
+    ACTION( REQ_REDIS_HSTRLEN )                                             \
+    ACTION( REQ_REDIS_HVALS )                                               \
+    ACTION( REQ_REDIS_INCR )                                                \
+    ACTION( REQ_REDIS_INCRBY )                                              \
+    ACTION( REQ_REDIS_INCRBYFLOAT )                                         \
+    ACTION( REQ_REDIS_LINDEX )                                              \
+    ACTION( REQ_REDIS_LINSERT )                                             \
+    ACTION( REQ_REDIS_LLEN )                                                \
+    ACTION( REQ_REDIS_LMOVE )                                               \
+    ACTION( REQ_REDIS_LPOP )                                                \
+    ACTION( REQ_REDIS_LPOS )                                                \
+    ACTION( REQ_REDIS_LPUSH )                                               \
+    ACTION( REQ_REDIS_LPUSHX )                                              \
+    ACTION( REQ_REDIS_LRANGE )                                              \
+    ACTION( REQ_REDIS_LREM )                                                \
+    ACTION( REQ_REDIS_LSET )                                                \
+    ACTION( REQ_REDIS_LTRIM )                                               \
+    ACTION( REQ_REDIS_MGET )                                                \
+    ACTION( REQ_REDIS_MSET )                                                \
+    ACTION( REQ_REDIS_PERSIST )                                             \
+    ACTION( REQ_REDIS_PEXPIRE )                                             \
+    ACTION( REQ_REDIS_PEXPIREAT )                                           \
+    ACTION( REQ_REDIS_PFADD )                                               \
+    ACTION( REQ_REDIS_PFCOUNT )                                             \
+    ACTION( REQ_REDIS_PFMERGE )                                             \
+    ACTION( REQ_REDIS_PING )                                                \
+    ACTION( REQ_REDIS_PSETEX )                                              \
+    ACTION( REQ_REDIS_PTTL )                                                \
+    ACTION( REQ_REDIS_QUIT )                                                \
+    ACTION( REQ_REDIS_RENAME )                                              \
+    ACTION( REQ_REDIS_RENAMENX )                                            \
+    ACTION( REQ_REDIS_RESTORE )                                             \
+    ACTION( REQ_REDIS_RPOP )                                                \
+    ACTION( REQ_REDIS_RPOPLPUSH )                                           \
+    ACTION( REQ_REDIS_RPUSH )                                               \
+    ACTION( REQ_REDIS_RPUSHX )                                              \
+    ACTION( REQ_REDIS_SADD )                                                \
+    ACTION( REQ_REDIS_SCARD )                                               \
+    ACTION( REQ_REDIS_SDIFF )                                               \
+    ACTION( REQ_REDIS_SDIFFSTORE )                                          \
+    ACTION( REQ_REDIS_SELECT )                                              \
+    ACTION( REQ_REDIS_SET )                                                 \
+    ACTION( REQ_REDIS_SETBIT )                                              \
+    ACTION( REQ_REDIS_SETEX )                                               \
+    ACTION( REQ_REDIS_SETNX )                                               \
+    ACTION( REQ_REDIS_SETRANGE )                                            \
+    ACTION( REQ_REDIS_SINTER )                                              \
+    ACTION( REQ_REDIS_SINTERSTORE )                                         \
+    ACTION( REQ_REDIS_SISMEMBER )                                           \
+    ACTION( REQ_REDIS_SMEMBERS )                                            \
+    ACTION( REQ_REDIS_SMISMEMBER )                                          \
+    ACTION( REQ_REDIS_SMOVE )                                               \
+    ACTION( REQ_REDIS_SORT )                                                \
+    ACTION( REQ_REDIS_SPOP )                                                \
+    ACTION( REQ_REDIS_SRANDMEMBER )                                         \
+    ACTION( REQ_REDIS_SREM )                                                \
+    ACTION( REQ_REDIS_SSCAN )                                               \
+    ACTION( REQ_REDIS_STRLEN )                                              \
+    ACTION( REQ_REDIS_SUNION )                                              \
+    ACTION( REQ_REDIS_SUNIONSTORE )                                         \
+    ACTION( REQ_REDIS_TOUCH )                                               \
+    ACTION( REQ_REDIS_TTL )                                                 \
+    ACTION( REQ_REDIS_TYPE )                                                \
+    ACTION( REQ_REDIS_UNLINK )                                              \
+    ACTION( REQ_REDIS_XACK )                                                \
+    ACTION( REQ_REDIS_XADD )                                                \
+    ACTION( REQ_REDIS_XCLAIM )                                              \
+    ACTION( REQ_REDIS_XDEL )                                                \
+    ACTION( REQ_REDIS_XLEN )                                                \
+    ACTION( REQ_REDIS_XPENDING )                                            \
+    ACTION( REQ_REDIS_XRANGE )                                              \
+    ACTION( REQ_REDIS_XREVRANGE )                                           \
+    ACTION( REQ_REDIS_XTRIM )                                               \
+    ACTION( REQ_REDIS_ZADD )                                                \
+    ACTION( REQ_REDIS_ZCARD )                                               \
+    ACTION( REQ_REDIS_ZCOUNT )                                              \
+    ACTION( REQ_REDIS_ZINCRBY )                                             \
+    ACTION( REQ_REDIS_ZINTERSTORE )                                         \
+    ACTION( REQ_REDIS_ZLEXCOUNT )                                           \
+    ACTION( REQ_REDIS_ZMSCORE )                                             \
+    ACTION( REQ_REDIS_ZPOPMAX )                                             \
+    ACTION( REQ_REDIS_ZPOPMIN )                                             \
+    ACTION( REQ_REDIS_ZRANDMEMBER )                                         \
+    ACTION( REQ_REDIS_ZRANGE )                                              \
+    ACTION( REQ_REDIS_ZRANGEBYLEX )                                         \
+    ACTION( REQ_REDIS_ZRANGEBYSCORE )                                       \
+    ACTION( REQ_REDIS_ZRANK )                                               \
+    ACTION( REQ_REDIS_ZREM )                                                \
+    ACTION( REQ_REDIS_ZREMRANGEBYLEX )                                      \
+    ACTION( REQ_REDIS_ZREMRANGEBYRANK )                                     \
+    ACTION( REQ_REDIS_ZREMRANGEBYSCORE )                                    \
+    ACTION( REQ_REDIS_ZREVRANGE )                                           \
+    ACTION( REQ_REDIS_ZREVRANGEBYLEX )                                      \
+    ACTION( REQ_REDIS_ZREVRANGEBYSCORE )                                    \
+    ACTION( REQ_REDIS_ZREVRANK )                                            \
+    ACTION( REQ_REDIS_ZSCAN )                                               \
+    ACTION( REQ_REDIS_ZSCORE )                                              \
+    ACTION( REQ_REDIS_ZUNIONSTORE )                                         \
+    ACTION( RSP_REDIS_STATUS )                                              \
+    ACTION( RSP_REDIS_ERROR )                                               \
+    ACTION( RSP_REDIS_ERROR_OOM )                                           \
+    ACTION( RSP_REDIS_ERROR_BUSY )                                          \
+    ACTION( RSP_REDIS_ERROR_LOADING )                                       \
+    ACTION( RSP_REDIS_ERROR_MOVED )                                         \
+    ACTION( RSP_REDIS_ERROR_ASK )                                           \
+    ACTION( RSP_REDIS_INTEGER )                                             \
+    ACTION( RSP_REDIS_BULK )                                                \
+    ACTION( RSP_REDIS_MULTIBULK )                                           \
+    ACTION( RSP_REDIS_NULL )                                                \
+    ACTION( RSP_REDIS_BOOLEAN )                                             \
+    ACTION( RSP_REDIS_DOUBLE )                                              \
+    ACTION( RSP_REDIS_BIGNUM )                                              \
+    ACTION( RSP_REDIS_VERBATIM )                                            \
+    ACTION( RSP_REDIS_MAP )                                                 \
+    ACTION( RSP_REDIS_SET )                                                 \
+    ACTION( RSP_REDIS_ATTRIBUTE )                                           \
+    ACTION( RSP_REDIS_PUSH )                                                \
+    ACTION( SENTINEL )                                                      \
+
+#define DEFINE_ACTION(_name) MSG_##_name,
+typedef enum msg_type {
+    MSG_TYPE_CODEC(DEFINE_ACTION)
+} msg_type_t;
+#undef DEFINE_ACTION
+
 struct keypos {
     uint8_t              *start;           /* key start pos */
     uint8_t              *end;             /* key end pos */
 };
 
+#define MSG_NKEYPOS_INLINE 4              /* # keypos stored inline in a msg */
+
+/*
+ * Fragments of a request split across servers, shared by the request that
+ * was split (the owner) and all its fragments. The group lives as long as
+ * any of its messages does, and keeps the count of the fragments that are
+ * done and in error, so that the state of the whole request is known
+ * without visiting its fragments.
+ */
+struct msg_frag {
+    uint64_t             id;              /* fragment id */
+    struct msg           *owner;          /* owner of fragments, if alive */
+    uint32_t             nfrag;           /* # fragment */
+    uint32_t             ndone;           /* # fragment done */
+    uint32_t             nerror;          /* # fragment in error */
+    uint32_t             nref;            /* # message in group */
+    struct msg           **seq;           /* fragment of each key of the owner */
+    unsigned             coalesced:1;     /* post-coalesce invoked? */
+};
+
+/*
+ * Key storage of a msg, attached on its first key and kept by the msg from
+ * then on, so that responses and keyless requests never touch it
+ */
+struct msg_keys {
+    struct array         keyv;            /* key array, inline until it spills */
+    struct keypos        kinline[MSG_NKEYPOS_INLINE]; /* inline key storage */
+};
+
+/*
+ * Protocol specific handlers of a message, one const table per protocol
+ * shared by all its messages.
+ */
+struct msg_ops {
+    msg_parse_t          parse_req;       /* request parser */
+    msg_parse_t          parse_rsp;       /* response parser */
+    msg_fragment_t       fragment;        /* message fragment */
+    msg_reply_t          reply;           /* generate message reply (example: ping) */
+    msg_failure_t        failure;         /* transient failure response? */
+    msg_redirect_t       redirect;        /* redirect request of response */
+    msg_coalesce_t       pre_coalesce;    /* message pre-coalesce */
+    msg_coalesce_t       post_coalesce;   /* message post-coalesce */
+};
+
 /*
  * This represents a message with a list of mbufs
  * that can be a redis/memcache request/response/error response.
+ *
+ * The fields touched on every forward come first and fit the first
+ * MSG_HOT_SIZE bytes of the msg, which is allocated cache line aligned.
+ * The few fields only used by redirected requests and backend threads
+ * follow; they are reset when the msg is put, so that reuse from the free
+ * list only writes the hot part. The state of fragmented requests lives in
+ * their msg_frag group and the keys in msg_keys, both attached on demand.
  */
+#define MSG_HOT_SIZE (4 * GF_CACHELINE_SIZE)
+
 struct msg {
     TAILQ_ENTRY(msg)     c_tqe;           /* link in client q */
     TAILQ_ENTRY(msg)     s_tqe;           /* link in server q */
@@ -61,80 +332,94 @@ struct msg {
     uint64_t             id;              /* message id */
     struct msg           *peer;           /* message peer */
     struct conn          *owner;          /* message owner - client | server */
-
-    struct rbnode        tmo_rbe;         /* entry in rbtree */
+    const struct msg_ops *ops;            /* protocol handlers */
 
     struct mhdr          mhdr;            /* message mbuf header */
     uint32_t             mlen;            /* message length */
-    int64_t              start_ts;        /* request start timestamp in usec */
-
     int                  state;           /* current parser state */
     uint8_t              *pos;            /* parser position marker */
     uint8_t              *token;          /* token marker */
-
-    msg_parse_t          parser;          /* message parser */
     msg_parse_result_t   result;          /* message parsing result */
+    msg_type_t           type;            /* message type */
 
-    msg_fragment_t       fragment;        /* message fragment */
-    msg_reply_t          reply;           /* generate message reply (example: ping) */
-    msg_add_auth_t       add_auth;        /* add auth message when we forward msg */
-    msg_failure_t        failure;         /* transient failure response? */
-
-    msg_coalesce_t       pre_coalesce;    /* message pre-coalesce */
-    msg_coalesce_t       post_coalesce;   /* message post-coalesce */
-
-    struct array         *keys;           /* array of keypos, for req */
-
+    uint32_t             expect;          /* # bytes of a value yet to be read */
     uint32_t             vlen;            /* value length (memcache) */
     uint8_t              *end;            /* end marker (memcache) */
-
     uint8_t              *narg_start;     /* narg start (redis) */
     uint8_t              *narg_end;       /* narg end (redis) */
     uint32_t             narg;            /* # arguments (redis, memcache) */
     uint32_t             rnarg;           /* running # arg used by parsing fsa (redis) */
     uint32_t             rlen;            /* running length in parsing fsa (redis) */
     uint32_t             integer;         /* integer reply value (redis) */
-    uint8_t              is_top_level;     /* is this top level (redis) */
 
-    struct msg           *frag_owner;     /* owner of fragment message */
-    uint32_t             nfrag;           /* # fragment */
-    uint32_t             nfrag_done;      /* # fragment done */
-    uint64_t             frag_id;         /* id of fragmented message */
-    struct msg           **frag_seq;      /* sequence of fragment message, map from keys to fragments*/
+    struct array         *keys;           /* array of keypos, for req */
+    struct msg_frag      *frag;           /* fragment group */
+    int64_t              start_ts;        /* request start timestamp in usec */
 
     err_t                err;             /* errno on error? */
+    uint8_t              is_top_level;    /* is this top level (redis) */
     unsigned             error:1;         /* error? */
-    unsigned             ferror:1;        /* one or more fragments are in error? */
     unsigned             request:1;       /* request? or response? */
     unsigned             quit:1;          /* quit request? */
     unsigned             noreply:1;       /* noreply? */
     unsigned             noforward:1;     /* not need forward (example: ping) */
     unsigned             done:1;          /* done? */
-    unsigned             fdone:1;         /* all fragments are done? */
+    unsigned             stream:1;        /* reply sent as fragments are done? */
     unsigned             swallow:1;       /* swallow response? */
     unsigned             redis:1;         /* redis? */
+    unsigned             resp3:1;         /* from a RESP3 client (redis)? */
+
+    struct rbnode        tmo_rbe;         /* entry in rbtree */
+
+    /* cold: redirected requests, backend threads, allocator */
+    uint32_t             nredirect;       /* # redirects followed (redis) */
+    struct backend_chan  *chan;           /* channel while on a backend thread */
+    uint32_t             pool_idx;        /* server pool index on the backend */
+    struct msg_pool      *pool;           /* allocator the msg is put back to (const) */
+    struct msg_keys      *kstore;         /* key storage or NULL before any key */
 };
 
 TAILQ_HEAD(msg_tqh, msg);
 
+static inline void
+msg_run_parser(struct msg *msg)
+{
+    if (msg->request) {
+        msg->ops->parse_req(msg);
+    } else {
+        msg->ops->parse_rsp(msg);
+    }
+}
+
 struct msg *msg_tmo_min(void);
 void msg_tmo_insert(struct msg *msg, struct conn *conn);
 void msg_tmo_delete(struct msg *msg);
 
 void msg_init(void);
 void msg_deinit(void);
-// const struct string *msg_type_string(msg_type_t type);
+void msg_reclaim(void);
+bool msg_trim(uint32_t nfree_max, uint32_t nbatch);
+uint32_t msg_nalloc(void);
+uint32_t msg_nalloc_max(void);
+const struct string *msg_type_string(msg_type_t type);
 struct msg *msg_get(struct conn *conn, bool request, bool redis);
 void msg_put(struct msg *msg);
+struct keypos *msg_keypos_push(struct msg *msg);
+void msg_keypos_reset(struct msg *msg);
 struct msg *msg_get_error(bool redis, err_t err);
 void msg_dump(const struct msg *msg, int level);
 bool msg_empty(const struct msg *msg);
 rstatus_t msg_recv(struct context *ctx, struct conn *conn);
 rstatus_t msg_send(struct context *ctx, struct conn *conn);
 uint64_t msg_gen_frag_id(void);
+struct msg_frag *msg_frag_get(struct msg *owner);
+void msg_frag_add(struct msg_frag *frag, struct msg *msg);
+void msg_frag_done(struct msg *msg);
+void msg_frag_put(struct msg *msg);
 uint32_t msg_backend_idx(const struct msg *msg, const uint8_t *key, uint32_t keylen);
 struct mbuf *msg_ensure_mbuf(struct msg *msg, size_t len);
 rstatus_t msg_append(struct msg *msg, const uint8_t *pos, size_t n);
+rstatus_t msg_append_slice(struct msg *msg, struct mbuf *mbuf, uint8_t *pos, size_t n);
 rstatus_t msg_prepend(struct msg *msg, const uint8_t *pos, size_t n);
 rstatus_t msg_prepend_format(struct msg *msg, const char *fmt, ...);
 bool msg_set_placeholder_key(struct msg *r);
@@ -155,11 +440,15 @@ void req_recv_done(struct context *ctx, struct conn *conn, struct msg *msg, stru
 struct msg *req_fake(struct context *ctx, struct conn *conn);
 struct msg *req_send_next(struct context *ctx, struct conn *conn);
 void req_send_done(struct context *ctx, struct conn *conn, struct msg *msg);
+void req_forward_error(struct context *ctx, struct conn *conn, struct msg *msg, err_t err);
+rstatus_t req_forward_server(struct context *ctx, struct server_pool *pool, struct msg *msg);
+void req_redirect(struct context *ctx, struct msg *msg, struct server *server, struct msg *pre);
 
 struct msg *rsp_get(struct conn *conn);
 void rsp_put(struct msg *msg);
 struct msg *rsp_recv_next(struct context *ctx, struct conn *conn, bool alloc);
 void rsp_recv_done(struct context *ctx, struct conn *conn, struct msg *msg, struct msg *nmsg);
+void rsp_forward_client(struct context *ctx, struct conn *c_conn, struct msg *pmsg, struct msg *msg);
 struct msg *rsp_send_next(struct context *ctx, struct conn *conn);
 void rsp_send_done(struct context *ctx, struct conn *conn, struct msg *msg);
 
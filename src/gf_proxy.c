@@ -73,7 +73,7 @@ proxy_close(struct context *ctx, struct conn *conn)
     ASSERT(!conn->client && conn->proxy);
 
     if (conn->sd < 0) {
-        conn->unref(conn);
+        conn->ops->unref(conn);
         conn_put(conn);
         return;
     }
@@ -83,7 +83,7 @@ proxy_close(struct context *ctx, struct conn *conn)
     ASSERT(TAILQ_EMPTY(&conn->imsg_q));
     ASSERT(TAILQ_EMPTY(&conn->omsg_q));
 
-    conn->unref(conn);
+    conn->ops->unref(conn);
 
     status = close(conn->sd);
     if (status < 0) {
@@ -145,7 +145,8 @@ proxy_listen(struct context *ctx, struct conn *p)
         return GF_ERROR;
     }
 
-    if (pool->reuseport) {
+    /* event loop threads each listen on the same port */
+    if (pool->reuseport || (ctx->nthread > 1 && p->family != AF_UNIX)) {
         status = gf_set_reuseport(p->sd);
         if (status < 0) {
             log_error("reuse of port '%.*s' for listening on p %d failed: %s",
@@ -212,6 +213,14 @@ proxy_each_init(void *elem, void *data)
     struct server_pool *pool = elem;
     struct conn *p;
 
+    /*
+     * A unix socket path cannot be shared, so only the first event loop
+     * listens on it
+     */
+    if (pool->info.family == AF_UNIX && pool->ctx->parent != NULL) {
+        return GF_OK;
+    }
+
     p = conn_get_proxy(pool);
     if (p == NULL) {
         return GF_ENOMEM;
@@ -219,7 +228,7 @@ proxy_each_init(void *elem, void *data)
 
     status = proxy_listen(pool->ctx, p);
     if (status != GF_OK) {
-        p->close(pool->ctx, p);
+        p->ops->close(pool->ctx, p);
         return status;
     }
 
@@ -259,7 +268,7 @@ proxy_each_deinit(void *elem, void *data)
 
     p = pool->p_conn;
     if (p != NULL) {
-        p->close(pool->ctx, p);
+        p->ops->close(pool->ctx, p);
     }
 
     return GF_OK;
@@ -367,7 +376,7 @@ proxy_accept(struct context *ctx, struct conn *p)
     if (status < 0) {
         log_error("set nonblock on c %d from p %d failed: %s", c->sd, p->sd,
                   strerror(errno));
-        c->close(ctx, c);
+        c->ops->close(ctx, c);
         return status;
     }
 
@@ -391,7 +400,7 @@ proxy_accept(struct context *ctx, struct conn *p)
     if (status < 0) {
         log_error("event add conn from p %d failed: %s", p->sd,
                   strerror(errno));
-        c->close(ctx, c);
+        c->ops->close(ctx, c);
         return status;
     }
 
@@ -56,7 +56,7 @@ req_log(const struct msg *req)
     }
 
     /* a fragment? */
-    if (req->frag_id != 0 && req->frag_owner != req) {
+    if (req->frag != NULL && req->frag->owner != req) {
         return;
     }
 
@@ -83,6 +83,11 @@ req_log(const struct msg *req)
         return;
     }
 
+    /* client closed while the request was on a backend thread? */
+    if (req->owner == NULL) {
+        return;
+    }
+
     kpos = array_get(req->keys, 0);
     /*
      * FIXME: add backend addr here
@@ -130,16 +135,13 @@ req_put(struct msg *msg)
  *
  * A request is done, if we received response for the given request.
  * A request vector is done if we received responses for all its
- * fragments.
- *
- * msg->fdone is modified to cache whether this request was done.
+ * fragments, at which point the fragments are coalesced.
  */
 bool
 req_done(const struct conn *conn, struct msg *msg)
 {
-    struct msg *cmsg;       /* current message */
-    uint64_t id;            /* fragment id */
-    uint32_t nfragment;     /* # fragment */
+    struct msg_frag *frag;  /* fragment group */
+    struct msg *owner;      /* owner of fragments */
 
     ASSERT(conn->client && !conn->proxy);
     ASSERT(msg->request);
@@ -148,69 +150,34 @@ req_done(const struct conn *conn, struct msg *msg)
         return false;
     }
 
-    id = msg->frag_id;
-    if (id == 0) {
+    frag = msg->frag;
+    if (frag == NULL || frag->coalesced) {
         return true;
     }
 
-    if (msg->fdone) {
-        /* request has already been marked as done */
-        return true;
-    }
-
-    if (msg->nfrag_done < msg->nfrag) {
+    if (frag->ndone < frag->nfrag) {
         return false;
     }
 
-    /* check all fragments of the given request vector are done */
-    for (cmsg = TAILQ_PREV(msg, msg_tqh, c_tqe);
-         cmsg != NULL && cmsg->frag_id == id;
-         cmsg = TAILQ_PREV(cmsg, msg_tqh, c_tqe)) {
-        
-        if (!cmsg->done) {
-            return false;
-        }
-    }
-
-    for (cmsg = TAILQ_NEXT(msg, c_tqe);
-         cmsg != NULL && cmsg->frag_id == id;
-         cmsg = TAILQ_NEXT(cmsg, c_tqe)) {
-
-        if (!cmsg->done) {
-            return false;
-        }
-    }
-
     /*
      * At this point, all the fragments including the last fragment have
-     * been received.
-     *
-     * Mark all fragments of the given request vector to be done to speed up
-     * future req_done calls for any of fragments of this request
+     * been received. The owner precedes its fragments in the client outq,
+     * so it is still around.
      */
-    msg->fdone = 1;
-    nfragment = 0;
-
-    for (cmsg = TAILQ_PREV(msg, msg_tqh, c_tqe);
-         cmsg != NULL && cmsg->frag_id == id;
-         cmsg = TAILQ_PREV(cmsg, msg_tqh, c_tqe)) {
-        cmsg->fdone = 1;
-        nfragment++;
-    }
-
-    for (cmsg = TAILQ_NEXT(msg, c_tqe);
-         cmsg != NULL && cmsg->frag_id == id;
-         cmsg = TAILQ_NEXT(cmsg, c_tqe)) {
-        cmsg->fdone = 1;
-        nfragment++;
+    owner = frag->owner;
+    ASSERT(owner != NULL && owner->done);
+
+    /* fragments in error are replied with an error instead */
+    frag->coalesced = 1;
+    if (frag->nerror == 0) {
+        owner->ops->post_coalesce(owner);
+        if (owner->error) {
+            frag->nerror++;
+        }
     }
 
-    ASSERT(msg->frag_owner->nfrag == nfragment);
-
-    msg->post_coalesce(msg->frag_owner);
-
     log_debug(LOG_DEBUG, "req from c %d with fid %"PRIu64" and %"PRIu32" "
-              "fragments is done", conn->sd, id, nfragment);
+              "fragments is done", conn->sd, frag->id, frag->nfrag);
 
     return true;
 }
@@ -220,78 +187,18 @@ req_done(const struct conn *conn, struct msg *msg)
  *
  * A request is in error, if there was an error in receiving response for the
  * given request. A multiget request is in error if there was an error in
- * receiving response for any its fragments.
+ * receiving response for any its fragments, or in coalescing them.
  */
 bool
 req_error(const struct conn *conn, struct msg *msg)
 {
-    struct msg *cmsg;
-    uint64_t id;
-    uint32_t nfragment;
-
     ASSERT(msg->request && req_done(conn, msg));
 
     if (msg->error) {
         return true;
     }
 
-    id = msg->frag_id;
-    if (id == 0) {
-        return false;
-    }
-
-    if (msg->ferror) {
-        /* request has already been marked to be in error */
-        return true;
-    }
-
-    /* check if any of the fragments of the given request are in error */
-    for (cmsg = TAILQ_PREV(msg, msg_tqh, c_tqe);
-         cmsg != NULL && cmsg->frag_id == id;
-         cmsg = TAILQ_PREV(cmsg, msg_tqh, c_tqe)) {
-
-        if (cmsg->error) {
-            goto ferror;
-        }
-    }
-
-    for (cmsg = TAILQ_NEXT(msg, c_tqe);
-         cmsg != NULL && cmsg->frag_id == id;
-         cmsg = TAILQ_NEXT(cmsg, c_tqe)) {
-
-        if (cmsg->error) {
-            goto ferror;
-        }
-    }
-
-    return false;
-
-ferror:
-    /*
-     * Mark all fragments of the given request to be in error to speed up
-     * future req_error calls for any of fragments of this request
-     */
-    msg->ferror = 1;
-    nfragment = 1;
-
-    for (cmsg = TAILQ_PREV(msg, msg_tqh, c_tqe);
-         cmsg != NULL && cmsg->frag_id == id;
-         cmsg = TAILQ_PREV(cmsg, msg_tqh, c_tqe)) {
-        cmsg->ferror = 1;
-        nfragment++;
-    }
-
-    for (cmsg = TAILQ_NEXT(msg, c_tqe);
-         cmsg != NULL && cmsg->frag_id == id;
-         cmsg = TAILQ_NEXT(cmsg, c_tqe)) {
-        cmsg->ferror = 1;
-        nfragment++;
-    }
-
-    log_debug(LOG_DEBUG, "req from c %d with fid %"PRIu64" and %"PRIu32" "
-              "fragments is in error", conn->sd, id, nfragment);
-
-    return true;
+    return msg->frag != NULL && msg->frag->nerror != 0;
 }
 
 void
@@ -361,6 +268,9 @@ req_client_enqueue_omsgq(struct context *ctx, struct conn *conn, struct msg *msg
     ASSERT(conn->client && !conn->proxy);
 
     TAILQ_INSERT_TAIL(&conn->omsg_q, msg, c_tqe);
+    conn->nout_msg++;
+
+    client_throttle(ctx, conn);
 }
 
 void
@@ -382,6 +292,15 @@ req_client_dequeue_omsgq(struct context *ctx, struct conn *conn, struct msg *msg
     ASSERT(conn->client && !conn->proxy);
 
     TAILQ_REMOVE(&conn->omsg_q, msg, c_tqe);
+    ASSERT(conn->nout_msg > 0);
+    conn->nout_msg--;
+
+    /* bytes counted for responses that were never sent go with the queue */
+    if (conn->nout_msg == 0) {
+        conn->out_bytes = 0;
+    }
+
+    client_unthrottle(ctx, conn);
 }
 
 void
@@ -428,7 +347,7 @@ req_recv_next(struct context *ctx, struct conn *conn, bool alloc)
          * half (by sending the second FIN) when the client has no
          * outstanding requests
          */
-        if (!conn->active(conn)) {
+        if (!conn->ops->active(conn)) {
             conn->done = 1;
             log_debug(LOG_INFO, "c %d is done", conn->sd);
         }
@@ -469,7 +388,7 @@ req_make_reply(struct context *ctx, struct conn *conn, struct msg *req)
     rsp->request = 0;
 
     req->done = 1;
-    conn->enqueue_outq(ctx, conn, req);
+    conn->ops->enqueue_outq(ctx, conn, req);
 
     return GF_OK;
 }
@@ -493,7 +412,8 @@ req_filter(struct conn *conn, struct msg *msg)
     /*
      * Handle "quit\r\n" (memcache) or "*1\r\n$4\r\nquit\r\n" (redis), which
      * is the protocol way of doing a passive close. The connection is closed
-     * as soon as all pending replies have been written to the client.
+     * as soon as all pending replies have been written to the client,
+     * including the reply to quit itself for redis.
      */
     if (msg->quit) {
         log_debug(LOG_INFO, "filter quit req %"PRIu64" from c %d", msg->id,
@@ -505,6 +425,9 @@ req_filter(struct conn *conn, struct msg *msg)
         }
         conn->eof = 1;
         conn->recv_ready = 0;
+        if (msg->noforward) {
+            return false;
+        }
         req_put(msg);
         return true;
     }
@@ -520,20 +443,20 @@ req_filter(struct conn *conn, struct msg *msg)
     return false;
 }
 
-static void
-req_forward_error(struct context *ctx, struct conn *conn, struct msg *msg)
+void
+req_forward_error(struct context *ctx, struct conn *conn, struct msg *msg,
+                  err_t err)
 {
-    rstatus_t status;
-
     ASSERT(conn->client && !conn->proxy);
 
     log_debug(LOG_INFO, "forward req %"PRIu64" len %"PRIu32" from "
               "c %d failed: %s", msg->id, msg->mlen, conn->sd,
-              strerror(errno));
+              strerror(err));
     
     msg->done = 1;
     msg->error = 1;
-    msg->err = errno;
+    msg->err = err;
+    msg_frag_done(msg);
 
     /* noreply request don't expect any response */
     if (msg->noreply) {
@@ -542,10 +465,7 @@ req_forward_error(struct context *ctx, struct conn *conn, struct msg *msg)
     }
 
     if (req_done(conn, TAILQ_FIRST(&conn->omsg_q))) {
-        status = event_add_out(ctx->evb, conn);
-        if (status != GF_OK) {
-            conn->err = errno;
-        }
+        core_dirty(ctx, conn);
     }
 }
 
@@ -558,76 +478,121 @@ req_forward_stats(struct context *ctx, struct server *server, struct msg *msg)
     stats_server_incr_by(ctx, server, request_bytes, msg->mlen);
 }
 
-static void
-req_forward(struct context *ctx, struct conn *c_conn, struct msg *msg)
+/*
+ * Forward request msg to the server of pool its key maps to. On failure,
+ * errno tells why.
+ */
+rstatus_t
+req_forward_server(struct context *ctx, struct server_pool *pool,
+                   struct msg *msg)
 {
-    rstatus_t status;
     struct conn *s_conn;
     uint8_t *key;
     uint32_t keylen;
     struct keypos *kpos;
 
-    ASSERT(c_conn->client && !c_conn->proxy);
-
-    /* enqueue message (request) into client outq, if response is expected */
-    if (!msg->noreply) {
-        c_conn->enqueue_outq(ctx, c_conn, msg);
-    }
-
     ASSERT(array_n(msg->keys) > 0);
     kpos = array_get(msg->keys, 0);
     key = kpos->start;
     keylen = (uint32_t)(kpos->end - kpos->start);
 
-    s_conn = server_pool_conn(ctx, c_conn->owner, key, keylen);
+    s_conn = server_pool_conn(ctx, pool, key, keylen, msg->resp3);
     if (s_conn == NULL) {
         /*
          * Handle a failure to establish a new connection to a server,
          * e.g. due to dns resolution errors.
-         *
-         * If this is a fragmented request sent to multiple servers such as
-         * a memcache get(multiget),
-         * mark the fragment for this request to the server as done.
-         *
-         * Normally, this would be done when the request was forwarded to the
-         * server, but due to failing to connect to the server this check is
-         * repeated here.
          */
-        if (msg->frag_owner != NULL) {
-            msg->frag_owner->nfrag_done++;
-        }
-        req_forward_error(ctx, c_conn, msg);
-        return;
+        return GF_ERROR;
     }
 
     ASSERT(!s_conn->client && !s_conn->proxy);
 
     /* enqueue the message (request) into server inq */
-    if (TAILQ_EMPTY(&s_conn->imsg_q)) {
-        status = event_add_out(ctx->evb, s_conn);
-        if (status != GF_OK) {
-            req_forward_error(ctx, c_conn, msg);
-            s_conn->err = errno;
-            return;
-        }
+    s_conn->ops->enqueue_inq(ctx, s_conn, msg);
+    core_dirty(ctx, s_conn);
+
+    req_forward_stats(ctx, s_conn->owner, msg);
+
+    log_debug(LOG_VERB, "forward req %"PRIu64" len %"PRIu32" to s %d with "
+              "key '%.*s'", msg->id, msg->mlen, s_conn->sd, keylen, key);
+
+    return GF_OK;
+}
+
+static void
+req_forward(struct context *ctx, struct conn *c_conn, struct msg *msg)
+{
+    rstatus_t status;
+
+    ASSERT(c_conn->client && !c_conn->proxy);
+
+    /* enqueue message (request) into client outq, if response is expected */
+    if (!msg->noreply) {
+        c_conn->ops->enqueue_outq(ctx, c_conn, msg);
     }
 
-    if (!conn_authenticated(s_conn)) {
-        status = msg->add_auth(ctx, c_conn, s_conn);
-        if (status != GF_OK) {
-            req_forward_error(ctx, c_conn, msg);
-            s_conn->err = errno;
-            return;
-        }
+    msg->resp3 = c_conn->resp3;
+
+    /* servers are connected to by backend I/O threads? */
+    if (array_n(&ctx->chan) != 0) {
+        backend_forward(ctx, c_conn, msg);
+        return;
     }
 
-    s_conn->enqueue_inq(ctx, s_conn, msg);
+    status = req_forward_server(ctx, c_conn->owner, msg);
+    if (status != GF_OK) {
+        req_forward_error(ctx, c_conn, msg, errno);
+    }
+}
 
-    req_forward_stats(ctx, s_conn->owner, msg);
+/*
+ * Forward request msg, that a server redirected instead of serving it,
+ * once again to server, right behind request pre made by the proxy, if
+ * any. The request has been sent in full already and is sent again from
+ * the start of its mbufs.
+ */
+void
+req_redirect(struct context *ctx, struct msg *msg, struct server *server,
+             struct msg *pre)
+{
+    struct conn *s_conn;
+    struct mbuf *mbuf;
+
+    ASSERT(msg->request && !msg->done && msg->peer == NULL);
+    ASSERT(pre == NULL || pre->swallow);
+
+    STAILQ_FOREACH(mbuf, &msg->mhdr, next) {
+        mbuf->pos = mbuf->start;
+    }
+
+    s_conn = server_pool_server_conn(ctx, server, msg->resp3);
+    if (s_conn == NULL) {
+        goto error;
+    }
 
-    log_debug(LOG_VERB, "forward from c %d to s %d req %"PRIu64" len %"PRIu32
-              " with key '%.*s'", c_conn->sd, s_conn->sd, msg->id,
-              msg->mlen, keylen, key);
+    if (pre != NULL) {
+        s_conn->ops->enqueue_inq(ctx, s_conn, pre);
+    }
+    s_conn->ops->enqueue_inq(ctx, s_conn, msg);
+    core_dirty(ctx, s_conn);
+
+    req_forward_stats(ctx, server, msg);
+
+    log_debug(LOG_VERB, "redirect req %"PRIu64" len %"PRIu32" to s %d",
+              msg->id, msg->mlen, s_conn->sd);
+
+    return;
+
+error:
+    if (pre != NULL) {
+        req_put(pre);
+    }
+    if (msg->chan != NULL) {
+        msg->err = errno;
+        backend_done(ctx, msg);
+        return;
+    }
+    req_forward_error(ctx, msg->owner, msg, errno);
 }
 
 void
@@ -660,16 +625,13 @@ req_recv_done(struct context *ctx, struct conn *conn, struct msg *msg,
             return;
         }
 
-        status = msg->reply(msg);
+        status = msg->ops->reply(msg);
         if (status != GF_OK) {
             conn->err = errno;
             return;
         }
 
-        status = event_add_out(ctx->evb, conn);
-        if (status != GF_OK) {
-            conn->err = errno;
-        }
+        core_dirty(ctx, conn);
 
         return;
     }
@@ -677,12 +639,15 @@ req_recv_done(struct context *ctx, struct conn *conn, struct msg *msg,
     /* do fragment */
     pool = conn->owner;
     TAILQ_INIT(&frag_msgq);
-    status = msg->fragment(msg, array_n(&pool->server), &frag_msgq);
-    if (status != GF_OK) {
-        if (!msg->noreply) {
-            conn->enqueue_outq(ctx, conn, msg);
+    if (msg->ops->fragment != NULL) {
+        status = msg->ops->fragment(msg, array_n(&pool->server), &frag_msgq);
+        if (status != GF_OK) {
+            if (!msg->noreply) {
+                conn->ops->enqueue_outq(ctx, conn, msg);
+            }
+            req_forward_error(ctx, conn, msg, errno);
+            return;
         }
-        req_forward_error(ctx, conn, msg);
     }
 
     /* if no fragment happened */
@@ -694,9 +659,9 @@ req_recv_done(struct context *ctx, struct conn *conn, struct msg *msg,
     status = req_make_reply(ctx, conn, msg);
     if (status != GF_OK) {
         if (!msg->noreply) {
-            conn->enqueue_outq(ctx, conn, msg);
+            conn->ops->enqueue_outq(ctx, conn, msg);
         }
-        req_forward_error(ctx, conn, msg);
+        req_forward_error(ctx, conn, msg, errno);
     }
 
     for (sub_msg = TAILQ_FIRST(&frag_msgq); sub_msg != NULL; sub_msg = tmsg) {
@@ -759,13 +724,13 @@ req_send_done(struct context *ctx, struct conn *conn, struct msg *msg)
     ASSERT(!conn->client && !conn->proxy);
     ASSERT(msg != NULL && conn->smsg == NULL);
     ASSERT(msg->request && !msg->done);
-    ASSERT(msg->owner != conn);
+    ASSERT(msg->chan != NULL || msg->owner != conn);
 
     log_debug(LOG_VVERB, "send done req %"PRIu64" len %"PRIu32" on "
               "s %d", msg->id, msg->mlen, conn->sd);
 
     /* dequeue the message (request) from server inq */
-    conn->dequeue_inq(ctx, conn, msg);
+    conn->ops->dequeue_inq(ctx, conn, msg);
 
     /*
      * noreply request instructs the server not to send any response. So,
@@ -773,7 +738,9 @@ req_send_done(struct context *ctx, struct conn *conn, struct msg *msg)
      * Otherwise, free the noreply request
      */
     if (!msg->noreply) {
-        conn->enqueue_outq(ctx, conn, msg);
+        conn->ops->enqueue_outq(ctx, conn, msg);
+    } else if (msg->chan != NULL) {
+        backend_done(ctx, msg);
     } else {
         req_put(msg);
     }
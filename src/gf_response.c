@@ -26,6 +26,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 #include <gf_core.h>
+#include <proto/gf_proto.h>
 
 struct msg *
 rsp_get(struct conn *conn)
@@ -50,27 +51,48 @@ rsp_put(struct msg *msg)
     msg_put(msg);
 }
 
+/*
+ * Return true if request msg is streamed and its reply holds data that
+ * can be sent, even if some of its fragments are not done yet
+ */
+static bool
+rsp_streaming(const struct msg *msg)
+{
+    return msg->stream && msg->peer != NULL && !msg_empty(msg->peer);
+}
+
+/*
+ * Return true if the reply to streamed request msg is still to be followed
+ * by more data or by an error reply, so that msg has to stay in the outq
+ * once the data sent so far is out
+ */
+static bool
+rsp_stream_held(const struct conn *conn, struct msg *msg)
+{
+    return msg->stream && (!msg->frag->coalesced || req_error(conn, msg));
+}
+
 static struct msg *
 rsp_make_error(struct context *ctx, struct conn *conn, struct msg *msg)
 {
     struct msg *pmsg;        /* peer message (response) */
     struct msg *cmsg, *nmsg; /* current and next message (request) */
-    uint64_t id;
+    struct msg_frag *frag;
     err_t err;
 
     ASSERT(conn->client && !conn->proxy);
     ASSERT(msg->request && req_error(conn, msg));
     ASSERT(msg->owner == conn);
 
-    id = msg->frag_id;
-    if (id != 0) {
+    frag = msg->frag;
+    if (frag != NULL) {
         for (err = 0, cmsg = TAILQ_NEXT(msg, c_tqe);
-             cmsg != NULL && cmsg->frag_id == id;
+             cmsg != NULL && cmsg->frag == frag;
              cmsg = nmsg) {
             nmsg = TAILQ_NEXT(cmsg, c_tqe);
 
             /* dequeue request (error fragment) from client outq */
-            conn->dequeue_outq(ctx, conn, cmsg);
+            conn->ops->dequeue_outq(ctx, conn, cmsg);
             if (err == 0 && cmsg->err != 0) {
                 err = cmsg->err;
             }
@@ -89,6 +111,10 @@ rsp_make_error(struct context *ctx, struct conn *conn, struct msg *msg)
         rsp_put(pmsg);
     }
 
+    if (conn->binary) {
+        return memcache_binary_error(msg, err);
+    }
+
     return msg_get_error(conn->redis, err);
 }
 
@@ -125,7 +151,7 @@ rsp_recv_next(struct context *ctx, struct conn *conn, bool alloc)
          * it crashes
          */
         conn->done = 1;
-        log_error("s %d active %d is done", conn->sd, conn->active(conn));
+        log_error("s %d active %d is done", conn->sd, conn->ops->active(conn));
 
         return NULL;
     }
@@ -163,6 +189,18 @@ rsp_filter(struct context *ctx, struct conn *conn, struct msg *msg)
         return true;
     }
 
+    /*
+     * RESP3 push messages are sent out of band, e.g. on client side
+     * caching invalidations, and are not replies to any request. None of
+     * the clients sharing the connection asked for them.
+     */
+    if (msg->type == MSG_RSP_REDIS_PUSH) {
+        log_debug(LOG_INFO, "filter push rsp %"PRIu64" len %"PRIu32" on s %d",
+                  msg->id, msg->mlen, conn->sd);
+        rsp_put(msg);
+        return true;
+    }
+
     pmsg = TAILQ_FIRST(&conn->omsg_q);
     if (pmsg == NULL) {
         log_debug(LOG_ERR, "filter stray rsp %"PRIu64" len %"PRIu32" on s %d",
@@ -202,7 +240,7 @@ rsp_filter(struct context *ctx, struct conn *conn, struct msg *msg)
      * If auto_eject_host is enabled, this will also update the failure_count
      * and eject the server if it exceeds the failure_limit
      */
-    if (msg->failure(msg)) {
+    if (msg->ops->failure(msg)) {
         log_debug(LOG_INFO, "server failure rsp %"PRIu64" len %"PRIu32" "
                   "on s %d", msg->id, msg->mlen, conn->sd);
         rsp_put(msg);
@@ -214,9 +252,9 @@ rsp_filter(struct context *ctx, struct conn *conn, struct msg *msg)
     }
 
     if (pmsg->swallow) {
-        conn->swallow_msg(conn, pmsg, msg);
+        conn->ops->swallow_msg(conn, pmsg, msg);
 
-        conn->dequeue_outq(ctx, conn, pmsg);
+        conn->ops->dequeue_outq(ctx, conn, pmsg);
         pmsg->done = 1;
 
         log_debug(LOG_INFO, "swallow rsp %"PRIu64" len %"PRIu32" of req "
@@ -228,6 +266,15 @@ rsp_filter(struct context *ctx, struct conn *conn, struct msg *msg)
         return true;
     }
 
+    /*
+     * A response that redirects the request to another server, e.g. once
+     * redis cluster moved a slot, is not for the client to see. The request
+     * is forwarded to that server instead.
+     */
+    if (msg->ops->redirect != NULL && msg->ops->redirect(ctx, conn, msg)) {
+        return true;
+    }
+
     return false;
 }
 
@@ -240,12 +287,42 @@ rsp_forward_stats(struct context *ctx, struct server *server, struct msg *msg, u
     stats_server_incr_by(ctx, server, response_bytes, msgsize);
 }
 
+/*
+ * Deliver response msg to its request pmsg from client c_conn, once pmsg
+ * is off the server connection
+ */
+void
+rsp_forward_client(struct context *ctx, struct conn *c_conn, struct msg *pmsg,
+                   struct msg *msg)
+{
+    struct msg *hmsg; /* head of client outq */
+
+    ASSERT(c_conn->client && !c_conn->proxy);
+    ASSERT(pmsg->request && !pmsg->done && pmsg->peer == NULL);
+
+    pmsg->done = 1;
+
+    /* establish msg <-> pmsg (response <-> request) link */
+    pmsg->peer = msg;
+    msg->peer = pmsg;
+
+    c_conn->out_bytes += msg->mlen;
+
+    msg->ops->pre_coalesce(msg);
+    msg_frag_done(pmsg);
+
+    client_throttle(ctx, c_conn);
+
+    hmsg = TAILQ_FIRST(&c_conn->omsg_q);
+    if (req_done(c_conn, hmsg) || rsp_streaming(hmsg)) {
+        core_dirty(ctx, c_conn);
+    }
+}
+
 static void
 rsp_forward(struct context *ctx, struct conn *s_conn, struct msg *msg)
 {
-    rstatus_t status;
-    struct msg *pmsg;
-    struct conn *c_conn;
+    struct msg *pmsg; /* peer request */
     uint32_t msgsize;
 
     ASSERT(!s_conn->client && !s_conn->proxy);
@@ -259,26 +336,18 @@ rsp_forward(struct context *ctx, struct conn *s_conn, struct msg *msg)
     ASSERT(pmsg != NULL && pmsg->peer == NULL);
     ASSERT(pmsg->request && !pmsg->done);
 
-    s_conn->dequeue_outq(ctx, s_conn, pmsg);
-    pmsg->done = 1;
-
-    /* establish msg <-> pmsg (response <-> request) link */
-    pmsg->peer = msg;
-    msg->peer = pmsg;
-
-    msg->pre_coalesce(msg);
+    s_conn->ops->dequeue_outq(ctx, s_conn, pmsg);
 
-    c_conn = pmsg->owner;
-    ASSERT(c_conn->client && !c_conn->proxy);
+    rsp_forward_stats(ctx, s_conn->owner, msg, msgsize);
 
-    if (req_done(c_conn, TAILQ_FIRST(&c_conn->omsg_q))) {
-        status = event_add_out(ctx->evb, c_conn);
-        if (status != GF_OK) {
-            c_conn->err = errno;
-        }
+    /* the client is served by the frontend the request came from */
+    if (pmsg->chan != NULL) {
+        msg->peer = pmsg;
+        backend_done(ctx, msg);
+        return;
     }
 
-    rsp_forward_stats(ctx, s_conn->owner, msg, msgsize);
+    rsp_forward_client(ctx, pmsg->owner, pmsg, msg);
 }
 
 void
@@ -310,7 +379,7 @@ rsp_send_next(struct context *ctx, struct conn *conn)
     ASSERT(conn->client && !conn->proxy);
 
     pmsg = TAILQ_FIRST(&conn->omsg_q);
-    if (pmsg == NULL && !req_done(conn, pmsg)) {
+    if (pmsg == NULL || !(req_done(conn, pmsg) || rsp_streaming(pmsg))) {
         /* nothing is outstanding, initiate close? */
         if (pmsg == NULL && conn->eof) {
             conn->done = 1;
@@ -328,17 +397,30 @@ rsp_send_next(struct context *ctx, struct conn *conn)
     msg = conn->smsg;
     if (msg != NULL) {
         ASSERT(!msg->request && msg->peer != NULL);
-        ASSERT(req_done(conn, msg->peer));
+        ASSERT(req_done(conn, msg->peer) || msg->peer->stream);
+        if (rsp_stream_held(conn, msg->peer)) {
+            conn->smsg = NULL;
+            return NULL;
+        }
         pmsg = TAILQ_NEXT(msg->peer, c_tqe);
     }
 
-    if (pmsg == NULL || !req_done(conn, pmsg)) {
+    if (pmsg == NULL || !(req_done(conn, pmsg) || rsp_streaming(pmsg))) {
         conn->smsg = NULL;
         return NULL;
     }
     ASSERT(pmsg->request && !pmsg->swallow);
 
-    if (req_error(conn, pmsg)) {
+    if (rsp_streaming(pmsg)) {
+        /*
+         * Data of a streamed reply is sent as it comes in, and before an
+         * error reply that may follow it
+         */
+        msg = pmsg->peer;
+    } else if (req_error(conn, pmsg)) {
+        /* the error reply ends a streamed reply */
+        pmsg->stream = 0;
+
         msg = rsp_make_error(ctx, conn, pmsg);
         if (msg == NULL) {
             conn->err = errno;
@@ -363,6 +445,7 @@ void
 rsp_send_done(struct context *ctx, struct conn *conn, struct msg *msg)
 {
     struct msg *pmsg; /* peer message (request) */
+    struct mbuf *mbuf;
 
     ASSERT(conn->client && !conn->proxy);
     ASSERT(conn->smsg == NULL);
@@ -375,8 +458,18 @@ rsp_send_done(struct context *ctx, struct conn *conn, struct msg *msg)
     ASSERT(pmsg->peer == msg);
     ASSERT(pmsg->done && !pmsg->swallow);
 
+    if (rsp_stream_held(conn, pmsg)) {
+        /* streamed so far, keep the request until the rest of its reply */
+        while ((mbuf = STAILQ_FIRST(&msg->mhdr)) != NULL) {
+            mbuf_remove(&msg->mhdr, mbuf);
+            mbuf_put(mbuf);
+        }
+        msg->mlen = 0;
+        return;
+    }
+
     /* dequeue request from client outq */
-    conn->dequeue_outq(ctx, conn, pmsg);
+    conn->ops->dequeue_outq(ctx, conn, pmsg);
 
     req_put(pmsg);
 }
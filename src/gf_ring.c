@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2024-2024, yanruibinghxu@gmail.com All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <gf_core.h>
+
+/*
+ * Initialize ring r with room for n elements, n being rounded up to a
+ * power of 2
+ */
+rstatus_t
+ring_init(struct ring *r, uint32_t n)
+{
+    uint32_t nslot;
+
+    ASSERT(n != 0 && n <= (1U << 31));
+
+    for (nslot = 1; nslot < n; nslot <<= 1) {
+        continue;
+    }
+
+    r->elem = gf_alloc(nslot * sizeof(*r->elem));
+    if (r->elem == NULL) {
+        return GF_ENOMEM;
+    }
+
+    r->mask = nslot - 1;
+    r->tail = 0;
+    r->head_cache = 0;
+    r->head = 0;
+    r->tail_cache = 0;
+
+    return GF_OK;
+}
+
+void
+ring_deinit(struct ring *r)
+{
+    if (r->elem != NULL) {
+        gf_free(r->elem);
+        r->elem = NULL;
+    }
+}
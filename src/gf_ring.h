@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2024-2024, yanruibinghxu@gmail.com All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __GF_RING_H__
+#define __GF_RING_H__
+
+#include <gf_core.h>
+
+/*
+ * Bounded lock-free queue of pointers between exactly one producer thread
+ * and one consumer thread. Each side writes its own index only, on a cache
+ * line of its own, and keeps a cached copy of the index of the other side
+ * that it only reloads when the ring looks full or empty.
+ */
+struct ring {
+    void     **elem;     /* element slots */
+    uint32_t mask;       /* # slots - 1, # slots is a power of 2 */
+
+    uint32_t tail __attribute__((aligned(GF_CACHELINE_SIZE))); /* next slot to push */
+    uint32_t head_cache; /* head as last seen by the producer */
+
+    uint32_t head __attribute__((aligned(GF_CACHELINE_SIZE))); /* next slot to pop */
+    uint32_t tail_cache; /* tail as last seen by the consumer */
+} __attribute__((aligned(GF_CACHELINE_SIZE)));
+
+/*
+ * Push elem, on the producer thread. Return false if the ring is full.
+ */
+static inline bool
+ring_push(struct ring *r, void *elem)
+{
+    uint32_t tail = r->tail;
+
+    if (tail - r->head_cache > r->mask) {
+        r->head_cache = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if (tail - r->head_cache > r->mask) {
+            return false;
+        }
+    }
+
+    r->elem[tail & r->mask] = elem;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+/*
+ * Pop the oldest element, on the consumer thread. Return NULL if the ring
+ * is empty.
+ */
+static inline void *
+ring_pop(struct ring *r)
+{
+    uint32_t head = r->head;
+    void *elem;
+
+    if (head == r->tail_cache) {
+        r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if (head == r->tail_cache) {
+            return NULL;
+        }
+    }
+
+    elem = r->elem[head & r->mask];
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+    return elem;
+}
+
+/*
+ * Return true if the ring looks empty to the consumer thread
+ */
+static inline bool
+ring_empty(struct ring *r)
+{
+    return r->head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+rstatus_t ring_init(struct ring *r, uint32_t n);
+void ring_deinit(struct ring *r);
+
+#endif
@@ -25,6 +25,8 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
+#include <arpa/inet.h>
+
 #include <gf_core.h>
 #include <gf_conf.h>
 
@@ -77,6 +79,10 @@ server_unref(struct conn *conn)
 
     ASSERT(server->ns_conn_q > 0);
     server->ns_conn_q--;
+    if (conn->resp3) {
+        ASSERT(server->ns_resp3_conn_q > 0);
+        server->ns_resp3_conn_q--;
+    }
     TAILQ_REMOVE(&server->s_conn_q, conn, conn_tqe);
 
     log_debug(LOG_VVERB, "unref conn %p owner %p from '%.*s'", conn, server,
@@ -192,11 +198,19 @@ server_deinit(struct array *server)
     array_deinit(server);
 }
 
+/*
+ * Return a connection to server that speaks RESP3 if resp3 is true, or the
+ * default protocol otherwise. Replies are relayed to clients as they are
+ * read, so a client that switched to RESP3 with HELLO 3 is only served by
+ * connections that switched too; each protocol gets up to
+ * 'server_connections:' connections of its own.
+ */
 struct conn *
-server_conn(struct server *server)
+server_conn(struct server *server, bool resp3)
 {
     struct server_pool *pool;
     struct conn *conn;
+    uint32_t nconn;
 
     pool = server->owner;
 
@@ -205,16 +219,28 @@ server_conn(struct server *server)
      * balancing on it. Support multiple algorithms for
      * 'server_connections:' > 0 key
      */
-    if (server->ns_conn_q < pool->server_connections) {
-        return conn_get(server, false, pool->redis);
+    nconn = resp3 ? server->ns_resp3_conn_q :
+                    server->ns_conn_q - server->ns_resp3_conn_q;
+    if (nconn < pool->server_connections) {
+        conn = conn_get(server, false, pool->redis);
+        if (conn != NULL && resp3) {
+            conn->resp3 = 1;
+            server->ns_resp3_conn_q++;
+        }
+        return conn;
     }
-    ASSERT(server->ns_conn_q == pool->server_connections);
+    ASSERT(nconn == pool->server_connections);
 
     /*
-     * Pick a server connection from the head of the queue and insert
-     * it back into the tail of queue to maintain the lru order
+     * Pick the least recently used server connection of the protocol and
+     * insert it back into the tail of queue to maintain the lru order
      */
-    conn = TAILQ_FIRST(&server->s_conn_q);
+    TAILQ_FOREACH(conn, &server->s_conn_q, conn_tqe) {
+        if (conn->resp3 == resp3) {
+            break;
+        }
+    }
+    ASSERT(conn != NULL);
     ASSERT(!conn->client && !conn->proxy);
 
     TAILQ_REMOVE(&server->s_conn_q, conn, conn_tqe);
@@ -234,7 +260,7 @@ server_each_preconnect(void *elem, void *data)
     server = elem;
     pool = server->owner;
 
-    conn = server_conn(server);
+    conn = server_conn(server, false);
     if (conn == NULL) {
         return GF_ENOMEM;
     }
@@ -263,7 +289,7 @@ server_each_disconnect(void *elem, void *data)
         ASSERT(server->ns_conn_q > 0);
 
         conn = TAILQ_FIRST(&server->s_conn_q);
-        conn->close(pool->ctx, conn);
+        conn->ops->close(pool->ctx, conn);
     }
     return GF_OK;
 }
@@ -361,9 +387,9 @@ server_close(struct context *ctx, struct conn *conn)
                        conn->connected);
     conn->connected = false;
 
-    if (conn->sd > 0) {
+    if (conn->sd < 0) {
         server_failure(ctx, conn->owner);
-        conn->unref(conn);
+        conn->ops->unref(conn);
         conn_put(conn);
         return;
     }
@@ -372,7 +398,14 @@ server_close(struct context *ctx, struct conn *conn)
         nmsg = TAILQ_NEXT(msg, s_tqe);
 
         /* dequeue the message (request) from server inq */
-        conn->dequeue_inq(ctx, conn, msg);
+        conn->ops->dequeue_inq(ctx, conn, msg);
+
+        /* the frontend the request came from replies, if need be */
+        if (msg->chan != NULL) {
+            msg->err = conn->err;
+            backend_done(ctx, msg);
+            continue;
+        }
 
         /*
          * Don't send any error response, if
@@ -390,13 +423,10 @@ server_close(struct context *ctx, struct conn *conn)
             msg->done = 1;
             msg->error = 1;
             msg->err = conn->err;
-
-            if (msg->frag_owner != NULL) {
-                msg->frag_owner->nfrag_done++;
-            }
+            msg_frag_done(msg);
 
             if (req_done(c_conn, TAILQ_FIRST(&c_conn->omsg_q))) {
-                event_add_out(ctx->evb, msg->owner);
+                core_dirty(ctx, c_conn);
             }
 
             log_debug(LOG_INFO, "close s %d schedule error for req %"PRIu64" "
@@ -411,7 +441,13 @@ server_close(struct context *ctx, struct conn *conn)
         nmsg = TAILQ_NEXT(msg, s_tqe);
 
         /* dequeue the message (request) from server outq */
-        conn->dequeue_outq(ctx, conn, msg);
+        conn->ops->dequeue_outq(ctx, conn, msg);
+
+        if (msg->chan != NULL) {
+            msg->err = conn->err;
+            backend_done(ctx, msg);
+            continue;
+        }
 
         if (msg->swallow) {
             log_debug(LOG_INFO, "close s %d swallow req %"PRIu64" len %"PRIu32
@@ -424,12 +460,10 @@ server_close(struct context *ctx, struct conn *conn)
             msg->done = 1;
             msg->error = 1;
             msg->err = conn->err;
-            if (msg->frag_owner != NULL) {
-                msg->frag_owner->nfrag_done++;
-            }
+            msg_frag_done(msg);
 
             if (req_done(c_conn, TAILQ_FIRST(&c_conn->omsg_q))) {
-                event_add_out(ctx->evb, msg->owner);
+                core_dirty(ctx, c_conn);
             }
 
             log_debug(LOG_INFO, "close s %d schedule error for req %"PRIu64" "
@@ -455,7 +489,7 @@ server_close(struct context *ctx, struct conn *conn)
 
     server_failure(ctx, conn->owner);
 
-    conn->unref(conn);
+    conn->ops->unref(conn);
 
     status = close(conn->sd);
     if (status < 0) {
@@ -534,7 +568,7 @@ server_connect(struct context *ctx, struct server *server, struct conn *conn)
         log_error("connect on s %d to server '%.*s' failed: %s", conn->sd,
                   server->pname.len, server->pname.data, strerror(errno));
 
-        goto error;
+        goto error_del;
     }
 
     ASSERT(!conn->connecting);
@@ -542,8 +576,31 @@ server_connect(struct context *ctx, struct server *server, struct conn *conn)
     log_debug(LOG_INFO, "connected on s %d to server '%.*s'", conn->sd,
               server->pname.len, server->pname.data);
 
+    stats_server_incr(ctx, server, server_connections);
+
+    /* a connect that completed at once, e.g. on a unix socket, is set up here */
+    conn->ops->post_connect(ctx, conn, server);
+    if (conn->err != 0) {
+        errno = conn->err;
+        status = GF_ERROR;
+        goto error_del;
+    }
+
     return GF_OK;
 
+error_del:
+    /*
+     * Callers close the conn without going through core_close, and close()
+     * alone does not unregister sd from every event backend
+     */
+    conn->err = errno;
+    if (event_del_conn(ctx->evb, conn) < 0) {
+        log_warn("event del conn s %d failed, ignored: %s", conn->sd,
+                 strerror(errno));
+    }
+    errno = conn->err;
+    return status;
+
 error:
     conn->err = errno;
     return status;
@@ -562,7 +619,7 @@ server_connected(struct context *ctx, struct conn *conn)
     conn->connecting = 0;
     conn->connected = 1;
 
-    conn->post_connect(ctx, conn, server);
+    conn->ops->post_connect(ctx, conn, server);
 
     log_debug(LOG_INFO, "connected on s %d to server '%.*s'", conn->sd,
               server->pname.len, server->pname.data);
@@ -690,6 +747,10 @@ server_pool_idx(const struct server_pool *pool, const uint8_t *key, uint32_t key
     case DIST_RANDOM:
         idx = random_dispatch(pool->continuum, pool->ncontinuum, 0);
         break;
+    case DIST_REDIS_CLUSTER:
+        hash = hash_crc16((const char *)key, keylen);
+        idx = cluster_dispatch(pool->continuum, pool->ncontinuum, hash);
+        break;
     default:
         NOT_REACHED();
         return 0;
@@ -715,11 +776,10 @@ server_pool_server(struct server_pool *pool, const uint8_t *key, uint32_t keylen
 
 struct conn *
 server_pool_conn(struct context *ctx, struct server_pool *pool, const uint8_t *key,
-                 uint32_t keylen)
+                 uint32_t keylen, bool resp3)
 {
     rstatus_t status;
     struct server *server;
-    struct conn *conn;
 
     status = server_pool_update(pool);
     if (status != GF_OK) {
@@ -732,8 +792,19 @@ server_pool_conn(struct context *ctx, struct server_pool *pool, const uint8_t *k
         return NULL;
     }
 
-    /* pick a connection to a given server */
-    conn = server_conn(server);
+    return server_pool_server_conn(ctx, server, resp3);
+}
+
+/*
+ * Pick a connection to a given server, connecting it if it is not
+ */
+struct conn *
+server_pool_server_conn(struct context *ctx, struct server *server, bool resp3)
+{
+    rstatus_t status;
+    struct conn *conn;
+
+    conn = server_conn(server, resp3);
     if (conn == NULL) {
         return NULL;
     }
@@ -747,6 +818,67 @@ server_pool_conn(struct context *ctx, struct server_pool *pool, const uint8_t *k
     return conn;
 }
 
+/*
+ * Return the server of pool listening on {host, hostlen}:port, where host is
+ * either the hostname of the server in the configuration or its address, or
+ * NULL if there is none
+ */
+struct server *
+server_pool_lookup(const struct server_pool *pool, const uint8_t *host,
+                   uint32_t hostlen, uint16_t port)
+{
+    struct server *server;
+    uint32_t i, nserver;
+    char addr[INET6_ADDRSTRLEN];
+    union {
+        struct in_addr  in;
+        struct in6_addr in6;
+    } ip;
+    int family;
+
+    family = AF_UNSPEC;
+    if (hostlen < sizeof(addr)) {
+        gf_memcpy(addr, host, hostlen);
+        addr[hostlen] = '\0';
+        if (inet_pton(AF_INET, addr, &ip.in) == 1) {
+            family = AF_INET;
+        } else if (inet_pton(AF_INET6, addr, &ip.in6) == 1) {
+            family = AF_INET6;
+        }
+    }
+
+    nserver = array_n(&pool->server);
+    for (i = 0; i < nserver; i++) {
+        server = array_get(&pool->server, i);
+
+        if (server->port != port) {
+            continue;
+        }
+
+        if (server->addrstr.len == hostlen &&
+            gf_strncmp(server->addrstr.data, host, hostlen) == 0) {
+            return server;
+        }
+
+        if (family != server->info.family) {
+            continue;
+        }
+
+        if (family == AF_INET &&
+            server->info.addr.in.sin_addr.s_addr == ip.in.s_addr) {
+            return server;
+        }
+
+        if (family == AF_INET6 &&
+            memcmp(&server->info.addr.in6.sin6_addr, &ip.in6,
+                   sizeof(ip.in6)) == 0) {
+            return server;
+        }
+    }
+
+    return NULL;
+}
+
 static rstatus_t
 server_pool_each_preconnect(void *elem, void *data)
 {
@@ -833,6 +965,8 @@ server_pool_run(struct server_pool *pool)
         return modula_update(pool);
     case DIST_RANDOM:
         return random_update(pool);
+    case DIST_REDIS_CLUSTER:
+        return cluster_update(pool);
     default:
         NOT_REACHED();
         return GF_ERROR;
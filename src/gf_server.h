@@ -88,6 +88,7 @@ struct server {
     struct sockinfo    info;          /* server socket info */
 
     uint32_t           ns_conn_q;     /* # server connection */
+    uint32_t           ns_resp3_conn_q; /* # server connection speaking RESP3 */
     struct conn_tqh    s_conn_q;      /* server connection q */
 
     int64_t            next_retry;    /* next retry time in usec */
@@ -108,6 +109,7 @@ struct server_pool {
     struct continuum   *continuum;           /* continuum */
     uint32_t           nlive_server;         /* # live server */
     int64_t            next_rebuild;         /* next distribution rebuild time in usec */
+    int64_t            next_slots_refresh;   /* next redis cluster slot map refresh time in usec */
 
     struct string      name;                 /* pool name (ref in conf_pool) */
     struct string      addrstr;              /* pool address - hostname:port (ref in conf_pool) */
@@ -122,6 +124,8 @@ struct server_pool {
     int                backlog;              /* listen backlog */
     int                redis_db;             /* redis database to connect to */
     uint32_t           client_connections;   /* maximum # client connection */
+    uint32_t           client_output_buffer_limit;  /* max response bytes queued for a client, 0 for none */
+    uint32_t           client_max_pending_requests; /* max # requests queued for a client, 0 for none */
     uint32_t           server_connections;   /* maximum # server connection */
     int64_t            server_retry_timeout; /* server retry timeout in usec */
     uint32_t           server_failure_limit; /* server failure limit */
@@ -130,6 +134,7 @@ struct server_pool {
     unsigned           auto_eject_hosts:1;   /* auto_eject_hosts? */
     unsigned           preconnect:1;         /* preconnect? */
     unsigned           redis:1;              /* redis? */
+    unsigned           binary:1;             /* memcache binary protocol? */
     unsigned           tcpkeepalive:1;       /* tcpkeepalive? */
     unsigned           reuseport:1;          /* set SO_REUSEPORT to socket */
 };
@@ -140,14 +145,16 @@ int server_timeout(struct conn *conn);
 bool server_active(const struct conn *conn);
 rstatus_t server_init(struct array *server, struct array *conf_server, struct server_pool *sp);
 void server_deinit(struct array *server);
-struct conn *server_conn(struct server *server);
+struct conn *server_conn(struct server *server, bool resp3);
 rstatus_t server_connect(struct context *ctx, struct server *server, struct conn *conn);
 void server_close(struct context *ctx, struct conn *conn);
 void server_connected(struct context *ctx, struct conn *conn);
 void server_ok(struct context *ctx, struct conn *conn);
 
 uint32_t server_pool_idx(const struct server_pool *pool, const uint8_t *key, uint32_t keylen);
-struct conn *server_pool_conn(struct context *ctx, struct server_pool *pool, const uint8_t *key, uint32_t keylen);
+struct conn *server_pool_conn(struct context *ctx, struct server_pool *pool, const uint8_t *key, uint32_t keylen, bool resp3);
+struct conn *server_pool_server_conn(struct context *ctx, struct server *server, bool resp3);
+struct server *server_pool_lookup(const struct server_pool *pool, const uint8_t *host, uint32_t hostlen, uint16_t port);
 rstatus_t server_pool_run(struct server_pool *pool);
 rstatus_t server_pool_preconnect(struct context *ctx);
 void server_pool_disconnect(struct context *ctx);
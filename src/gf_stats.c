@@ -364,6 +364,30 @@ stats_create_buf(struct stats *st)
     size += int64_max_digits;
     size += key_value_extra;
 
+    size += st->nmbuf_str.len;
+    size += int64_max_digits;
+    size += key_value_extra;
+
+    size += st->nmbuf_max_str.len;
+    size += int64_max_digits;
+    size += key_value_extra;
+
+    size += st->nmsg_str.len;
+    size += int64_max_digits;
+    size += key_value_extra;
+
+    size += st->nmsg_max_str.len;
+    size += int64_max_digits;
+    size += key_value_extra;
+
+    size += st->nconn_str.len;
+    size += int64_max_digits;
+    size += key_value_extra;
+
+    size += st->nconn_max_str.len;
+    size += int64_max_digits;
+    size += key_value_extra;
+
     /* server pools */
     for (i = 0; i < array_n(&st->sum); i++) {
         struct stats_pool *stp = array_get(&st->sum, i);
@@ -521,6 +545,36 @@ stats_add_header(struct stats *st)
         return status;
     }
 
+    status = stats_add_num(st, &st->nmbuf_str, mbuf_nmapped_bytes());
+    if (status != GF_OK) {
+        return status;
+    }
+
+    status = stats_add_num(st, &st->nmbuf_max_str, mbuf_nmapped_bytes_max());
+    if (status != GF_OK) {
+        return status;
+    }
+
+    status = stats_add_num(st, &st->nmsg_str, msg_nalloc());
+    if (status != GF_OK) {
+        return status;
+    }
+
+    status = stats_add_num(st, &st->nmsg_max_str, msg_nalloc_max());
+    if (status != GF_OK) {
+        return status;
+    }
+
+    status = stats_add_num(st, &st->nconn_str, conn_nalloc());
+    if (status != GF_OK) {
+        return status;
+    }
+
+    status = stats_add_num(st, &st->nconn_max_str, conn_nalloc_max());
+    if (status != GF_OK) {
+        return status;
+    }
+
     return GF_OK;
 }
 
@@ -657,29 +711,34 @@ stats_aggregate_metric(struct array *dst, const struct array *src)
     }
 }
 
+/*
+ * Aggregate stats shadow (b) of src, which is st itself or one of its
+ * children, to sum (c) of st
+ */
 static void
-stats_aggregate(struct stats *st)
+stats_aggregate_shadow(struct stats *st, struct stats *src)
 {
     uint32_t i;
 
-    if (st->aggregate == 0) {
+    if (src->aggregate == 0) {
         log_debug(LOG_PVERB, "skip aggregate of shadow %p to sum %p as "
-                  "generator is slow", st->shadow.elem, st->sum.elem);
+                  "generator is slow", src->shadow.elem, st->sum.elem);
         return;
     }
 
-    log_debug(LOG_PVERB, "aggregate stats shadow %p to sum %p", st->shadow.elem,
-              st->sum.elem);
+    log_debug(LOG_PVERB, "aggregate stats shadow %p to sum %p",
+              src->shadow.elem, st->sum.elem);
 
-    for (i = 0; i < array_n(&st->shadow); i++) {
+    for (i = 0; i < array_n(&src->shadow); i++) {
         struct stats_pool *stp1, *stp2;
-        uint32_t j;
+        uint32_t j, nserver;
 
-        stp1 = array_get(&st->shadow, i);
+        stp1 = array_get(&src->shadow, i);
         stp2 = array_get(&st->sum, i);
         stats_aggregate_metric(&stp2->metric, &stp1->metric);
 
-        for (j = 0; j < array_n(&stp1->server); j++) {
+        nserver = MIN(array_n(&stp1->server), array_n(&stp2->server));
+        for (j = 0; j < nserver; j++) {
             struct stats_server *sts1, *sts2;
 
             sts1 = array_get(&stp1->server, j);
@@ -688,7 +747,70 @@ stats_aggregate(struct stats *st)
         }
     }
 
-    st->aggregate = 0;
+    src->aggregate = 0;
+}
+
+static void
+stats_aggregate(struct stats *st)
+{
+    uint32_t i;
+
+    stats_aggregate_shadow(st, st);
+
+    pthread_mutex_lock(&st->child_lock);
+    for (i = 0; i < array_n(&st->child); i++) {
+        struct stats **child = array_get(&st->child, i);
+
+        stats_aggregate_shadow(st, *child);
+    }
+    pthread_mutex_unlock(&st->child_lock);
+}
+
+/*
+ * Have the stats of another event loop served by parent
+ */
+static rstatus_t
+stats_link(struct stats *parent, struct stats *st)
+{
+    struct stats **child;
+
+    ASSERT(array_n(&parent->sum) == array_n(&st->shadow));
+
+    pthread_mutex_lock(&parent->child_lock);
+    child = array_push(&parent->child);
+    if (child != NULL) {
+        *child = st;
+    }
+    pthread_mutex_unlock(&parent->child_lock);
+
+    if (child == NULL) {
+        return GF_ENOMEM;
+    }
+
+    st->parent = parent;
+
+    return GF_OK;
+}
+
+static void
+stats_unlink(struct stats *st)
+{
+    struct stats *parent = st->parent;
+    uint32_t i;
+
+    pthread_mutex_lock(&parent->child_lock);
+    for (i = 0; i < array_n(&parent->child); i++) {
+        struct stats **child = array_get(&parent->child, i);
+
+        if (*child == st) {
+            *child = *(struct stats **)array_top(&parent->child);
+            array_pop(&parent->child);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&parent->child_lock);
+
+    st->parent = NULL;
 }
 
 static rstatus_t
@@ -884,9 +1006,15 @@ stats_stop_aggregator(struct stats *st)
     close(st->sd);
 }
 
+/*
+ * Create the stats of an event loop. The stats of the first one serve the
+ * stats port; those of the other event loops are handed their parent and
+ * only collect metrics for it to aggregate.
+ */
 struct stats *
 stats_create(uint16_t stats_port, const char *stats_ip, int stats_interval,
-             const char *source, const struct array *server_pool)
+             const char *source, const struct array *server_pool,
+             struct stats *parent)
 {
     rstatus_t status;
     struct stats *st;
@@ -913,6 +1041,10 @@ stats_create(uint16_t stats_port, const char *stats_ip, int stats_interval,
     st->tid = (pthread_t) -1;
     st->sd = -1;
 
+    st->parent = NULL;
+    array_null(&st->child);
+    pthread_mutex_init(&st->child_lock, NULL);
+
     string_set_text(&st->service_str, "service");
     string_set_text(&st->service, "nutcracker");
 
@@ -928,6 +1060,15 @@ stats_create(uint16_t stats_port, const char *stats_ip, int stats_interval,
     string_set_text(&st->ntotal_conn_str, "total_connections");
     string_set_text(&st->ncurr_conn_str, "curr_connections");
 
+    string_set_text(&st->nmbuf_str, "mbuf_bytes");
+    string_set_text(&st->nmbuf_max_str, "max_mbuf_bytes");
+
+    string_set_text(&st->nmsg_str, "alloc_msgs");
+    string_set_text(&st->nmsg_max_str, "max_alloc_msgs");
+
+    string_set_text(&st->nconn_str, "alloc_conns");
+    string_set_text(&st->nconn_max_str, "max_alloc_conns");
+
     st->updated = 0;
     st->aggregate = 0;
 
@@ -943,6 +1084,19 @@ stats_create(uint16_t stats_port, const char *stats_ip, int stats_interval,
         goto error;
     }
 
+    if (parent != NULL) {
+        status = stats_link(parent, st);
+        if (status != GF_OK) {
+            goto error;
+        }
+        return st;
+    }
+
+    status = array_init(&st->child, 1, sizeof(struct stats *));
+    if (status != GF_OK) {
+        goto error;
+    }
+
     status = stats_pool_map(&st->sum, server_pool);
     if (status != GF_OK) {
         goto error;
@@ -968,7 +1122,13 @@ error:
 void
 stats_destroy(struct stats *st)
 {
-    stats_stop_aggregator(st);
+    if (st->parent != NULL) {
+        stats_unlink(st);
+    } else {
+        stats_stop_aggregator(st);
+    }
+    array_deinit(&st->child);
+    pthread_mutex_destroy(&st->child_lock);
     stats_pool_unmap(&st->sum);
     stats_pool_unmap(&st->shadow);
     stats_pool_unmap(&st->current);
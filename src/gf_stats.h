@@ -35,6 +35,8 @@
     ACTION( client_eof,             STATS_COUNTER,      "# eof on client connections")                              \
     ACTION( client_err,             STATS_COUNTER,      "# errors on client connections")                           \
     ACTION( client_connections,     STATS_GAUGE,        "# active client connections")                              \
+    ACTION( client_throttled,       STATS_COUNTER,      "# times reading from a client was paused")                 \
+    ACTION( client_epoll_ctl,       STATS_COUNTER,      "# epoll_ctl calls on client and proxy connections")        \
     /* pool behavior */                                                                                             \
     ACTION( server_ejects,          STATS_COUNTER,      "# times backend server was ejected")                       \
     /* forwarder behavior */                                                                                        \
@@ -46,6 +48,8 @@
     ACTION( server_eof,             STATS_COUNTER,      "# eof on server connections")                              \
     ACTION( server_err,             STATS_COUNTER,      "# errors on server connections")                           \
     ACTION( server_timedout,        STATS_COUNTER,      "# timeouts on server connections")                         \
+    ACTION( server_epoll_ctl,       STATS_COUNTER,      "# epoll_ctl calls on server connections")                  \
+    ACTION( redirects,              STATS_COUNTER,      "# requests redirected to another server")                  \
     ACTION( server_connections,     STATS_GAUGE,        "# active server connections")                              \
     ACTION( server_ejected_at,      STATS_TIMESTAMP,    "timestamp when server was ejected in usec since epoch")    \
     /* data behavior */                                                                                             \
@@ -111,6 +115,10 @@ struct stats {
     pthread_t           tid;             /* stats aggregator thread */
     int                 sd;              /* stats descriptor */
 
+    struct stats        *parent;         /* stats serving this one or NULL */
+    struct array        child;           /* stats *[] of other event loops */
+    pthread_mutex_t     child_lock;      /* child[] lock */
+
     struct string       service_str;     /* service string */
     struct string       service;         /* service */
     struct string       source_str;      /* source string */
@@ -121,6 +129,12 @@ struct stats {
     struct string       timestamp_str;   /* timestamp string */
     struct string       ntotal_conn_str; /* total connections string */
     struct string       ncurr_conn_str;  /* curr connections string */
+    struct string       nmbuf_str;       /* allocated mbuf bytes string */
+    struct string       nmbuf_max_str;   /* max allocated mbuf bytes string */
+    struct string       nmsg_str;        /* allocated msgs string */
+    struct string       nmsg_max_str;    /* max allocated msgs string */
+    struct string       nconn_str;       /* allocated conns string */
+    struct string       nconn_max_str;   /* max allocated conns string */
 
     volatile int        aggregate;       /* shadow (b) aggregate? */
     volatile int        updated;         /* current (a) updated? */
@@ -211,7 +225,7 @@ void _stats_server_incr_by(struct context *ctx, const struct server *server, sta
 void _stats_server_decr_by(struct context *ctx, const struct server *server, stats_server_field_t fidx, int64_t val);
 void _stats_server_set_ts(struct context *ctx, const struct server *server, stats_server_field_t fidx, int64_t val);
 
-struct stats *stats_create(uint16_t stats_port, const char *stats_ip, int stats_interval, const char *source, const struct array *server_pool);
+struct stats *stats_create(uint16_t stats_port, const char *stats_ip, int stats_interval, const char *source, const struct array *server_pool, struct stats *parent);
 void stats_destroy(struct stats *stats);
 void stats_swap(struct stats *stats);
 
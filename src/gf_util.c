@@ -273,6 +273,25 @@ void *_gf_realloc(void *ptr, size_t size, const char *name, int line) {
     return p;
 }
 
+void *_gf_memalign(size_t alignment, size_t size, const char *name, int line) {
+    void *p;
+    int err;
+
+    ASSERT(size != 0);
+
+    err = posix_memalign(&p, alignment, size);
+    if (err != 0) {
+        log_error("posix_memalign(%zu, %zu) failed @ %s:%d", alignment, size,
+                  name, line);
+        return NULL;
+    }
+
+    log_debug(LOG_VVERB, "posix_memalign(%zu, %zu) at %p @ %s:%d", alignment,
+              size, p, name, line);
+
+    return p;
+}
+
 void _gf_free(void *ptr, const char *name, int line) {
     ASSERT(ptr != NULL);
     log_debug(LOG_VVERB, "free(%p) @ %s:%d", ptr, name, line);
@@ -86,6 +86,7 @@
  * of 2.
  */
 #define GF_ALIGNMENT        sizeof(unsigned long) /* platform word */
+#define GF_CACHELINE_SIZE   64                    /* cpu cache line */
 #define GF_ALIGN(d, n)      (((d) + (n - 1)) & ~(n - 1))
 #define GF_ALIGN_PTR(p, n)  \
     (void *) (((uintptr_t) (p) + ((uintptr_t) n - 1)) & ~((uintptr_t) n - 1))
@@ -130,6 +131,40 @@
 #define gf_gethostname(_name, _len) gethostname((char*)_name, (size_t)_len)
 #define gf_atoi(_line, _n)          _gf_atoi((uint8_t *)_line, (size_t)_n)
 
+/*
+ * Counters shared by the event loop threads. They only feed stats and
+ * limits, so relaxed ordering is enough.
+ */
+#define gf_atomic_add(_p, _n)   __atomic_add_fetch(_p, _n, __ATOMIC_RELAXED)
+#define gf_atomic_sub(_p, _n)   __atomic_sub_fetch(_p, _n, __ATOMIC_RELAXED)
+#define gf_atomic_get(_p)       __atomic_load_n(_p, __ATOMIC_RELAXED)
+
+#define gf_atomic_max(_p, _v) do {                                          \
+    __typeof__(*(_p)) _n = (_v);                                            \
+    __typeof__(*(_p)) _o = __atomic_load_n(_p, __ATOMIC_RELAXED);           \
+    while (_o < _n &&                                                       \
+           !__atomic_compare_exchange_n(_p, &_o, _n, true,                  \
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)); \
+} while (0)
+
+/*
+ * Lock-free multi-producer single-consumer stack of objects linked through
+ * their _next pointer. Any thread pushes one, and the thread that owns the
+ * stack takes all of them at once, so the ABA problem cannot arise.
+ */
+#define gf_mpsc_push(_head, _elem, _next) do {                              \
+    __typeof__(*(_head)) _h = __atomic_load_n(_head, __ATOMIC_RELAXED);     \
+    do {                                                                    \
+        (_next) = _h;                                                       \
+    } while (!__atomic_compare_exchange_n(_head, &_h, _elem, true,          \
+                                          __ATOMIC_RELEASE,                 \
+                                          __ATOMIC_RELAXED));               \
+} while (0)
+
+#define gf_mpsc_take(_head)     __atomic_exchange_n(_head, NULL, __ATOMIC_ACQUIRE)
+
+#define gf_mpsc_empty(_head)    (__atomic_load_n(_head, __ATOMIC_RELAXED) == NULL)
+
 
 int gf_set_blocking(int sd);
 int gf_set_nonblocking(int sd);
@@ -163,6 +198,9 @@ bool gf_valid_port(int n);
 #define gf_realloc(_p, _s)              \
     _gf_realloc(_p, (size_t)(_s), __FILE__, __LINE__)
 
+#define gf_memalign(_a, _s)             \
+    _gf_memalign((size_t)(_a), (size_t)(_s), __FILE__, __LINE__)
+
 #define gf_free(_p) do {                \
     _gf_free(_p, __FILE__, __LINE__);   \
     (_p) = NULL;                        \
@@ -173,6 +211,7 @@ void *_gf_alloc(size_t size, const char *name, int line);
 void *_gf_zalloc(size_t size, const char *name, int line);
 void *_gf_calloc(size_t nmemb, size_t size, const char *name, int line);
 void *_gf_realloc(void *ptr, size_t size, const char *name, int line);
+void *_gf_memalign(size_t alignment, size_t size, const char *name, int line);
 void _gf_free(void *ptr, const char *name, int line);
 
 /*
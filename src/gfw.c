@@ -31,6 +31,8 @@
 #include <signal.h>
 #include <getopt.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <sys/stat.h>
 #include <sys/utsname.h>
 
@@ -48,8 +50,22 @@
 #define GF_STATS_INTERVAL   STATS_INTERVAL
 #define GF_PID_FILE         NULL
 #define GF_MBUF_SIZE        MBUF_SIZE
+#define GF_MBUF_PREALLOC    0
+#define GF_FREE_MAX         UINT32_MAX
 #define GF_MBUF_MIN_SIZE    MBUF_MIN_SIZE
 #define GF_MBUF_MAX_SIZE    MBUF_MAX_SIZE
+#define GF_THREADS          1
+#define GF_MAX_THREADS      256
+#define GF_BACKEND_THREADS  0
+#define GF_MAX_BACKEND_THREADS 64
+
+#ifdef GF_HAVE_IO_URING
+# define GF_EVENT_URING     1
+# define GF_EVENT_BACKEND   "io_uring"
+#else
+# define GF_EVENT_URING     0
+# define GF_EVENT_BACKEND   "epoll"
+#endif
 
 static int show_help;
 static int show_version;
@@ -57,6 +73,19 @@ static int test_conf;
 static int daemonize;
 static int describe_stats;
 
+struct worker {
+    pthread_t       tid;     /* worker thread */
+    struct instance nci;     /* instance copy of the worker */
+    struct context  *ctx;    /* context of the first event loop */
+    sem_t           ready;   /* posted once the worker has started */
+    rstatus_t       status;  /* start status */
+    bool            backend; /* backend I/O thread? */
+    struct context  *loop;   /* context of the worker */
+    sem_t           go;      /* posted once a backend may run (backend) */
+};
+
+static struct worker *backends;  /* backend I/O threads */
+
 static const struct option long_options[] = {
     { "help",           no_argument,        NULL,   'h' },
     { "version",        no_argument,        NULL,   'V' },
@@ -71,10 +100,18 @@ static const struct option long_options[] = {
     { "stats-addr",     required_argument,  NULL,   'a' },
     { "pid-file",       required_argument,  NULL,   'p' },
     { "mbuf-size",      required_argument,  NULL,   'm' },
+    { "mbuf-prealloc",  required_argument,  NULL,   'M' },
+    { "mbuf-hugepage",  required_argument,  NULL,   'H' },
+    { "mbuf-free-max",  required_argument,  NULL,   'b' },
+    { "msg-free-max",   required_argument,  NULL,   'q' },
+    { "conn-free-max",  required_argument,  NULL,   'n' },
+    { "event-backend",  required_argument,  NULL,   'e' },
+    { "threads",        required_argument,  NULL,   'T' },
+    { "backend-threads", required_argument, NULL,   'B' },
     { NULL,             0,                  NULL,    0  }
 };
 
-static const char short_options[] = "hVtdDv:o:c:s:i:a:p:m:";
+static const char short_options[] = "hVtdDv:o:c:s:i:a:p:m:M:H:b:q:n:e:T:B:";
 
 static rstatus_t
 gf_daemonize(int dump_core)
@@ -208,6 +245,9 @@ gf_show_usage(void)
         "Usage: gfw [-?hVdDt] [-v verbosity level] [-o output file]" CRLF
         "           [-c conf file] [-s stats port] [-a stats addr]" CRLF
         "           [-i stats interval] [-p pid file] [-m mbuf size]" CRLF
+        "           [-M mbuf prealloc] [-H mbuf hugepage]" CRLF
+        "           [-b mbuf free max] [-q msg free max] [-n conn free max]" CRLF
+        "           [-e event backend] [-T threads] [-B backend threads]" CRLF
         "");
     log_stderr(
         "Options:" CRLF
@@ -223,15 +263,25 @@ gf_show_usage(void)
         "  -s, --stats-port=N     : set stats monitoring port (default: %d)" CRLF
         "  -a, --stats-addr=S     : set stats monitoring ip (default: %s)" CRLF
         "  -i, --stats-interval=N : set stats aggregation interval in msec (default: %d msec)" CRLF
-        "  -p, --pid-file=S       : set pid file (default: %s)" CRLF
-        "  -m, --mbuf-size=N      : set size of mbuf chunk in bytes (default: %d bytes)" CRLF
-        "",
+        "  -p, --pid-file=S       : set pid file (default: %s)",
         GF_LOG_DEFAULT, GF_LOG_MIN, GF_LOG_MAX,
         GF_LOG_PATH != NULL ? GF_LOG_PATH : "stderr",
         GF_CONF_PATH,
         GF_STATS_PORT, GF_STATS_ADDR, GF_STATS_INTERVAL,
-        GF_PID_FILE != NULL ? GF_PID_FILE : "off",
-        GF_MBUF_SIZE);
+        GF_PID_FILE != NULL ? GF_PID_FILE : "off");
+    log_stderr(
+        "  -m, --mbuf-size=N      : set size of mbuf chunk in bytes (default: %d bytes)" CRLF
+        "  -M, --mbuf-prealloc=N  : set # mbufs preallocated at startup (default: %d)" CRLF
+        "  -H, --mbuf-hugepage=S  : set huge pages for mbufs: off, thp or hugetlb (default: off)" CRLF
+        "  -b, --mbuf-free-max=N  : set max # free mbufs kept per size class (default: unlimited)" CRLF
+        "  -q, --msg-free-max=N   : set max # free messages kept (default: unlimited)" CRLF
+        "  -n, --conn-free-max=N  : set max # free connections kept (default: unlimited)" CRLF
+        "  -e, --event-backend=S  : set event backend: epoll, epoll_et or io_uring (default: %s)" CRLF
+        "  -T, --threads=N        : set # event loop threads (default: %d, max: %d)" CRLF
+        "  -B, --backend-threads=N: set # backend I/O threads owning the server connections (default: %d, max: %d)" CRLF
+        "",
+        GF_MBUF_SIZE, GF_MBUF_PREALLOC, GF_EVENT_BACKEND, GF_THREADS,
+        GF_MAX_THREADS, GF_BACKEND_THREADS, GF_MAX_BACKEND_THREADS);
 }
 
 static rstatus_t
@@ -297,6 +347,15 @@ gf_set_default_options(struct instance *nci)
 
     nci->hostname[GF_MAXHOSTNAMELEN-1] = '\0';
     nci->mbuf_chunk_size = GF_MBUF_SIZE;
+    nci->mbuf_prealloc = GF_MBUF_PREALLOC;
+    nci->mbuf_hugepage = MBUF_HUGEPAGE_OFF;
+    nci->mbuf_free_max = GF_FREE_MAX;
+    nci->msg_free_max = GF_FREE_MAX;
+    nci->conn_free_max = GF_FREE_MAX;
+    nci->event_uring = GF_EVENT_URING;
+    nci->event_et = 0;
+    nci->nthread = GF_THREADS;
+    nci->nbackend = GF_BACKEND_THREADS;
     nci->pid = (pid_t)-1;
     nci->pid_filename = NULL;
     nci->pidfile = 0;
@@ -388,6 +447,100 @@ gf_get_options(int argc, char **argv, struct instance *nci)
             }
             nci->mbuf_chunk_size = (size_t)value;
             break;
+        case 'M':
+            value = gf_atoi(optarg, strlen(optarg));
+            if (value < 0) {
+                log_stderr("gfw: option -M requires a number");
+                return GF_ERROR;
+            }
+            nci->mbuf_prealloc = (uint32_t)value;
+            break;
+        case 'H':
+            if (strcmp(optarg, "off") == 0) {
+                nci->mbuf_hugepage = MBUF_HUGEPAGE_OFF;
+            } else if (strcmp(optarg, "thp") == 0) {
+                nci->mbuf_hugepage = MBUF_HUGEPAGE_THP;
+            } else if (strcmp(optarg, "hugetlb") == 0) {
+                nci->mbuf_hugepage = MBUF_HUGEPAGE_HUGETLB;
+            } else {
+                log_stderr("gfw: option -H must be one of off, thp or "
+                           "hugetlb");
+                return GF_ERROR;
+            }
+            break;
+        case 'b':
+        case 'q':
+        case 'n':
+            value = gf_atoi(optarg, strlen(optarg));
+            if (value < 0) {
+                log_stderr("gfw: option -%c requires a number", c);
+                return GF_ERROR;
+            }
+            if (c == 'b') {
+                nci->mbuf_free_max = (uint32_t)value;
+            } else if (c == 'q') {
+                nci->msg_free_max = (uint32_t)value;
+            } else {
+                nci->conn_free_max = (uint32_t)value;
+            }
+            break;
+        case 'e':
+            if (strcmp(optarg, "epoll") == 0) {
+                nci->event_uring = 0;
+                nci->event_et = 0;
+            } else if (strcmp(optarg, "epoll_et") == 0) {
+#ifdef GF_HAVE_EPOLL
+                nci->event_uring = 0;
+                nci->event_et = 1;
+#else
+                log_stderr("gfw: epoll_et event backend requires epoll");
+                return GF_ERROR;
+#endif
+            } else if (strcmp(optarg, "io_uring") == 0) {
+#ifdef GF_HAVE_IO_URING
+                nci->event_uring = 1;
+                nci->event_et = 0;
+#else
+                log_stderr("gfw: io_uring event backend requires "
+                           "configuring with --with-io_uring");
+                return GF_ERROR;
+#endif
+            } else {
+                log_stderr("gfw: option -e must be one of epoll, epoll_et or "
+                           "io_uring");
+                return GF_ERROR;
+            }
+            break;
+        case 'T':
+            value = gf_atoi(optarg, strlen(optarg));
+            if (value <= 0) {
+                log_stderr("gfw: option -T requires a non-zero number");
+                return GF_ERROR;
+            }
+
+            if (value > GF_MAX_THREADS) {
+                log_stderr("gfw: # threads must be at most %d",
+                           GF_MAX_THREADS);
+                return GF_ERROR;
+            }
+
+            nci->nthread = (uint32_t)value;
+            break;
+        case 'B':
+            value = gf_atoi(optarg, strlen(optarg));
+            if (value < 0) {
+                log_stderr("gfw: option -B requires a number");
+                return GF_ERROR;
+            }
+
+            if (value > GF_MAX_BACKEND_THREADS) {
+                log_stderr("gfw: # backend threads must be at most %d",
+                           GF_MAX_BACKEND_THREADS);
+                return GF_ERROR;
+            }
+
+            nci->nbackend = (uint32_t)value;
+            break;
         case '?':
             switch (optopt) {
             case 'o':
@@ -396,12 +549,20 @@ gf_get_options(int argc, char **argv, struct instance *nci)
                 log_stderr("gfw: option -%c requires a file name", optopt);
                 break;
             case 'm':
+            case 'M':
+            case 'b':
+            case 'q':
+            case 'n':
+            case 'T':
+            case 'B':
             case 'v':
             case 's':
             case 'i':
                 log_stderr("gfw: option -%c requires a number", optopt);
                 break;
             case 'a':
+            case 'H':
+            case 'e':
                 log_stderr("gfw: option -%c requires a string", optopt);
                 break;
             default:
@@ -481,17 +642,191 @@ gf_post_run(struct instance *nci)
     log_deinit();
 }
 
+/*
+ * Attach event loop ctx to every backend I/O thread
+ */
+static rstatus_t
+gf_attach_backends(struct instance *nci, struct context *ctx)
+{
+    rstatus_t status;
+    uint32_t i;
+
+    for (i = 0; i < nci->nbackend; i++) {
+        status = backend_attach(ctx, backends[i].loop);
+        if (status != GF_OK) {
+            return status;
+        }
+    }
+
+    return GF_OK;
+}
+
+static void *
+gf_worker_run(void *arg)
+{
+    struct worker *w = arg;
+    struct context *ctx;
+
+    ctx = core_start(&w->nci, w->ctx, w->backend);
+    w->status = ctx != NULL ? GF_OK : GF_ERROR;
+    if (ctx != NULL && !w->backend) {
+        w->status = gf_attach_backends(&w->nci, ctx);
+    }
+    w->loop = ctx;
+    sem_post(&w->ready);
+    if (w->status != GF_OK) {
+        return NULL;
+    }
+
+    /* a backend runs once every event loop is attached to it */
+    if (w->backend) {
+        while (sem_wait(&w->go) < 0 && errno == EINTR) {
+            continue;
+        }
+    }
+
+    for (;;) {
+        if (core_loop(ctx) != GF_OK) {
+            break;
+        }
+    }
+
+    /* other threads still hand requests over to this context until exit */
+    if (w->nci.nbackend != 0) {
+        return NULL;
+    }
+
+    core_stop(ctx);
+
+    return NULL;
+}
+
+/*
+ * Start worker thread w and wait for it to be up
+ */
+static rstatus_t
+gf_start_worker(struct worker *w, struct instance *nci, struct context *ctx,
+                bool backend)
+{
+    int status;
+
+    w->nci = *nci;
+    w->ctx = ctx;
+    w->status = GF_ERROR;
+    w->backend = backend;
+    w->loop = NULL;
+    sem_init(&w->ready, 0, 0);
+    sem_init(&w->go, 0, 0);
+
+    status = pthread_create(&w->tid, NULL, gf_worker_run, w);
+    if (status != 0) {
+        log_error("create of %s thread failed: %s",
+                  backend ? "backend I/O" : "event loop", strerror(status));
+        return GF_ERROR;
+    }
+
+    while (sem_wait(&w->ready) < 0 && errno == EINTR) {
+        continue;
+    }
+    sem_destroy(&w->ready);
+
+    return w->status;
+}
+
+/*
+ * Start the backend I/O threads, if any. They own the server connections
+ * of all event loops, and wait for all of them to be attached to run.
+ */
+static rstatus_t
+gf_start_backends(struct instance *nci, struct context *ctx)
+{
+    rstatus_t status;
+    uint32_t i;
+
+    if (nci->nbackend == 0) {
+        return GF_OK;
+    }
+
+    backends = gf_calloc(nci->nbackend, sizeof(*backends));
+    if (backends == NULL) {
+        return GF_ENOMEM;
+    }
+
+    for (i = 0; i < nci->nbackend; i++) {
+        status = gf_start_worker(&backends[i], nci, ctx, true);
+        if (status != GF_OK) {
+            log_error("start of backend I/O thread %"PRIu32" failed", i);
+            return GF_ERROR;
+        }
+    }
+
+    return gf_attach_backends(nci, ctx);
+}
+
+/*
+ * Start the event loops other than the first one, each on its own thread.
+ * They listen on the same addresses as the first one and keep running until
+ * the process exits.
+ */
+static rstatus_t
+gf_start_workers(struct instance *nci, struct context *ctx)
+{
+    rstatus_t status;
+    struct worker *worker;
+    uint32_t i;
+
+    if (nci->nthread > 1) {
+        worker = gf_calloc(nci->nthread - 1, sizeof(*worker));
+        if (worker == NULL) {
+            return GF_ENOMEM;
+        }
+
+        for (i = 0; i < nci->nthread - 1; i++) {
+            status = gf_start_worker(&worker[i], nci, ctx, false);
+            if (status != GF_OK) {
+                log_error("start of event loop thread %"PRIu32" failed",
+                          i + 1);
+                return GF_ERROR;
+            }
+        }
+
+        log_debug(LOG_NOTICE, "started %"PRIu32" event loop threads",
+                  nci->nthread);
+    }
+
+    for (i = 0; i < nci->nbackend; i++) {
+        sem_post(&backends[i].go);
+    }
+
+    if (nci->nbackend != 0) {
+        log_debug(LOG_NOTICE, "started %"PRIu32" backend I/O threads",
+                  nci->nbackend);
+    }
+
+    return GF_OK;
+}
+
 static void
 gf_run(struct instance *nci)
 {
     rstatus_t status;
     struct context *ctx;
 
-    ctx = core_start(nci);
+    ctx = core_start(nci, NULL, false);
     if (ctx == NULL) {
         return;
     }
 
+    status = gf_start_backends(nci, ctx);
+    if (status != GF_OK) {
+        return;
+    }
+
+    status = gf_start_workers(nci, ctx);
+    if (status != GF_OK) {
+        return;
+    }
+
     /* run rabbit run */
     for (;;) {
         status = core_loop(ctx);
@@ -500,6 +835,11 @@ gf_run(struct instance *nci)
         }
     }
 
+    /* other event loops still report through this context until exit */
+    if (nci->nthread > 1 || nci->nbackend != 0) {
+        return;
+    }
+
     core_stop(ctx);
 }
 
@@ -518,8 +858,10 @@ int main(int argc, char *argv[])
 
     if (show_version) {
         log_stderr("This is gfw-%s", GF_VERSION_STRING);
-#if GF_HAVE_EPOLL
-        log_stderr("async event backend: epoll");
+#if GF_HAVE_EPOLL && GF_HAVE_IO_URING
+        log_stderr("async event backend: epoll, epoll_et, io_uring");
+#elif GF_HAVE_EPOLL
+        log_stderr("async event backend: epoll, epoll_et");
 #elif GF_HAVE_KQUEUE
         log_stderr("async event backend: kqueue");
 #elif GF_HAVE_EVENT_PORTS
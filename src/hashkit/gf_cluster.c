@@ -0,0 +1,72 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gf_core.h>
+#include <gf_server.h>
+#include <gf_hashkit.h>
+
+/*
+ * The continuum of a redis cluster pool is its slot map: one point per hash
+ * slot, holding the index of the server that serves the slot. The map is
+ * spread evenly over the servers of the pool until it is loaded from the
+ * cluster itself with CLUSTER SLOTS, and kept up to date as servers redirect
+ * requests with MOVED (see redis_redirect). Servers that are down keep their
+ * slots, as no other server could serve them.
+ */
+rstatus_t
+cluster_update(struct server_pool *pool)
+{
+    uint32_t nserver;             /* # server - live and dead */
+    uint32_t slot;                /* hash slot */
+
+    nserver = array_n(&pool->server);
+    pool->nlive_server = nserver;
+    pool->next_rebuild = 0LL;
+
+    if (pool->continuum != NULL) {
+        /* the slot map is owned by the cluster */
+        return GF_OK;
+    }
+
+    pool->continuum = gf_alloc(sizeof(*pool->continuum) * CLUSTER_SLOTS);
+    if (pool->continuum == NULL) {
+        return GF_ENOMEM;
+    }
+    pool->nserver_continuum = nserver;
+    pool->ncontinuum = CLUSTER_SLOTS;
+
+    for (slot = 0; slot < CLUSTER_SLOTS; slot++) {
+        pool->continuum[slot].index = (uint32_t)((uint64_t)slot * nserver /
+                                                 CLUSTER_SLOTS);
+        pool->continuum[slot].value = slot;
+    }
+
+    log_debug(LOG_VERB, "updated pool %"PRIu32" '%.*s' with %"PRIu32" "
+              "servers on %"PRIu32" slots", pool->idx, pool->name.len,
+              pool->name.data, nserver, pool->ncontinuum);
+
+    return GF_OK;
+}
+
+uint32_t
+cluster_dispatch(const struct continuum *continuum, uint32_t ncontinuum, uint32_t hash)
+{
+    ASSERT(continuum != NULL);
+    ASSERT(ncontinuum == CLUSTER_SLOTS);
+
+    return continuum[hash & (CLUSTER_SLOTS - 1)].index;
+}
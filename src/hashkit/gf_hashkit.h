@@ -39,6 +39,9 @@
     ACTION( DIST_KETAMA,        ketama        ) \
     ACTION( DIST_MODULA,        modula        ) \
     ACTION( DIST_RANDOM,        random        ) \
+    ACTION( DIST_REDIS_CLUSTER, redis_cluster ) \
+
+#define CLUSTER_SLOTS   16384   /* # hash slots of a redis cluster */
 
 #define DEFINE_ACTION(_hash, _name) _hash,
 typedef enum hash_type {
@@ -74,6 +77,8 @@ rstatus_t modula_update(struct server_pool *pool);
 uint32_t modula_dispatch(const struct continuum *continuum, uint32_t ncontinuum, uint32_t hash);
 rstatus_t random_update(struct server_pool *pool);
 uint32_t random_dispatch(const struct continuum *continuum, uint32_t ncontinuum, uint32_t hash);
+rstatus_t cluster_update(struct server_pool *pool);
+uint32_t cluster_dispatch(const struct continuum *continuum, uint32_t ncontinuum, uint32_t hash);
 uint32_t ketama_hash(const char *key, size_t key_length, uint32_t alignment);
 
 #endif
@@ -0,0 +1,1018 @@
+/*
+ * Copyright (c) 2024-2024, yanruibinghxu@gmail.com All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <ctype.h>
+
+#include <gf_core.h>
+#include <proto/gf_proto.h>
+
+/*
+ * Longest token of a command or a reply line; only keys are allowed to be
+ * this long, other tokens are names and numbers
+ */
+#define MEMCACHE_TOKEN_MAXLEN   MEMCACHE_MAX_KEY_LENGTH
+
+#define MEMCACHE_CMD_RETRIEVAL  0x01    /* get, gets: one or more keys */
+#define MEMCACHE_CMD_STORAGE    0x02    /* <key> <flags> <exptime> <bytes> */
+#define MEMCACHE_CMD_CAS        0x04    /* storage with a <cas unique> */
+#define MEMCACHE_CMD_ARITHMETIC 0x08    /* <key> <value> */
+#define MEMCACHE_CMD_TOUCH      0x10    /* <key> <exptime> */
+#define MEMCACHE_CMD_QUIT       0x20    /* passive close */
+
+struct memcache_command {
+    struct string name;             /* command name */
+    msg_type_t    type;             /* request type */
+    unsigned      flags;            /* MEMCACHE_CMD_* */
+};
+
+static const struct memcache_command memcache_commands[] = {
+    { string("get"), MSG_REQ_MC_GET, MEMCACHE_CMD_RETRIEVAL },
+    { string("gets"), MSG_REQ_MC_GETS, MEMCACHE_CMD_RETRIEVAL },
+    { string("set"), MSG_REQ_MC_SET, MEMCACHE_CMD_STORAGE },
+    { string("add"), MSG_REQ_MC_ADD, MEMCACHE_CMD_STORAGE },
+    { string("replace"), MSG_REQ_MC_REPLACE, MEMCACHE_CMD_STORAGE },
+    { string("append"), MSG_REQ_MC_APPEND, MEMCACHE_CMD_STORAGE },
+    { string("prepend"), MSG_REQ_MC_PREPEND, MEMCACHE_CMD_STORAGE },
+    { string("cas"), MSG_REQ_MC_CAS, MEMCACHE_CMD_STORAGE | MEMCACHE_CMD_CAS },
+    { string("delete"), MSG_REQ_MC_DELETE, 0 },
+    { string("incr"), MSG_REQ_MC_INCR, MEMCACHE_CMD_ARITHMETIC },
+    { string("decr"), MSG_REQ_MC_DECR, MEMCACHE_CMD_ARITHMETIC },
+    { string("touch"), MSG_REQ_MC_TOUCH, MEMCACHE_CMD_TOUCH },
+    { string("quit"), MSG_REQ_MC_QUIT, MEMCACHE_CMD_QUIT },
+};
+
+/*
+ * Reply lines that start with a keyword. A number alone on a line is the
+ * reply of incr and decr
+ */
+static const struct {
+    struct string name;             /* reply keyword */
+    msg_type_t    type;             /* response type */
+} memcache_replies[] = {
+    { string("VALUE"), MSG_RSP_MC_VALUE },
+    { string("END"), MSG_RSP_MC_END },
+    { string("STORED"), MSG_RSP_MC_STORED },
+    { string("NOT_STORED"), MSG_RSP_MC_NOT_STORED },
+    { string("EXISTS"), MSG_RSP_MC_EXISTS },
+    { string("NOT_FOUND"), MSG_RSP_MC_NOT_FOUND },
+    { string("DELETED"), MSG_RSP_MC_DELETED },
+    { string("TOUCHED"), MSG_RSP_MC_TOUCHED },
+    { string("ERROR"), MSG_RSP_MC_ERROR },
+    { string("CLIENT_ERROR"), MSG_RSP_MC_CLIENT_ERROR },
+    { string("SERVER_ERROR"), MSG_RSP_MC_SERVER_ERROR },
+};
+
+/*
+ * Cursor over the token delimiters of a line, ' ' and CR. The positions
+ * of both are computed for a 64 byte window at a time with gf_memmask(),
+ * so that finding the end of the following token costs a shift and a bit
+ * scan. Data blocks skipped by length are never looked at.
+ */
+struct memcache_scan {
+    uint8_t  *base;                 /* start of window */
+    uint8_t  *end;                  /* end of window */
+    uint64_t mask;                  /* positions of ' ' and CR in [base, end) */
+};
+
+static inline void
+memcache_scan_init(struct memcache_scan *s)
+{
+    s->base = NULL;
+    s->end = NULL;
+    s->mask = 0;
+}
+
+/*
+ * Return the first ' ' or CR in [p, last) or NULL
+ */
+static inline uint8_t *
+memcache_scan_next(struct memcache_scan *s, uint8_t *p, uint8_t *last)
+{
+    uint64_t mask;
+
+    for (;;) {
+        if (p >= s->base && p < s->end) {
+            mask = s->mask >> (p - s->base);
+            if (mask != 0) {
+                return p + __builtin_ctzll(mask);
+            }
+            p = s->end;
+        }
+
+        if (p >= last) {
+            return NULL;
+        }
+
+        s->base = p;
+        s->end = p + ((last - p) < 64 ? (last - p) : 64);
+        s->mask = gf_memmask(p, last, ' ') | gf_memmask(p, last, CR);
+    }
+}
+
+/*
+ * Parse the decimal number in [p, last) into v. Return false if it is empty,
+ * has a non digit or does not fit in 64 bits.
+ */
+static inline bool
+memcache_atou64(const uint8_t *p, const uint8_t *last, uint64_t *v)
+{
+    uint64_t n;
+
+    if (p == last || last - p > 20) {
+        return false;
+    }
+
+    for (n = 0; p < last; p++) {
+        if ((uint8_t)(*p - '0') > 9 || n > (UINT64_MAX - 9) / 10) {
+            return false;
+        }
+        n = n * 10 + (uint64_t)(*p - '0');
+    }
+
+    *v = n;
+
+    return true;
+}
+
+static inline bool
+memcache_atou(const uint8_t *p, const uint8_t *last, uint32_t *v)
+{
+    uint64_t n;
+
+    if (!memcache_atou64(p, last, &n) || n > UINT32_MAX) {
+        return false;
+    }
+
+    *v = (uint32_t)n;
+
+    return true;
+}
+
+static const struct memcache_command *
+memcache_command_lookup(const uint8_t *name, uint32_t len)
+{
+    const struct memcache_command *cmd;
+    uint32_t i;
+
+    for (i = 0; i < NELEMS(memcache_commands); i++) {
+        cmd = &memcache_commands[i];
+        if (cmd->name.len == len && memcmp(cmd->name.data, name, len) == 0) {
+            return cmd;
+        }
+    }
+
+    return NULL;
+}
+
+static const struct memcache_command *
+memcache_command(msg_type_t type)
+{
+    uint32_t i;
+
+    for (i = 0; i < NELEMS(memcache_commands); i++) {
+        if (memcache_commands[i].type == type) {
+            return &memcache_commands[i];
+        }
+    }
+
+    NOT_REACHED();
+    return NULL;
+}
+
+static msg_type_t
+memcache_reply_lookup(const uint8_t *name, uint32_t len)
+{
+    uint32_t i;
+
+    for (i = 0; i < NELEMS(memcache_replies); i++) {
+        if (memcache_replies[i].name.len == len &&
+            memcmp(memcache_replies[i].name.data, name, len) == 0) {
+            return memcache_replies[i].type;
+        }
+    }
+
+    return MSG_UNKNOWN;
+}
+
+static rstatus_t
+memcache_key(struct msg *r, uint8_t *start, uint8_t *end)
+{
+    struct keypos *kpos;
+
+    if (end - start > MEMCACHE_MAX_KEY_LENGTH) {
+        log_error("parsed bad req %"PRIu64" of type %d with key prefix "
+                  "'%.*s...' and length %d that exceeds maximum key length",
+                  r->id, r->type, 16, start, (int)(end - start));
+        return GF_ERROR;
+    }
+
+    kpos = msg_keypos_push(r);
+    if (kpos == NULL) {
+        return GF_ENOMEM;
+    }
+    kpos->start = start;
+    kpos->end = end;
+
+    return GF_OK;
+}
+
+/*
+ * Memcache text protocol requests are a command line, followed by a data
+ * block of <bytes> and CRLF for storage commands:
+ *
+ *   get|gets <key>*\r\n
+ *   set|add|replace|append|prepend <key> <flags> <exptime> <bytes> [noreply]\r\n
+ *   cas <key> <flags> <exptime> <bytes> <cas unique> [noreply]\r\n
+ *   delete <key> [noreply]\r\n
+ *   incr|decr <key> <value> [noreply]\r\n
+ *   touch <key> <exptime> [noreply]\r\n
+ *   quit\r\n
+ *
+ * The command line is parsed a token at a time, each token being found
+ * with memcache_scan_next(). A token is always parsed from a single mbuf,
+ * so keys can be recorded in place; when an mbuf ends in the middle of a
+ * token, the parser rewinds to the start of the token and asks for more
+ * data (AGAIN) or, if the mbuf is full, for it to be moved to a new mbuf
+ * (REPAIR). The data block is skipped by length and may span any # mbufs.
+ */
+void
+memcache_parse_req(struct msg *r)
+{
+    const struct memcache_command *cmd;
+    struct memcache_scan s;
+    struct mbuf *b;
+    uint8_t *p, *d, *m;
+    uint32_t len, v;
+    uint64_t v64;
+    rstatus_t status;
+    enum {
+        SW_START,
+        SW_KEY,
+        SW_KEYS,
+        SW_FLAGS,
+        SW_EXPIRY,
+        SW_VLEN,
+        SW_CAS,
+        SW_NUM,
+        SW_NOREPLY,
+        SW_END,
+        SW_LF,
+        SW_VAL,
+        SW_VAL_LF,
+        SW_SENTINEL
+    } state;
+
+    state = r->state;
+    b = STAILQ_LAST(&r->mhdr, mbuf, next);
+
+    ASSERT(r->request);
+    ASSERT(state >= SW_START && state < SW_SENTINEL);
+    ASSERT(b != NULL);
+    ASSERT(b->pos <= b->last);
+
+    /* validate the parsing maker */
+    ASSERT(r->pos != NULL);
+    ASSERT(r->pos >= b->pos && r->pos <= b->last);
+
+    memcache_scan_init(&s);
+    cmd = (state == SW_START) ? NULL : memcache_command(r->type);
+
+    p = r->pos;
+    while (p < b->last) {
+
+        switch (state) {
+        case SW_LF:
+            if (*p != LF) {
+                goto error;
+            }
+            if (!(cmd->flags & MEMCACHE_CMD_STORAGE)) {
+                goto done;
+            }
+            p++;
+            state = SW_VAL;
+            continue;
+
+        case SW_VAL:
+            m = p + r->vlen;
+            if (m >= b->last) {
+                r->vlen -= (uint32_t)(b->last - p);
+                r->expect = r->vlen + CRLF_LEN;
+                p = b->last;
+                continue;
+            }
+            if (*m != CR) {
+                goto error;
+            }
+            r->vlen = 0;
+            p = m + 1; /* move forward by vlen bytes */
+            state = SW_VAL_LF;
+            continue;
+
+        case SW_VAL_LF:
+            if (*p != LF) {
+                goto error;
+            }
+            goto done;
+
+        default:
+            break;
+        }
+
+        d = memcache_scan_next(&s, p, b->last);
+        if (d == NULL) {
+            if (b->last - p > MEMCACHE_TOKEN_MAXLEN) {
+                goto error;
+            }
+            r->token = p;
+            break;
+        }
+
+        if (d == p) {
+            /* extra space or a space before the end of the line */
+            if (*d == ' ' && state != SW_START) {
+                p++;
+                continue;
+            }
+            if (*d == CR && (state == SW_KEYS || state == SW_NOREPLY ||
+                             state == SW_END)) {
+                p++;
+                state = SW_LF;
+                continue;
+            }
+            goto error;
+        }
+
+        len = (uint32_t)(d - p);
+
+        switch (state) {
+        case SW_START:
+            cmd = memcache_command_lookup(p, len);
+            if (cmd == NULL) {
+                goto error;
+            }
+            r->type = cmd->type;
+            if (cmd->flags & MEMCACHE_CMD_QUIT) {
+                r->quit = 1;
+                state = SW_END;
+            } else {
+                state = SW_KEY;
+            }
+            break;
+
+        case SW_KEY:
+        case SW_KEYS:
+            status = memcache_key(r, p, d);
+            if (status != GF_OK) {
+                if (status == GF_ENOMEM) {
+                    goto enomem;
+                }
+                goto error;
+            }
+            if (cmd->flags & MEMCACHE_CMD_RETRIEVAL) {
+                state = SW_KEYS;
+            } else if (cmd->flags & MEMCACHE_CMD_STORAGE) {
+                state = SW_FLAGS;
+            } else if (cmd->flags & MEMCACHE_CMD_ARITHMETIC) {
+                state = SW_NUM;
+            } else if (cmd->flags & MEMCACHE_CMD_TOUCH) {
+                state = SW_EXPIRY;
+            } else {
+                state = SW_NOREPLY;
+            }
+            break;
+
+        case SW_FLAGS:
+            if (!memcache_atou(p, d, &v)) {
+                goto error;
+            }
+            state = SW_EXPIRY;
+            break;
+
+        case SW_EXPIRY:
+            /* negative exptime expires the item immediately */
+            if (!memcache_atou(*p == '-' ? p + 1 : p, d, &v)) {
+                goto error;
+            }
+            state = (cmd->flags & MEMCACHE_CMD_STORAGE) ? SW_VLEN : SW_NOREPLY;
+            break;
+
+        case SW_VLEN:
+            if (!memcache_atou(p, d, &r->vlen)) {
+                goto error;
+            }
+            state = (cmd->flags & MEMCACHE_CMD_CAS) ? SW_CAS : SW_NOREPLY;
+            break;
+
+        case SW_CAS:
+        case SW_NUM:
+            if (!memcache_atou64(p, d, &v64)) {
+                goto error;
+            }
+            state = SW_NOREPLY;
+            break;
+
+        case SW_NOREPLY:
+            if (len != sizeof("noreply") - 1 ||
+                memcmp(p, "noreply", len) != 0) {
+                goto error;
+            }
+            r->noreply = 1;
+            state = SW_END;
+            break;
+
+        case SW_END:
+        default:
+            goto error;
+        }
+
+        p = d + 1;
+        if (*d == CR) {
+            if (state != SW_KEYS && state != SW_NOREPLY && state != SW_END) {
+                goto error;
+            }
+            state = SW_LF;
+        }
+    }
+
+    r->pos = p;
+    r->state = state;
+    r->result = MSG_PARSE_AGAIN;
+
+    if (r->token != NULL) {
+        /*
+         * Rewind to the start of the incomplete token and parse it again
+         * when more data is read into this mbuf or, if it is full, once
+         * the token has been moved into a new mbuf.
+         */
+        if (b->last == b->end) {
+            if ((size_t)(b->last - r->token) >= mbuf_max_data_size()) {
+                goto error;
+            }
+            r->result = MSG_PARSE_REPAIR;
+        }
+
+        r->pos = r->token;
+        r->token = NULL;
+    }
+
+    log_hexdump(LOG_VERB, b->pos, mbuf_length(b), "parsed req %"PRIu64" res %d "
+                "type %d state %d rpos %d of %d", r->id, r->result, r->type,
+                r->state, (int)(r->pos - b->pos), (int)(b->last - b->pos));
+    return;
+
+done:
+    r->pos = p + 1;
+    ASSERT(r->pos <= b->last);
+    r->state = SW_START;
+    r->token = NULL;
+    r->result = MSG_PARSE_OK;
+
+    log_hexdump(LOG_VERB, b->pos, mbuf_length(b), "parsed req %"PRIu64" res %d "
+                "type %d state %d rpos %d of %d", r->id, r->result, r->type,
+                r->state, (int)(r->pos - b->pos), (int)(b->last - b->pos));
+    return;
+
+enomem:
+    r->result = MSG_PARSE_ERROR;
+    r->state = state;
+    r->token = NULL;
+    errno = ENOMEM;
+
+    log_error("parsed req %"PRIu64" of type %d failed: %s", r->id, r->type,
+              strerror(errno));
+    return;
+
+error:
+    r->result = MSG_PARSE_ERROR;
+    r->state = state;
+    r->token = NULL;
+    errno = EINVAL;
+
+    log_hexdump(LOG_INFO, b->pos, mbuf_length(b), "parsed bad req %"PRIu64" "
+                "res %d type %d state %d", r->id, r->result, r->type,
+                r->state);
+}
+
+/*
+ * Memcache text protocol replies are a single line, except for retrievals
+ * which reply with an item per key found and a closing "END" line:
+ *
+ *   VALUE <key> <flags> <bytes> [<cas unique>]\r\n<data block>\r\n
+ *   ...
+ *   END\r\n
+ *
+ * Reply lines are parsed a token at a time like the request command
+ * lines. The data block of an item is skipped by length using msg->vlen,
+ * without looking at its bytes, and may span any # mbufs. The text of an
+ * error line is skipped as well. msg->end marks the "END" line of
+ * a retrieval reply.
+ */
+void
+memcache_parse_rsp(struct msg *r)
+{
+    struct memcache_scan s;
+    struct mbuf *b;
+    uint8_t *p, *d, *m;
+    uint32_t v;
+    uint64_t v64;
+    msg_type_t type;
+    enum {
+        SW_START,
+        SW_KEY,
+        SW_FLAGS,
+        SW_VLEN,
+        SW_CAS,
+        SW_END,
+        SW_RUNTO_CR,
+        SW_LF,
+        SW_VALUE_LF,
+        SW_VAL,
+        SW_VAL_LF,
+        SW_SENTINEL
+    } state;
+
+    state = r->state;
+    b = STAILQ_LAST(&r->mhdr, mbuf, next);
+
+    ASSERT(!r->request);
+    ASSERT(state >= SW_START && state < SW_SENTINEL);
+    ASSERT(b != NULL);
+    ASSERT(b->pos <= b->last);
+
+    /* validate the parsing maker */
+    ASSERT(r->pos != NULL);
+    ASSERT(r->pos >= b->pos && r->pos <= b->last);
+
+    memcache_scan_init(&s);
+
+    p = r->pos;
+    while (p < b->last) {
+
+        switch (state) {
+        case SW_RUNTO_CR:
+            m = gf_memchr(p, CR, b->last - p);
+            if (m == NULL) {
+                p = b->last;
+                continue;
+            }
+            p = m + 1;
+            state = SW_LF;
+            continue;
+
+        case SW_LF:
+            if (*p != LF) {
+                goto error;
+            }
+            goto done;
+
+        case SW_VALUE_LF:
+            if (*p != LF) {
+                goto error;
+            }
+            p++;
+            state = SW_VAL;
+            continue;
+
+        case SW_VAL:
+            m = p + r->vlen;
+            if (m >= b->last) {
+                r->vlen -= (uint32_t)(b->last - p);
+                r->expect = r->vlen + CRLF_LEN;
+                p = b->last;
+                continue;
+            }
+            if (*m != CR) {
+                goto error;
+            }
+            r->vlen = 0;
+            p = m + 1; /* move forward by vlen bytes */
+            state = SW_VAL_LF;
+            continue;
+
+        case SW_VAL_LF:
+            if (*p != LF) {
+                goto error;
+            }
+            /* next item or the end of a retrieval reply */
+            p++;
+            state = SW_START;
+            continue;
+
+        default:
+            break;
+        }
+
+        d = memcache_scan_next(&s, p, b->last);
+        if (d == NULL) {
+            if (b->last - p > MEMCACHE_TOKEN_MAXLEN) {
+                goto error;
+            }
+            r->token = p;
+            break;
+        }
+
+        if (d == p) {
+            /* extra space or a space before the end of the line */
+            if (*d == ' ' && state != SW_START) {
+                p++;
+                continue;
+            }
+            if (*d == CR && (state == SW_CAS || state == SW_END)) {
+                p++;
+                state = (r->type == MSG_RSP_MC_VALUE && r->end == NULL) ?
+                        SW_VALUE_LF : SW_LF;
+                continue;
+            }
+            goto error;
+        }
+
+        switch (state) {
+        case SW_START:
+            if (isdigit(*p)) {
+                type = memcache_atou64(p, d, &v64) ? MSG_RSP_MC_NUM :
+                                                     MSG_UNKNOWN;
+            } else {
+                type = memcache_reply_lookup(p, (uint32_t)(d - p));
+            }
+
+            if (r->type == MSG_RSP_MC_VALUE) {
+                /* only items or the end may follow an item */
+                if (type != MSG_RSP_MC_VALUE && type != MSG_RSP_MC_END) {
+                    goto error;
+                }
+            } else if (type != MSG_UNKNOWN) {
+                r->type = type;
+            }
+
+            switch (type) {
+            case MSG_RSP_MC_VALUE:
+                state = SW_KEY;
+                break;
+
+            case MSG_RSP_MC_END:
+                r->end = p;
+                state = SW_END;
+                break;
+
+            case MSG_RSP_MC_CLIENT_ERROR:
+            case MSG_RSP_MC_SERVER_ERROR:
+                state = SW_RUNTO_CR;
+                break;
+
+            case MSG_UNKNOWN:
+                goto error;
+
+            default:
+                state = SW_END;
+                break;
+            }
+            break;
+
+        case SW_KEY:
+            if (d - p > MEMCACHE_MAX_KEY_LENGTH) {
+                goto error;
+            }
+            state = SW_FLAGS;
+            break;
+
+        case SW_FLAGS:
+            if (!memcache_atou(p, d, &v)) {
+                goto error;
+            }
+            state = SW_VLEN;
+            break;
+
+        case SW_VLEN:
+            if (!memcache_atou(p, d, &r->vlen)) {
+                goto error;
+            }
+            state = SW_CAS;
+            break;
+
+        case SW_CAS:
+            if (!memcache_atou64(p, d, &v64)) {
+                goto error;
+            }
+            state = SW_END;
+            break;
+
+        case SW_END:
+        default:
+            goto error;
+        }
+
+        p = d + 1;
+        if (*d == CR) {
+            if (state != SW_RUNTO_CR && state != SW_CAS && state != SW_END) {
+                goto error;
+            }
+            state = (r->type == MSG_RSP_MC_VALUE && r->end == NULL) ?
+                    SW_VALUE_LF : SW_LF;
+        }
+    }
+
+    r->pos = p;
+    r->state = state;
+    r->result = MSG_PARSE_AGAIN;
+
+    if (r->token != NULL) {
+        /*
+         * Rewind to the start of the incomplete token and parse it again
+         * when more data is read into this mbuf or, if it is full, once
+         * the token has been moved into a new mbuf.
+         */
+        if (b->last == b->end) {
+            if ((size_t)(b->last - r->token) >= mbuf_max_data_size()) {
+                goto error;
+            }
+            r->result = MSG_PARSE_REPAIR;
+        }
+
+        r->pos = r->token;
+        r->token = NULL;
+    }
+
+    log_hexdump(LOG_VERB, b->pos, mbuf_length(b), "parsed rsp %"PRIu64" res %d "
+                "type %d state %d rpos %d of %d", r->id, r->result, r->type,
+                r->state, (int)(r->pos - b->pos), (int)(b->last - b->pos));
+    return;
+
+done:
+    r->pos = p + 1;
+    ASSERT(r->pos <= b->last);
+    r->state = SW_START;
+    r->token = NULL;
+    r->result = MSG_PARSE_OK;
+
+    log_hexdump(LOG_VERB, b->pos, mbuf_length(b), "parsed rsp %"PRIu64" res %d "
+                "type %d state %d rpos %d of %d", r->id, r->result, r->type,
+                r->state, (int)(r->pos - b->pos), (int)(b->last - b->pos));
+    return;
+
+error:
+    r->result = MSG_PARSE_ERROR;
+    r->state = state;
+    r->token = NULL;
+    errno = EINVAL;
+
+    log_hexdump(LOG_INFO, b->pos, mbuf_length(b), "parsed bad rsp %"PRIu64" "
+                "res %d type %d state %d", r->id, r->result, r->type,
+                r->state);
+}
+
+/*
+ * Split a retrieval whose keys live on more than one server into one
+ * retrieval per server, each with the keys of its server. Items are sent to
+ * the client as the reply of each server comes in, so the request is marked
+ * to be streamed; the client pairs items with keys by name.
+ */
+rstatus_t
+memcache_fragment(struct msg *r, uint32_t nserver, struct msg_tqh *frag_msgq)
+{
+    const struct memcache_command *cmd;
+    rstatus_t status;
+    struct msg **sub_msgs, *sub_msg, *tmsg;
+    struct keypos *kpos, *sub_kpos;
+    struct mbuf *mbuf;
+    uint32_t *idx;
+    uint32_t i, nkey, keylen;
+    bool single;
+
+    ASSERT(r->request);
+
+    nkey = array_n(r->keys);
+    if ((r->type != MSG_REQ_MC_GET && r->type != MSG_REQ_MC_GETS) ||
+        nkey <= 1 || nserver <= 1) {
+        return GF_OK;
+    }
+
+    sub_msgs = gf_zalloc(nserver * sizeof(*sub_msgs) + nkey * sizeof(*idx));
+    if (sub_msgs == NULL) {
+        return GF_ENOMEM;
+    }
+    idx = (uint32_t *)(sub_msgs + nserver);
+
+    for (single = true, i = 0; i < nkey; i++) {
+        kpos = array_get(r->keys, i);
+        idx[i] = msg_backend_idx(r, kpos->start,
+                                 (uint32_t)(kpos->end - kpos->start));
+        ASSERT(idx[i] < nserver);
+        single = single && idx[i] == idx[0];
+    }
+    if (single) {
+        gf_free(sub_msgs);
+        return GF_OK;
+    }
+
+    cmd = memcache_command(r->type);
+
+    if (msg_frag_get(r) == NULL) {
+        status = GF_ENOMEM;
+        goto error;
+    }
+    r->stream = 1;
+
+    for (i = 0; i < nkey; i++) {
+        sub_msg = sub_msgs[idx[i]];
+        if (sub_msg == NULL) {
+            sub_msg = msg_get(r->owner, r->request, r->redis);
+            if (sub_msg == NULL) {
+                status = GF_ENOMEM;
+                goto error;
+            }
+            sub_msg->type = r->type;
+            msg_frag_add(r->frag, sub_msg);
+
+            sub_msgs[idx[i]] = sub_msg;
+            TAILQ_INSERT_TAIL(frag_msgq, sub_msg, m_tqe);
+
+            status = msg_append(sub_msg, cmd->name.data, cmd->name.len);
+            if (status != GF_OK) {
+                goto error;
+            }
+        }
+
+        kpos = array_get(r->keys, i);
+        keylen = (uint32_t)(kpos->end - kpos->start);
+
+        status = msg_append(sub_msg, (uint8_t *)" ", 1);
+        if (status != GF_OK) {
+            goto error;
+        }
+        status = msg_append(sub_msg, kpos->start, keylen);
+        if (status != GF_OK) {
+            goto error;
+        }
+
+        /* key of the sub request points to its own copy */
+        sub_kpos = msg_keypos_push(sub_msg);
+        if (sub_kpos == NULL) {
+            status = GF_ENOMEM;
+            goto error;
+        }
+        mbuf = STAILQ_LAST(&sub_msg->mhdr, mbuf, next);
+        sub_kpos->start = mbuf->last - keylen;
+        sub_kpos->end = mbuf->last;
+    }
+
+    TAILQ_FOREACH(sub_msg, frag_msgq, m_tqe) {
+        status = msg_append(sub_msg, (uint8_t *)CRLF, CRLF_LEN);
+        if (status != GF_OK) {
+            goto error;
+        }
+    }
+
+    gf_free(sub_msgs);
+
+    log_debug(LOG_VERB, "fragment req %"PRIu64" with %"PRIu32" keys into "
+              "%"PRIu32" requests", r->id, nkey, r->frag->nfrag);
+
+    return GF_OK;
+
+error:
+    for (sub_msg = TAILQ_FIRST(frag_msgq); sub_msg != NULL; sub_msg = tmsg) {
+        tmsg = TAILQ_NEXT(sub_msg, m_tqe);
+        TAILQ_REMOVE(frag_msgq, sub_msg, m_tqe);
+        msg_put(sub_msg);
+    }
+    gf_free(sub_msgs);
+    if (r->frag != NULL) {
+        msg_frag_put(r);
+    }
+    r->stream = 0;
+
+    return status;
+}
+
+/*
+ * Pre-coalesce handler is invoked for every response. The items of the
+ * reply to a fragment are moved to the reply of the request right away,
+ * without the "END" line that closes them, to be streamed to the client
+ * while other fragments are still outstanding. A fragment that is not
+ * replied with items puts the request in error.
+ */
+void
+memcache_pre_coalesce(struct msg *r)
+{
+    struct msg *pr = r->peer; /* peer request */
+    struct msg *rsp;
+    struct mbuf *mbuf, *nbuf;
+    uint32_t len;
+    bool drop;
+
+    ASSERT(!r->request);
+    ASSERT(pr->request);
+
+    if (pr->frag == NULL) {
+        /* do nothing, if not a response to a fragmented request */
+        return;
+    }
+
+    if (r->type != MSG_RSP_MC_VALUE && r->type != MSG_RSP_MC_END) {
+        pr->error = 1;
+        pr->err = EINVAL;
+        return;
+    }
+
+    if (pr->frag->owner == NULL) {
+        /* the fragmented request is gone with its client */
+        return;
+    }
+
+    rsp = pr->frag->owner->peer;
+    if (rsp == NULL) {
+        return;
+    }
+
+    ASSERT(r->end != NULL);
+
+    for (drop = false, mbuf = STAILQ_FIRST(&r->mhdr); mbuf != NULL;
+         mbuf = nbuf) {
+        nbuf = STAILQ_NEXT(mbuf, next);
+
+        mbuf_remove(&r->mhdr, mbuf);
+
+        if (!drop && r->end >= mbuf->pos && r->end < mbuf->last) {
+            mbuf->last = r->end;
+            drop = true;
+        } else if (drop) {
+            mbuf_put(mbuf);
+            continue;
+        }
+
+        len = mbuf_length(mbuf);
+        if (len == 0) {
+            mbuf_put(mbuf);
+            continue;
+        }
+        mbuf_insert(&rsp->mhdr, mbuf);
+        rsp->mlen += len;
+    }
+    r->mlen = 0;
+}
+
+/*
+ * Close the streamed items of a fragmented retrieval with the "END" line,
+ * once all of its fragments are done
+ */
+void
+memcache_post_coalesce(struct msg *r)
+{
+    struct msg *rsp = r->peer; /* peer response */
+    rstatus_t status;
+
+    ASSERT(r->request && r->frag->owner == r);
+    ASSERT(!r->error && r->frag->nerror == 0);
+    ASSERT(rsp != NULL && !rsp->request);
+
+    status = msg_append(rsp, (uint8_t *)"END\r\n", 5);
+    if (status != GF_OK) {
+        r->error = 1;
+        r->err = ENOMEM;
+        return;
+    }
+    rsp->type = MSG_RSP_MC_END;
+}
+
+/*
+ * Memcache has no transient failure replies that the proxy acts upon
+ */
+bool
+memcache_failure(const struct msg *r)
+{
+    return false;
+}
+
+void
+memcache_post_connect(struct context *ctx, struct conn *conn, struct server *server)
+{
+}
+
+void
+memcache_swallow_msg(struct conn *conn, struct msg *pmsg, struct msg *msg)
+{
+}
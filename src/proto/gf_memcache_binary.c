@@ -0,0 +1,875 @@
+/*
+ * Copyright (c) 2024-2024, yanruibinghxu@gmail.com All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <gf_core.h>
+#include <proto/gf_proto.h>
+
+/*
+ * Memcache binary protocol packet header, 24 bytes in network byte order:
+ *
+ *   0      magic        1      opcode       2-3    key length
+ *   4      extras len   5      data type    6-7    vbucket (status in rsp)
+ *   8-11   body length  12-15  opaque       16-23  cas
+ *
+ * The body that follows is the extras, the key and the value, in that order
+ */
+#define MEMCACHE_BINARY_HEADER_LEN  24
+#define MEMCACHE_BINARY_REQ_MAGIC   0x80
+#define MEMCACHE_BINARY_RSP_MAGIC   0x81
+
+#define MEMCACHE_BINARY_OPCODE(_p)  ((_p)[1])
+#define MEMCACHE_BINARY_KEYLEN(_p)  ((uint16_t)((_p)[2] << 8 | (_p)[3]))
+#define MEMCACHE_BINARY_EXTLEN(_p)  ((_p)[4])
+#define MEMCACHE_BINARY_STATUS(_p)  ((uint16_t)((_p)[6] << 8 | (_p)[7]))
+#define MEMCACHE_BINARY_BODYLEN(_p)                                         \
+    ((uint32_t)(_p)[8] << 24 | (uint32_t)(_p)[9] << 16 |                    \
+     (uint32_t)(_p)[10] << 8 | (uint32_t)(_p)[11])
+
+#define MEMCACHE_BINARY_OP_NOOP     0x0a
+#define MEMCACHE_BINARY_OP_MAX      0x24
+
+#define MEMCACHE_BINARY_CMD_KEY     0x01    /* has a key */
+#define MEMCACHE_BINARY_CMD_QUIET   0x02    /* no reply unless there is news */
+#define MEMCACHE_BINARY_CMD_LOCAL   0x04    /* replied by the proxy itself */
+#define MEMCACHE_BINARY_CMD_QUIT    0x08    /* passive close */
+
+struct memcache_binary_command {
+    struct string name;             /* command name, empty if unsupported */
+    msg_type_t    type;             /* request type */
+    msg_type_t    rsp_type;         /* type of a successful response */
+    unsigned      flags;            /* MEMCACHE_BINARY_CMD_* */
+};
+
+#define KEY     MEMCACHE_BINARY_CMD_KEY
+#define QUIET   MEMCACHE_BINARY_CMD_QUIET
+#define LOCAL   MEMCACHE_BINARY_CMD_LOCAL
+#define QUIT    MEMCACHE_BINARY_CMD_QUIT
+
+static const struct memcache_binary_command memcache_binary_commands[] = {
+    [0x00] = { string("get"), MSG_REQ_MC_GET, MSG_RSP_MC_VALUE, KEY },
+    [0x01] = { string("set"), MSG_REQ_MC_SET, MSG_RSP_MC_STORED, KEY },
+    [0x02] = { string("add"), MSG_REQ_MC_ADD, MSG_RSP_MC_STORED, KEY },
+    [0x03] = { string("replace"), MSG_REQ_MC_REPLACE, MSG_RSP_MC_STORED, KEY },
+    [0x04] = { string("delete"), MSG_REQ_MC_DELETE, MSG_RSP_MC_DELETED, KEY },
+    [0x05] = { string("increment"), MSG_REQ_MC_INCR, MSG_RSP_MC_NUM, KEY },
+    [0x06] = { string("decrement"), MSG_REQ_MC_DECR, MSG_RSP_MC_NUM, KEY },
+    [0x07] = { string("quit"), MSG_REQ_MC_QUIT, MSG_UNKNOWN, QUIT },
+    [0x09] = { string("getq"), MSG_REQ_MC_GET, MSG_RSP_MC_VALUE, KEY | QUIET },
+    [0x0a] = { string("noop"), MSG_REQ_MC_NOOP, MSG_RSP_MC_END, LOCAL },
+    [0x0b] = { string("version"), MSG_REQ_MC_VERSION, MSG_RSP_MC_VERSION,
+               LOCAL },
+    [0x0c] = { string("getk"), MSG_REQ_MC_GET, MSG_RSP_MC_VALUE, KEY },
+    [0x0d] = { string("getkq"), MSG_REQ_MC_GET, MSG_RSP_MC_VALUE, KEY | QUIET },
+    [0x0e] = { string("append"), MSG_REQ_MC_APPEND, MSG_RSP_MC_STORED, KEY },
+    [0x0f] = { string("prepend"), MSG_REQ_MC_PREPEND, MSG_RSP_MC_STORED, KEY },
+    [0x11] = { string("setq"), MSG_REQ_MC_SET, MSG_RSP_MC_STORED, KEY | QUIET },
+    [0x12] = { string("addq"), MSG_REQ_MC_ADD, MSG_RSP_MC_STORED, KEY | QUIET },
+    [0x13] = { string("replaceq"), MSG_REQ_MC_REPLACE, MSG_RSP_MC_STORED,
+               KEY | QUIET },
+    [0x14] = { string("deleteq"), MSG_REQ_MC_DELETE, MSG_RSP_MC_DELETED,
+               KEY | QUIET },
+    [0x15] = { string("incrementq"), MSG_REQ_MC_INCR, MSG_RSP_MC_NUM,
+               KEY | QUIET },
+    [0x16] = { string("decrementq"), MSG_REQ_MC_DECR, MSG_RSP_MC_NUM,
+               KEY | QUIET },
+    [0x17] = { string("quitq"), MSG_REQ_MC_QUIT, MSG_UNKNOWN, QUIT | QUIET },
+    [0x19] = { string("appendq"), MSG_REQ_MC_APPEND, MSG_RSP_MC_STORED,
+               KEY | QUIET },
+    [0x1a] = { string("prependq"), MSG_REQ_MC_PREPEND, MSG_RSP_MC_STORED,
+               KEY | QUIET },
+    [0x1c] = { string("touch"), MSG_REQ_MC_TOUCH, MSG_RSP_MC_TOUCHED, KEY },
+    [0x1d] = { string("gat"), MSG_REQ_MC_GAT, MSG_RSP_MC_VALUE, KEY },
+    [0x1e] = { string("gatq"), MSG_REQ_MC_GAT, MSG_RSP_MC_VALUE, KEY | QUIET },
+    [0x23] = { string("gatk"), MSG_REQ_MC_GAT, MSG_RSP_MC_VALUE, KEY },
+    [0x24] = { string("gatkq"), MSG_REQ_MC_GAT, MSG_RSP_MC_VALUE, KEY | QUIET },
+};
+
+#undef KEY
+#undef QUIET
+#undef LOCAL
+#undef QUIT
+
+static const struct string rsp_version = string("gfwproxy-" GF_VERSION_STRING);
+
+static inline const struct memcache_binary_command *
+memcache_binary_command(uint8_t opcode)
+{
+    const struct memcache_binary_command *cmd;
+
+    if (opcode > MEMCACHE_BINARY_OP_MAX) {
+        return NULL;
+    }
+
+    cmd = &memcache_binary_commands[opcode];
+    if (cmd->name.len == 0) {
+        return NULL;
+    }
+
+    return cmd;
+}
+
+/*
+ * A packet ends a request or a response unless it is quiet. QUITQ is quiet
+ * but nothing may follow it.
+ */
+static inline bool
+memcache_binary_last(const struct memcache_binary_command *cmd)
+{
+    return !(cmd->flags & MEMCACHE_BINARY_CMD_QUIET) ||
+           (cmd->flags & MEMCACHE_BINARY_CMD_QUIT);
+}
+
+static msg_type_t
+memcache_binary_rsp_type(const struct memcache_binary_command *cmd,
+                         uint16_t status)
+{
+    switch (status) {
+    case 0x0000:
+        return cmd->rsp_type;
+
+    case 0x0001:
+        return MSG_RSP_MC_NOT_FOUND;
+
+    case 0x0002:
+        return MSG_RSP_MC_EXISTS;
+
+    case 0x0005:
+        return MSG_RSP_MC_NOT_STORED;
+
+    case 0x0081:
+        return MSG_RSP_MC_ERROR;
+
+    case 0x0082:
+    case 0x0084:
+    case 0x0085:
+    case 0x0086:
+        return MSG_RSP_MC_SERVER_ERROR;
+
+    default:
+        return MSG_RSP_MC_CLIENT_ERROR;
+    }
+}
+
+/*
+ * Memcache binary requests are parsed a packet at a time. The header,
+ * extras and key of a packet are read in place once they are all in the
+ * current mbuf; otherwise the parser rewinds to the start of the packet and
+ * asks for more data (AGAIN) or, if the mbuf is full, for it to be moved to
+ * a new mbuf (REPAIR). The value is skipped by length and may span any
+ * # mbufs.
+ *
+ * Quiet packets (GETQ, GETKQ, SETQ, ...) are only answered when there is
+ * news, so a run of quiet packets and the packet that ends it, usually a
+ * NOOP, is parsed into a single message. The backends answer such a
+ * message with a single response that ends with the reply to its last
+ * packet, and memcache_binary_fragment() splits it into one pipeline per
+ * backend. msg->end marks the header of the last packet parsed.
+ */
+void
+memcache_binary_parse_req(struct msg *r)
+{
+    const struct memcache_binary_command *cmd;
+    struct mbuf *b;
+    struct keypos *kpos;
+    uint8_t *p;
+    uint32_t keylen, extlen, bodylen, need;
+    enum {
+        SW_START,
+        SW_VAL,
+        SW_SENTINEL
+    } state;
+
+    state = r->state;
+    b = STAILQ_LAST(&r->mhdr, mbuf, next);
+
+    ASSERT(r->request);
+    ASSERT(state >= SW_START && state < SW_SENTINEL);
+    ASSERT(b != NULL);
+    ASSERT(b->pos <= b->last);
+
+    /* validate the parsing maker */
+    ASSERT(r->pos != NULL);
+    ASSERT(r->pos >= b->pos && r->pos <= b->last);
+
+    p = r->pos;
+
+    for (;;) {
+        if (state == SW_VAL) {
+            if ((uint32_t)(b->last - p) < r->vlen) {
+                r->vlen -= (uint32_t)(b->last - p);
+                r->expect = r->vlen;
+                p = b->last;
+                break;
+            }
+            p += r->vlen; /* move forward by vlen bytes */
+            r->vlen = 0;
+            state = SW_START;
+
+            cmd = memcache_binary_command(MEMCACHE_BINARY_OPCODE(r->end));
+            if (memcache_binary_last(cmd)) {
+                goto done;
+            }
+        }
+
+        if (p == b->last) {
+            break;
+        }
+
+        if (b->last - p < MEMCACHE_BINARY_HEADER_LEN) {
+            r->token = p;
+            break;
+        }
+
+        if (p[0] != MEMCACHE_BINARY_REQ_MAGIC) {
+            goto error;
+        }
+
+        cmd = memcache_binary_command(MEMCACHE_BINARY_OPCODE(p));
+        if (cmd == NULL) {
+            goto error;
+        }
+
+        keylen = MEMCACHE_BINARY_KEYLEN(p);
+        extlen = MEMCACHE_BINARY_EXTLEN(p);
+        bodylen = MEMCACHE_BINARY_BODYLEN(p);
+
+        if (extlen + keylen > bodylen || keylen > MEMCACHE_MAX_KEY_LENGTH ||
+            ((cmd->flags & MEMCACHE_BINARY_CMD_KEY) != 0) != (keylen != 0)) {
+            goto error;
+        }
+
+        /*
+         * Only keyed packets may follow a quiet packet, or a NOOP that
+         * ends them
+         */
+        if (r->end != NULL && keylen == 0 &&
+            MEMCACHE_BINARY_OPCODE(p) != MEMCACHE_BINARY_OP_NOOP) {
+            goto error;
+        }
+
+        need = MEMCACHE_BINARY_HEADER_LEN + extlen + keylen;
+        if ((uint32_t)(b->last - p) < need) {
+            if (need > mbuf_data_size()) {
+                goto error;
+            }
+            r->token = p;
+            break;
+        }
+
+        if (r->end == NULL) {
+            r->type = cmd->type;
+        }
+
+        if (cmd->flags & MEMCACHE_BINARY_CMD_QUIT) {
+            r->quit = 1;
+        }
+
+        if (keylen != 0) {
+            kpos = msg_keypos_push(r);
+            if (kpos == NULL) {
+                goto enomem;
+            }
+            kpos->start = p + MEMCACHE_BINARY_HEADER_LEN + extlen;
+            kpos->end = kpos->start + keylen;
+        }
+
+        r->end = p;
+        r->vlen = bodylen - extlen - keylen;
+        p += need;
+        state = SW_VAL;
+    }
+
+    ASSERT(p <= b->last);
+    r->pos = p;
+    r->state = state;
+    r->result = MSG_PARSE_AGAIN;
+
+    if (r->token != NULL) {
+        /*
+         * Rewind to the start of the incomplete packet and parse it again
+         * when more data is read into this mbuf or, if it is full, once
+         * the packet has been moved into a new mbuf.
+         */
+        if (b->last == b->end) {
+            if ((size_t)(b->last - r->token) >= mbuf_max_data_size()) {
+                goto error;
+            }
+            r->result = MSG_PARSE_REPAIR;
+        }
+
+        r->pos = r->token;
+        r->token = NULL;
+    }
+
+    log_hexdump(LOG_VERB, b->pos, mbuf_length(b), "parsed req %"PRIu64" res %d "
+                "type %d state %d rpos %d of %d", r->id, r->result, r->type,
+                r->state, (int)(r->pos - b->pos), (int)(b->last - b->pos));
+    return;
+
+done:
+    /* a lone NOOP or VERSION is answered by the proxy */
+    if (array_n(r->keys) == 0 && (cmd->flags & MEMCACHE_BINARY_CMD_LOCAL)) {
+        r->noforward = 1;
+    }
+
+    r->pos = p;
+    ASSERT(r->pos <= b->last);
+    r->state = SW_START;
+    r->token = NULL;
+    r->result = MSG_PARSE_OK;
+
+    log_hexdump(LOG_VERB, b->pos, mbuf_length(b), "parsed req %"PRIu64" res %d "
+                "type %d state %d rpos %d of %d", r->id, r->result, r->type,
+                r->state, (int)(r->pos - b->pos), (int)(b->last - b->pos));
+    return;
+
+enomem:
+    r->result = MSG_PARSE_ERROR;
+    r->state = state;
+    errno = ENOMEM;
+
+    log_error("parsed req %"PRIu64" of type %d failed: %s", r->id, r->type,
+              strerror(errno));
+    return;
+
+error:
+    r->result = MSG_PARSE_ERROR;
+    r->state = state;
+    r->token = NULL;
+    errno = EINVAL;
+
+    log_hexdump(LOG_INFO, b->pos, mbuf_length(b), "parsed bad req %"PRIu64" "
+                "res %d type %d state %d", r->id, r->result, r->type,
+                r->state);
+}
+
+/*
+ * Memcache binary responses are parsed like requests, except that only the
+ * header of a packet has to be in a single mbuf. A response ends with the
+ * first packet that is not a reply to a quiet request; msg->end marks its
+ * header.
+ */
+void
+memcache_binary_parse_rsp(struct msg *r)
+{
+    const struct memcache_binary_command *cmd;
+    struct mbuf *b;
+    uint8_t *p;
+    enum {
+        SW_START,
+        SW_VAL,
+        SW_SENTINEL
+    } state;
+
+    state = r->state;
+    b = STAILQ_LAST(&r->mhdr, mbuf, next);
+
+    ASSERT(!r->request);
+    ASSERT(state >= SW_START && state < SW_SENTINEL);
+    ASSERT(b != NULL);
+    ASSERT(b->pos <= b->last);
+
+    /* validate the parsing maker */
+    ASSERT(r->pos != NULL);
+    ASSERT(r->pos >= b->pos && r->pos <= b->last);
+
+    p = r->pos;
+
+    for (;;) {
+        if (state == SW_VAL) {
+            if ((uint32_t)(b->last - p) < r->vlen) {
+                r->vlen -= (uint32_t)(b->last - p);
+                r->expect = r->vlen;
+                p = b->last;
+                break;
+            }
+            p += r->vlen; /* move forward by vlen bytes */
+            r->vlen = 0;
+            state = SW_START;
+
+            cmd = memcache_binary_command(MEMCACHE_BINARY_OPCODE(r->end));
+            if (memcache_binary_last(cmd)) {
+                goto done;
+            }
+        }
+
+        if (p == b->last) {
+            break;
+        }
+
+        if (b->last - p < MEMCACHE_BINARY_HEADER_LEN) {
+            r->token = p;
+            break;
+        }
+
+        if (p[0] != MEMCACHE_BINARY_RSP_MAGIC) {
+            goto error;
+        }
+
+        cmd = memcache_binary_command(MEMCACHE_BINARY_OPCODE(p));
+        if (cmd == NULL) {
+            goto error;
+        }
+
+        r->type = memcache_binary_rsp_type(cmd, MEMCACHE_BINARY_STATUS(p));
+        r->end = p;
+        r->vlen = MEMCACHE_BINARY_BODYLEN(p);
+        p += MEMCACHE_BINARY_HEADER_LEN;
+        state = SW_VAL;
+    }
+
+    ASSERT(p <= b->last);
+    r->pos = p;
+    r->state = state;
+    r->result = MSG_PARSE_AGAIN;
+
+    if (r->token != NULL) {
+        /* rewind to the start of the incomplete header */
+        if (b->last == b->end) {
+            r->result = MSG_PARSE_REPAIR;
+        }
+
+        r->pos = r->token;
+        r->token = NULL;
+    }
+
+    log_hexdump(LOG_VERB, b->pos, mbuf_length(b), "parsed rsp %"PRIu64" res %d "
+                "type %d state %d rpos %d of %d", r->id, r->result, r->type,
+                r->state, (int)(r->pos - b->pos), (int)(b->last - b->pos));
+    return;
+
+done:
+    r->pos = p;
+    ASSERT(r->pos <= b->last);
+    r->state = SW_START;
+    r->token = NULL;
+    r->result = MSG_PARSE_OK;
+
+    log_hexdump(LOG_VERB, b->pos, mbuf_length(b), "parsed rsp %"PRIu64" res %d "
+                "type %d state %d rpos %d of %d", r->id, r->result, r->type,
+                r->state, (int)(r->pos - b->pos), (int)(b->last - b->pos));
+    return;
+
+error:
+    r->result = MSG_PARSE_ERROR;
+    r->state = state;
+    r->token = NULL;
+    errno = EINVAL;
+
+    log_hexdump(LOG_INFO, b->pos, mbuf_length(b), "parsed bad rsp %"PRIu64" "
+                "res %d type %d state %d", r->id, r->result, r->type,
+                r->state);
+}
+
+/*
+ * Append n bytes of msg data starting at *pos in *mbuf to dst and advance
+ * (*mbuf, *pos) past them
+ */
+static rstatus_t
+memcache_binary_copy(struct msg *dst, struct mbuf **mbuf, uint8_t **pos,
+                     uint32_t n)
+{
+    rstatus_t status;
+    uint32_t len;
+
+    while (n > 0) {
+        if (*pos == (*mbuf)->last) {
+            *mbuf = STAILQ_NEXT(*mbuf, next);
+            ASSERT(*mbuf != NULL);
+            *pos = (*mbuf)->pos;
+            continue;
+        }
+
+        len = MIN(n, (uint32_t)((*mbuf)->last - *pos));
+        len = MIN(len, (uint32_t)mbuf_data_size());
+
+        status = msg_append(dst, *pos, len);
+        if (status != GF_OK) {
+            return status;
+        }
+
+        *pos += len;
+        n -= len;
+    }
+
+    return GF_OK;
+}
+
+/*
+ * Append the packet at *pos in *mbuf to sub_msg and advance past it. The
+ * header, extras and key are kept in a single mbuf of sub_msg as they are
+ * in the parsed request; the key is recorded in sub_msg->keys.
+ */
+static rstatus_t
+memcache_binary_append_packet(struct msg *sub_msg, struct mbuf **mbuf,
+                              uint8_t **pos)
+{
+    struct mbuf *dst;
+    struct keypos *kpos;
+    uint8_t *p;
+    uint32_t keylen, extlen, need;
+
+    p = *pos;
+    keylen = MEMCACHE_BINARY_KEYLEN(p);
+    extlen = MEMCACHE_BINARY_EXTLEN(p);
+    need = MEMCACHE_BINARY_HEADER_LEN + extlen + keylen;
+
+    ASSERT((uint32_t)((*mbuf)->last - p) >= need);
+
+    dst = msg_ensure_mbuf(sub_msg, need);
+    if (dst == NULL) {
+        return GF_ENOMEM;
+    }
+
+    if (keylen != 0) {
+        kpos = msg_keypos_push(sub_msg);
+        if (kpos == NULL) {
+            return GF_ENOMEM;
+        }
+        kpos->start = dst->last + MEMCACHE_BINARY_HEADER_LEN + extlen;
+        kpos->end = kpos->start + keylen;
+    }
+
+    sub_msg->end = dst->last;
+    mbuf_copy(dst, p, need);
+    sub_msg->mlen += need;
+    *pos = p + need;
+
+    return memcache_binary_copy(sub_msg, mbuf, pos,
+                                MEMCACHE_BINARY_BODYLEN(p) - extlen - keylen);
+}
+
+/*
+ * Split a run of quiet packets into one pipeline per backend, each of them
+ * ended by the last packet of the run or by a NOOP, so that every backend
+ * answers with a single response. Packets are copied to the fragments in
+ * their order; msg->frag->seq maps the i-th key to its fragment.
+ */
+rstatus_t
+memcache_binary_fragment(struct msg *r, uint32_t nserver,
+                         struct msg_tqh *frag_msgq)
+{
+    rstatus_t status;
+    struct msg **sub_msgs, *sub_msg, *tmsg;
+    struct keypos *kpos;
+    struct mbuf *mbuf;
+    uint8_t *p, *last;
+    uint32_t i, idx, nkey;
+    bool single;
+
+    nkey = array_n(r->keys);
+    if (nkey <= 1) {
+        return GF_OK;
+    }
+
+    /* a run of packets for a single backend is forwarded as it is */
+    kpos = array_get(r->keys, 0);
+    idx = msg_backend_idx(r, kpos->start, (uint32_t)(kpos->end - kpos->start));
+    for (single = true, i = 1; i < nkey && single; i++) {
+        kpos = array_get(r->keys, i);
+        single = msg_backend_idx(r, kpos->start,
+                                 (uint32_t)(kpos->end - kpos->start)) == idx;
+    }
+    if (single) {
+        return GF_OK;
+    }
+
+    sub_msgs = gf_zalloc(nserver * sizeof(*sub_msgs));
+    if (sub_msgs == NULL) {
+        return GF_ENOMEM;
+    }
+
+    if (msg_frag_get(r) == NULL) {
+        gf_free(sub_msgs);
+        return GF_ENOMEM;
+    }
+
+    r->frag->seq = gf_alloc(nkey * sizeof(*r->frag->seq));
+    if (r->frag->seq == NULL) {
+        status = GF_ENOMEM;
+        goto error;
+    }
+
+    last = r->end;
+    mbuf = STAILQ_FIRST(&r->mhdr);
+    p = mbuf->pos;
+
+    for (i = 0; i < nkey; i++) {
+        while (p == mbuf->last) {
+            mbuf = STAILQ_NEXT(mbuf, next);
+            p = mbuf->pos;
+        }
+
+        kpos = array_get(r->keys, i);
+        idx = msg_backend_idx(r, kpos->start,
+                              (uint32_t)(kpos->end - kpos->start));
+        ASSERT(idx < nserver);
+
+        sub_msg = sub_msgs[idx];
+        if (sub_msg == NULL) {
+            sub_msg = msg_get(r->owner, r->request, r->redis);
+            if (sub_msg == NULL) {
+                status = GF_ENOMEM;
+                goto error;
+            }
+            sub_msg->type = r->type;
+            msg_frag_add(r->frag, sub_msg);
+
+            sub_msgs[idx] = sub_msg;
+            TAILQ_INSERT_TAIL(frag_msgq, sub_msg, m_tqe);
+        }
+        r->frag->seq[i] = sub_msg;
+
+        status = memcache_binary_append_packet(sub_msg, &mbuf, &p);
+        if (status != GF_OK) {
+            goto error;
+        }
+    }
+
+    /*
+     * End every pipeline but the one that got the last packet with the
+     * NOOP that ends the run, or a NOOP with the opaque of the last packet
+     */
+    TAILQ_FOREACH(sub_msg, frag_msgq, m_tqe) {
+        if (memcache_binary_last(memcache_binary_command(
+                MEMCACHE_BINARY_OPCODE(sub_msg->end)))) {
+            continue;
+        }
+
+        status = msg_append(sub_msg, last, MEMCACHE_BINARY_HEADER_LEN);
+        if (status != GF_OK) {
+            goto error;
+        }
+        sub_msg->end = NULL;
+
+        if (MEMCACHE_BINARY_OPCODE(last) != MEMCACHE_BINARY_OP_NOOP) {
+            mbuf = STAILQ_LAST(&sub_msg->mhdr, mbuf, next);
+            p = mbuf->last - MEMCACHE_BINARY_HEADER_LEN;
+            memset(p, 0, MEMCACHE_BINARY_HEADER_LEN);
+            p[0] = MEMCACHE_BINARY_REQ_MAGIC;
+            p[1] = MEMCACHE_BINARY_OP_NOOP;
+            gf_memcpy(p + 12, last + 12, 4);
+        }
+    }
+
+    gf_free(sub_msgs);
+
+    log_debug(LOG_VERB, "fragment req %"PRIu64" with %"PRIu32" keys into "
+              "%"PRIu32" pipelines", r->id, nkey, r->frag->nfrag);
+
+    return GF_OK;
+
+error:
+    for (sub_msg = TAILQ_FIRST(frag_msgq); sub_msg != NULL; sub_msg = tmsg) {
+        tmsg = TAILQ_NEXT(sub_msg, m_tqe);
+        TAILQ_REMOVE(frag_msgq, sub_msg, m_tqe);
+        msg_put(sub_msg);
+    }
+    gf_free(sub_msgs);
+    msg_frag_put(r);
+
+    return status;
+}
+
+void
+memcache_binary_pre_coalesce(struct msg *r)
+{
+    ASSERT(!r->request);
+    ASSERT(r->peer->request);
+}
+
+/*
+ * Move the data of src before upto, or all of it if upto is NULL, to the
+ * tail of dst. Whole mbufs are moved; only the part of the mbuf holding
+ * upto that precedes it is copied.
+ */
+static rstatus_t
+memcache_binary_move(struct msg *dst, struct msg *src, uint8_t *upto)
+{
+    rstatus_t status;
+    struct mbuf *mbuf;
+    uint32_t n;
+
+    while ((mbuf = STAILQ_FIRST(&src->mhdr)) != NULL) {
+        if (upto != NULL && upto >= mbuf->pos && upto < mbuf->last) {
+            n = (uint32_t)(upto - mbuf->pos);
+            if (n != 0) {
+                status = msg_append(dst, mbuf->pos, n);
+                if (status != GF_OK) {
+                    return status;
+                }
+                mbuf->pos = upto;
+                src->mlen -= n;
+            }
+            return GF_OK;
+        }
+
+        n = mbuf_length(mbuf);
+        mbuf_remove(&src->mhdr, mbuf);
+        mbuf_insert(&dst->mhdr, mbuf);
+        src->mlen -= n;
+        dst->mlen += n;
+    }
+
+    return GF_OK;
+}
+
+/*
+ * Merge the responses of the pipelines of a fragmented request into the
+ * response of the request: the quiet replies of every pipeline, grouped by
+ * pipeline, followed by the reply to the last packet of the request. Clients
+ * pair quiet replies with their requests by opaque, so only the final reply
+ * has to come last. The replies to the NOOPs that ended the other pipelines
+ * are dropped.
+ */
+void
+memcache_binary_post_coalesce(struct msg *r)
+{
+    struct msg *rsp = r->peer; /* peer response */
+    struct msg *sub_msg, *last_msg, *sub_rsp;
+    struct mbuf *mbuf;
+    rstatus_t status;
+
+    ASSERT(r->request && r->frag->owner == r);
+    ASSERT(!r->error && r->frag->nerror == 0);
+    ASSERT(rsp != NULL && !rsp->request);
+
+    last_msg = r->frag->seq[array_n(r->keys) - 1];
+
+    for (sub_msg = TAILQ_NEXT(r, c_tqe);
+         sub_msg != NULL && sub_msg->frag == r->frag;
+         sub_msg = TAILQ_NEXT(sub_msg, c_tqe)) {
+        sub_rsp = sub_msg->peer;
+        if (sub_msg == last_msg) {
+            continue;
+        }
+
+        status = memcache_binary_move(rsp, sub_rsp, sub_rsp->end);
+        if (status != GF_OK) {
+            rsp->error = 1;
+            return;
+        }
+
+        /* drop the reply to the NOOP that ended the pipeline */
+        while ((mbuf = STAILQ_FIRST(&sub_rsp->mhdr)) != NULL) {
+            mbuf_remove(&sub_rsp->mhdr, mbuf);
+            mbuf_put(mbuf);
+        }
+        sub_rsp->mlen = 0;
+    }
+
+    sub_rsp = last_msg->peer;
+    status = memcache_binary_move(rsp, sub_rsp, NULL);
+    if (status != GF_OK) {
+        rsp->error = 1;
+        return;
+    }
+    rsp->type = sub_rsp->type;
+}
+
+/*
+ * Fill the response header of the packet whose request header is at req
+ */
+static void
+memcache_binary_header(uint8_t *p, const uint8_t *req, uint16_t status,
+                       uint32_t bodylen)
+{
+    memset(p, 0, MEMCACHE_BINARY_HEADER_LEN);
+    p[0] = MEMCACHE_BINARY_RSP_MAGIC;
+    p[1] = MEMCACHE_BINARY_OPCODE(req);
+    p[6] = (uint8_t)(status >> 8);
+    p[7] = (uint8_t)status;
+    p[8] = (uint8_t)(bodylen >> 24);
+    p[9] = (uint8_t)(bodylen >> 16);
+    p[10] = (uint8_t)(bodylen >> 8);
+    p[11] = (uint8_t)bodylen;
+    gf_memcpy(p + 12, req + 12, 4); /* opaque */
+}
+
+rstatus_t
+memcache_binary_reply(struct msg *r)
+{
+    struct msg *rsp = r->peer;
+    uint8_t header[MEMCACHE_BINARY_HEADER_LEN];
+    rstatus_t status;
+
+    ASSERT(rsp != NULL);
+    ASSERT(r->end != NULL);
+
+    switch (r->type) {
+    case MSG_REQ_MC_NOOP:
+        memcache_binary_header(header, r->end, 0, 0);
+        return msg_append(rsp, header, sizeof(header));
+
+    case MSG_REQ_MC_VERSION:
+        memcache_binary_header(header, r->end, 0, rsp_version.len);
+        status = msg_append(rsp, header, sizeof(header));
+        if (status != GF_OK) {
+            return status;
+        }
+        return msg_append(rsp, rsp_version.data, rsp_version.len);
+
+    default:
+        NOT_REACHED();
+        return GF_ERROR;
+    }
+}
+
+/*
+ * Error response to request r, with the opcode and opaque of its last packet
+ */
+struct msg *
+memcache_binary_error(struct msg *r, err_t err)
+{
+    struct msg *msg;
+    uint8_t header[MEMCACHE_BINARY_HEADER_LEN];
+    const char *errstr = err ? strerror(err) : "unknown";
+    uint32_t len;
+
+    ASSERT(r->request && r->end != NULL);
+
+    msg = msg_get(r->owner, false, false);
+    if (msg == NULL) {
+        return NULL;
+    }
+
+    len = (uint32_t)gf_strlen(errstr);
+    memcache_binary_header(header, r->end, err == ENOMEM ? 0x0082 : 0x0084,
+                           len);
+
+    if (msg_append(msg, header, sizeof(header)) != GF_OK ||
+        msg_append(msg, (uint8_t *)errstr, len) != GF_OK) {
+        msg_put(msg);
+        return NULL;
+    }
+    msg->type = MSG_RSP_MC_SERVER_ERROR;
+
+    log_debug(LOG_VVERB, "get msg %p id %"PRIu64" len %"PRIu32" error '%s'",
+              msg, msg->id, msg->mlen, errstr);
+
+    return msg;
+}
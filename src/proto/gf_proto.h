@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2024-2024, yanruibinghxu@gmail.com All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __GF_PROTO_H__
+#define __GF_PROTO_H__
+
+#include <gf_core.h>
+
+#define MEMCACHE_MAX_KEY_LENGTH 250     /* max key length in bytes */
+
+void memcache_parse_req(struct msg *r);
+void memcache_parse_rsp(struct msg *r);
+bool memcache_failure(const struct msg *r);
+rstatus_t memcache_fragment(struct msg *r, uint32_t nserver, struct msg_tqh *frag_msgq);
+void memcache_pre_coalesce(struct msg *r);
+void memcache_post_coalesce(struct msg *r);
+void memcache_post_connect(struct context *ctx, struct conn *conn, struct server *server);
+void memcache_swallow_msg(struct conn *conn, struct msg *pmsg, struct msg *msg);
+
+void memcache_binary_parse_req(struct msg *r);
+void memcache_binary_parse_rsp(struct msg *r);
+rstatus_t memcache_binary_fragment(struct msg *r, uint32_t nserver, struct msg_tqh *frag_msgq);
+void memcache_binary_pre_coalesce(struct msg *r);
+void memcache_binary_post_coalesce(struct msg *r);
+rstatus_t memcache_binary_reply(struct msg *r);
+struct msg *memcache_binary_error(struct msg *r, err_t err);
+
+void redis_init(void);
+void redis_parse_req(struct msg *r);
+void redis_parse_rsp(struct msg *r);
+bool redis_failure(const struct msg *r);
+bool redis_redirect(struct context *ctx, struct conn *conn, struct msg *r);
+rstatus_t redis_fragment(struct msg *r, uint32_t nserver, struct msg_tqh *frag_msgq);
+void redis_pre_coalesce(struct msg *r);
+void redis_post_coalesce(struct msg *r);
+rstatus_t redis_reply(struct msg *r);
+void redis_post_connect(struct context *ctx, struct conn *conn, struct server *server);
+void redis_swallow_msg(struct conn *conn, struct msg *pmsg, struct msg *msg);
+
+#endif
@@ -0,0 +1,2829 @@
+/*
+ * Copyright (c) 2024-2024, yanruibinghxu@gmail.com All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <ctype.h>
+
+#include <gf_core.h>
+#include <hashkit/gf_hashkit.h>
+#include <proto/gf_proto.h>
+
+#define REDIS_CMD_LOCAL     0x01    /* replied by the proxy itself */
+#define REDIS_CMD_QUIT      0x02    /* passive close */
+#define REDIS_CMD_ARGS      0x04    /* all arguments are kept in msg->keys */
+#define REDIS_CMD_NUMKEYS   0x08    /* # keys is the argument before firstkey */
+#define REDIS_CMD_FRAGMENT  0x10    /* keys are split across servers */
+#define REDIS_CMD_ARG1      0x20    /* only the first argument is kept */
+#define REDIS_CMD_ECHO      0x40    /* the last argument is echoed back */
+
+#define REDIS_CMD_MAXLEN    32      /* max length of a known command name */
+
+/*
+ * Bytes around an argument that must fit in the same mbuf as the argument
+ * itself: "$<len>\r\n" in front of it and "\r\n" after it.
+ */
+#define REDIS_ARG_SLACK     16
+
+#define REDIS_REDIRECT_MAX          5       /* max # redirects of a request */
+#define REDIS_REDIRECT_MAXLEN       128     /* max length of a redirect reply */
+#define REDIS_CLUSTER_REFRESH_USEC  1000000 /* min interval of slot map loads */
+
+struct redis_command {
+    struct string name;             /* lowercase command name */
+    msg_type_t    type;             /* request type */
+    int           arity;            /* # args, -N means >= N */
+    int           firstkey;         /* first key argument, 0 if none */
+    int           lastkey;          /* last key argument, -1 is the last argument */
+    int           step;             /* step between key arguments */
+    unsigned      flags;            /* REDIS_CMD_* */
+};
+
+/*
+ * Redis commands sorted by name, which is also the order of their request
+ * type in msg_type_t, so that the table can be searched by name and indexed
+ * by type alike. Key specifications follow the redis command table.
+ */
+static const struct redis_command redis_commands[] = {
+    { string("append"), MSG_REQ_REDIS_APPEND, 3, 1, 1, 1, 0 },
+    { string("asking"), MSG_REQ_REDIS_ASKING, 1, 0, 0, 0, REDIS_CMD_LOCAL },
+    { string("auth"), MSG_REQ_REDIS_AUTH, -2, 0, 0, 0, REDIS_CMD_LOCAL | REDIS_CMD_ARGS },
+    { string("bitcount"), MSG_REQ_REDIS_BITCOUNT, -2, 1, 1, 1, 0 },
+    { string("bitop"), MSG_REQ_REDIS_BITOP, -4, 2, -1, 1, 0 },
+    { string("bitpos"), MSG_REQ_REDIS_BITPOS, -3, 1, 1, 1, 0 },
+    { string("client"), MSG_REQ_REDIS_CLIENT, -2, 0, 0, 0, REDIS_CMD_LOCAL | REDIS_CMD_ARG1 },
+    { string("cluster"), MSG_REQ_REDIS_CLUSTER, -2, 0, 0, 0, REDIS_CMD_LOCAL },
+    { string("command"), MSG_REQ_REDIS_COMMAND, -1, 0, 0, 0, REDIS_CMD_LOCAL | REDIS_CMD_ARGS },
+    { string("decr"), MSG_REQ_REDIS_DECR, 2, 1, 1, 1, 0 },
+    { string("decrby"), MSG_REQ_REDIS_DECRBY, 3, 1, 1, 1, 0 },
+    { string("del"), MSG_REQ_REDIS_DEL, -2, 1, -1, 1, REDIS_CMD_FRAGMENT },
+    { string("dump"), MSG_REQ_REDIS_DUMP, 2, 1, 1, 1, 0 },
+    { string("echo"), MSG_REQ_REDIS_ECHO, 2, 0, 0, 0, REDIS_CMD_LOCAL | REDIS_CMD_ECHO },
+    { string("eval"), MSG_REQ_REDIS_EVAL, -3, 3, 0, 1, REDIS_CMD_NUMKEYS },
+    { string("evalsha"), MSG_REQ_REDIS_EVALSHA, -3, 3, 0, 1, REDIS_CMD_NUMKEYS },
+    { string("exists"), MSG_REQ_REDIS_EXISTS, -2, 1, -1, 1, REDIS_CMD_FRAGMENT },
+    { string("expire"), MSG_REQ_REDIS_EXPIRE, -3, 1, 1, 1, 0 },
+    { string("expireat"), MSG_REQ_REDIS_EXPIREAT, -3, 1, 1, 1, 0 },
+    { string("geoadd"), MSG_REQ_REDIS_GEOADD, -5, 1, 1, 1, 0 },
+    { string("geodist"), MSG_REQ_REDIS_GEODIST, -4, 1, 1, 1, 0 },
+    { string("geohash"), MSG_REQ_REDIS_GEOHASH, -2, 1, 1, 1, 0 },
+    { string("geopos"), MSG_REQ_REDIS_GEOPOS, -2, 1, 1, 1, 0 },
+    { string("georadius"), MSG_REQ_REDIS_GEORADIUS, -6, 1, 1, 1, 0 },
+    { string("georadiusbymember"), MSG_REQ_REDIS_GEORADIUSBYMEMBER, -5, 1, 1, 1, 0 },
+    { string("geosearch"), MSG_REQ_REDIS_GEOSEARCH, -7, 1, 1, 1, 0 },
+    { string("get"), MSG_REQ_REDIS_GET, 2, 1, 1, 1, 0 },
+    { string("getbit"), MSG_REQ_REDIS_GETBIT, 3, 1, 1, 1, 0 },
+    { string("getdel"), MSG_REQ_REDIS_GETDEL, 2, 1, 1, 1, 0 },
+    { string("getex"), MSG_REQ_REDIS_GETEX, -2, 1, 1, 1, 0 },
+    { string("getrange"), MSG_REQ_REDIS_GETRANGE, 4, 1, 1, 1, 0 },
+    { string("getset"), MSG_REQ_REDIS_GETSET, 3, 1, 1, 1, 0 },
+    { string("hdel"), MSG_REQ_REDIS_HDEL, -3, 1, 1, 1, 0 },
+    { string("hello"), MSG_REQ_REDIS_HELLO, -1, 0, 0, 0, REDIS_CMD_LOCAL | REDIS_CMD_ARGS },
+    { string("hexists"), MSG_REQ_REDIS_HEXISTS, 3, 1, 1, 1, 0 },
+    { string("hget"), MSG_REQ_REDIS_HGET, 3, 1, 1, 1, 0 },
+    { string("hgetall"), MSG_REQ_REDIS_HGETALL, 2, 1, 1, 1, 0 },
+    { string("hincrby"), MSG_REQ_REDIS_HINCRBY, 4, 1, 1, 1, 0 },
+    { string("hincrbyfloat"), MSG_REQ_REDIS_HINCRBYFLOAT, 4, 1, 1, 1, 0 },
+    { string("hkeys"), MSG_REQ_REDIS_HKEYS, 2, 1, 1, 1, 0 },
+    { string("hlen"), MSG_REQ_REDIS_HLEN, 2, 1, 1, 1, 0 },
+    { string("hmget"), MSG_REQ_REDIS_HMGET, -3, 1, 1, 1, 0 },
+    { string("hmset"), MSG_REQ_REDIS_HMSET, -4, 1, 1, 1, 0 },
+    { string("hrandfield"), MSG_REQ_REDIS_HRANDFIELD, -2, 1, 1, 1, 0 },
+    { string("hscan"), MSG_REQ_REDIS_HSCAN, -3, 1, 1, 1, 0 },
+    { string("hset"), MSG_REQ_REDIS_HSET, -4, 1, 1, 1, 0 },
+    { string("hsetnx"), MSG_REQ_REDIS_HSETNX, 4, 1, 1, 1, 0 },
+    { string("hstrlen"), MSG_REQ_REDIS_HSTRLEN, 3, 1, 1, 1, 0 },
+    { string("hvals"), MSG_REQ_REDIS_HVALS, 2, 1, 1, 1, 0 },
+    { string("incr"), MSG_REQ_REDIS_INCR, 2, 1, 1, 1, 0 },
+    { string("incrby"), MSG_REQ_REDIS_INCRBY, 3, 1, 1, 1, 0 },
+    { string("incrbyfloat"), MSG_REQ_REDIS_INCRBYFLOAT, 3, 1, 1, 1, 0 },
+    { string("lindex"), MSG_REQ_REDIS_LINDEX, 3, 1, 1, 1, 0 },
+    { string("linsert"), MSG_REQ_REDIS_LINSERT, 5, 1, 1, 1, 0 },
+    { string("llen"), MSG_REQ_REDIS_LLEN, 2, 1, 1, 1, 0 },
+    { string("lmove"), MSG_REQ_REDIS_LMOVE, 5, 1, 2, 1, 0 },
+    { string("lpop"), MSG_REQ_REDIS_LPOP, -2, 1, 1, 1, 0 },
+    { string("lpos"), MSG_REQ_REDIS_LPOS, -3, 1, 1, 1, 0 },
+    { string("lpush"), MSG_REQ_REDIS_LPUSH, -3, 1, 1, 1, 0 },
+    { string("lpushx"), MSG_REQ_REDIS_LPUSHX, -3, 1, 1, 1, 0 },
+    { string("lrange"), MSG_REQ_REDIS_LRANGE, 4, 1, 1, 1, 0 },
+    { string("lrem"), MSG_REQ_REDIS_LREM, 4, 1, 1, 1, 0 },
+    { string("lset"), MSG_REQ_REDIS_LSET, 4, 1, 1, 1, 0 },
+    { string("ltrim"), MSG_REQ_REDIS_LTRIM, 4, 1, 1, 1, 0 },
+    { string("mget"), MSG_REQ_REDIS_MGET, -2, 1, -1, 1, REDIS_CMD_FRAGMENT },
+    { string("mset"), MSG_REQ_REDIS_MSET, -3, 1, -1, 2, REDIS_CMD_FRAGMENT },
+    { string("persist"), MSG_REQ_REDIS_PERSIST, 2, 1, 1, 1, 0 },
+    { string("pexpire"), MSG_REQ_REDIS_PEXPIRE, -3, 1, 1, 1, 0 },
+    { string("pexpireat"), MSG_REQ_REDIS_PEXPIREAT, -3, 1, 1, 1, 0 },
+    { string("pfadd"), MSG_REQ_REDIS_PFADD, -2, 1, 1, 1, 0 },
+    { string("pfcount"), MSG_REQ_REDIS_PFCOUNT, -2, 1, -1, 1, 0 },
+    { string("pfmerge"), MSG_REQ_REDIS_PFMERGE, -2, 1, -1, 1, 0 },
+    { string("ping"), MSG_REQ_REDIS_PING, -1, 0, 0, 0, REDIS_CMD_LOCAL | REDIS_CMD_ECHO },
+    { string("psetex"), MSG_REQ_REDIS_PSETEX, 4, 1, 1, 1, 0 },
+    { string("pttl"), MSG_REQ_REDIS_PTTL, 2, 1, 1, 1, 0 },
+    { string("quit"), MSG_REQ_REDIS_QUIT, -1, 0, 0, 0, REDIS_CMD_LOCAL | REDIS_CMD_QUIT },
+    { string("rename"), MSG_REQ_REDIS_RENAME, 3, 1, 2, 1, 0 },
+    { string("renamenx"), MSG_REQ_REDIS_RENAMENX, 3, 1, 2, 1, 0 },
+    { string("restore"), MSG_REQ_REDIS_RESTORE, -4, 1, 1, 1, 0 },
+    { string("rpop"), MSG_REQ_REDIS_RPOP, -2, 1, 1, 1, 0 },
+    { string("rpoplpush"), MSG_REQ_REDIS_RPOPLPUSH, 3, 1, 2, 1, 0 },
+    { string("rpush"), MSG_REQ_REDIS_RPUSH, -3, 1, 1, 1, 0 },
+    { string("rpushx"), MSG_REQ_REDIS_RPUSHX, -3, 1, 1, 1, 0 },
+    { string("sadd"), MSG_REQ_REDIS_SADD, -3, 1, 1, 1, 0 },
+    { string("scard"), MSG_REQ_REDIS_SCARD, 2, 1, 1, 1, 0 },
+    { string("sdiff"), MSG_REQ_REDIS_SDIFF, -2, 1, -1, 1, 0 },
+    { string("sdiffstore"), MSG_REQ_REDIS_SDIFFSTORE, -3, 1, -1, 1, 0 },
+    { string("select"), MSG_REQ_REDIS_SELECT, 2, 0, 0, 0, REDIS_CMD_LOCAL | REDIS_CMD_ARGS },
+    { string("set"), MSG_REQ_REDIS_SET, -3, 1, 1, 1, 0 },
+    { string("setbit"), MSG_REQ_REDIS_SETBIT, 4, 1, 1, 1, 0 },
+    { string("setex"), MSG_REQ_REDIS_SETEX, 4, 1, 1, 1, 0 },
+    { string("setnx"), MSG_REQ_REDIS_SETNX, 3, 1, 1, 1, 0 },
+    { string("setrange"), MSG_REQ_REDIS_SETRANGE, 4, 1, 1, 1, 0 },
+    { string("sinter"), MSG_REQ_REDIS_SINTER, -2, 1, -1, 1, 0 },
+    { string("sinterstore"), MSG_REQ_REDIS_SINTERSTORE, -3, 1, -1, 1, 0 },
+    { string("sismember"), MSG_REQ_REDIS_SISMEMBER, 3, 1, 1, 1, 0 },
+    { string("smembers"), MSG_REQ_REDIS_SMEMBERS, 2, 1, 1, 1, 0 },
+    { string("smismember"), MSG_REQ_REDIS_SMISMEMBER, -3, 1, 1, 1, 0 },
+    { string("smove"), MSG_REQ_REDIS_SMOVE, 4, 1, 2, 1, 0 },
+    { string("sort"), MSG_REQ_REDIS_SORT, -2, 1, 1, 1, 0 },
+    { string("spop"), MSG_REQ_REDIS_SPOP, -2, 1, 1, 1, 0 },
+    { string("srandmember"), MSG_REQ_REDIS_SRANDMEMBER, -2, 1, 1, 1, 0 },
+    { string("srem"), MSG_REQ_REDIS_SREM, -3, 1, 1, 1, 0 },
+    { string("sscan"), MSG_REQ_REDIS_SSCAN, -3, 1, 1, 1, 0 },
+    { string("strlen"), MSG_REQ_REDIS_STRLEN, 2, 1, 1, 1, 0 },
+    { string("sunion"), MSG_REQ_REDIS_SUNION, -2, 1, -1, 1, 0 },
+    { string("sunionstore"), MSG_REQ_REDIS_SUNIONSTORE, -3, 1, -1, 1, 0 },
+    { string("touch"), MSG_REQ_REDIS_TOUCH, -2, 1, -1, 1, REDIS_CMD_FRAGMENT },
+    { string("ttl"), MSG_REQ_REDIS_TTL, 2, 1, 1, 1, 0 },
+    { string("type"), MSG_REQ_REDIS_TYPE, 2, 1, 1, 1, 0 },
+    { string("unlink"), MSG_REQ_REDIS_UNLINK, -2, 1, -1, 1, REDIS_CMD_FRAGMENT },
+    { string("xack"), MSG_REQ_REDIS_XACK, -4, 1, 1, 1, 0 },
+    { string("xadd"), MSG_REQ_REDIS_XADD, -5, 1, 1, 1, 0 },
+    { string("xclaim"), MSG_REQ_REDIS_XCLAIM, -6, 1, 1, 1, 0 },
+    { string("xdel"), MSG_REQ_REDIS_XDEL, -3, 1, 1, 1, 0 },
+    { string("xlen"), MSG_REQ_REDIS_XLEN, 2, 1, 1, 1, 0 },
+    { string("xpending"), MSG_REQ_REDIS_XPENDING, -3, 1, 1, 1, 0 },
+    { string("xrange"), MSG_REQ_REDIS_XRANGE, -4, 1, 1, 1, 0 },
+    { string("xrevrange"), MSG_REQ_REDIS_XREVRANGE, -4, 1, 1, 1, 0 },
+    { string("xtrim"), MSG_REQ_REDIS_XTRIM, -4, 1, 1, 1, 0 },
+    { string("zadd"), MSG_REQ_REDIS_ZADD, -4, 1, 1, 1, 0 },
+    { string("zcard"), MSG_REQ_REDIS_ZCARD, 2, 1, 1, 1, 0 },
+    { string("zcount"), MSG_REQ_REDIS_ZCOUNT, 4, 1, 1, 1, 0 },
+    { string("zincrby"), MSG_REQ_REDIS_ZINCRBY, 4, 1, 1, 1, 0 },
+    { string("zinterstore"), MSG_REQ_REDIS_ZINTERSTORE, -4, 1, 1, 1, 0 },
+    { string("zlexcount"), MSG_REQ_REDIS_ZLEXCOUNT, 4, 1, 1, 1, 0 },
+    { string("zmscore"), MSG_REQ_REDIS_ZMSCORE, -3, 1, 1, 1, 0 },
+    { string("zpopmax"), MSG_REQ_REDIS_ZPOPMAX, -2, 1, 1, 1, 0 },
+    { string("zpopmin"), MSG_REQ_REDIS_ZPOPMIN, -2, 1, 1, 1, 0 },
+    { string("zrandmember"), MSG_REQ_REDIS_ZRANDMEMBER, -2, 1, 1, 1, 0 },
+    { string("zrange"), MSG_REQ_REDIS_ZRANGE, -4, 1, 1, 1, 0 },
+    { string("zrangebylex"), MSG_REQ_REDIS_ZRANGEBYLEX, -4, 1, 1, 1, 0 },
+    { string("zrangebyscore"), MSG_REQ_REDIS_ZRANGEBYSCORE, -4, 1, 1, 1, 0 },
+    { string("zrank"), MSG_REQ_REDIS_ZRANK, 3, 1, 1, 1, 0 },
+    { string("zrem"), MSG_REQ_REDIS_ZREM, -3, 1, 1, 1, 0 },
+    { string("zremrangebylex"), MSG_REQ_REDIS_ZREMRANGEBYLEX, 4, 1, 1, 1, 0 },
+    { string("zremrangebyrank"), MSG_REQ_REDIS_ZREMRANGEBYRANK, 4, 1, 1, 1, 0 },
+    { string("zremrangebyscore"), MSG_REQ_REDIS_ZREMRANGEBYSCORE, 4, 1, 1, 1, 0 },
+    { string("zrevrange"), MSG_REQ_REDIS_ZREVRANGE, -4, 1, 1, 1, 0 },
+    { string("zrevrangebylex"), MSG_REQ_REDIS_ZREVRANGEBYLEX, -4, 1, 1, 1, 0 },
+    { string("zrevrangebyscore"), MSG_REQ_REDIS_ZREVRANGEBYSCORE, -4, 1, 1, 1, 0 },
+    { string("zrevrank"), MSG_REQ_REDIS_ZREVRANK, 3, 1, 1, 1, 0 },
+    { string("zscan"), MSG_REQ_REDIS_ZSCAN, -3, 1, 1, 1, 0 },
+    { string("zscore"), MSG_REQ_REDIS_ZSCORE, 3, 1, 1, 1, 0 },
+    { string("zunionstore"), MSG_REQ_REDIS_ZUNIONSTORE, -4, 1, 1, 1, 0 },
+};
+
+/*
+ * Replies of the proxy that never change are static mbufs, which replies
+ * take slices of instead of a copy
+ */
+static struct mbuf rsp_ok = MBUF_STATIC("+OK\r\n");
+static struct mbuf rsp_pong = MBUF_STATIC("+PONG\r\n");
+static struct mbuf rsp_ping_arity = MBUF_STATIC("-ERR wrong number of arguments for 'ping' command\r\n");
+static struct mbuf rsp_null = MBUF_STATIC("$-1\r\n");
+static struct mbuf rsp_empty_array = MBUF_STATIC("*0\r\n");
+static struct mbuf rsp_empty_map = MBUF_STATIC("%0\r\n");
+static struct mbuf rsp_unknown_command = MBUF_STATIC("-ERR unknown command\r\n");
+static struct mbuf rsp_unknown_subcommand = MBUF_STATIC("-ERR unknown subcommand\r\n");
+static struct mbuf rsp_auth_required = MBUF_STATIC("-NOAUTH Authentication required.\r\n");
+static struct mbuf rsp_no_password = MBUF_STATIC("-ERR Client sent AUTH, but no password is set\r\n");
+static struct mbuf rsp_invalid_password = MBUF_STATIC("-ERR invalid password\r\n");
+static struct mbuf rsp_select_unsupported = MBUF_STATIC("-ERR SELECT of a db other than the pool's redis_db is not supported\r\n");
+static struct mbuf rsp_noproto = MBUF_STATIC("-NOPROTO unsupported protocol version\r\n");
+
+/* requests of the proxy to redis cluster */
+static struct mbuf req_asking = MBUF_STATIC("*1\r\n$6\r\nASKING\r\n");
+static struct mbuf req_cluster_slots = MBUF_STATIC("*2\r\n$7\r\nCLUSTER\r\n$5\r\nSLOTS\r\n");
+
+/* ":<# command>\r\n", set by redis_init() */
+static uint8_t rsp_command_count_buf[GF_UINT32_MAXLEN + 3];
+static struct mbuf rsp_command_count;
+
+static const struct string hello_auth = string("auth");
+static const struct string hello_setname = string("setname");
+static const struct string subcmd_count = string("count");
+static const struct string subcmd_docs = string("docs");
+static const struct string subcmd_getname = string("getname");
+static const struct string subcmd_setinfo = string("setinfo");
+static const struct string subcmd_setname = string("setname");
+
+static inline rstatus_t
+redis_append_static(struct msg *rsp, struct mbuf *mbuf)
+{
+    ASSERT(mbuf_static(mbuf));
+
+    return msg_append_slice(rsp, mbuf, mbuf->pos, mbuf_length(mbuf));
+}
+
+/*
+ * Cursor over the CR delimiters of a buffer. The positions of CR are
+ * computed for a 64 byte window at a time with gf_memmask(), so that
+ * finding the end of each following header line costs a shift and a bit
+ * scan, and bulk payloads skipped by length are never looked at.
+ */
+struct redis_crscan {
+    uint8_t  *base;                 /* start of window */
+    uint8_t  *end;                  /* end of window */
+    uint64_t mask;                  /* positions of CR in [base, end) */
+};
+
+static inline void
+redis_crscan_init(struct redis_crscan *s)
+{
+    s->base = NULL;
+    s->end = NULL;
+    s->mask = 0;
+}
+
+/*
+ * Return the first CR in [p, last) or NULL
+ */
+static inline uint8_t *
+redis_crscan_next(struct redis_crscan *s, uint8_t *p, uint8_t *last)
+{
+    uint64_t mask;
+
+    for (;;) {
+        if (p >= s->base && p < s->end) {
+            mask = s->mask >> (p - s->base);
+            if (mask != 0) {
+                return p + __builtin_ctzll(mask);
+            }
+            p = s->end;
+        }
+
+        if (p >= last) {
+            return NULL;
+        }
+
+        s->base = p;
+        s->end = p + ((last - p) < 64 ? (last - p) : 64);
+        s->mask = gf_memmask(p, last, CR);
+    }
+}
+
+/*
+ * Parse the decimal number in [p, last) into v. Return false if it is empty,
+ * has a non digit or does not fit in 32 bits.
+ */
+static inline bool
+redis_atou(const uint8_t *p, const uint8_t *last, uint32_t *v)
+{
+    uint64_t n;
+
+    if (p == last || last - p > 10) {
+        return false;
+    }
+
+    for (n = 0; p < last; p++) {
+        if ((uint8_t)(*p - '0') > 9) {
+            return false;
+        }
+        n = n * 10 + (uint64_t)(*p - '0');
+    }
+
+    if (n > UINT32_MAX) {
+        return false;
+    }
+
+    *v = (uint32_t)n;
+
+    return true;
+}
+
+static const struct redis_command *
+redis_command_lookup(const uint8_t *name, uint32_t len)
+{
+    uint8_t lname[REDIS_CMD_MAXLEN];
+    const struct redis_command *cmd;
+    uint32_t i, lo, hi, mid;
+    int cmp;
+
+    if (len == 0 || len > REDIS_CMD_MAXLEN) {
+        return NULL;
+    }
+
+    for (i = 0; i < len; i++) {
+        lname[i] = (uint8_t)tolower(name[i]);
+    }
+
+    lo = 0;
+    hi = NELEMS(redis_commands);
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        cmd = &redis_commands[mid];
+
+        cmp = memcmp(lname, cmd->name.data, MIN(len, cmd->name.len));
+        if (cmp == 0) {
+            cmp = (int)len - (int)cmd->name.len;
+        }
+        if (cmp == 0) {
+            return cmd;
+        }
+
+        if (cmp < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    return NULL;
+}
+
+static inline const struct redis_command *
+redis_command(msg_type_t type)
+{
+    const struct redis_command *cmd;
+
+    ASSERT(type >= MSG_REQ_REDIS_APPEND);
+    ASSERT((uint32_t)(type - MSG_REQ_REDIS_APPEND) < NELEMS(redis_commands));
+
+    cmd = &redis_commands[type - MSG_REQ_REDIS_APPEND];
+    ASSERT(cmd->type == type);
+
+    return cmd;
+}
+
+static bool
+redis_argc_valid(const struct redis_command *cmd, uint32_t narg)
+{
+    if (cmd->arity > 0 && narg != (uint32_t)cmd->arity) {
+        return false;
+    }
+
+    if (cmd->arity < 0 && narg < (uint32_t)-cmd->arity) {
+        return false;
+    }
+
+    /* keys come in groups of step arguments, e.g. key-value pairs of mset */
+    if (cmd->lastkey < 0 && cmd->step > 1 &&
+        (narg - (uint32_t)cmd->firstkey) % (uint32_t)cmd->step != 0) {
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Return true if argument idx of request r has to be seen as a whole, that
+ * is if it is the command name, a key or an argument the proxy interprets.
+ * Such an argument has to be contiguous in a single mbuf; all the others
+ * are skipped by their length.
+ */
+static bool
+redis_arghold(struct msg *r, uint32_t idx)
+{
+    const struct redis_command *cmd;
+    uint32_t firstkey, lastkey;
+
+    if (idx == 0) {
+        if (r->rlen > REDIS_CMD_MAXLEN) {
+            /* too long to be any command we know */
+            r->noforward = 1;
+            return false;
+        }
+        return true;
+    }
+
+    if (r->type == MSG_UNKNOWN) {
+        return false;
+    }
+
+    cmd = redis_command(r->type);
+
+    if (cmd->flags & REDIS_CMD_ARGS) {
+        return true;
+    }
+
+    if (cmd->flags & REDIS_CMD_ARG1) {
+        return idx == 1;
+    }
+
+    if (cmd->flags & REDIS_CMD_ECHO) {
+        /* the reply takes the argument by reference, see redis_append_echo */
+        r->integer = r->rlen;
+        return false;
+    }
+
+    if (r->noforward) {
+        /* invalid # arguments, the request is only replied with an error */
+        return false;
+    }
+
+    firstkey = (uint32_t)cmd->firstkey;
+    if (firstkey == 0) {
+        return false;
+    }
+
+    if (cmd->flags & REDIS_CMD_NUMKEYS) {
+        return idx >= firstkey - 1 && idx < firstkey + r->integer;
+    }
+
+    lastkey = cmd->lastkey < 0 ? r->narg + (uint32_t)cmd->lastkey :
+                                 (uint32_t)cmd->lastkey;
+
+    return idx >= firstkey && idx <= lastkey &&
+           (idx - firstkey) % (uint32_t)cmd->step == 0;
+}
+
+/*
+ * Handle argument idx of request r held in [start, end). The command name
+ * sets the request type, the # keys argument of eval bounds its keys and
+ * every other argument held is recorded in msg->keys.
+ */
+static rstatus_t
+redis_arg(struct msg *r, uint32_t idx, uint8_t *start, uint8_t *end)
+{
+    const struct redis_command *cmd;
+    struct keypos *kpos;
+    uint32_t numkeys;
+
+    if (idx == 0) {
+        cmd = redis_command_lookup(start, (uint32_t)(end - start));
+        if (cmd == NULL) {
+            r->noforward = 1;
+            return GF_OK;
+        }
+
+        r->type = cmd->type;
+
+        if (!redis_argc_valid(cmd, r->narg)) {
+            r->noforward = 1;
+            return GF_OK;
+        }
+
+        if (cmd->flags & REDIS_CMD_LOCAL) {
+            r->noforward = 1;
+        }
+
+        if (cmd->flags & REDIS_CMD_QUIT) {
+            r->quit = 1;
+        }
+
+        return GF_OK;
+    }
+
+    cmd = redis_command(r->type);
+
+    if ((cmd->flags & REDIS_CMD_NUMKEYS) &&
+        idx == (uint32_t)cmd->firstkey - 1) {
+        if (!redis_atou(start, end, &numkeys) ||
+            numkeys > r->narg - (uint32_t)cmd->firstkey) {
+            r->noforward = 1;
+            return GF_OK;
+        }
+        r->integer = numkeys;
+        return GF_OK;
+    }
+
+    kpos = msg_keypos_push(r);
+    if (kpos == NULL) {
+        return GF_ENOMEM;
+    }
+    kpos->start = start;
+    kpos->end = end;
+
+    return GF_OK;
+}
+
+/*
+ * Finish a request whose last argument was parsed. Requests without keys
+ * that still have to be forwarded, like eval with no keys, are routed on a
+ * placeholder key.
+ */
+static rstatus_t
+redis_parse_req_done(struct msg *r)
+{
+    if (r->noforward || r->quit || array_n(r->keys) != 0) {
+        return GF_OK;
+    }
+
+    if (!msg_set_placeholder_key(r)) {
+        return GF_ENOMEM;
+    }
+
+    return GF_OK;
+}
+
+/*
+ * Parse a request held entirely in mbuf b, which is the common case of
+ * requests read from a socket. Header lines are found with a vectorized
+ * scan of their CR delimiters and arguments are skipped by length. Return
+ * false, with the request left untouched, if the request is incomplete or
+ * invalid, for redis_parse_req() to handle it byte by byte.
+ */
+static bool
+redis_parse_req_fast(struct msg *r, struct mbuf *b)
+{
+    struct redis_crscan s;
+    uint8_t *p, *q, *last;
+    uint32_t narg, len, idx;
+
+    p = r->pos;
+    last = b->last;
+
+    if (*p != '*') {
+        return false;
+    }
+
+    redis_crscan_init(&s);
+
+    q = redis_crscan_next(&s, p + 1, last);
+    if (q == NULL || q + 1 == last || q[1] != LF ||
+        !redis_atou(p + 1, q, &narg) || narg == 0) {
+        return false;
+    }
+
+    r->narg_start = p;
+    r->narg_end = q;
+    r->narg = narg;
+
+    p = q + CRLF_LEN;
+
+    for (idx = 0; idx < narg; idx++) {
+        if (p >= last || *p != '$') {
+            goto fail;
+        }
+
+        q = redis_crscan_next(&s, p + 1, last);
+        if (q == NULL || !redis_atou(p + 1, q, &len)) {
+            goto fail;
+        }
+
+        /* "\r\n<len bytes>\r\n" must be all in this mbuf */
+        if ((size_t)(last - q) < (size_t)len + 2 * CRLF_LEN) {
+            goto fail;
+        }
+
+        p = q + CRLF_LEN;
+        if (q[1] != LF || p[len] != CR || p[len + 1] != LF) {
+            goto fail;
+        }
+
+        r->rlen = len;
+        if (redis_arghold(r, idx)) {
+            if (len + REDIS_ARG_SLACK > mbuf_data_size()) {
+                goto fail;
+            }
+            if (redis_arg(r, idx, p, p + len) != GF_OK) {
+                goto fail;
+            }
+        }
+
+        p += len + CRLF_LEN;
+    }
+
+    if (redis_parse_req_done(r) != GF_OK) {
+        goto fail;
+    }
+
+    r->pos = p;
+    r->rnarg = 0;
+    r->rlen = 0;
+    r->result = MSG_PARSE_OK;
+
+    log_hexdump(LOG_VERB, b->pos, mbuf_length(b), "parsed req %"PRIu64" res %d "
+                "type %d state %d rpos %d of %d", r->id, r->result, r->type,
+                r->state, (int)(r->pos - b->pos), (int)(b->last - b->pos));
+
+    return true;
+
+fail:
+    r->type = MSG_UNKNOWN;
+    msg_keypos_reset(r);
+    r->narg_start = NULL;
+    r->narg_end = NULL;
+    r->narg = 0;
+    r->rlen = 0;
+    r->integer = 0;
+    r->noforward = 0;
+    r->quit = 0;
+
+    return false;
+}
+
+/*
+ * Parse a redis request in the unified protocol: a multibulk of bulk
+ * arguments, the first of which is the command name.
+ *
+ *   *<narg>\r\n
+ *   $<arg0 len>\r\n<arg0>\r\n
+ *   ...
+ *   $<argN len>\r\n<argN>\r\n
+ *
+ * The command name, keys and any argument the proxy interprets must be
+ * contiguous; when an mbuf ends in the middle of one of them, the parser
+ * rewinds to the start of its "$<len>" line and asks for more data (AGAIN)
+ * or, if the mbuf is full, for it to be moved to a new mbuf (REPAIR).
+ * Other arguments are skipped by length and may span any # mbufs.
+ */
+void
+redis_parse_req(struct msg *r)
+{
+    struct mbuf *b;
+    uint8_t *p, *m;
+    uint8_t ch;
+    enum {
+        SW_START,
+        SW_NARG,
+        SW_NARG_LF,
+        SW_ARG_LEN_START,
+        SW_ARG_LEN,
+        SW_ARG_LEN_LF,
+        SW_ARG,
+        SW_ARG_LF,
+        SW_SENTINEL
+    } state;
+
+    state = r->state;
+    b = STAILQ_LAST(&r->mhdr, mbuf, next);
+
+    ASSERT(r->request);
+    ASSERT(state >= SW_START && state < SW_SENTINEL);
+    ASSERT(b != NULL);
+    ASSERT(b->pos <= b->last);
+
+    /* validate the parsing maker */
+    ASSERT(r->pos != NULL);
+    ASSERT(r->pos >= b->pos && r->pos <= b->last);
+
+    if (state == SW_START && r->pos < b->last &&
+        redis_parse_req_fast(r, b)) {
+        return;
+    }
+
+    for (p = r->pos; p < b->last; p++) {
+        ch = *p;
+
+        switch (state) {
+
+        case SW_START:
+            if (ch != '*') {
+                goto error;
+            }
+            r->token = p;
+            r->narg_start = p;
+            r->rnarg = 0;
+            state = SW_NARG;
+
+            break;
+
+        case SW_NARG:
+            if (isdigit(ch)) {
+                if (r->rnarg > (UINT32_MAX - 9) / 10) {
+                    goto error;
+                }
+                r->rnarg = r->rnarg * 10 + (uint32_t)(ch - '0');
+            } else if (ch == CR) {
+                if ((p - r->token) <= 1 || r->rnarg == 0) {
+                    goto error;
+                }
+                r->narg = r->rnarg;
+                r->narg_end = p;
+                r->token = NULL;
+                state = SW_NARG_LF;
+            } else {
+                goto error;
+            }
+
+            break;
+
+        case SW_NARG_LF:
+            if (ch != LF) {
+                goto error;
+            }
+            state = SW_ARG_LEN_START;
+
+            break;
+
+        case SW_ARG_LEN_START:
+            if (ch != '$') {
+                goto error;
+            }
+            r->token = p;
+            r->rlen = 0;
+            state = SW_ARG_LEN;
+
+            break;
+
+        case SW_ARG_LEN:
+            if (isdigit(ch)) {
+                if (r->rlen > (UINT32_MAX - 9) / 10) {
+                    goto error;
+                }
+                r->rlen = r->rlen * 10 + (uint32_t)(ch - '0');
+            } else if (ch == CR) {
+                if ((p - r->token) <= 1) {
+                    goto error;
+                }
+                if (!redis_arghold(r, r->narg - r->rnarg)) {
+                    r->token = NULL;
+                } else if (r->rlen + REDIS_ARG_SLACK > mbuf_data_size()) {
+                    log_error("req %"PRIu64" has an argument of %"PRIu32" "
+                              "bytes, that does not fit in an mbuf", r->id,
+                              r->rlen);
+                    goto error;
+                }
+                state = SW_ARG_LEN_LF;
+            } else {
+                goto error;
+            }
+
+            break;
+
+        case SW_ARG_LEN_LF:
+            if (ch != LF) {
+                goto error;
+            }
+            state = SW_ARG;
+
+            break;
+
+        case SW_ARG:
+            m = p + r->rlen;
+            if (m >= b->last) {
+                /*
+                 * Argument continues past this mbuf; a held argument is
+                 * parsed again from its token once it is all in an mbuf
+                 */
+                if (r->token == NULL) {
+                    r->rlen -= (uint32_t)(b->last - p);
+                }
+                r->expect = (uint32_t)(m - b->last) + CRLF_LEN;
+                p = b->last - 1;
+                break;
+            }
+
+            if (*m != CR) {
+                goto error;
+            }
+
+            if (r->token != NULL) {
+                if (redis_arg(r, r->narg - r->rnarg, p, m) != GF_OK) {
+                    goto enomem;
+                }
+                r->token = NULL;
+            }
+
+            r->rlen = 0;
+            p = m; /* move forward by rlen bytes */
+            state = SW_ARG_LF;
+
+            break;
+
+        case SW_ARG_LF:
+            if (ch != LF) {
+                goto error;
+            }
+            r->rnarg--;
+            if (r->rnarg == 0) {
+                goto done;
+            }
+            state = SW_ARG_LEN_START;
+
+            break;
+
+        case SW_SENTINEL:
+        default:
+            NOT_REACHED();
+            break;
+        }
+    }
+
+    ASSERT(p == b->last);
+    r->pos = p;
+    r->state = state;
+    r->result = MSG_PARSE_AGAIN;
+
+    if (r->token != NULL) {
+        /*
+         * Rewind to the start of the incomplete token and parse it again
+         * when more data is read into this mbuf or, if it is full, once
+         * the token has been moved into a new mbuf.
+         */
+        if (b->last == b->end) {
+            if ((size_t)(b->last - r->token) >= mbuf_max_data_size()) {
+                goto error;
+            }
+            r->result = MSG_PARSE_REPAIR;
+        }
+
+        r->pos = r->token;
+        r->token = NULL;
+        r->state = (*r->pos == '*') ? SW_START : SW_ARG_LEN_START;
+    }
+
+    log_hexdump(LOG_VERB, b->pos, mbuf_length(b), "parsed req %"PRIu64" res %d "
+                "type %d state %d rpos %d of %d", r->id, r->result, r->type,
+                r->state, (int)(r->pos - b->pos), (int)(b->last - b->pos));
+    return;
+
+done:
+    if (redis_parse_req_done(r) != GF_OK) {
+        goto enomem;
+    }
+
+    r->pos = p + 1;
+    ASSERT(r->pos <= b->last);
+    r->state = SW_START;
+    r->token = NULL;
+    r->result = MSG_PARSE_OK;
+
+    log_hexdump(LOG_VERB, b->pos, mbuf_length(b), "parsed req %"PRIu64" res %d "
+                "type %d state %d rpos %d of %d", r->id, r->result, r->type,
+                r->state, (int)(r->pos - b->pos), (int)(b->last - b->pos));
+    return;
+
+enomem:
+    r->result = MSG_PARSE_ERROR;
+    r->state = state;
+    errno = ENOMEM;
+
+    log_error("parsed req %"PRIu64" of type %d failed: %s", r->id, r->type,
+              strerror(errno));
+    return;
+
+error:
+    r->result = MSG_PARSE_ERROR;
+    r->state = state;
+    errno = EINVAL;
+
+    log_hexdump(LOG_INFO, b->pos, mbuf_length(b), "parsed bad req %"PRIu64" "
+                "res %d type %d state %d", r->id, r->result, r->type,
+                r->state);
+}
+
+/*
+ * Error replies that the proxy acts upon, matched on the text following
+ * the leading '-'
+ */
+#define REDIS_ERROR_PREFIX_MAXLEN   8   /* longest prefix, "LOADING " */
+
+static const struct {
+    struct string prefix;
+    msg_type_t    type;
+} redis_errors[] = {
+    { string("OOM "), MSG_RSP_REDIS_ERROR_OOM },
+    { string("BUSY "), MSG_RSP_REDIS_ERROR_BUSY },
+    { string("LOADING "), MSG_RSP_REDIS_ERROR_LOADING },
+    { string("MOVED "), MSG_RSP_REDIS_ERROR_MOVED },
+    { string("ASK "), MSG_RSP_REDIS_ERROR_ASK },
+};
+
+static msg_type_t
+redis_error_type(const uint8_t *p, size_t n)
+{
+    uint32_t i;
+
+    for (i = 0; i < NELEMS(redis_errors); i++) {
+        if (n >= redis_errors[i].prefix.len &&
+            memcmp(p, redis_errors[i].prefix.data,
+                   redis_errors[i].prefix.len) == 0) {
+            return redis_errors[i].type;
+        }
+    }
+
+    return MSG_RSP_REDIS_ERROR;
+}
+
+/*
+ * Parse a redis reply. The parser is resumable: its state, the number of
+ * elements still expected (rnarg) and the bytes left in the current bulk
+ * (rlen) survive across reads, so every byte is looked at once however the
+ * reply is split. Nested multibulks need no stack: a multibulk header of
+ * N elements simply adds N to the elements expected, and the reply is
+ * complete once that count drops to zero. Bulk payloads are skipped by
+ * length, status and error text by a memchr for CR.
+ *
+ * RESP3 replies are parsed the same way: null, boolean, double and big
+ * number are lines, blob error and verbatim string are bulks, and set and
+ * push are multibulks while a map or an attribute of N entries expects 2N
+ * elements. An attribute is not an element of its own, it precedes the
+ * element it describes. Replies of any type are forwarded as they are read.
+ *
+ * The type of the reply is that of its top level element. The value of a
+ * top level integer is kept in msg->integer, the # elements of a top level
+ * multibulk in msg->narg.
+ */
+void
+redis_parse_rsp(struct msg *r)
+{
+    struct mbuf *b;
+    uint8_t *p, *m;
+    uint8_t ch;
+    size_t avail;
+    enum {
+        SW_START,
+        SW_LINE,
+        SW_INTEGER_START,
+        SW_INTEGER,
+        SW_BULK_LEN_START,
+        SW_BULK_LEN,
+        SW_BULK_LEN_LF,
+        SW_BULK,
+        SW_MULTIBULK_LEN_START,
+        SW_MULTIBULK_LEN,
+        SW_MAP_LEN_START,
+        SW_MAP_LEN,
+        SW_ATTRIBUTE_LEN_START,
+        SW_ATTRIBUTE_LEN,
+        SW_NIL,
+        SW_LF,
+        SW_SENTINEL
+    } state;
+
+    state = r->state;
+    b = STAILQ_LAST(&r->mhdr, mbuf, next);
+
+    ASSERT(!r->request);
+    ASSERT(state >= SW_START && state < SW_SENTINEL);
+    ASSERT(b != NULL);
+    ASSERT(b->pos <= b->last);
+
+    /* validate the parsing maker */
+    ASSERT(r->pos != NULL);
+    ASSERT(r->pos >= b->pos && r->pos <= b->last);
+
+    for (p = r->pos; p < b->last; p++) {
+        ch = *p;
+
+        switch (state) {
+
+        case SW_START:
+            if (r->type == MSG_UNKNOWN) {
+                /* top level element */
+                r->is_top_level = 1;
+                r->rnarg = 1;
+            } else if (r->type == MSG_RSP_REDIS_ATTRIBUTE && r->rnarg == 1) {
+                /* top level element that follows a top level attribute */
+                r->is_top_level = 1;
+            } else {
+                r->is_top_level = 0;
+            }
+            r->rlen = 0;
+
+            switch (ch) {
+            case '+':
+                if (r->is_top_level) {
+                    r->type = MSG_RSP_REDIS_STATUS;
+                }
+                state = SW_LINE;
+                break;
+
+            case '-':
+                state = SW_LINE;
+                if (!r->is_top_level) {
+                    break;
+                }
+
+                /*
+                 * The error is classified as soon as its prefix or its CR
+                 * is in the mbuf, otherwise it is parsed again from the
+                 * '-' once more data is read.
+                 */
+                avail = (size_t)(b->last - p - 1);
+                if (avail < REDIS_ERROR_PREFIX_MAXLEN &&
+                    gf_memchr(p + 1, CR, avail) == NULL) {
+                    r->token = p;
+                    p = b->last - 1;
+                    break;
+                }
+                r->type = redis_error_type(p + 1, avail);
+                break;
+
+            case ':':
+                if (r->is_top_level) {
+                    r->type = MSG_RSP_REDIS_INTEGER;
+                    r->integer = 0;
+                }
+                state = SW_INTEGER_START;
+                break;
+
+            case '$':
+                if (r->is_top_level) {
+                    r->type = MSG_RSP_REDIS_BULK;
+                }
+                state = SW_BULK_LEN_START;
+                break;
+
+            case '*':
+                if (r->is_top_level) {
+                    r->type = MSG_RSP_REDIS_MULTIBULK;
+                    r->narg_start = p;
+                }
+                state = SW_MULTIBULK_LEN_START;
+                break;
+
+            case '_':
+            case '#':
+            case ',':
+            case '(':
+                if (r->is_top_level) {
+                    r->type = (ch == '_') ? MSG_RSP_REDIS_NULL :
+                              (ch == '#') ? MSG_RSP_REDIS_BOOLEAN :
+                              (ch == ',') ? MSG_RSP_REDIS_DOUBLE :
+                                            MSG_RSP_REDIS_BIGNUM;
+                }
+                state = SW_LINE;
+                break;
+
+            case '!':
+            case '=':
+                if (r->is_top_level) {
+                    r->type = (ch == '!') ? MSG_RSP_REDIS_ERROR :
+                                            MSG_RSP_REDIS_VERBATIM;
+                }
+                state = SW_BULK_LEN_START;
+                break;
+
+            case '~':
+            case '>':
+                if (r->is_top_level) {
+                    r->type = (ch == '~') ? MSG_RSP_REDIS_SET :
+                                            MSG_RSP_REDIS_PUSH;
+                    r->narg_start = p;
+                }
+                state = SW_MULTIBULK_LEN_START;
+                break;
+
+            case '%':
+                if (r->is_top_level) {
+                    r->type = MSG_RSP_REDIS_MAP;
+                }
+                state = SW_MAP_LEN_START;
+                break;
+
+            case '|':
+                if (r->is_top_level) {
+                    r->type = MSG_RSP_REDIS_ATTRIBUTE;
+                }
+                state = SW_ATTRIBUTE_LEN_START;
+                break;
+
+            default:
+                goto error;
+            }
+
+            break;
+
+        case SW_LINE:
+            m = gf_memchr(p, CR, b->last - p);
+            if (m == NULL) {
+                p = b->last - 1;
+                break;
+            }
+            p = m;
+            state = SW_LF;
+
+            break;
+
+        case SW_INTEGER_START:
+            if (ch == '-') {
+                state = SW_INTEGER;
+                break;
+            }
+            /* fall through */
+
+        case SW_INTEGER:
+            if (isdigit(ch)) {
+                if (r->is_top_level) {
+                    r->integer = r->integer * 10 + (uint32_t)(ch - '0');
+                }
+                state = SW_INTEGER;
+            } else if (ch == CR && state == SW_INTEGER) {
+                state = SW_LF;
+            } else {
+                goto error;
+            }
+
+            break;
+
+        case SW_BULK_LEN_START:
+        case SW_MULTIBULK_LEN_START:
+            if (ch == '-') {
+                /* nil bulk or multibulk */
+                state = SW_NIL;
+                break;
+            }
+            /* fall through */
+
+        case SW_MAP_LEN_START:
+        case SW_ATTRIBUTE_LEN_START:
+            if (!isdigit(ch)) {
+                goto error;
+            }
+            r->rlen = (uint32_t)(ch - '0');
+            state = (state == SW_BULK_LEN_START) ? SW_BULK_LEN :
+                    (state == SW_MULTIBULK_LEN_START) ? SW_MULTIBULK_LEN :
+                    (state == SW_MAP_LEN_START) ? SW_MAP_LEN :
+                                                  SW_ATTRIBUTE_LEN;
+
+            break;
+
+        case SW_BULK_LEN:
+            if (isdigit(ch)) {
+                if (r->rlen > (UINT32_MAX - 9) / 10) {
+                    goto error;
+                }
+                r->rlen = r->rlen * 10 + (uint32_t)(ch - '0');
+            } else if (ch == CR) {
+                state = SW_BULK_LEN_LF;
+            } else {
+                goto error;
+            }
+
+            break;
+
+        case SW_BULK_LEN_LF:
+            if (ch != LF) {
+                goto error;
+            }
+            state = SW_BULK;
+
+            break;
+
+        case SW_BULK:
+            m = p + r->rlen;
+            if (m >= b->last) {
+                r->rlen -= (uint32_t)(b->last - p);
+                r->expect = r->rlen + CRLF_LEN;
+                p = b->last - 1;
+                break;
+            }
+
+            if (*m != CR) {
+                goto error;
+            }
+
+            r->rlen = 0;
+            p = m; /* move forward by rlen bytes */
+            state = SW_LF;
+
+            break;
+
+        case SW_MULTIBULK_LEN:
+        case SW_MAP_LEN:
+        case SW_ATTRIBUTE_LEN:
+            if (isdigit(ch)) {
+                if (r->rlen > (UINT32_MAX - 9) / 10) {
+                    goto error;
+                }
+                r->rlen = r->rlen * 10 + (uint32_t)(ch - '0');
+                break;
+            }
+            if (ch != CR) {
+                goto error;
+            }
+
+            if (state != SW_MULTIBULK_LEN) {
+                /*
+                 * A map or an attribute holds a key and a value per entry,
+                 * and an attribute is followed by the element it describes
+                 */
+                if (r->rlen > (UINT32_MAX - 1) / 2) {
+                    goto error;
+                }
+                r->rlen = 2 * r->rlen + (state == SW_ATTRIBUTE_LEN ? 1 : 0);
+            } else if (r->is_top_level) {
+                r->narg = r->rlen;
+                r->narg_end = p;
+            }
+            /* the elements are accounted for at the LF */
+            state = SW_LF;
+
+            break;
+
+        case SW_NIL:
+            if (isdigit(ch)) {
+                break;
+            }
+            if (ch != CR) {
+                goto error;
+            }
+            state = SW_LF;
+
+            break;
+
+        case SW_LF:
+            if (ch != LF) {
+                goto error;
+            }
+
+            /* an element is done, and a multibulk header expects rlen more */
+            if (r->rlen > UINT32_MAX - r->rnarg) {
+                goto error;
+            }
+            r->rnarg = r->rnarg - 1 + r->rlen;
+            r->rlen = 0;
+            if (r->rnarg == 0) {
+                goto done;
+            }
+            state = SW_START;
+
+            break;
+
+        case SW_SENTINEL:
+        default:
+            NOT_REACHED();
+            break;
+        }
+    }
+
+    ASSERT(p == b->last);
+    r->pos = p;
+    r->state = state;
+    r->result = MSG_PARSE_AGAIN;
+
+    if (r->token != NULL) {
+        /* top level error too short to be classified yet */
+        r->result = (b->last == b->end) ? MSG_PARSE_REPAIR : MSG_PARSE_AGAIN;
+        r->pos = r->token;
+        r->token = NULL;
+        r->state = SW_START;
+        r->type = MSG_UNKNOWN;
+    }
+
+    log_hexdump(LOG_VERB, b->pos, mbuf_length(b), "parsed rsp %"PRIu64" res %d "
+                "type %d state %d rpos %d of %d", r->id, r->result, r->type,
+                r->state, (int)(r->pos - b->pos), (int)(b->last - b->pos));
+    return;
+
+done:
+    ASSERT(r->type > MSG_UNKNOWN && r->type < MSG_SENTINEL);
+    r->pos = p + 1;
+    ASSERT(r->pos <= b->last);
+    r->state = SW_START;
+    r->token = NULL;
+    r->result = MSG_PARSE_OK;
+
+    log_hexdump(LOG_VERB, b->pos, mbuf_length(b), "parsed rsp %"PRIu64" res %d "
+                "type %d state %d rpos %d of %d", r->id, r->result, r->type,
+                r->state, (int)(r->pos - b->pos), (int)(b->last - b->pos));
+    return;
+
+error:
+    r->result = MSG_PARSE_ERROR;
+    r->state = state;
+    errno = EINVAL;
+
+    log_hexdump(LOG_INFO, b->pos, mbuf_length(b), "parsed bad rsp %"PRIu64" "
+                "res %d type %d state %d", r->id, r->result, r->type,
+                r->state);
+}
+
+/*
+ * Return true, if redis replies with a transient server failure response,
+ * otherwise return false
+ *
+ * Transient failures on redis are scenarios when it is temporarily
+ * unresponsive and responds with the following protocol specific error
+ * reply:
+ * -OOM, when redis is out-of-memory
+ * -BUSY, when redis is busy
+ * -LOADING when redis is loading dataset into memory
+ *
+ * See issue: https://github.com/twitter/twemproxy/issues/369
+ */
+bool
+redis_failure(const struct msg *r)
+{
+    ASSERT(!r->request);
+
+    switch (r->type) {
+    case MSG_RSP_REDIS_ERROR_OOM:
+    case MSG_RSP_REDIS_ERROR_BUSY:
+    case MSG_RSP_REDIS_ERROR_LOADING:
+        return true;
+
+    default:
+        break;
+    }
+
+    return false;
+}
+
+static bool
+redis_error(const struct msg *r)
+{
+    switch (r->type) {
+    case MSG_RSP_REDIS_ERROR:
+    case MSG_RSP_REDIS_ERROR_OOM:
+    case MSG_RSP_REDIS_ERROR_BUSY:
+    case MSG_RSP_REDIS_ERROR_LOADING:
+    case MSG_RSP_REDIS_ERROR_MOVED:
+    case MSG_RSP_REDIS_ERROR_ASK:
+        return true;
+
+    default:
+        break;
+    }
+
+    return false;
+}
+
+/*
+ * Pre-coalesce handler is invoked for every response. Replies to fragments
+ * are all merged by the post-coalesce handler, once they are all in.
+ */
+void
+redis_pre_coalesce(struct msg *r)
+{
+    ASSERT(!r->request);
+    ASSERT(r->peer->request);
+}
+
+/*
+ * Return the start of the "$<len>" header of the argument held at kpos,
+ * which is in the same mbuf as the argument itself
+ */
+static uint8_t *
+redis_argstart(const struct keypos *kpos)
+{
+    uint8_t *p;
+
+    for (p = kpos->start - CRLF_LEN - 1; *p != '$'; p--) {
+        /* skip the digits of the argument length */
+    }
+
+    return p;
+}
+
+/*
+ * Append the bytes of a request from the cursor (*mbuf, *pos) up to end, or
+ * up to the end of the request if end is NULL, to sub_msg by reference and
+ * move the cursor to end.
+ */
+static rstatus_t
+redis_append_upto(struct msg *sub_msg, struct mbuf **mbuf, uint8_t **pos,
+                  uint8_t *end)
+{
+    rstatus_t status;
+    struct mbuf *m;
+    uint8_t *p;
+
+    m = *mbuf;
+    p = *pos;
+
+    for (;;) {
+        if (end != NULL && end >= p && end < m->last) {
+            status = msg_append_slice(sub_msg, m, p, (size_t)(end - p));
+            if (status != GF_OK) {
+                return status;
+            }
+            break;
+        }
+
+        status = msg_append_slice(sub_msg, m, p, (size_t)(m->last - p));
+        if (status != GF_OK) {
+            return status;
+        }
+
+        if (STAILQ_NEXT(m, next) == NULL) {
+            ASSERT(end == NULL);
+            end = m->last;
+            break;
+        }
+        m = STAILQ_NEXT(m, next);
+        p = m->pos;
+    }
+
+    *mbuf = m;
+    *pos = end;
+
+    return GF_OK;
+}
+
+/*
+ * Split a multi-key request whose keys live on more than one server into
+ * one request per server. A key of mget, del, exists, touch or unlink, or
+ * a key-value pair of mset, is an argument range that is handed over to the
+ * request of its server by reference: sub requests are made of slices of
+ * the mbufs of r behind a header of their own, and no argument is copied.
+ * frag->seq maps every key to its sub request, to merge replies in key order.
+ */
+rstatus_t
+redis_fragment(struct msg *r, uint32_t nserver, struct msg_tqh *frag_msgq)
+{
+    const struct redis_command *cmd;
+    rstatus_t status;
+    struct msg **sub_msgs, *sub_msg, *tmsg;
+    struct keypos *kpos, *sub_kpos;
+    struct mbuf *mbuf;
+    uint8_t *p, *end;
+    uint32_t *idx;
+    uint32_t i, nkey;
+    bool single;
+
+    ASSERT(r->request && r->type != MSG_UNKNOWN);
+
+    cmd = redis_command(r->type);
+    nkey = array_n(r->keys);
+    if (!(cmd->flags & REDIS_CMD_FRAGMENT) || nkey <= 1 || nserver <= 1) {
+        return GF_OK;
+    }
+
+    sub_msgs = gf_zalloc(nserver * sizeof(*sub_msgs) + nkey * sizeof(*idx));
+    if (sub_msgs == NULL) {
+        return GF_ENOMEM;
+    }
+    idx = (uint32_t *)(sub_msgs + nserver);
+
+    for (single = true, i = 0; i < nkey; i++) {
+        kpos = array_get(r->keys, i);
+        idx[i] = msg_backend_idx(r, kpos->start,
+                                 (uint32_t)(kpos->end - kpos->start));
+        ASSERT(idx[i] < nserver);
+        single = single && idx[i] == idx[0];
+    }
+    if (single) {
+        gf_free(sub_msgs);
+        return GF_OK;
+    }
+
+    if (msg_frag_get(r) == NULL) {
+        gf_free(sub_msgs);
+        return GF_ENOMEM;
+    }
+
+    r->frag->seq = gf_alloc(nkey * sizeof(*r->frag->seq));
+    if (r->frag->seq == NULL) {
+        status = GF_ENOMEM;
+        goto error;
+    }
+
+    /* the command name is left behind, every sub request gets its own */
+    p = redis_argstart(array_get(r->keys, 0));
+    mbuf = STAILQ_FIRST(&r->mhdr);
+    while (p < mbuf->pos || p >= mbuf->last) {
+        mbuf = STAILQ_NEXT(mbuf, next);
+    }
+
+    for (i = 0; i < nkey; i++) {
+        sub_msg = sub_msgs[idx[i]];
+        if (sub_msg == NULL) {
+            sub_msg = msg_get(r->owner, r->request, r->redis);
+            if (sub_msg == NULL) {
+                status = GF_ENOMEM;
+                goto error;
+            }
+            sub_msg->type = r->type;
+            sub_msg->narg = 1;
+            msg_frag_add(r->frag, sub_msg);
+
+            sub_msgs[idx[i]] = sub_msg;
+            TAILQ_INSERT_TAIL(frag_msgq, sub_msg, m_tqe);
+        }
+        r->frag->seq[i] = sub_msg;
+
+        kpos = array_get(r->keys, i);
+        sub_kpos = msg_keypos_push(sub_msg);
+        if (sub_kpos == NULL) {
+            status = GF_ENOMEM;
+            goto error;
+        }
+        *sub_kpos = *kpos;
+        sub_msg->narg += (uint32_t)cmd->step;
+
+        end = i + 1 < nkey ? redis_argstart(array_get(r->keys, i + 1)) : NULL;
+        status = redis_append_upto(sub_msg, &mbuf, &p, end);
+        if (status != GF_OK) {
+            goto error;
+        }
+    }
+
+    TAILQ_FOREACH(sub_msg, frag_msgq, m_tqe) {
+        status = msg_prepend_format(sub_msg, "*%"PRIu32"\r\n$%"PRIu32"\r\n"
+                                    "%.*s\r\n", sub_msg->narg, cmd->name.len,
+                                    cmd->name.len, cmd->name.data);
+        if (status != GF_OK) {
+            goto error;
+        }
+    }
+
+    gf_free(sub_msgs);
+
+    log_debug(LOG_VERB, "fragment req %"PRIu64" with %"PRIu32" keys into "
+              "%"PRIu32" requests", r->id, nkey, r->frag->nfrag);
+
+    return GF_OK;
+
+error:
+    for (sub_msg = TAILQ_FIRST(frag_msgq); sub_msg != NULL; sub_msg = tmsg) {
+        tmsg = TAILQ_NEXT(sub_msg, m_tqe);
+        TAILQ_REMOVE(frag_msgq, sub_msg, m_tqe);
+        msg_put(sub_msg);
+    }
+    gf_free(sub_msgs);
+    msg_frag_put(r);
+
+    return status;
+}
+
+/*
+ * Return the length of the line at the head of reply r, including its CRLF,
+ * or 0 if there is none. The type byte of the line is returned in type and
+ * the length it carries, if any, in val.
+ */
+static size_t
+redis_line_len(const struct msg *r, uint8_t *type, int64_t *val)
+{
+    struct mbuf *mbuf;
+    uint8_t *p;
+    uint64_t v;
+    size_t len;
+    bool neg;
+
+    len = 0;
+    v = 0;
+    neg = false;
+
+    STAILQ_FOREACH(mbuf, &r->mhdr, next) {
+        for (p = mbuf->pos; p < mbuf->last; p++) {
+            if (len++ == 0) {
+                *type = *p;
+            } else if (*p == LF) {
+                *val = neg ? -1 : (int64_t)MIN(v, INT32_MAX);
+                return len;
+            } else if (*p == '-') {
+                neg = true;
+            } else if (isdigit(*p)) {
+                v = v * 10 + (uint64_t)(*p - '0');
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Return the length of the element at the head of reply r, or 0 if it is
+ * not a line or a bulk
+ */
+static size_t
+redis_element_len(const struct msg *r)
+{
+    size_t len;
+    int64_t val;
+    uint8_t type;
+
+    len = redis_line_len(r, &type, &val);
+    if (len == 0) {
+        return 0;
+    }
+
+    switch (type) {
+    case '$':
+    case '!':
+    case '=':
+        if (val >= 0) {
+            len += (size_t)val + CRLF_LEN;
+        }
+        return len;
+
+    case '+':
+    case '-':
+    case ':':
+    case '_':
+    case '#':
+    case ',':
+    case '(':
+        return len;
+
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+/*
+ * Drop the first n bytes of reply r. The mbufs let go of stay alive for as
+ * long as another message holds a slice of them.
+ */
+static void
+redis_consume(struct msg *r, size_t n)
+{
+    struct mbuf *mbuf;
+    size_t len;
+
+    while ((mbuf = STAILQ_FIRST(&r->mhdr)) != NULL) {
+        len = MIN(n, (size_t)mbuf_length(mbuf));
+        mbuf->pos += len;
+        r->mlen -= (uint32_t)len;
+        n -= len;
+
+        if (!mbuf_empty(mbuf)) {
+            break;
+        }
+        mbuf_remove(&r->mhdr, mbuf);
+        mbuf_put(mbuf);
+    }
+}
+
+/*
+ * The reply to a fragmented mget has the elements of the replies to its
+ * sub requests in key order, each of them picked by reference from the
+ * reply that holds it.
+ */
+static rstatus_t
+redis_coalesce_mget(struct msg *r, struct msg *rsp)
+{
+    rstatus_t status;
+    struct msg *sub_msg, *sub_rsp;
+    struct mbuf *mbuf;
+    char buf[GF_UINT32_MAXLEN + 3];
+    size_t len;
+    int64_t val;
+    uint32_t i, nkey;
+    uint8_t type;
+    int n;
+
+    for (sub_msg = TAILQ_NEXT(r, c_tqe);
+         sub_msg != NULL && sub_msg->frag == r->frag;
+         sub_msg = TAILQ_NEXT(sub_msg, c_tqe)) {
+        sub_rsp = sub_msg->peer;
+        if (sub_rsp->type != MSG_RSP_REDIS_MULTIBULK) {
+            return GF_ERROR;
+        }
+
+        len = redis_line_len(sub_rsp, &type, &val);
+        if (len == 0 || type != '*' || val != array_n(sub_msg->keys)) {
+            return GF_ERROR;
+        }
+        redis_consume(sub_rsp, len);
+    }
+
+    nkey = array_n(r->keys);
+    n = gf_scnprintf(buf, sizeof(buf), "*%"PRIu32"\r\n", nkey);
+    status = msg_append(rsp, (uint8_t *)buf, (size_t)n);
+    if (status != GF_OK) {
+        return status;
+    }
+
+    for (i = 0; i < nkey; i++) {
+        sub_rsp = r->frag->seq[i]->peer;
+
+        len = redis_element_len(sub_rsp);
+        if (len == 0) {
+            return GF_ERROR;
+        }
+
+        mbuf = STAILQ_FIRST(&sub_rsp->mhdr);
+        status = msg_append_slice(rsp, mbuf, mbuf->pos, len);
+        if (status != GF_OK) {
+            return status;
+        }
+        redis_consume(sub_rsp, len);
+    }
+
+    rsp->type = MSG_RSP_REDIS_MULTIBULK;
+    rsp->narg = nkey;
+
+    return GF_OK;
+}
+
+/*
+ * The reply to a fragmented del, exists, touch or unlink is the sum of the
+ * replies to its sub requests
+ */
+static rstatus_t
+redis_coalesce_integer(struct msg *r, struct msg *rsp)
+{
+    struct msg *sub_msg;
+    char buf[GF_UINT64_MAXLEN + 3];
+    uint64_t sum;
+    int n;
+
+    sum = 0;
+    for (sub_msg = TAILQ_NEXT(r, c_tqe);
+         sub_msg != NULL && sub_msg->frag == r->frag;
+         sub_msg = TAILQ_NEXT(sub_msg, c_tqe)) {
+        if (sub_msg->peer->type != MSG_RSP_REDIS_INTEGER) {
+            return GF_ERROR;
+        }
+        sum += sub_msg->peer->integer;
+    }
+
+    n = gf_scnprintf(buf, sizeof(buf), ":%"PRIu64"\r\n", sum);
+
+    rsp->type = MSG_RSP_REDIS_INTEGER;
+    rsp->integer = (uint32_t)sum;
+
+    return msg_append(rsp, (uint8_t *)buf, (size_t)n);
+}
+
+/*
+ * The reply to a fragmented mset is +OK once all of its sub requests are
+ */
+static rstatus_t
+redis_coalesce_status(struct msg *r, struct msg *rsp)
+{
+    struct msg *sub_msg;
+
+    for (sub_msg = TAILQ_NEXT(r, c_tqe);
+         sub_msg != NULL && sub_msg->frag == r->frag;
+         sub_msg = TAILQ_NEXT(sub_msg, c_tqe)) {
+        if (sub_msg->peer->type != MSG_RSP_REDIS_STATUS) {
+            return GF_ERROR;
+        }
+    }
+
+    rsp->type = MSG_RSP_REDIS_STATUS;
+
+    return redis_append_static(rsp, &rsp_ok);
+}
+
+/*
+ * Merge the replies to the sub requests of a fragmented request into the
+ * reply to the request. An error reply of a sub request, the first one in
+ * key order, is the reply as it is. The replies to the sub requests are
+ * left empty, so that only the merged reply is sent. A reply that can't be
+ * merged puts the request in error.
+ */
+void
+redis_post_coalesce(struct msg *r)
+{
+    struct msg *rsp = r->peer; /* peer response */
+    struct msg *sub_msg, *sub_rsp, *err_rsp;
+    struct mbuf *mbuf;
+    rstatus_t status;
+    uint32_t i, nkey;
+
+    ASSERT(r->request && r->frag->owner == r);
+    ASSERT(!r->error && r->frag->nerror == 0);
+    ASSERT(rsp != NULL && !rsp->request);
+
+    nkey = array_n(r->keys);
+    for (err_rsp = NULL, i = 0; i < nkey && err_rsp == NULL; i++) {
+        sub_rsp = r->frag->seq[i]->peer;
+        if (redis_error(sub_rsp)) {
+            err_rsp = sub_rsp;
+        }
+    }
+
+    if (err_rsp != NULL) {
+        while ((mbuf = STAILQ_FIRST(&err_rsp->mhdr)) != NULL) {
+            mbuf_remove(&err_rsp->mhdr, mbuf);
+            mbuf_insert(&rsp->mhdr, mbuf);
+        }
+        rsp->mlen += err_rsp->mlen;
+        rsp->type = err_rsp->type;
+        err_rsp->mlen = 0;
+        status = GF_OK;
+    } else {
+        switch (r->type) {
+        case MSG_REQ_REDIS_MGET:
+            status = redis_coalesce_mget(r, rsp);
+            break;
+
+        case MSG_REQ_REDIS_DEL:
+        case MSG_REQ_REDIS_EXISTS:
+        case MSG_REQ_REDIS_TOUCH:
+        case MSG_REQ_REDIS_UNLINK:
+            status = redis_coalesce_integer(r, rsp);
+            break;
+
+        case MSG_REQ_REDIS_MSET:
+            status = redis_coalesce_status(r, rsp);
+            break;
+
+        default:
+            NOT_REACHED();
+            status = GF_ERROR;
+            break;
+        }
+    }
+
+    for (sub_msg = TAILQ_NEXT(r, c_tqe);
+         sub_msg != NULL && sub_msg->frag == r->frag;
+         sub_msg = TAILQ_NEXT(sub_msg, c_tqe)) {
+        sub_rsp = sub_msg->peer;
+        while ((mbuf = STAILQ_FIRST(&sub_rsp->mhdr)) != NULL) {
+            mbuf_remove(&sub_rsp->mhdr, mbuf);
+            mbuf_put(mbuf);
+        }
+        sub_rsp->mlen = 0;
+    }
+
+    if (status != GF_OK) {
+        log_warn("coalesce req %"PRIu64" with %"PRIu32" fragments failed",
+                 r->id, r->frag->nfrag);
+        r->error = 1;
+        r->err = status == GF_ENOMEM ? ENOMEM : EINVAL;
+        r->frag->seq[0]->err = r->err;
+    }
+}
+
+/*
+ * Append the last argument of request req to rsp as a bulk reply. The
+ * request ends with the argument, so its bytes are picked by reference
+ * from the tail of the request, across however many mbufs they span.
+ */
+static rstatus_t
+redis_append_echo(struct msg *rsp, struct msg *req)
+{
+    rstatus_t status;
+    struct mbuf *mbuf;
+    char buf[GF_UINT32_MAXLEN + 3];
+    size_t skip, len;
+    int n;
+
+    n = gf_scnprintf(buf, sizeof(buf), "$%"PRIu32"\r\n", req->integer);
+    status = msg_append(rsp, (uint8_t *)buf, (size_t)n);
+    if (status != GF_OK) {
+        return status;
+    }
+
+    ASSERT(req->mlen >= req->integer + CRLF_LEN);
+    skip = req->mlen - req->integer - CRLF_LEN;
+
+    STAILQ_FOREACH(mbuf, &req->mhdr, next) {
+        len = mbuf_length(mbuf);
+        if (skip >= len) {
+            skip -= len;
+            continue;
+        }
+
+        status = msg_append_slice(rsp, mbuf, mbuf->pos + skip, len - skip);
+        if (status != GF_OK) {
+            return status;
+        }
+        skip = 0;
+    }
+
+    return GF_OK;
+}
+
+static rstatus_t
+redis_handle_auth_req(struct msg *req, struct msg *rsp)
+{
+    struct conn *conn = rsp->owner;
+    const struct server_pool *pool;
+    const struct keypos *kpos;
+    const uint8_t *key;
+    uint32_t keylen;
+    bool valid;
+
+    ASSERT(conn->client && !conn->proxy);
+
+    pool = conn->owner;
+
+    if (!pool->require_auth) {
+        /*
+         * AUTH command from the client in absence of a redis_auth:
+         * directive should be treated as an error
+         */
+        return redis_append_static(rsp, &rsp_no_password);
+    }
+
+    /* the password is the last argument of both AUTH forms */
+    kpos = array_top(req->keys);
+    key = kpos->start;
+    keylen = (uint32_t)(kpos->end - kpos->start);
+    valid = (keylen == pool->redis_auth.len) &&
+            (memcmp(pool->redis_auth.data, key, keylen) == 0) ? true : false;
+    if (valid) {
+        conn->authenticated = 1;
+        return redis_append_static(rsp, &rsp_ok);
+    }
+
+    /*
+     * Password in the AUTH command doesn't match the one configured in
+     * redis_auth: directive
+     *
+     * We mark the connection has unauthenticated until the client
+     * reauthenticates with the correct password
+     */
+    conn->authenticated = 0;
+    return redis_append_static(rsp, &rsp_invalid_password);
+}
+
+static bool
+redis_argeq(const struct keypos *kpos, const struct string *str)
+{
+    return (uint32_t)(kpos->end - kpos->start) == str->len &&
+           strncasecmp((const char *)kpos->start, (const char *)str->data,
+                       str->len) == 0;
+}
+
+/*
+ * HELLO [protover [AUTH username password] [SETNAME clientname]]
+ *
+ * The protocol version is switched on the client connection only; its
+ * requests are then forwarded on server connections that speak the same
+ * version (see server_conn). The reply describes the proxy rather than
+ * any one of the servers behind it.
+ */
+static rstatus_t
+redis_handle_hello_req(struct msg *req, struct msg *rsp)
+{
+    struct conn *conn = rsp->owner;
+    const struct server_pool *pool;
+    const struct keypos *kpos, *pass;
+    uint32_t i, nkey, keylen, proto;
+    char buf[256];
+    int n;
+
+    ASSERT(conn->client && !conn->proxy);
+
+    pool = conn->owner;
+    nkey = array_n(req->keys);
+    proto = conn->resp3 ? 3 : 2;
+    pass = NULL;
+
+    if (nkey > 0) {
+        kpos = array_get(req->keys, 0);
+        if (!redis_atou(kpos->start, kpos->end, &proto) ||
+            proto < 2 || proto > 3) {
+            return redis_append_static(rsp, &rsp_noproto);
+        }
+    }
+
+    for (i = 1; i < nkey; i++) {
+        kpos = array_get(req->keys, i);
+        keylen = (uint32_t)(kpos->end - kpos->start);
+
+        if (redis_argeq(kpos, &hello_auth) && i + 2 < nkey) {
+            pass = array_get(req->keys, i + 2);
+            i += 2;
+        } else if (redis_argeq(kpos, &hello_setname) && i + 1 < nkey) {
+            /* server connections are shared, the name is not kept */
+            i += 1;
+        } else {
+            n = gf_scnprintf(buf, sizeof(buf), "-ERR Syntax error in HELLO "
+                             "option '%.*s'\r\n", MIN(keylen, 64),
+                             kpos->start);
+            return msg_append(rsp, (uint8_t *)buf, (size_t)n);
+        }
+    }
+
+    if (pass != NULL) {
+        if (!pool->require_auth) {
+            return redis_append_static(rsp, &rsp_no_password);
+        }
+
+        keylen = (uint32_t)(pass->end - pass->start);
+        if (keylen != pool->redis_auth.len ||
+            memcmp(pool->redis_auth.data, pass->start, keylen) != 0) {
+            conn->authenticated = 0;
+            return redis_append_static(rsp, &rsp_invalid_password);
+        }
+        conn->authenticated = 1;
+    }
+
+    if (!conn_authenticated(conn)) {
+        return redis_append_static(rsp, &rsp_auth_required);
+    }
+
+    conn->resp3 = (proto == 3) ? 1 : 0;
+
+    /* a RESP3 map counts entries, a RESP2 array elements */
+    n = gf_scnprintf(buf, sizeof(buf), "%s\r\n"
+                     "$6\r\nserver\r\n$8\r\ngfwproxy\r\n"
+                     "$7\r\nversion\r\n$%d\r\n%s\r\n"
+                     "$5\r\nproto\r\n:%"PRIu32"\r\n"
+                     "$2\r\nid\r\n:%d\r\n"
+                     "$4\r\nmode\r\n$10\r\nstandalone\r\n"
+                     "$4\r\nrole\r\n$6\r\nmaster\r\n"
+                     "$7\r\nmodules\r\n*0\r\n",
+                     conn->resp3 ? "%7" : "*14",
+                     (int)(sizeof(GF_VERSION_STRING) - 1), GF_VERSION_STRING,
+                     proto, conn->sd);
+
+    return msg_append(rsp, (uint8_t *)buf, (size_t)n);
+}
+
+static rstatus_t
+redis_handle_select_req(struct msg *req, struct msg *rsp)
+{
+    struct conn *conn = rsp->owner;
+    const struct server_pool *pool;
+    const struct keypos *kpos;
+    uint32_t db;
+
+    pool = conn->owner;
+
+    /*
+     * Server connections of a pool are all bound to its redis_db: and
+     * shared by its clients, so selecting any other database is refused
+     */
+    kpos = array_get(req->keys, 0);
+    if (!redis_atou(kpos->start, kpos->end, &db) ||
+        (int)db != pool->redis_db) {
+        return redis_append_static(rsp, &rsp_select_unsupported);
+    }
+
+    return redis_append_static(rsp, &rsp_ok);
+}
+
+/*
+ * PING [message]
+ */
+static rstatus_t
+redis_handle_ping_req(struct msg *req, struct msg *rsp)
+{
+    if (req->narg == 1) {
+        return redis_append_static(rsp, &rsp_pong);
+    }
+
+    if (req->narg > 2) {
+        return redis_append_static(rsp, &rsp_ping_arity);
+    }
+
+    return redis_append_echo(rsp, req);
+}
+
+/*
+ * COMMAND [COUNT | DOCS [command ...]]
+ *
+ * The proxy counts the commands it knows, but has no documentation of them
+ * nor the details of the redis command table to give.
+ */
+static rstatus_t
+redis_handle_command_req(struct msg *req, struct msg *rsp)
+{
+    struct conn *conn = rsp->owner;
+    const struct keypos *kpos;
+
+    if (array_n(req->keys) == 0) {
+        return redis_append_static(rsp, &rsp_empty_array);
+    }
+
+    kpos = array_get(req->keys, 0);
+
+    if (redis_argeq(kpos, &subcmd_count) && array_n(req->keys) == 1) {
+        return redis_append_static(rsp, &rsp_command_count);
+    }
+
+    if (redis_argeq(kpos, &subcmd_docs)) {
+        return redis_append_static(rsp, conn->resp3 ? &rsp_empty_map :
+                                                      &rsp_empty_array);
+    }
+
+    return redis_append_static(rsp, &rsp_unknown_subcommand);
+}
+
+/*
+ * CLIENT SETNAME name | CLIENT SETINFO attr value | CLIENT GETNAME
+ *
+ * Server connections are shared, so the name and attributes of a client
+ * are accepted but not kept, as with HELLO SETNAME.
+ */
+static rstatus_t
+redis_handle_client_req(struct msg *req, struct msg *rsp)
+{
+    const struct keypos *kpos;
+    uint32_t nkey;
+
+    /* only the subcommand is kept, a name or value may be of any length */
+    nkey = req->narg - 1;
+    kpos = array_get(req->keys, 0);
+
+    if ((redis_argeq(kpos, &subcmd_setname) && nkey == 2) ||
+        (redis_argeq(kpos, &subcmd_setinfo) && nkey == 3)) {
+        return redis_append_static(rsp, &rsp_ok);
+    }
+
+    if (redis_argeq(kpos, &subcmd_getname) && nkey == 1) {
+        return redis_append_static(rsp, &rsp_null);
+    }
+
+    return redis_append_static(rsp, &rsp_unknown_subcommand);
+}
+
+void
+redis_init(void)
+{
+    int n;
+
+    n = gf_scnprintf(rsp_command_count_buf, sizeof(rsp_command_count_buf),
+                     ":%d\r\n", (int)NELEMS(redis_commands));
+    mbuf_init_static(&rsp_command_count, rsp_command_count_buf,
+                     rsp_command_count_buf + n);
+}
+
+/*
+ * Reply to a request that is not forwarded: a command served by the proxy
+ * itself, a request from a client that is yet to authenticate, or an
+ * unknown command or a command with a wrong # arguments.
+ */
+rstatus_t
+redis_reply(struct msg *r)
+{
+    struct conn *c_conn;
+    struct msg *rsp = r->peer;
+    const struct redis_command *cmd;
+    char buf[sizeof("-ERR wrong number of arguments for '' command\r\n") +
+             REDIS_CMD_MAXLEN];
+    int n;
+
+    ASSERT(rsp != NULL && rsp->owner != NULL);
+
+    c_conn = rsp->owner;
+
+    if (r->type == MSG_UNKNOWN) {
+        if (!conn_authenticated(c_conn)) {
+            return redis_append_static(rsp, &rsp_auth_required);
+        }
+        return redis_append_static(rsp, &rsp_unknown_command);
+    }
+
+    cmd = redis_command(r->type);
+
+    if (!redis_argc_valid(cmd, r->narg) ||
+        (!(cmd->flags & REDIS_CMD_LOCAL) && conn_authenticated(c_conn))) {
+        n = gf_scnprintf(buf, sizeof(buf), "-ERR wrong number of arguments "
+                         "for '%.*s' command\r\n", cmd->name.len,
+                         cmd->name.data);
+        return msg_append(rsp, (uint8_t *)buf, (size_t)n);
+    }
+
+    if (r->type == MSG_REQ_REDIS_AUTH) {
+        return redis_handle_auth_req(r, rsp);
+    }
+
+    if (r->type == MSG_REQ_REDIS_HELLO) {
+        /* HELLO may authenticate the client with its AUTH option */
+        return redis_handle_hello_req(r, rsp);
+    }
+
+    if (r->type == MSG_REQ_REDIS_QUIT) {
+        /* the connection is closed once the reply is sent */
+        return redis_append_static(rsp, &rsp_ok);
+    }
+
+    if (!conn_authenticated(c_conn)) {
+        return redis_append_static(rsp, &rsp_auth_required);
+    }
+
+    switch (r->type) {
+    case MSG_REQ_REDIS_PING:
+        return redis_handle_ping_req(r, rsp);
+
+    case MSG_REQ_REDIS_ECHO:
+        return redis_append_echo(rsp, r);
+
+    case MSG_REQ_REDIS_COMMAND:
+        return redis_handle_command_req(r, rsp);
+
+    case MSG_REQ_REDIS_CLIENT:
+        return redis_handle_client_req(r, rsp);
+
+    case MSG_REQ_REDIS_SELECT:
+        return redis_handle_select_req(r, rsp);
+
+    case MSG_REQ_REDIS_ASKING:
+    case MSG_REQ_REDIS_CLUSTER:
+        /* the cluster is hidden behind the proxy */
+        return redis_append_static(rsp, &rsp_unknown_command);
+
+    default:
+        NOT_REACHED();
+        return GF_ERROR;
+    }
+}
+
+/*
+ * Return a request made by the proxy on server connection conn, the bytes
+ * of which are those of static mbuf req. Its response is swallowed.
+ */
+static struct msg *
+redis_proxy_req(struct conn *conn, struct mbuf *req, msg_type_t type)
+{
+    rstatus_t status;
+    struct msg *msg;
+
+    msg = msg_get(conn, true, conn->redis);
+    if (msg == NULL) {
+        return NULL;
+    }
+
+    status = redis_append_static(msg, req);
+    if (status != GF_OK) {
+        msg_put(msg);
+        return NULL;
+    }
+
+    msg->type = type;
+    msg->result = MSG_PARSE_OK;
+    msg->swallow = 1;
+    msg->owner = NULL;
+
+    return msg;
+}
+
+/*
+ * Copy up to n bytes from the head of reply r into buf. Return the # bytes
+ * copied.
+ */
+static size_t
+redis_copy(const struct msg *r, uint8_t *buf, size_t n)
+{
+    struct mbuf *mbuf;
+    size_t len, copied;
+
+    copied = 0;
+    STAILQ_FOREACH(mbuf, &r->mhdr, next) {
+        len = MIN(n - copied, (size_t)mbuf_length(mbuf));
+        gf_memcpy(buf + copied, mbuf->pos, len);
+        copied += len;
+        if (copied == n) {
+            break;
+        }
+    }
+
+    return copied;
+}
+
+/*
+ * Read the element at *pos of the reply held in [*pos, end): its type byte,
+ * the length or integer it carries in val and, for a bulk, its payload in
+ * data. Return false if the reply is cut short.
+ */
+static bool
+redis_read_element(uint8_t **pos, uint8_t *end, uint8_t *type, int64_t *val,
+                   struct string *data)
+{
+    uint8_t *p, *lf;
+    int64_t v;
+    bool neg;
+
+    p = *pos;
+    lf = memchr(p, LF, (size_t)(end - p));
+    if (lf == NULL || lf - p < 2) {
+        return false;
+    }
+
+    *type = *p;
+    v = 0;
+    neg = false;
+    for (p++; p < lf - 1; p++) {
+        if (*p == '-') {
+            neg = true;
+        } else if (isdigit(*p) && v < INT32_MAX) {
+            v = v * 10 + (*p - '0');
+        }
+    }
+    *val = neg ? -v : v;
+    p = lf + 1;
+
+    if ((*type == '$' || *type == '!' || *type == '=') && *val >= 0) {
+        if (end - p < *val + (int64_t)CRLF_LEN) {
+            return false;
+        }
+        if (data != NULL) {
+            data->len = (uint32_t)*val;
+            data->data = p;
+        }
+        p += *val + CRLF_LEN;
+    } else if (data != NULL) {
+        string_init(data);
+    }
+
+    *pos = p;
+
+    return true;
+}
+
+/* Skip the next n elements, nested ones included, of the reply at *pos */
+static bool
+redis_skip_elements(uint8_t **pos, uint8_t *end, int64_t n)
+{
+    uint8_t type;
+    int64_t val;
+
+    while (n > 0) {
+        if (!redis_read_element(pos, end, &type, &val, NULL)) {
+            return false;
+        }
+        n--;
+
+        switch (type) {
+        case '*':
+        case '~':
+        case '>':
+            n += MAX(val, 0);
+            break;
+
+        case '%':
+            n += 2 * MAX(val, 0);
+            break;
+
+        case '|':
+            /* an attribute precedes the element it describes */
+            n += 2 * MAX(val, 0) + 1;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Return the server of redis cluster pool at {host, hostlen}:port as told by
+ * server, which leaves host empty for a node that is at its own address
+ */
+static struct server *
+redis_cluster_server(struct server *server, const uint8_t *host,
+                     uint32_t hostlen, uint32_t port)
+{
+    if (port > UINT16_MAX) {
+        return NULL;
+    }
+
+    if (hostlen == 0) {
+        host = server->addrstr.data;
+        hostlen = server->addrstr.len;
+    }
+
+    return server_pool_lookup(server->owner, host, hostlen, (uint16_t)port);
+}
+
+/*
+ * Return true if the slot map of redis cluster pool is due to be loaded,
+ * which is at most once every REDIS_CLUSTER_REFRESH_USEC
+ */
+static bool
+redis_cluster_refresh_due(struct server_pool *pool)
+{
+    int64_t now;
+
+    if (pool->dist_type != DIST_REDIS_CLUSTER) {
+        return false;
+    }
+
+    now = gf_usec_now();
+    if (now < 0 || now < pool->next_slots_refresh) {
+        return false;
+    }
+    pool->next_slots_refresh = now + REDIS_CLUSTER_REFRESH_USEC;
+
+    return true;
+}
+
+/*
+ * Load the slot map of a redis cluster pool from reply r to CLUSTER SLOTS
+ * on server connection conn. The reply has a range of slots per element:
+ *
+ *   *<# range>
+ *     *<# element>
+ *       :<first slot>
+ *       :<last slot>
+ *       *<# element>        master of the range
+ *         $<host>
+ *         :<port>
+ *         ...               node id and metadata
+ *       ...                 replicas of the range
+ *
+ * Slots served by a master that is not a server of the pool are left as
+ * they are.
+ */
+static void
+redis_cluster_load(struct conn *conn, struct msg *r)
+{
+    struct server *server = conn->owner, *master;
+    struct server_pool *pool = server->owner;
+    struct string host;
+    uint8_t *buf, *p, *end;
+    uint8_t type;
+    int64_t nrange, nelem, nnode, first, last, len, port, slot;
+    uint32_t nslot, nunknown;
+
+    if (redis_error(r)) {
+        log_warn("CLUSTER SLOTS failed on %s | %s", pool->name.data,
+                 server->name.data);
+        return;
+    }
+
+    buf = gf_alloc(r->mlen);
+    if (buf == NULL) {
+        return;
+    }
+    p = buf;
+    end = buf + redis_copy(r, buf, r->mlen);
+
+    nslot = 0;
+    nunknown = 0;
+
+    if (!redis_read_element(&p, end, &type, &nrange, NULL) || type != '*') {
+        goto error;
+    }
+
+    for (; nrange > 0; nrange--) {
+        if (!redis_read_element(&p, end, &type, &nelem, NULL) ||
+            type != '*' || nelem < 3) {
+            goto error;
+        }
+
+        if (!redis_read_element(&p, end, &type, &first, NULL) ||
+            type != ':' ||
+            !redis_read_element(&p, end, &type, &last, NULL) ||
+            type != ':' || first < 0 || first > last ||
+            last >= CLUSTER_SLOTS) {
+            goto error;
+        }
+
+        if (!redis_read_element(&p, end, &type, &nnode, NULL) ||
+            type != '*' || nnode < 2 ||
+            !redis_read_element(&p, end, &type, &len, &host) ||
+            type != '$' ||
+            !redis_read_element(&p, end, &type, &port, NULL) ||
+            type != ':' || port < 0 ||
+            !redis_skip_elements(&p, end, nnode - 2) ||
+            !redis_skip_elements(&p, end, nelem - 3)) {
+            goto error;
+        }
+
+        master = redis_cluster_server(server, host.data, host.len,
+                                      (uint32_t)port);
+        if (master == NULL) {
+            log_debug(LOG_INFO, "slots %"PRId64"-%"PRId64" of %s are on "
+                      "'%.*s:%"PRId64"' which is not in the pool",
+                      first, last, pool->name.data, host.len, host.data,
+                      port);
+            nunknown++;
+            continue;
+        }
+
+        for (slot = first; slot <= last; slot++) {
+            pool->continuum[slot].index = master->idx;
+        }
+        nslot += (uint32_t)(last - first + 1);
+    }
+
+    gf_free(buf);
+
+    if (nunknown != 0) {
+        log_warn("%"PRIu32" slot ranges of %s are on servers not in the pool",
+                 nunknown, pool->name.data);
+    }
+
+    log_debug(LOG_NOTICE, "loaded %"PRIu32" slots of %s from %s", nslot,
+              pool->name.data, server->name.data);
+
+    return;
+
+error:
+    gf_free(buf);
+    log_warn("CLUSTER SLOTS on %s | %s has a bad reply", pool->name.data,
+             server->name.data);
+}
+
+/*
+ * Redirect the request that reply r on server connection conn answers, if r
+ * is a redirection of redis cluster:
+ *
+ *   -MOVED <slot> <host>:<port>, the slot is served by another server now,
+ *    the slot map is updated and, as others slots likely moved with it,
+ *    reloaded.
+ *   -ASK <slot> <host>:<port>, the slot is being migrated to another server,
+ *    which serves the request only once ASKING is sent right before it.
+ *
+ * Return true if the request is forwarded again and reply r is consumed, or
+ * false if r is for the client to see.
+ */
+bool
+redis_redirect(struct context *ctx, struct conn *conn, struct msg *r)
+{
+    struct server *server = conn->owner, *target;
+    struct server_pool *pool = server->owner;
+    struct msg *pmsg, *asking, *msg;
+    uint8_t line[REDIS_REDIRECT_MAXLEN];
+    uint8_t *p, *end, *slot_end, *colon;
+    uint32_t slot, port;
+
+    if (r->type != MSG_RSP_REDIS_ERROR_MOVED &&
+        r->type != MSG_RSP_REDIS_ERROR_ASK) {
+        return false;
+    }
+
+    if (pool->dist_type != DIST_REDIS_CLUSTER) {
+        return false;
+    }
+
+    pmsg = TAILQ_FIRST(&conn->omsg_q);
+    ASSERT(pmsg != NULL && pmsg->request && !pmsg->swallow);
+
+    if (pmsg->nredirect >= REDIS_REDIRECT_MAX) {
+        log_warn("req %"PRIu64" on %s is redirected more than %d times",
+                 pmsg->id, pool->name.data, REDIS_REDIRECT_MAX);
+        return false;
+    }
+
+    /* "-MOVED 3999 127.0.0.1:6381\r\n" */
+    end = line + redis_copy(r, line, sizeof(line));
+    end = memchr(line, CR, (size_t)(end - line));
+    if (end == NULL) {
+        return false;
+    }
+
+    p = memchr(line, ' ', (size_t)(end - line));
+    if (p == NULL) {
+        return false;
+    }
+    p++;
+
+    slot_end = memchr(p, ' ', (size_t)(end - p));
+    if (slot_end == NULL || !redis_atou(p, slot_end, &slot) ||
+        slot >= CLUSTER_SLOTS) {
+        return false;
+    }
+    p = slot_end + 1;
+
+    for (colon = end - 1; colon >= p && *colon != ':'; colon--) {
+        /* the port follows the last colon, as in "::1:6381" */
+    }
+    if (colon < p || !redis_atou(colon + 1, end, &port)) {
+        return false;
+    }
+
+    target = redis_cluster_server(server, p, (uint32_t)(colon - p), port);
+    if (target == NULL) {
+        log_warn("%s | %s redirects slot %"PRIu32" to '%.*s' which is not in "
+                 "the pool", pool->name.data, server->name.data, slot,
+                 (int)(end - p), p);
+        return false;
+    }
+
+    asking = NULL;
+    if (r->type == MSG_RSP_REDIS_ERROR_ASK) {
+        asking = redis_proxy_req(conn, &req_asking, MSG_REQ_REDIS_ASKING);
+        if (asking == NULL) {
+            return false;
+        }
+    } else {
+        pool->continuum[slot].index = target->idx;
+
+        /* the server that knows the slot moved knows the new slot map */
+        if (redis_cluster_refresh_due(pool)) {
+            msg = redis_proxy_req(conn, &req_cluster_slots,
+                                  MSG_REQ_REDIS_CLUSTER);
+            if (msg != NULL) {
+                conn->ops->enqueue_inq(ctx, conn, msg);
+                core_dirty(ctx, conn);
+            }
+        }
+    }
+
+    log_debug(LOG_VERB, "%s | %s redirects req %"PRIu64" on slot %"PRIu32
+              " to %s", pool->name.data, server->name.data, pmsg->id, slot,
+              target->name.data);
+
+    server_ok(ctx, conn);
+    stats_server_incr(ctx, server, redirects);
+
+    conn->ops->dequeue_outq(ctx, conn, pmsg);
+    rsp_put(r);
+
+    pmsg->nredirect++;
+    req_redirect(ctx, pmsg, target, asking);
+
+    return true;
+}
+
+/*
+ * Queue a request made by the proxy ahead of any request already queued on
+ * a freshly connected server connection. Its response is swallowed.
+ */
+static void
+redis_post_connect_enqueue(struct context *ctx, struct conn *conn,
+                           struct msg *msg, msg_type_t type)
+{
+    msg->type = type;
+    msg->result = MSG_PARSE_OK;
+    msg->swallow = 1;
+    msg->owner = NULL;
+
+    req_server_enqueue_imsgq_head(ctx, conn, msg);
+}
+
+/*
+ * Set up a new server connection with a handshake queued ahead of anything
+ * else on it, the request that triggered the connect included: AUTH with the
+ * password of the pool, or HELLO for a connection that serves RESP3 clients,
+ * which switches protocol and carries the password itself, followed by
+ * SELECT of the database of the pool and, on a redis cluster pool whose slot
+ * map is due to be loaded, CLUSTER SLOTS.
+ *
+ * Requests are pipelined right behind the handshake, which redis completes
+ * before running any of them, so the handshake costs no round trip of its
+ * own. A failed handshake fails the connection, with the requests behind it
+ * (see redis_swallow_msg).
+ */
+void
+redis_post_connect(struct context *ctx, struct conn *conn, struct server *server)
+{
+    rstatus_t status;
+    struct server_pool *pool = server->owner;
+    struct msg *msg;
+    char db[GF_UINT32_MAXLEN];
+    int n;
+
+    ASSERT(!conn->client && conn->connected);
+    ASSERT(conn->redis);
+
+    /* requests are queued at the head, so the last one queued goes first */
+    if (redis_cluster_refresh_due(pool)) {
+        msg = redis_proxy_req(conn, &req_cluster_slots, MSG_REQ_REDIS_CLUSTER);
+        if (msg == NULL) {
+            goto error;
+        }
+        req_server_enqueue_imsgq_head(ctx, conn, msg);
+
+        log_debug(LOG_NOTICE, "sent 'CLUSTER SLOTS' to %s | %s",
+                  pool->name.data, server->name.data);
+    }
+
+    if (pool->redis_db > 0) {
+        msg = msg_get(conn, true, conn->redis);
+        if (msg == NULL) {
+            goto error;
+        }
+
+        n = gf_scnprintf(db, sizeof(db), "%d", pool->redis_db);
+        status = msg_prepend_format(msg, "*2\r\n$6\r\nSELECT\r\n$%d\r\n%s\r\n",
+                                    n, db);
+        if (status != GF_OK) {
+            msg_put(msg);
+            goto error;
+        }
+        redis_post_connect_enqueue(ctx, conn, msg, MSG_REQ_REDIS_SELECT);
+
+        log_debug(LOG_NOTICE, "sent 'SELECT %d' to %s | %s", pool->redis_db,
+                  pool->name.data, server->name.data);
+    }
+
+    if (conn->resp3) {
+        msg = msg_get(conn, true, conn->redis);
+        if (msg == NULL) {
+            goto error;
+        }
+
+        if (pool->require_auth) {
+            status = msg_prepend_format(msg, "*5\r\n$5\r\nHELLO\r\n$1\r\n3\r\n"
+                                        "$4\r\nAUTH\r\n$7\r\ndefault\r\n"
+                                        "$%d\r\n%s\r\n",
+                                        pool->redis_auth.len,
+                                        pool->redis_auth.data);
+        } else {
+            status = msg_prepend_format(msg, "*2\r\n$5\r\nHELLO\r\n"
+                                        "$1\r\n3\r\n");
+        }
+        if (status != GF_OK) {
+            msg_put(msg);
+            goto error;
+        }
+        redis_post_connect_enqueue(ctx, conn, msg, MSG_REQ_REDIS_HELLO);
+
+        log_debug(LOG_NOTICE, "sent 'HELLO 3' to %s | %s", pool->name.data,
+                  server->name.data);
+    } else if (pool->require_auth) {
+        msg = msg_get(conn, true, conn->redis);
+        if (msg == NULL) {
+            goto error;
+        }
+
+        status = msg_prepend_format(msg, "*2\r\n$4\r\nAUTH\r\n$%d\r\n%s\r\n",
+                                    pool->redis_auth.len,
+                                    pool->redis_auth.data);
+        if (status != GF_OK) {
+            msg_put(msg);
+            goto error;
+        }
+        redis_post_connect_enqueue(ctx, conn, msg, MSG_REQ_REDIS_AUTH);
+
+        log_debug(LOG_NOTICE, "sent 'AUTH' to %s | %s", pool->name.data,
+                  server->name.data);
+    }
+
+    conn->authenticated = 1;
+
+    /* the handshake heads the inq and goes out with the next flush */
+    core_dirty(ctx, conn);
+
+    return;
+
+error:
+    /* requests must not go out on a connection that is not set up */
+    log_error("handshake on s %d to %s | %s failed: %s", conn->sd,
+              pool->name.data, server->name.data, strerror(ENOMEM));
+    conn->err = ENOMEM;
+}
+
+void
+redis_swallow_msg(struct conn *conn, struct msg *pmsg, struct msg *msg)
+{
+    struct server *conn_server;
+    struct server_pool *conn_pool;
+    uint8_t buf[128], *message;
+    size_t copy_len;
+
+    if (pmsg == NULL || msg == NULL) {
+        return;
+    }
+
+    if (pmsg->type == MSG_REQ_REDIS_CLUSTER) {
+        redis_cluster_load(conn, msg);
+        return;
+    }
+
+    if (!redis_error(msg)) {
+        return;
+    }
+
+    if (pmsg->type != MSG_REQ_REDIS_AUTH &&
+        pmsg->type != MSG_REQ_REDIS_SELECT &&
+        pmsg->type != MSG_REQ_REDIS_HELLO) {
+        return;
+    }
+
+    /*
+     * Get a prefix of the error for the log, with the initial type byte and
+     * the trailing \r\n removed.
+     */
+    conn_server = (struct server *)conn->owner;
+    conn_pool = conn_server->owner;
+    copy_len = redis_copy(msg, buf, sizeof(buf) - 1);
+    ASSERT(copy_len > 0);
+    if (copy_len == msg->mlen && copy_len >= 1 + CRLF_LEN) {
+        copy_len -= CRLF_LEN;
+    }
+    buf[copy_len] = '\0';
+    message = &buf[1];
+
+    switch (pmsg->type) {
+    case MSG_REQ_REDIS_AUTH:
+        log_warn("AUTH failed on %s | %s: %s", conn_pool->name.data,
+                 conn_server->name.data, message);
+        conn->err = EACCES;
+        conn->authenticated = 0;
+        break;
+
+    case MSG_REQ_REDIS_SELECT:
+        log_warn("SELECT %d failed on %s | %s: %s",
+                 conn_pool->redis_db, conn_pool->name.data,
+                 conn_server->name.data, message);
+        conn->err = EINVAL;
+        break;
+
+    case MSG_REQ_REDIS_HELLO:
+        log_warn("HELLO 3 failed on %s | %s: %s", conn_pool->name.data,
+                 conn_server->name.data, message);
+        if (conn_pool->require_auth) {
+            /* the password went with HELLO, the connection is not usable */
+            conn->err = EACCES;
+            conn->authenticated = 0;
+        }
+        /* replies on the connection stay RESP2, which RESP3 clients read */
+        break;
+
+    default:
+        NOT_REACHED();
+        break;
+    }
+}